@@ -0,0 +1,67 @@
+#!/bin/sh
+# Checks that lobster_cache is used when nothing changed, and that programs are recompiled (and
+# still run correctly) when an included file changes, the cache file is damaged, or --no-cache
+# is given.
+# usage: test_cache.sh [ path to lobster executable ]
+
+exe=${1:-../../lobster/lobster.exe}
+lobsterdir=$(cd "$(dirname "$0")/../../lobster" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# The standard includes are found next to the executable, so give the copy its own.
+cp "$exe" "$tmp/lobster" || exit 1
+ln -s "$lobsterdir/include" "$tmp/include"
+mkdir "$tmp/prog"
+cat > "$tmp/prog/cachetest.lobster" <<EOF
+include "cachetest_inc.lobster"
+print "value: " + answer()
+EOF
+cache="$tmp/prog/lobster_cache/cachetest.lobster.lbc"
+
+fail=0
+# run <expected value> <compiling|using cached bytecode> [ options ]
+run() {
+    value=$1; how=$2; shift 2
+    out=$("$tmp/lobster" --verbose "$@" "$tmp/prog/cachetest.lobster" 2>&1)
+    if ! echo "$out" | grep -q "^value: $value\$" || ! echo "$out" | grep -q "^$how"; then
+        echo "FAIL: $test: expected value $value and \"$how\", got:"
+        echo "$out"
+        fail=1
+    fi
+}
+
+test="first run"
+echo 'def answer(): 1' > "$tmp/prog/cachetest_inc.lobster"
+run 1 compiling
+test="second run"
+run 1 "using cached bytecode"
+
+test="edited include"
+echo 'def answer(): 2' > "$tmp/prog/cachetest_inc.lobster"
+run 2 compiling
+run 2 "using cached bytecode"
+
+test="corrupt cache"
+size=$(wc -c < "$cache")
+printf 'garbage' | dd of="$cache" bs=1 seek=$((size / 2)) conv=notrunc 2>/dev/null
+run 2 compiling
+run 2 "using cached bytecode"
+
+test="truncated cache"
+head -c $((size / 2)) "$cache" > "$tmp/half" && mv "$tmp/half" "$cache"
+run 2 compiling
+head -c 6 "$cache" > "$tmp/header" && mv "$tmp/header" "$cache"
+run 2 compiling
+run 2 "using cached bytecode"
+
+test="--no-cache"
+echo 'def answer(): 3' > "$tmp/prog/cachetest_inc.lobster"
+run 3 compiling --no-cache
+run 3 compiling --no-cache
+test="after --no-cache"
+run 3 compiling
+run 3 "using cached bytecode"
+
+[ $fail = 0 ] && echo "cache test ok"
+exit $fail
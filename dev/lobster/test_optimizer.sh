@@ -0,0 +1,59 @@
+#!/bin/sh
+# Checks that samples/tests/optimizertest.lobster passes, and that code the optimizer can fully
+# fold ends up as the same bytecode size as writing the result directly.
+# usage: test_optimizer.sh [ path to lobster executable ]
+
+exe=${1:-../../lobster/lobster.exe}
+lobsterdir=$(cd "$(dirname "$0")/../../lobster" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# The standard includes are found next to the executable, so give the copy its own.
+cp "$exe" "$tmp/lobster" || exit 1
+ln -s "$lobsterdir/include" "$tmp/include"
+
+fail=0
+out=$("$tmp/lobster" --non-interactive-test "$lobsterdir/samples/tests/optimizertest.lobster" 2>&1)
+if ! echo "$out" | grep -q "^optimizertest ok\$"; then
+    echo "FAIL: optimizertest.lobster:"
+    echo "$out"
+    fail=1
+fi
+
+# size <source>: prints the bytecode size, which is the offset of the final EXIT.
+size() {
+    echo "$1" > "$tmp/size.lobster"
+    rm -f "$tmp/disasm.txt"
+    "$tmp/lobster" --no-cache --disasm "$tmp/size.lobster" > /dev/null 2>&1
+    sed -n 's/^I \([0-9]*\).*EXIT.*/\1/p' "$tmp/disasm.txt"
+}
+
+folded=$(size 'def f(x):
+    x * 2
+    x * 1 - 0 + ((1 + 2) * 3 - 8 / 2)
+print f(length("ab"))')
+direct=$(size 'def f(x): x + 5
+print f(length("ab"))')
+if [ -z "$folded" ] || [ "$folded" != "$direct" ]; then
+    echo "FAIL: folded code is $folded bytes of bytecode, expected $direct"
+    fail=1
+fi
+
+# A call with the types a specialization's type variables got bound to after it was made reuses
+# it, rather than cloning the function again.
+echo 'def first_or(v, d): if v.length: v[0] else: d
+def bound_later():
+    a := []
+    x := first_or(a, 0)
+    a.push(1)
+    first_or([ 2 ], 0) + first_or(a, 0) + x
+print bound_later()' > "$tmp/spec.lobster"
+out=$("$tmp/lobster" --no-cache --verbose "$tmp/spec.lobster" 2>&1)
+if ! echo "$out" | grep -q "cloned: 0\$"; then
+    echo "FAIL: specialization with bound type variables was not reused:"
+    echo "$out"
+    fail=1
+fi
+
+[ $fail = 0 ] && echo "optimizer test ok"
+exit $fail
@@ -21,7 +21,7 @@
 
 namespace lobster {
 
-static RandomNumberGenerator<MersenneTwister> rnd;
+static thread_local RandomNumberGenerator<MersenneTwister> rnd;
 
 static int IntCompare(const Value &a, const Value &b) {
     return a.ival() < b.ival() ? -1 : a.ival() > b.ival();
@@ -59,6 +59,130 @@ template<typename T> Value BinarySearch(Value &l, Value &key, T comparefun) {
     return Value(i);
 }
 
+// Scalars are sorted as unsigned 32-bit keys that order the same way, so one radix sort
+// serves both ints and floats (negative floats have their bits inverted, positive ones just
+// their sign flipped).
+static void ToSortKeys(uint32_t *k, int n, ValueType t) {
+    if (t == V_INT) for (int i = 0; i < n; i++) k[i] ^= 0x80000000;
+    else for (int i = 0; i < n; i++) k[i] = k[i] & 0x80000000 ? ~k[i] : k[i] | 0x80000000;
+}
+
+static void FromSortKeys(uint32_t *k, int n, ValueType t) {
+    if (t == V_INT) for (int i = 0; i < n; i++) k[i] ^= 0x80000000;
+    else for (int i = 0; i < n; i++) k[i] = k[i] & 0x80000000 ? k[i] & 0x7FFFFFFF : ~k[i];
+}
+
+// Stable LSD radix sort, permuting idxs (if any) along with the keys. Passes over bytes that
+// are the same for all keys are skipped.
+static void RadixSort(uint32_t *keys, int *idxs, int n) {
+    if (n < 2) return;
+    vector<uint32_t> tk(n);
+    vector<int> ti(idxs ? n : 0);
+    for (int shift = 0; shift < 32; shift += 8) {
+        int counts[256] = { 0 };
+        for (int i = 0; i < n; i++) counts[(keys[i] >> shift) & 0xFF]++;
+        if (counts[(keys[0] >> shift) & 0xFF] == n) continue;
+        for (int b = 0, sum = 0; b < 256; b++) { auto c = counts[b]; counts[b] = sum; sum += c; }
+        for (int i = 0; i < n; i++) {
+            auto pos = counts[(keys[i] >> shift) & 0xFF]++;
+            tk[pos] = keys[i];
+            if (idxs) ti[pos] = idxs[i];
+        }
+        memcpy(keys, tk.data(), n * sizeof(uint32_t));
+        if (idxs) memcpy(idxs, ti.data(), n * sizeof(int));
+    }
+}
+
+static bool StringLess(const Value &a, const Value &b) { return StringCompare(a, b) < 0; }
+
+// Packed vectors are sorted as keys in place, vectors of strings by moving their Values
+// around, which doesn't affect refcounts.
+static void SortElems(LVector *v) {
+    if (!v->len) return;
+    if (v->packed != V_NIL) {
+        auto k = v->PackedElems<uint32_t>();
+        ToSortKeys(k, v->len, v->packed);
+        RadixSort(k, nullptr, v->len);
+        FromSortKeys(k, v->len, v->packed);
+    } else {
+        sort(&v->AtRef(0), &v->AtRef(0) + v->len, StringLess);
+    }
+}
+
+// Sorts the first n elements into place, and if nth, only the nth one.
+static void PartialSortElems(LVector *v, int n, bool nth) {
+    if (n >= v->len) {
+        if (!nth) SortElems(v);
+        return;
+    }
+    if (v->packed != V_NIL) {
+        auto k = v->PackedElems<uint32_t>();
+        ToSortKeys(k, v->len, v->packed);
+        if (nth) nth_element(k, k + n, k + v->len);
+        else partial_sort(k, k + n, k + v->len);
+        FromSortKeys(k, v->len, v->packed);
+    } else {
+        auto e = &v->AtRef(0);
+        if (nth) nth_element(e, e + n, e + v->len, StringLess);
+        else partial_sort(e, e + n, e + v->len, StringLess);
+    }
+}
+
+// Returns -1 after reporting an error.
+static int SortIndex(Value &n, int max) {
+    if (n.ival() < 0 || n.ival() > max) {
+        g_vm->BuiltinError("sort index out of range");
+        return -1;
+    }
+    return n.ival();
+}
+
+// Reorders the elements of a vector to be in the order given by idxs.
+static void Permute(LVector *v, const vector<int> &idxs) {
+    if (v->packed != V_NIL) {
+        auto e = v->PackedElems<uint32_t>();
+        vector<uint32_t> tmp(e, e + v->len);
+        for (int i = 0; i < v->len; i++) e[i] = tmp[idxs[i]];
+    } else {
+        vector<Value> tmp(&v->AtRef(0), &v->AtRef(0) + v->len);
+        for (int i = 0; i < v->len; i++) v->AtRef(i) = tmp[idxs[i]];
+    }
+}
+
+// The stable sorted order of n scalar keys (of type t) or strings.
+static vector<int> SortOrder(const uint32_t *keys, int n, ValueType t) {
+    vector<int> idxs(n);
+    for (int i = 0; i < n; i++) idxs[i] = i;
+    vector<uint32_t> sk(keys, keys + n);
+    ToSortKeys(sk.data(), n, t);
+    RadixSort(sk.data(), idxs.data(), n);
+    return idxs;
+}
+
+static vector<int> SortOrder(const Value *strs, int n) {
+    vector<int> idxs(n);
+    for (int i = 0; i < n; i++) idxs[i] = i;
+    stable_sort(idxs.begin(), idxs.end(), [&](int a, int b) {
+        return StringLess(strs[a], strs[b]);
+    });
+    return idxs;
+}
+
+static Value SortWithKeys(Value &l, Value &keys) {
+    auto v = l.vval();
+    auto k = keys.vval();
+    if (v->len != k->len) return g_vm->BuiltinError("sort_with_keys: vectors differ in length");
+    if (v->len) {
+        auto idxs = k->packed != V_NIL
+            ? SortOrder(k->PackedElems<uint32_t>(), k->len, k->packed)
+            : SortOrder(&k->AtRef(0), k->len);
+        Permute(v, idxs);
+        Permute(k, idxs);
+    }
+    keys.DECRT();
+    return l;
+}
+
 // int <-> float
 const TypeInfo &SwapVectType(const TypeInfo *available, const TypeInfo &existing) {
     // FIXME: this is slow, cache these.
@@ -71,10 +195,25 @@ const TypeInfo &SwapVectType(const TypeInfo *available, const TypeInfo &existing
     return existing.t != V_STRUCT || !available ? existing : *available;
 }
 
-void RealVector(Value &v) {
+// Shallow copy of a vector or struct.
+ElemObj *CopyElems(ElemObj *e) {
+    auto len = e->Len();
+    if (e->ti.t == V_VECTOR) {
+        auto nv = (LVector *)g_vm->NewVector(0, len, e->ti);
+        nv->Append((LVector *)e, 0, len);
+        return nv;
+    }
+    auto nv = g_vm->NewVector(len, len, e->ti);
+    if (len) nv->Init(((LStruct *)e)->Elems(), len, true);
+    return nv;
+}
+
+// Returns false after reporting an error.
+bool RealVector(Value &v) {
     // FIXME: need to guarantee this in typechecking
-    if (v.eval()->ti.t != V_VECTOR)
-        g_vm->BuiltinError("vector operation cannot use struct");
+    if (v.eval()->ti.t == V_VECTOR) return true;
+    g_vm->BuiltinError("vector operation cannot use struct");
+    return false;
 }
 
 void AddBuiltins() {
@@ -164,9 +303,14 @@ void AddBuiltins() {
         "iterates over int/vector/string, body may take [ element [ , index ] ] arguments");
 
     STARTDECL(append) (Value &v1, Value &v2) {
-        RealVector(v1);
+        if (!RealVector(v1)) return Value();
         auto &type = v1.eval()->ti;
         assert(&type == &v2.eval()->ti);  // FIXME: need to guarantee this in typechecking
+        if (v1.vval()->refc == 1) {
+            // Nobody else can observe v1, so append to it directly.
+            v1.vval()->Append(v2.vval(), 0, v2.vval()->len); v2.DECRT();
+            return v1;
+        }
         auto nv = (LVector *)g_vm->NewVector(0, v1.eval()->Len() + v2.eval()->Len(), type);
         nv->Append(v1.vval(), 0, v1.vval()->len); v1.DECRT();
         nv->Append(v2.vval(), 0, v2.vval()->len); v2.DECRT();
@@ -216,7 +360,7 @@ void AddBuiltins() {
         " unlike == which is only true for vectors/objects if they are the same object)");
 
     STARTDECL(push) (Value &l, Value &x) {
-        RealVector(l);
+        if (!RealVector(l)) return Value();
         l.vval()->Push(x);
         return l;
     }
@@ -224,8 +368,8 @@ void AddBuiltins() {
         "appends one element to a vector, returns existing vector");
 
     STARTDECL(pop) (Value &l) {
-        RealVector(l);
-        if (!l.vval()->len) { l.DECRT(); g_vm->BuiltinError("pop: empty vector"); }
+        if (!RealVector(l)) return Value();
+        if (!l.vval()->len) { l.DECRT(); return g_vm->BuiltinError("pop: empty vector"); }
         auto v = l.vval()->Pop();
         l.DECRT();
         return v;
@@ -234,8 +378,8 @@ void AddBuiltins() {
         "removes last element from vector and returns it");
 
     STARTDECL(top) (Value &l) {
-        RealVector(l);
-        if (!l.vval()->len) { l.DECRT(); g_vm->BuiltinError("top: empty vector"); }
+        if (!RealVector(l)) return Value();
+        if (!l.vval()->len) { l.DECRT(); return g_vm->BuiltinError("top: empty vector"); }
         auto v = l.vval()->Top();
         l.DECRT();
         return v;
@@ -245,21 +389,21 @@ void AddBuiltins() {
 
     STARTDECL(replace) (Value &l, Value &i, Value &a) {
         auto len = l.eval()->Len();
-        if (i.ival() < 0 || i.ival() >= len) g_vm->BuiltinError("replace: index out of range");
-        auto nv = g_vm->NewVector(len, len, l.eval()->ti);
-        if (len) nv->Init(&l.eval()->At(0), len, true);
+        if (i.ival() < 0 || i.ival() >= len)
+            return g_vm->BuiltinError("replace: index out of range");
+        auto nv = CopyElems(l.eval());
         l.DECRT();
         nv->Dec(i.ival());
-        nv->At(i.ival()) = a;
+        nv->Set(i.ival(), a);
         return Value(nv);
     }
     ENDDECL3(replace, "xs,i,x", "V*IA1", "V1",
         "returns a copy of a vector with the element at i replaced by x");
 
     STARTDECL(insert) (Value &l, Value &i, Value &a) {
-        RealVector(l);
+        if (!RealVector(l)) return Value();
         if (i.ival() < 0 || i.ival() > l.vval()->len)
-            g_vm->BuiltinError("insert: index or n out of range");  // note: i==len is legal
+            return g_vm->BuiltinError("insert: index or n out of range");  // note: i==len is legal
         l.vval()->Insert(a, i.ival());
         return l;
     }
@@ -268,13 +412,13 @@ void AddBuiltins() {
         " returns original vector");
 
     STARTDECL(remove) (Value &l, Value &i, Value &n) {
-        RealVector(l);
+        if (!RealVector(l)) return Value();
         int amount = max(n.ival(), 1);
         if (n.ival() < 0 || amount > l.vval()->len || i.ival() < 0 ||
             i.ival() > l.vval()->len - amount)
-            g_vm->BuiltinError("remove: index (" + to_string(i.ival()) +
-                               ") or n (" + to_string(amount) +
-                               ") out of range (" + to_string(l.vval()->len) + ")");
+            return g_vm->BuiltinError("remove: index (" + to_string(i.ival()) +
+                                      ") or n (" + to_string(amount) +
+                                      ") out of range (" + to_string(l.vval()->len) + ")");
         auto v = l.vval()->Remove(i.ival(), amount, 1);
         l.DECRT();
         return v;
@@ -284,7 +428,7 @@ void AddBuiltins() {
         " to remove as an optional argument, default 1. returns the first element removed.");
 
     STARTDECL(removeobj) (Value &l, Value &o) {
-        RealVector(l);
+        if (!RealVector(l)) return Value();
         int removed = 0;
         auto vt = g_vm->GetTypeInfo(l.vval()->ti.subt).t;
         for (int i = 0; i < l.vval()->len; i++) {
@@ -328,10 +472,233 @@ void AddBuiltins() {
     ENDDECL2(binarysearch, "xs,key", "S]S", "II",
         "string version.");
 
+    STARTDECL(sort) (Value &l) {
+        SortElems(l.vval());
+        return l;
+    }
+    ENDDECL1(sort, "xs", "I]", "I]",
+        "sorts a vector in place (natively, using a radix sort for ints and floats), returns it."
+        " This overload is for int vectors.");
+
+    STARTDECL(sort) (Value &l) {
+        SortElems(l.vval());
+        return l;
+    }
+    ENDDECL1(sort, "xs", "F]", "F]",
+        "float version.");
+
+    STARTDECL(sort) (Value &l) {
+        SortElems(l.vval());
+        return l;
+    }
+    ENDDECL1(sort, "xs", "S]", "S]",
+        "string version.");
+
+    STARTDECL(partial_sort) (Value &l, Value &n) {
+        auto i = SortIndex(n, l.vval()->len);
+        if (i < 0) return Value();
+        PartialSortElems(l.vval(), i, false);
+        return l;
+    }
+    ENDDECL2(partial_sort, "xs,n", "I]I", "I]",
+        "sorts in place only the first n elements of a vector (those that would be there after a"
+        " full sort), the remaining ones are left in unspecified order. Returns the vector. This"
+        " overload is for int vectors.");
+
+    STARTDECL(partial_sort) (Value &l, Value &n) {
+        auto i = SortIndex(n, l.vval()->len);
+        if (i < 0) return Value();
+        PartialSortElems(l.vval(), i, false);
+        return l;
+    }
+    ENDDECL2(partial_sort, "xs,n", "F]I", "F]",
+        "float version.");
+
+    STARTDECL(partial_sort) (Value &l, Value &n) {
+        auto i = SortIndex(n, l.vval()->len);
+        if (i < 0) return Value();
+        PartialSortElems(l.vval(), i, false);
+        return l;
+    }
+    ENDDECL2(partial_sort, "xs,n", "S]I", "S]",
+        "string version.");
+
+    STARTDECL(nth_element) (Value &l, Value &n) {
+        auto i = SortIndex(n, l.vval()->len - 1);
+        if (i < 0) return Value();
+        PartialSortElems(l.vval(), i, true);
+        auto x = l.vval()->At(i);
+        l.DECRT();
+        return x;
+    }
+    ENDDECL2(nth_element, "xs,n", "I]I", "I",
+        "reorders a vector in place such that element n is what it would be after a full sort,"
+        " with all smaller elements before it and all larger ones after (each in unspecified"
+        " order). Returns element n, so e.g. nth_element(xs, xs.length / 2) gives the median."
+        " This overload is for int vectors.");
+
+    STARTDECL(nth_element) (Value &l, Value &n) {
+        auto i = SortIndex(n, l.vval()->len - 1);
+        if (i < 0) return Value();
+        PartialSortElems(l.vval(), i, true);
+        auto x = l.vval()->At(i);
+        l.DECRT();
+        return x;
+    }
+    ENDDECL2(nth_element, "xs,n", "F]I", "F",
+        "float version.");
+
+    STARTDECL(nth_element) (Value &l, Value &n) {
+        auto i = SortIndex(n, l.vval()->len - 1);
+        if (i < 0) return Value();
+        PartialSortElems(l.vval(), i, true);
+        auto x = l.vval()->At(i);
+        x.INCRT();
+        l.DECRT();
+        return x;
+    }
+    ENDDECL2(nth_element, "xs,n", "S]I", "S",
+        "string version.");
+
+    STARTDECL(sort_with_keys) (Value &l, Value &keys) {
+        return SortWithKeys(l, keys);
+    }
+    ENDDECL2(sort_with_keys, "xs,keys", "V*I]", "V1",
+        "stable sorts a vector in place by a parallel vector of keys, which gets sorted along with"
+        " it. Returns xs. This overload is for int keys.");
+
+    STARTDECL(sort_with_keys) (Value &l, Value &keys) {
+        return SortWithKeys(l, keys);
+    }
+    ENDDECL2(sort_with_keys, "xs,keys", "V*F]", "V1",
+        "float version.");
+
+    STARTDECL(sort_with_keys) (Value &l, Value &keys) {
+        return SortWithKeys(l, keys);
+    }
+    ENDDECL2(sort_with_keys, "xs,keys", "V*S]", "V1",
+        "string version.");
+
+    STARTDECL(sort_by_key) (Value &l, Value &path) {
+        auto v = l.vval();
+        auto p = path.vval();
+        if (v->packed != V_NIL)
+            return g_vm->BuiltinError("sort_by_key: use sort() for int/float vectors");
+        ValueType kt = V_NIL;
+        vector<uint32_t> keys;
+        vector<Value> skeys;
+        for (int i = 0; i < v->len; i++) {
+            auto e = v->At(i);
+            auto et = v->ElemType(i);
+            for (int j = 0; j < p->len; j++) {
+                auto f = p->At(j).ival();
+                if (!IsVector(et) || !e.True() || f < 0 || f >= e.eval()->Len())
+                    return g_vm->BuiltinError("sort_by_key: key path does not match elements");
+                auto eo = e.eval();
+                e = eo->At(f);
+                et = eo->ElemType(f);
+            }
+            if (i && et != kt) return g_vm->BuiltinError("sort_by_key: keys differ in type");
+            kt = et;
+            switch (kt) {
+                case V_INT: keys.push_back((uint32_t)e.ival()); break;
+                case V_FLOAT: {
+                    float f = e.fval();
+                    uint32_t u;
+                    memcpy(&u, &f, sizeof(u));
+                    keys.push_back(u);
+                    break;
+                }
+                case V_STRING:
+                    if (!e.True()) return g_vm->BuiltinError("sort_by_key: nil key");
+                    skeys.push_back(e);
+                    break;
+                default:
+                    return g_vm->BuiltinError("sort_by_key: keys must be int, float or string");
+            }
+        }
+        if (v->len) {
+            Permute(v, kt == V_STRING ? SortOrder(skeys.data(), v->len)
+                                      : SortOrder(keys.data(), v->len, kt));
+        }
+        path.DECRT();
+        return l;
+    }
+    ENDDECL2(sort_by_key, "xs,path", "V*I]", "V1",
+        "stable sorts a vector of structs in place by one of their int, float or string fields,"
+        " without calling back into Lobster. The field is given as a path of field indices, e.g."
+        " [1] for the second field, or [0, 2] for the third field of the struct in the first."
+        " Returns xs.");
+
+    STARTDECL(hash) (Value &x) {
+        auto h = RefHash(x.refnil());
+        x.DECRTNIL();
+        return Value((int)h);
+    }
+    ENDDECL1(hash, "x", "A", "I",
+        "hashes any value, consistent with equal(): values that are equal have the same hash"
+        " (so it recurses into vectors/objects).");
+
+    // The probing for hashmap.lobster, using open addressing with linear probing: index has a
+    // power of 2 size, with each slot holding 0 if empty, -1 if removed, otherwise an entry + 1.
+    STARTDECL(hashmap_find) (Value &keys, Value &key, Value &hashes, Value &index) {
+        auto kv = keys.vval();
+        auto kt = g_vm->GetTypeInfo(kv->ti.subt).t;
+        auto h = (int)key.Hash(kt);
+        auto hv = hashes.vval();
+        auto iv = index.vval();
+        int entry = -1, slot = -1;
+        auto mask = iv->len - 1;
+        for (int n = 0, i = h & mask; n < iv->len; n++, i = (i + 1) & mask) {
+            auto e = iv->At(i).ival();
+            if (e <= 0) {
+                if (slot < 0) slot = i;
+                if (e) continue;
+                break;
+            }
+            if (hv->At(e - 1).ival() == h && kv->At(e - 1).Equal(kt, key, kt, true)) {
+                entry = e - 1;
+                slot = i;
+                break;
+            }
+        }
+        keys.DECRT();
+        key.DECTYPE(kt);
+        hashes.DECRT();
+        index.DECRT();
+        g_vm->Push(Value(entry));
+        g_vm->Push(Value(slot));
+        return Value(h);
+    }
+    ENDDECL4(hashmap_find, "keys,key,hashes,index", "V*A1I]I]", "III",
+        "looks up key in the index of a hash map (see hashmap.lobster). returns the entry it is"
+        " stored at, or -1, the slot in the index it was found at (or can be inserted at), and"
+        " its hash.");
+
+    STARTDECL(hashmap_index) (Value &hashes, Value &size) {
+        auto hv = hashes.vval();
+        auto len = size.ival();
+        if (len <= hv->len || (len & (len - 1)))
+            return g_vm->BuiltinError("hashmap_index: size must be a power of 2 larger than the"
+                                      " number of entries");
+        auto iv = (LVector *)g_vm->NewVector(len, len,
+                                             g_vm->GetTypeInfo(TYPE_ELEM_VECTOR_OF_INT));
+        for (int i = 0; i < len; i++) iv->Set(i, Value(0));
+        for (int e = 0; e < hv->len; e++) {
+            auto i = hv->At(e).ival() & (len - 1);
+            while (iv->At(i).ival()) i = (i + 1) & (len - 1);
+            iv->Set(i, Value(e + 1));
+        }
+        hashes.DECRT();
+        return Value(iv);
+    }
+    ENDDECL2(hashmap_index, "hashes,size", "I]I", "I]",
+        "builds the index of a hash map (see hashmap.lobster) of the given size for entries with"
+        " these hashes.");
+
     STARTDECL(copy) (Value &v) {
-        auto len = v.eval()->Len();
-        auto nv = g_vm->NewVector(len, len, v.eval()->ti);
-        if (len) nv->Init(&v.eval()->At(0), len, true);
+        if (v.eval()->refc == 1) return v;  // Nobody else can observe the original.
+        auto nv = CopyElems(v.eval());
         v.DECRT();
         return Value(nv);
     }
@@ -339,13 +706,20 @@ void AddBuiltins() {
         "makes a shallow copy of vector/object.");
 
     STARTDECL(slice) (Value &l, Value &s, Value &e) {
-        RealVector(l);
+        if (!RealVector(l)) return Value();
         int size = e.ival();
         if (size < 0) size = l.eval()->Len() + size;
         int start = s.ival();
         if (start < 0) start = l.eval()->Len() + start;
         if (start < 0 || start + size > (int)l.eval()->Len())
-            g_vm->BuiltinError("slice: values out of range");
+            return g_vm->BuiltinError("slice: values out of range");
+        if (l.vval()->refc == 1) {
+            // Nobody else can observe l, so cut the slice out of it directly.
+            auto v = l.vval();
+            if (start + size < v->len) v->Remove(start + size, v->len - start - size, 0);
+            if (start) v->Remove(0, start, 0);
+            return l;
+        }
         auto nv = (LVector *)g_vm->NewVector(0, size, l.eval()->ti);
         nv->Append(l.vval(), start, size);
         l.DECRT();
@@ -389,7 +763,7 @@ void AddBuiltins() {
         int start = s.ival();
         if (start < 0) start = l.sval()->len + start;
         if (start < 0 || start + size > (int)l.sval()->len)
-            g_vm->BuiltinError("substring: values out of range");
+            return g_vm->BuiltinError("substring: values out of range");
 
         auto ns = g_vm->NewString(l.sval()->str() + start, size);
         l.DECRT();
@@ -448,7 +822,7 @@ void AddBuiltins() {
         char buf[7];
         string s;
         for (int i = 0; i < v.eval()->Len(); i++) {
-            auto &c = v.eval()->At(i);
+            auto c = v.eval()->At(i);
             TYPE_ASSERT(c.type == V_INT);
             ToUTF8(c.ival(), buf);
             s += buf;
@@ -476,7 +850,7 @@ void AddBuiltins() {
 
     STARTDECL(number2string) (Value &n, Value &b, Value &mc) {
         if (b.ival() < 2 || b.ival() > 36 || mc.ival() > 32)
-            g_vm->BuiltinError("number2string: values out of range");
+            return g_vm->BuiltinError("number2string: values out of range");
         uint i = (uint)n.ival();
         string s;
         const char *from = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
@@ -532,7 +906,7 @@ void AddBuiltins() {
         auto v = g_vm->NewVector(len, len, typeinfo); \
         for (int i = 0; i < a.eval()->Len(); i++) { \
             auto f = a.eval()->At(i); \
-            v->At(i) = Value(op); \
+            v->Set(i, Value(op)); \
         } \
         a.DECRT(); \
         return Value(v);
@@ -706,12 +1080,13 @@ void AddBuiltins() {
     // FIXME: need to guarantee this assert in typechecking
     #define VECBINOP(name,access) \
         auto len = x.eval()->Len(); \
-        if (len != y.eval()->Len()) g_vm->BuiltinError(#name "() arguments must be equal length"); \
+        if (len != y.eval()->Len()) \
+            return g_vm->BuiltinError(#name "() arguments must be equal length"); \
         auto &type = x.eval()->ti; \
         assert(&type == &y.eval()->ti); \
         auto v = g_vm->NewVector(len, len, type); \
         for (int i = 0; i < x.eval()->Len(); i++) { \
-            v->At(i) = Value(name(x.eval()->At(i).access(), y.eval()->At(i).access())); \
+            v->Set(i, Value(name(x.eval()->At(i).access(), y.eval()->At(i).access()))); \
         } \
         x.DECRT(); y.DECRT(); \
         return Value(v);
@@ -881,9 +1256,10 @@ void AddBuiltins() {
         "resumes execution of a coroutine, passing a value back or nil");
 
     STARTDECL(returnvalue) (Value &co) {
-        Value &rv = co.cval()->Current();
+        auto rv = co.cval()->Current();
+        if (!rv) return Value();
         co.DECRT();
-        return rv;
+        return *rv;
     }
     ENDDECL1(returnvalue, "coroutine", "R", "A1",
         "gets the last return value of a coroutine");
@@ -928,7 +1304,7 @@ void AddBuiltins() {
         " called");
 
     STARTDECL(assert) (Value &c) {
-        if (!c.True()) g_vm->BuiltinError("assertion failed");
+        if (!c.True()) return g_vm->BuiltinError("assertion failed");
         return c;
     }
     ENDDECL1(assert, "condition", "A*", "A1",
@@ -947,9 +1323,58 @@ void AddBuiltins() {
     }
     ENDDECL0(collect_garbage, "", "", "I",
         "forces a garbage collection to re-claim cycles. slow and not recommended to be used."
-        " instead, write code to clear any back pointers before abandoning data structures. Watch"
-        " for a \"LEAKS FOUND\" message in the console upon program exit to know when you've"
-        " created a cycle. returns number of objects collected.");
+        " the cycle collector already does this incrementally, unless turned off with"
+        " set_cycle_collector(0, 0), in which case you can watch for a \"LEAKS FOUND\" message in"
+        " the console upon program exit to know when you've created a cycle. returns number of"
+        " objects collected.");
+
+    STARTDECL(collect_cycles) (Value &budget) {
+        return Value(g_vm->cc.Collect(budget.ival() / 1000000.0));
+    }
+    ENDDECL1(collect_cycles, "budget", "I", "I",
+        "runs the cycle collector for about budget microseconds (or until done if 0), and returns"
+        " the number of objects in cycles it freed. it already runs by itself, see"
+        " set_cycle_collector().");
+
+    STARTDECL(set_cycle_collector) (Value &budget, Value &threshold) {
+        g_vm->cc.budget = max(budget.ival(), 0);
+        g_vm->cc.threshold = max(threshold.ival(), 1);
+        g_vm->cc.trigger = g_vm->cc.candidates.size() + g_vm->cc.threshold;
+        return Value();
+    }
+    ENDDECL2(set_cycle_collector, "budget,threshold", "II", "",
+        "the cycle collector frees objects that are only kept alive by cycles amongst themselves."
+        " it runs for at most budget microseconds (default 1000, 0 turns it off) at every"
+        " gl_frame(), and whenever threshold (default 10000) vectors/objects that may be part of"
+        " a cycle have lost a reference since it last ran.");
+
+    STARTDECL(cycle_collector_stats) () {
+        g_vm->Push(Value(g_vm->cc.slices));
+        g_vm->Push(Value(g_vm->cc.freed));
+        g_vm->Push(Value(g_vm->cc.totaltime));
+        return Value(g_vm->cc.maxpause);
+    }
+    ENDDECL0(cycle_collector_stats, "", "", "IIFF",
+        "returns the number of times the cycle collector ran, the number of objects it freed, and"
+        " the total and longest time it took, in seconds.");
+
+    STARTDECL(profile_start) (Value &interval) {
+        g_vm->prof.Start(interval.ival() > 0 ? interval.ival() : 1000);
+        return Value();
+    }
+    ENDDECL1(profile_start, "interval", "I?", "",
+        "starts the sampling profiler, which records which functions are being called every"
+        " interval microseconds (default 1000). running a program with --profile does the same"
+        " for the whole program.");
+
+    STARTDECL(profile_stop) () {
+        g_vm->prof.Stop();
+        g_vm->Push(g_vm->NewString(g_vm->prof.Report()));
+        return Value(g_vm->NewString(g_vm->prof.Folded()));
+    }
+    ENDDECL0(profile_stop, "", "", "SS",
+        "stops the sampling profiler, and returns a table of the functions that took the most"
+        " time, and all call stacks sampled in the \"folded\" format flamegraph tools take.");
 
     STARTDECL(set_max_stack_size) (Value &max) {
         g_vm->SetMaxStack(max.ival() * 1024 * 1024 / sizeof(Value));
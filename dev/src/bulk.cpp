@@ -0,0 +1,499 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bulk operations over large [int] / [float] vectors, working directly on their packed storage.
+// Elementwise + - * / on whole vectors are already handled by the regular operators.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define BULK_SSE 1
+    #include <emmintrin.h>
+#else
+    #define BULK_SSE 0
+#endif
+
+namespace lobster {
+
+// These report errors by halting the VM (returning nullptr), so builtins check g_vm->halted after
+// them.
+template<typename T> static T *Packed(const Value &v, const char *name) {
+    auto vt = is_floating_point<T>::value ? V_FLOAT : V_INT;
+    if (v.eval()->ti.t != V_VECTOR || v.vval()->packed != vt) {
+        g_vm->BuiltinError(string(name) + ": requires a plain [int] or [float] vector");
+        return nullptr;
+    }
+    return v.vval()->PackedElems<T>();
+}
+
+static void SameLen(const Value &a, const Value &b, const char *name) {
+    if (a.vval()->len != b.vval()->len)
+        g_vm->BuiltinError(string(name) + ": vectors must be the same length");
+}
+
+// Where to store the result of an elementwise op on v: v itself if nobody else can observe it
+// (see VM::VectorLoop), otherwise a new vector. In both cases the caller's reference to v is
+// consumed, but v stays alive until the op is done, since it is either the result or has other
+// references.
+static LVector *Dest(Value &v) {
+    auto vec = v.vval();
+    if (vec->refc == 1) return vec;
+    auto nv = (LVector *)g_vm->NewVector(vec->len, vec->len, vec->ti);
+    v.DECRT();
+    return nv;
+}
+
+static LVector *NewPacked(int len, type_elem_t t) {
+    return (LVector *)g_vm->NewVector(len, len, g_vm->GetTypeInfo(t));
+}
+
+// Kernels. The SSE versions process 4 elements at a time, the scalar loops handle the remainder
+// (and everything on other platforms). Float reductions therefore sum in a different order than
+// a sequential loop would.
+
+static void FMA(float *d, const float *x, const float *y, const float *z, int len) {
+    int i = 0;
+    #if BULK_SSE
+        for (; i + 4 <= len; i += 4)
+            _mm_storeu_ps(d + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)),
+                                            _mm_loadu_ps(z + i)));
+    #endif
+    for (; i < len; i++) d[i] = x[i] * y[i] + z[i];
+}
+
+static void AXPY(float *d, float a, const float *x, const float *y, int len) {
+    int i = 0;
+    #if BULK_SSE
+        auto va = _mm_set1_ps(a);
+        for (; i + 4 <= len; i += 4)
+            _mm_storeu_ps(d + i, _mm_add_ps(_mm_mul_ps(va, _mm_loadu_ps(x + i)),
+                                            _mm_loadu_ps(y + i)));
+    #endif
+    for (; i < len; i++) d[i] = a * x[i] + y[i];
+}
+
+static void Clamp(float *d, const float *x, float lo, float hi, int len) {
+    int i = 0;
+    #if BULK_SSE
+        auto vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+        for (; i + 4 <= len; i += 4)
+            _mm_storeu_ps(d + i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(x + i), vlo), vhi));
+    #endif
+    for (; i < len; i++) d[i] = min(max(x[i], lo), hi);
+}
+
+#if BULK_SSE
+// SSE2 has no 32-bit integer min/max.
+static inline __m128i MinI(__m128i a, __m128i b) {
+    auto gt = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
+static inline __m128i MaxI(__m128i a, __m128i b) {
+    auto gt = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+#endif
+
+static void Clamp(int *d, const int *x, int lo, int hi, int len) {
+    int i = 0;
+    #if BULK_SSE
+        auto vlo = _mm_set1_epi32(lo), vhi = _mm_set1_epi32(hi);
+        for (; i + 4 <= len; i += 4)
+            _mm_storeu_si128((__m128i *)(d + i),
+                             MinI(MaxI(_mm_loadu_si128((const __m128i *)(x + i)), vlo), vhi));
+    #endif
+    for (; i < len; i++) d[i] = min(max(x[i], lo), hi);
+}
+
+static float Sum(const float *x, int len) {
+    int i = 0;
+    float s = 0;
+    #if BULK_SSE
+        auto acc = _mm_setzero_ps();
+        for (; i + 4 <= len; i += 4) acc = _mm_add_ps(acc, _mm_loadu_ps(x + i));
+        float t[4];
+        _mm_storeu_ps(t, acc);
+        s = (t[0] + t[1]) + (t[2] + t[3]);
+    #endif
+    for (; i < len; i++) s += x[i];
+    return s;
+}
+
+static int Sum(const int *x, int len) {
+    int i = 0;
+    int s = 0;
+    #if BULK_SSE
+        auto acc = _mm_setzero_si128();
+        for (; i + 4 <= len; i += 4)
+            acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *)(x + i)));
+        int t[4];
+        _mm_storeu_si128((__m128i *)t, acc);
+        s = t[0] + t[1] + t[2] + t[3];
+    #endif
+    for (; i < len; i++) s += x[i];
+    return s;
+}
+
+static float Dot(const float *x, const float *y, int len) {
+    int i = 0;
+    float s = 0;
+    #if BULK_SSE
+        auto acc = _mm_setzero_ps();
+        for (; i + 4 <= len; i += 4)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+        float t[4];
+        _mm_storeu_ps(t, acc);
+        s = (t[0] + t[1]) + (t[2] + t[3]);
+    #endif
+    for (; i < len; i++) s += x[i] * y[i];
+    return s;
+}
+
+static int Dot(const int *x, const int *y, int len) {
+    int s = 0;
+    for (int i = 0; i < len; i++) s += x[i] * y[i];
+    return s;
+}
+
+template<bool ISMAX> static float MinMax(const float *x, int len) {
+    int i = 0;
+    float m = ISMAX ? -FLT_MAX : FLT_MAX;
+    #if BULK_SSE
+        if (len >= 4) {
+            auto acc = _mm_loadu_ps(x);
+            for (i = 4; i + 4 <= len; i += 4) {
+                auto v = _mm_loadu_ps(x + i);
+                acc = ISMAX ? _mm_max_ps(acc, v) : _mm_min_ps(acc, v);
+            }
+            float t[4];
+            _mm_storeu_ps(t, acc);
+            for (int j = 0; j < 4; j++) m = ISMAX ? max(m, t[j]) : min(m, t[j]);
+        }
+    #endif
+    for (; i < len; i++) m = ISMAX ? max(m, x[i]) : min(m, x[i]);
+    return m;
+}
+
+template<bool ISMAX> static int MinMax(const int *x, int len) {
+    int i = 0;
+    int m = ISMAX ? INT_MIN : INT_MAX;
+    #if BULK_SSE
+        if (len >= 4) {
+            auto acc = _mm_loadu_si128((const __m128i *)x);
+            for (i = 4; i + 4 <= len; i += 4) {
+                auto v = _mm_loadu_si128((const __m128i *)(x + i));
+                acc = ISMAX ? MaxI(acc, v) : MinI(acc, v);
+            }
+            int t[4];
+            _mm_storeu_si128((__m128i *)t, acc);
+            for (int j = 0; j < 4; j++) m = ISMAX ? max(m, t[j]) : min(m, t[j]);
+        }
+    #endif
+    for (; i < len; i++) m = ISMAX ? max(m, x[i]) : min(m, x[i]);
+    return m;
+}
+
+template<bool ISMAX, typename T> static int ArgMinMax(const T *x, int len) {
+    int best = len ? 0 : -1;
+    for (int i = 1; i < len; i++) if (ISMAX ? x[i] > x[best] : x[i] < x[best]) best = i;
+    return best;
+}
+
+static void PrefixSum(float *d, const float *x, int len) {
+    int i = 0;
+    #if BULK_SSE
+        auto carry = _mm_setzero_ps();
+        for (; i + 4 <= len; i += 4) {
+            auto v = _mm_loadu_ps(x + i);
+            v = _mm_add_ps(v, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 4)));
+            v = _mm_add_ps(v, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 8)));
+            v = _mm_add_ps(v, carry);
+            _mm_storeu_ps(d + i, v);
+            carry = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+        }
+    #endif
+    float s = i ? d[i - 1] : 0;
+    for (; i < len; i++) d[i] = s += x[i];
+}
+
+static void PrefixSum(int *d, const int *x, int len) {
+    int i = 0;
+    #if BULK_SSE
+        auto carry = _mm_setzero_si128();
+        for (; i + 4 <= len; i += 4) {
+            auto v = _mm_loadu_si128((const __m128i *)(x + i));
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi32(v, carry);
+            _mm_storeu_si128((__m128i *)(d + i), v);
+            carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+        }
+    #endif
+    int s = i ? d[i - 1] : 0;
+    for (; i < len; i++) d[i] = s += x[i];
+}
+
+template<typename T> static Value Gather(Value &xs, Value &idxs, type_elem_t vt) {
+    auto x = Packed<T>(xs, "bulk_gather");
+    auto idx = Packed<int>(idxs, "bulk_gather");
+    if (g_vm->halted) return Value();
+    auto len = idxs.vval()->len, xlen = xs.vval()->len;
+    auto nv = NewPacked(len, vt);
+    auto d = nv->PackedElems<T>();
+    for (int i = 0; i < len; i++) {
+        if (idx[i] < 0 || idx[i] >= xlen) {
+            Value(nv).DECRT();
+            return g_vm->BuiltinError("bulk_gather: index out of range: " + to_string(idx[i]));
+        }
+        d[i] = x[idx[i]];
+    }
+    xs.DECRT();
+    idxs.DECRT();
+    return Value(nv);
+}
+
+template<typename T> static Value Scatter(Value &xs, Value &idxs, Value &vals) {
+    auto x = Packed<T>(xs, "bulk_scatter");
+    auto idx = Packed<int>(idxs, "bulk_scatter");
+    auto v = Packed<T>(vals, "bulk_scatter");
+    SameLen(idxs, vals, "bulk_scatter");
+    if (g_vm->halted) return Value();
+    auto len = idxs.vval()->len, xlen = xs.vval()->len;
+    for (int i = 0; i < len; i++) {
+        if (idx[i] < 0 || idx[i] >= xlen)
+            return g_vm->BuiltinError("bulk_scatter: index out of range: " + to_string(idx[i]));
+        x[idx[i]] = v[i];
+    }
+    idxs.DECRT();
+    vals.DECRT();
+    return xs;
+}
+
+void AddBulk() {
+    STARTDECL(bulk_fma) (Value &xs, Value &ys, Value &zs) {
+        auto x = Packed<float>(xs, "bulk_fma");
+        auto y = Packed<float>(ys, "bulk_fma");
+        auto z = Packed<float>(zs, "bulk_fma");
+        SameLen(xs, ys, "bulk_fma");
+        SameLen(xs, zs, "bulk_fma");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto d = Dest(zs);
+        FMA(d->PackedElems<float>(), x, y, z, len);
+        xs.DECRT();
+        ys.DECRT();
+        return Value(d);
+    }
+    ENDDECL3(bulk_fma, "xs,ys,zs", "F]F]F]", "F]",
+        "returns xs * ys + zs for each element");
+
+    STARTDECL(bulk_axpy) (Value &a, Value &xs, Value &ys) {
+        auto x = Packed<float>(xs, "bulk_axpy");
+        auto y = Packed<float>(ys, "bulk_axpy");
+        SameLen(xs, ys, "bulk_axpy");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto d = Dest(ys);
+        AXPY(d->PackedElems<float>(), a.fval(), x, y, len);
+        xs.DECRT();
+        return Value(d);
+    }
+    ENDDECL3(bulk_axpy, "a,xs,ys", "FF]F]", "F]",
+        "returns a * xs + ys for each element");
+
+    STARTDECL(bulk_clamp) (Value &xs, Value &lo, Value &hi) {
+        auto x = Packed<float>(xs, "bulk_clamp");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto d = Dest(xs);
+        Clamp(d->PackedElems<float>(), x, lo.fval(), hi.fval(), len);
+        return Value(d);
+    }
+    ENDDECL3(bulk_clamp, "xs,lo,hi", "F]FF", "F]",
+        "returns each element clamped to the range [lo..hi]");
+
+    STARTDECL(bulk_clamp) (Value &xs, Value &lo, Value &hi) {
+        auto x = Packed<int>(xs, "bulk_clamp");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto d = Dest(xs);
+        Clamp(d->PackedElems<int>(), x, lo.ival(), hi.ival(), len);
+        return Value(d);
+    }
+    ENDDECL3(bulk_clamp, "xs,lo,hi", "I]II", "I]",
+        "int version.");
+
+    STARTDECL(bulk_prefix_sum) (Value &xs) {
+        auto x = Packed<float>(xs, "bulk_prefix_sum");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto d = Dest(xs);
+        PrefixSum(d->PackedElems<float>(), x, len);
+        return Value(d);
+    }
+    ENDDECL1(bulk_prefix_sum, "xs", "F]", "F]",
+        "returns the running totals of xs, i.e. element i is the sum of elements 0..i");
+
+    STARTDECL(bulk_prefix_sum) (Value &xs) {
+        auto x = Packed<int>(xs, "bulk_prefix_sum");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto d = Dest(xs);
+        PrefixSum(d->PackedElems<int>(), x, len);
+        return Value(d);
+    }
+    ENDDECL1(bulk_prefix_sum, "xs", "I]", "I]",
+        "int version.");
+
+    #define BULKREDUCE(T, name, exp) \
+        auto x = Packed<T>(xs, #name); \
+        if (g_vm->halted) return Value(); \
+        auto r = exp; \
+        xs.DECRT(); \
+        return Value(r);
+
+    STARTDECL(bulk_sum) (Value &xs) { BULKREDUCE(float, bulk_sum, Sum(x, xs.vval()->len)) }
+    ENDDECL1(bulk_sum, "xs", "F]", "F",
+        "sum of all elements, 0 for an empty vector");
+    STARTDECL(bulk_sum) (Value &xs) { BULKREDUCE(int, bulk_sum, Sum(x, xs.vval()->len)) }
+    ENDDECL1(bulk_sum, "xs", "I]", "I",
+        "int version.");
+
+    STARTDECL(bulk_min) (Value &xs) { BULKREDUCE(float, bulk_min, MinMax<false>(x, xs.vval()->len)) }
+    ENDDECL1(bulk_min, "xs", "F]", "F",
+        "smallest element, or the largest possible float for an empty vector");
+    STARTDECL(bulk_min) (Value &xs) { BULKREDUCE(int, bulk_min, MinMax<false>(x, xs.vval()->len)) }
+    ENDDECL1(bulk_min, "xs", "I]", "I",
+        "int version.");
+
+    STARTDECL(bulk_max) (Value &xs) { BULKREDUCE(float, bulk_max, MinMax<true>(x, xs.vval()->len)) }
+    ENDDECL1(bulk_max, "xs", "F]", "F",
+        "largest element, or the smallest possible float for an empty vector");
+    STARTDECL(bulk_max) (Value &xs) { BULKREDUCE(int, bulk_max, MinMax<true>(x, xs.vval()->len)) }
+    ENDDECL1(bulk_max, "xs", "I]", "I",
+        "int version.");
+
+    STARTDECL(bulk_argmin) (Value &xs) {
+        BULKREDUCE(float, bulk_argmin, (ArgMinMax<false>(x, xs.vval()->len)))
+    }
+    ENDDECL1(bulk_argmin, "xs", "F]", "I",
+        "index of the (first) smallest element, or -1 for an empty vector");
+    STARTDECL(bulk_argmin) (Value &xs) {
+        BULKREDUCE(int, bulk_argmin, (ArgMinMax<false>(x, xs.vval()->len)))
+    }
+    ENDDECL1(bulk_argmin, "xs", "I]", "I",
+        "int version.");
+
+    STARTDECL(bulk_argmax) (Value &xs) {
+        BULKREDUCE(float, bulk_argmax, (ArgMinMax<true>(x, xs.vval()->len)))
+    }
+    ENDDECL1(bulk_argmax, "xs", "F]", "I",
+        "index of the (first) largest element, or -1 for an empty vector");
+    STARTDECL(bulk_argmax) (Value &xs) {
+        BULKREDUCE(int, bulk_argmax, (ArgMinMax<true>(x, xs.vval()->len)))
+    }
+    ENDDECL1(bulk_argmax, "xs", "I]", "I",
+        "int version.");
+
+    STARTDECL(bulk_dot) (Value &xs, Value &ys) {
+        auto x = Packed<float>(xs, "bulk_dot");
+        auto y = Packed<float>(ys, "bulk_dot");
+        SameLen(xs, ys, "bulk_dot");
+        if (g_vm->halted) return Value();
+        auto r = Dot(x, y, xs.vval()->len);
+        xs.DECRT();
+        ys.DECRT();
+        return Value(r);
+    }
+    ENDDECL2(bulk_dot, "xs,ys", "F]F]", "F",
+        "dot product of two vectors of any (equal) length");
+
+    STARTDECL(bulk_dot) (Value &xs, Value &ys) {
+        auto x = Packed<int>(xs, "bulk_dot");
+        auto y = Packed<int>(ys, "bulk_dot");
+        SameLen(xs, ys, "bulk_dot");
+        if (g_vm->halted) return Value();
+        auto r = Dot(x, y, xs.vval()->len);
+        xs.DECRT();
+        ys.DECRT();
+        return Value(r);
+    }
+    ENDDECL2(bulk_dot, "xs,ys", "I]I]", "I",
+        "int version.");
+
+    STARTDECL(bulk_gather) (Value &xs, Value &idxs) {
+        return Gather<float>(xs, idxs, TYPE_ELEM_VECTOR_OF_FLOAT);
+    }
+    ENDDECL2(bulk_gather, "xs,indices", "F]I]", "F]",
+        "returns a new vector with the elements of xs at each of the indices");
+
+    STARTDECL(bulk_gather) (Value &xs, Value &idxs) {
+        return Gather<int>(xs, idxs, TYPE_ELEM_VECTOR_OF_INT);
+    }
+    ENDDECL2(bulk_gather, "xs,indices", "I]I]", "I]",
+        "int version.");
+
+    STARTDECL(bulk_scatter) (Value &xs, Value &idxs, Value &vals) {
+        return Scatter<float>(xs, idxs, vals);
+    }
+    ENDDECL3(bulk_scatter, "xs,indices,values", "F]I]F]", "F]",
+        "writes each of values into xs at the corresponding index, returns xs");
+
+    STARTDECL(bulk_scatter) (Value &xs, Value &idxs, Value &vals) {
+        return Scatter<int>(xs, idxs, vals);
+    }
+    ENDDECL3(bulk_scatter, "xs,indices,values", "I]I]I]", "I]",
+        "int version.");
+
+    STARTDECL(bulk_histogram) (Value &xs, Value &lo, Value &hi, Value &bins) {
+        auto x = Packed<float>(xs, "bulk_histogram");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto nbins = max(bins.ival(), 0);
+        auto nv = NewPacked(nbins, TYPE_ELEM_VECTOR_OF_INT);
+        auto h = nv->PackedElems<int>();
+        memset(h, 0, nbins * sizeof(int));
+        auto l = lo.fval();
+        auto scale = nbins / (hi.fval() - l);
+        for (int i = 0; i < len; i++) {
+            auto b = (x[i] - l) * scale;
+            if (b >= 0 && b < nbins) h[(int)b]++;
+        }
+        xs.DECRT();
+        return Value(nv);
+    }
+    ENDDECL4(bulk_histogram, "xs,lo,hi,bins", "F]FFI", "I]",
+        "counts how many elements fall in each of bins equal sized ranges between lo and hi,"
+        " elements outside [lo..hi) are ignored");
+
+    STARTDECL(bulk_histogram) (Value &xs, Value &bins) {
+        auto x = Packed<int>(xs, "bulk_histogram");
+        if (g_vm->halted) return Value();
+        auto len = xs.vval()->len;
+        auto nbins = max(bins.ival(), 0);
+        auto nv = NewPacked(nbins, TYPE_ELEM_VECTOR_OF_INT);
+        auto h = nv->PackedElems<int>();
+        memset(h, 0, nbins * sizeof(int));
+        for (int i = 0; i < len; i++) if (x[i] >= 0 && x[i] < nbins) h[x[i]]++;
+        xs.DECRT();
+        return Value(nv);
+    }
+    ENDDECL2(bulk_histogram, "xs,bins", "I]I", "I]",
+        "counts how often each of the values 0..bins-1 occurs in xs, other values are ignored");
+}
+
+}
@@ -27,6 +27,13 @@ struct CodeGen  {
     map<vector<type_elem_t>, type_elem_t> type_lookup;  // Wasteful, but simple.
     vector<TypeRef> rettypes, temptypestack;
     size_t nested_fors;
+    vector<int> unbox_fallbacks;  // UNBOXVAR jumps of the current unboxed expression.
+    size_t unbox_base;            // Size of temptypestack at its start.
+    int nounbox;
+    int num_multi_caches;  // Inline caches of CALLMULTI call sites, see VM::EvalMulti.
+    set<Ident *> freevars;             // Vars used by functions other than their own.
+    set<int> nonlocalreturns;          // Functions returned from out of another function.
+    set<const Node *> tailcalls;       // Calls of the current function that end it.
     vector<const char *> stringtable;  // sized strings.
 
     int Pos() { return (int)code.size(); }
@@ -119,7 +126,8 @@ struct CodeGen  {
         return offset;
     }
 
-    CodeGen(Parser &_p, SymbolTable &_st) : parser(_p), st(_st), nested_fors(0) {
+    CodeGen(Parser &_p, SymbolTable &_st)
+        : parser(_p), st(_st), nested_fors(0), unbox_base(0), nounbox(0), num_multi_caches(0) {
         // Pre-load some types into the table, must correspond to order of type_elem_t enums.
                                                             GetTypeTableOffset(type_int);
                                                             GetTypeTableOffset(type_float);
@@ -148,6 +156,12 @@ struct CodeGen  {
                 struc->superclass->firstsubclass = struc;
             }
         }
+        for (auto f : parser.st.functiontable) {
+            for (auto sf = f->subf; sf; sf = sf->next) if (sf->typechecked) {
+                for (auto &arg : sf->freevars.v) freevars.insert(arg.id);
+                FindNonLocalReturns(sf->body, *sf);
+            }
+        }
         linenumbernodes.push_back(parser.root);
         SplitAttr(0);
         Emit(IL_JUMP, 0);
@@ -280,6 +294,11 @@ struct CodeGen  {
         // optimize function calls
         Emit((int)defs.size());
         for (auto id : defs) Emit(id->idx);
+        tailcalls.clear();
+        if (sf.body && CanTailCall(sf)) {
+            FindTailCalls(Parser::LastInList(sf.body)->head(), sf);
+            FindTailReturns(sf.body, sf);
+        }
         if (sf.body) BodyGen(sf.body);
         else Dummy(true);
         TakeTemp(1);
@@ -288,6 +307,69 @@ struct CodeGen  {
         linenumbernodes.pop_back();
     }
 
+    void FindNonLocalReturns(const Node *n, const SubFunction &sf) {
+        if (!n) return;
+        if (n->type == T_RETURN) {
+            auto fid = n->return_function_idx()->integer();
+            if (fid >= 0 && (fid != sf.parent->idx || sf.parent->anonymous))
+                nonlocalreturns.insert(fid);
+        }
+        FindNonLocalReturns(n->a(), sf);
+        FindNonLocalReturns(n->b(), sf);
+        FindNonLocalReturns(n->c(), sf);
+    }
+
+    // Whether the frame of sf can be removed before a call it ends with, rather than after: its
+    // vars must not be used by functions it passes on (which see them as free variables), or be
+    // dynamically scoped, and nothing may unwind the stack looking for sf.
+    bool CanTailCall(const SubFunction &sf) {
+        auto &f = *sf.parent;
+        if (f.anonymous || sf.iscoroutine || sf.dynscoperedefs.v.size() || sf.logvarcallgraph ||
+            sf.returntypes.size() > 1 || nonlocalreturns.count(f.idx))
+            return false;
+        for (auto &arg : sf.args.v) if (freevars.count(arg.id)) return false;
+        for (auto &loc : sf.locals.v) if (freevars.count(loc.id)) return false;
+        return true;
+    }
+
+    // Collects the calls whose value becomes the return value of sf.
+    void FindTailCalls(const Node *n, const SubFunction &sf) {
+        switch (n->type) {
+            case T_CALL: {
+                auto &csf = *n->call_function()->sf();
+                auto &cf = *csf.parent;
+                if (!cf.anonymous && !cf.multimethod && !cf.istype && !csf.iscoroutine &&
+                    csf.returntypes.size() == 1 && csf.returntypes[0] == sf.returntypes[0])
+                    tailcalls.insert(n);
+                break;
+            }
+            case T_IF:
+                FindTailCalls(n->if_then(), sf);
+                if (n->if_else()->type != T_DEFAULTVAL) FindTailCalls(n->if_else(), sf);
+                break;
+            case T_INLINED:
+                for (auto list = n->body(); list; list = list->tail())
+                    if (!list->tail()) FindTailCalls(list->head(), sf);
+                break;
+            case T_SEQ:
+                FindTailCalls(n->right(), sf);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // A "return" out of sf itself ends it just the same.
+    void FindTailReturns(const Node *n, const SubFunction &sf) {
+        if (!n) return;
+        if (n->type == T_RETURN && n->return_function_idx()->integer() == sf.parent->idx &&
+            n->return_value())
+            FindTailCalls(n->return_value(), sf);
+        FindTailReturns(n->a(), sf);
+        FindTailReturns(n->b(), sf);
+        FindTailReturns(n->c(), sf);
+    }
+
     void EmitTempInfo(const Node *callnode) {
         int i = 0;
         uint mask = 0;
@@ -322,19 +404,28 @@ struct CodeGen  {
         return lastarg;
     };
 
-    void GenCall(const SubFunction &sf, const Node *args, const Node *errnode, int &nargs) {
+    void GenCall(const SubFunction &sf, const Node *args, const Node *errnode, int &nargs,
+                 bool tailcall = false) {
         auto &f = *sf.parent;
         GenArgs(args, nargs);
         if (f.nargs() != nargs)
             parser.Error("call to function " + f.name + " needs " + to_string(f.nargs()) +
                          " arguments, " + to_string(nargs) + " given", errnode);
         TakeTemp(nargs);
-        Emit(f.multimethod ? IL_CALLMULTI : IL_CALL,
-             f.idx,
-             f.multimethod ? f.bytecodestart : sf.subbytecodestart);
-        GenFixup(&sf);
-        EmitTempInfo(args);
+        if (tailcall) {
+            // Any temps left are those of enclosing fors, which a return has already popped.
+            assert(temptypestack.size() == nested_fors * 2);
+            Emit(IL_TAILCALL, f.idx, sf.subbytecodestart);
+            GenFixup(&sf);
+        } else {
+            Emit(f.multimethod ? IL_CALLMULTI : IL_CALL,
+                 f.idx,
+                 f.multimethod ? f.bytecodestart : sf.subbytecodestart);
+            GenFixup(&sf);
+            EmitTempInfo(args);
+        }
         if (f.multimethod) {
+            Emit(num_multi_caches++);
             for (auto list = args; list; list = list->tail()) {
                 Emit(GetTypeTableOffset(list->head()->exptype));
             }
@@ -347,12 +438,166 @@ struct CodeGen  {
 
     int JumpRef(int jumpop, TypeRef type) { return IsRefNil(type->t) ? jumpop + 1 : jumpop; }
 
+    // Generates a condition followed by a JUMPFAIL to be patched with SETL. Comparisons of ints
+    // get turned into a single superinstruction instead.
+    void GenJumpFail(const Node *cond) {
+        // Conditions of control structures are usually inlined closures, look inside those.
+        if (cond->type == T_INLINED) {
+            auto list = cond->body();
+            while (list->tail()) list = list->tail();
+            if (list->head()->exptype->t == cond->exptype->t) {
+                linenumbernodes.push_back(cond);
+                for (list = cond->body(); list->tail(); list = list->tail())
+                    Gen(list->head(), 0);
+                GenJumpFail(list->head());
+                linenumbernodes.pop_back();
+                return;
+            }
+        }
+        int opc = -1;
+        switch (cond->type) {
+            case T_LT:   opc = 0; break;
+            case T_GT:   opc = 1; break;
+            case T_LTEQ: opc = 2; break;
+            case T_GTEQ: opc = 3; break;
+            case T_EQ:   opc = 4; break;
+            case T_NEQ:  opc = 5; break;
+            default:     break;
+        }
+        if (opc < 0 || cond->left()->exptype->t != V_INT || cond->right()->exptype->t != V_INT) {
+            Gen(cond, 1, true);
+            Emit(JumpRef(IL_JUMPFAIL, cond->exptype), 0);
+            return;
+        }
+        linenumbernodes.push_back(cond);
+        if (cond->left()->type == T_IDENT && cond->right()->type == T_INT) {
+            Emit(IL_JUMPFAILVILT + opc, cond->left()->sid()->idx, cond->right()->integer(), 0);
+        } else {
+            Gen(cond->left(), 1);
+            Gen(cond->right(), 1);
+            TakeTemp(2);
+            Emit(IL_JUMPFAILILT + opc, 0);
+        }
+        linenumbernodes.pop_back();
+    }
+
+    // Arithmetic on value structs (see Struct::unboxable) is generated such that intermediate
+    // results live on the stack as one scalar per field, and only the final result gets allocated.
+    // Since a variable may hold a subclass of its static type at runtime (which has more fields),
+    // UNBOXVAR checks the exact type, and if it differs, jumps to a regular boxed version of the
+    // same expression. This is why this is limited to expressions without side effects.
+    const Struct *UnboxedStruct(const Node *n) {
+        auto type = n->exptype;
+        return type->t == V_STRUCT && type->struc->unboxable ? type->struc : nullptr;
+    }
+
+    bool PureScalar(const Node *n, ValueType t) {
+        if (n->exptype->t != t) return false;
+        switch (n->type) {
+            case T_INT:
+            case T_FLOAT:
+            case T_IDENT:
+                return true;
+            case T_DOT:
+                return n->left()->type == T_IDENT;
+            case T_UMINUS:
+                return PureScalar(n->child(), t);
+            case T_I2F:
+                return PureScalar(n->child(), V_INT);
+            case T_PLUS:
+            case T_MINUS:
+            case T_MULT:
+            case T_DIV:
+                return PureScalar(n->left(), t) && PureScalar(n->right(), t);
+            default:
+                return false;
+        }
+    }
+
+    bool Unboxable(const Node *n, const Struct *s) {
+        if (UnboxedStruct(n) != s) return false;
+        switch (n->type) {
+            case T_IDENT:
+                return true;
+            case T_CONSTRUCTOR:
+                for (auto cn = n->constructor_args(); cn; cn = cn->tail())
+                    if (!PureScalar(cn->head(), s->vectortype->sub->t)) return false;
+                return true;
+            case T_UMINUS:
+                return Unboxable(n->child(), s);
+            case T_PLUS:
+            case T_MINUS:
+            case T_MULT:
+            case T_DIV:
+                return Unboxable(n->left(), s) &&
+                       (Unboxable(n->right(), s) || PureScalar(n->right(), s->vectortype->sub->t));
+            default:
+                return false;
+        }
+    }
+
+    // Generates an Unboxable n as one scalar per field.
+    void GenUnboxed(const Node *n, const Struct *s) {
+        linenumbernodes.push_back(n);
+        auto isint = s->vectortype->sub->t == V_INT;
+        auto nfields = (int)s->fields.size();
+        switch (n->type) {
+            case T_IDENT:
+                Emit(IL_UNBOXVAR, n->sid()->idx, GetTypeTableOffset(n->exptype));
+                Emit((int)(temptypestack.size() - unbox_base), 0);
+                unbox_fallbacks.push_back(Pos());
+                for (int i = 0; i < nfields; i++) temptypestack.push_back(s->vectortype->sub);
+                break;
+            case T_CONSTRUCTOR:
+                for (auto cn = n->constructor_args(); cn; cn = cn->tail()) Gen(cn->head(), 1);
+                break;
+            case T_UMINUS:
+                GenUnboxed(n->child(), s);
+                if (isint) Emit(IL_PUSHINT, -1); else GenFloat(-1);
+                Emit(isint ? IL_IVSMULU : IL_FVSMULU, nfields);
+                break;
+            default: {
+                int opc = n->type == T_PLUS ? 0 : n->type == T_MINUS ? 1 : n->type == T_MULT ? 2 : 3;
+                GenUnboxed(n->left(), s);
+                bool withscalar = IsScalar(n->right()->exptype->t);
+                if (withscalar) Gen(n->right(), 1);
+                else GenUnboxed(n->right(), s);
+                TakeTemp(withscalar ? 1 : nfields);
+                Emit((isint ? (withscalar ? IL_IVSADDU : IL_IVVADDU)
+                            : (withscalar ? IL_FVSADDU : IL_FVVADDU)) + opc, nfields);
+                break;
+            }
+        }
+        linenumbernodes.pop_back();
+    }
+
+    template<typename U, typename B> void GenUnboxedOrBoxed(U gen_unboxed, B gen_boxed) {
+        unbox_fallbacks.clear();
+        unbox_base = temptypestack.size();
+        gen_unboxed();
+        if (unbox_fallbacks.empty()) return;
+        Emit(IL_JUMP, 0);
+        MARKL(done);
+        for (auto loc : unbox_fallbacks) SETL(loc);
+        unbox_fallbacks.clear();
+        nounbox++;
+        gen_boxed();
+        nounbox--;
+        SETL(done);
+    }
+
     void GenFloat(float f) { Emit(IL_PUSHFLT); int2float i2f; i2f.f = f; Emit(i2f.i); }
 
     void Gen(const Node *n, int retval, bool taketemp = false, const Node *parent = nullptr) {
         // The cases below generate no retvals if retval==0, otherwise they generate however many
         // they can irrespective of retval, optionally record that in rettypes for the more complex
         // cases. Then at the end of this function the two get matched up.
+        if (!retval && n->OpMayFail()) {
+            // Unused values are normally not computed at all, but this one may be a runtime error.
+            Gen(n, 1, true, parent);
+            Emit(IsRefNil(n->exptype->t) ? IL_POPREF : IL_POP);
+            return;
+        }
         auto tempstartsize = temptypestack.size();
         linenumbernodes.push_back(n);
         int opc = 0;
@@ -387,6 +632,10 @@ struct CodeGen  {
 
             case T_DOT:
             case T_DOTMAYBE:
+                if (retval && n->type == T_DOT && n->left()->type == T_IDENT) {
+                    Emit(IL_PUSHVARFLD, n->left()->sid()->idx, FieldIndex(n->right()));
+                    break;
+                }
                 Gen(n->left(), retval, true);
                 if (retval) GenFieldAccess(n->right(), -1, n->type == T_DOTMAYBE);
                 break;
@@ -458,6 +707,18 @@ struct CodeGen  {
             case T_MULT:  opc++;
             case T_MINUS: opc++;
             case T_PLUS:
+                if (retval && !nounbox && opc < 4 && UnboxedStruct(n) &&
+                    Unboxable(n, UnboxedStruct(n))) {
+                    auto s = UnboxedStruct(n);
+                    GenUnboxedOrBoxed([&]() {
+                        GenUnboxed(n, s);
+                        TakeTemp((int)s->fields.size());
+                        Emit(IL_NEWVEC, GetTypeTableOffset(n->exptype), (int)s->fields.size());
+                    }, [&]() {
+                        Gen(n, 1, true);
+                    });
+                    break;
+                }
                 Gen(n->left(), retval);
                 Gen(n->right(), retval);
                 if (retval) {
@@ -628,7 +889,8 @@ struct CodeGen  {
                         // last thing in a function, requiring a return value
                     }
                 } else if (n->type == T_CALL) {
-                    GenCall(*n->call_function()->sf(), n->call_args(), n->call_function(), nargs);
+                    GenCall(*n->call_function()->sf(), n->call_args(), n->call_function(), nargs,
+                            tailcalls.count(n) > 0);
                 } else {
                     assert(n->type == T_DYNCALL);
                     if (n->dcall_fval()->exptype->t == V_YIELD) {
@@ -714,8 +976,12 @@ struct CodeGen  {
             }
 
             case T_AND: {
-                Gen(n->left(), 1, true);
-                Emit(JumpRef(retval ? IL_JUMPFAILR : IL_JUMPFAIL, n->left()->exptype), 0);
+                if (retval) {
+                    Gen(n->left(), 1, true);
+                    Emit(JumpRef(IL_JUMPFAILR, n->left()->exptype), 0);
+                } else {
+                    GenJumpFail(n->left());
+                }
                 MARKL(loc);
                 Gen(n->right(), retval, true);
                 SETL(loc);
@@ -738,10 +1004,13 @@ struct CodeGen  {
             }
 
             case T_IF: {
-                Gen(n->if_condition(), 1, true);
                 bool has_else = n->if_else()->type != T_DEFAULTVAL;
-                Emit(JumpRef(!has_else && retval ? IL_JUMPFAILN : IL_JUMPFAIL,
-                             n->if_condition()->exptype), 0);
+                if (!has_else && retval) {
+                    Gen(n->if_condition(), 1, true);
+                    Emit(JumpRef(IL_JUMPFAILN, n->if_condition()->exptype), 0);
+                } else {
+                    GenJumpFail(n->if_condition());
+                }
                 MARKL(loc);
                 if (has_else) {
                     Gen(n->if_then(), retval, true);
@@ -761,8 +1030,7 @@ struct CodeGen  {
             case T_WHILE: {
                 SplitAttr(Pos());
                 MARKL(loopback);
-                Gen(n->while_condition(), 1, true);
-                Emit(JumpRef(IL_JUMPFAIL, n->while_condition()->exptype), 0);
+                GenJumpFail(n->while_condition());
                 MARKL(jumpout);
                 Gen(n->while_body(), 0);
                 Emit(IL_JUMP, loopback);
@@ -946,6 +1214,31 @@ struct CodeGen  {
 
     void GenAssign(const Node *lval, int lvalop, int retval, TypeRef type,
                    const Node *rhs = nullptr) {
+        auto s = UnboxedStruct(lval);
+        if (s && !nounbox && lval->type == T_IDENT && rhs && lvalop >= LVO_IADD &&
+            lvalop <= LVO_IDIV && lvalop % 2 == LVO_IADD % 2 &&
+            (Unboxable(rhs, s) || PureScalar(rhs, s->vectortype->sub->t))) {
+            // Same as GenUnboxed for lval = lval op rhs.
+            GenUnboxedOrBoxed([&]() {
+                auto isint = s->vectortype->sub->t == V_INT;
+                auto nfields = (int)s->fields.size();
+                GenUnboxed(lval, s);
+                bool withscalar = IsScalar(rhs->exptype->t);
+                if (withscalar) Gen(rhs, 1);
+                else GenUnboxed(rhs, s);
+                TakeTemp(withscalar ? 1 : nfields);
+                Emit((isint ? (withscalar ? IL_IVSADDU : IL_IVVADDU)
+                            : (withscalar ? IL_FVSADDU : IL_FVVADDU)) + (lvalop - LVO_IADD) / 2,
+                     nfields);
+                TakeTemp(nfields);
+                Emit(IL_NEWVEC, GetTypeTableOffset(lval->exptype), nfields);
+                Emit(IL_LVALVAR, retval ? LVO_WRITERREF : LVO_WRITEREF, lval->sid()->idx);
+                VarModified(lval->sid());
+            }, [&]() {
+                GenAssign(lval, lvalop, retval, type, rhs);
+            });
+            return;
+        }
         if (lvalop >= LVO_IADD && lvalop <= LVO_IMOD) {
             if (type->t == V_INT) {
             } else if (type->t == V_FLOAT)  {
@@ -970,6 +1263,12 @@ struct CodeGen  {
             else assert(type->t == V_INT);
         }
         if (retval) lvalop++;
+        if (lval->type == T_IDENT && rhs && rhs->type == T_INT &&
+            (lvalop == LVO_WRITE || lvalop == LVO_IADD || lvalop == LVO_ISUB)) {
+            Emit(IL_LVALVARI, lvalop, lval->sid()->idx, rhs->integer());
+            VarModified(lval->sid());
+            return;
+        }
         int na = 0;
         if (rhs) { Gen(rhs, 1); na++; }
         switch (lval->type) {
@@ -994,15 +1293,18 @@ struct CodeGen  {
         }
     }
 
-    void GenFieldAccess(Node *sfieldnode, int lvalop, bool maybe) {
-        auto f = sfieldnode->fld();
+    int FieldIndex(const Node *sfieldnode) {
         auto stype = sfieldnode->exptype;
         assert(stype->t == V_STRUCT);  // Ensured by typechecker.
+        auto idx = stype->struc->Has(sfieldnode->fld());
+        assert(idx >= 0);
+        return idx;
+    }
+
+    void GenFieldAccess(Node *sfieldnode, int lvalop, bool maybe) {
         if (lvalop >= 0) Emit(IL_LVALFLD, lvalop);
         else Emit(IL_PUSHFLD + (int)maybe);
-        auto idx = stype->struc->Has(f);
-        assert(idx >= 0);
-        Emit(idx);
+        Emit(FieldIndex(sfieldnode));
     }
 
     #undef MARKL
@@ -23,7 +23,7 @@
 
 namespace lobster {
 
-static SlabAlloc *parserpool = nullptr;    // set during the lifetime of a Parser object
+static thread_local SlabAlloc *parserpool = nullptr;    // set during the lifetime of a Parser object
 
 }
 
@@ -73,17 +73,26 @@ const int fileheaderlen = 4;
 
 void Compile(const char *fn, char *stringsource, vector<uchar> &bytecode,
              string *parsedump = nullptr) {
+    double phases[5];
+    phases[0] = SecondsSinceStart();
     SymbolTable st;
     Parser parser(fn, st, stringsource);
     parser.Parse();
+    phases[1] = SecondsSinceStart();
     TypeChecker tc(parser, st);
+    phases[2] = SecondsSinceStart();
     // Optimizer is not optional, must always run at least one pass, since TypeChecker and CodeGen
     // rely on it culling const if-thens and other things.
     Optimizer opt(parser, st, tc, 100);
+    phases[3] = SecondsSinceStart();
     if (parsedump) *parsedump = parser.DumpAll(true);
     CodeGen cg(parser, st);
     st.Serialize(cg.code, cg.code_attr, cg.type_table, cg.vint_typeoffsets, cg.vfloat_typeoffsets,
                  cg.lineinfo, cg.sids, cg.stringtable, bytecode);
+    phases[4] = SecondsSinceStart();
+    Output(OUTPUT_INFO, "compile time: parse %.3f, typecheck %.3f, optimize %.3f, codegen %.3f sec",
+           phases[1] - phases[0], phases[2] - phases[1], phases[3] - phases[2],
+           phases[4] - phases[3]);
     //parserpool->printstats();
 }
 
@@ -113,7 +122,7 @@ bool LoadByteCode(const char *bcf, vector<uchar> &bytecode) {
     if (!bc) return false;
     if (memcmp(fileheader, bc, fileheaderlen)) {
         free(bc);
-        throw string("bytecode file corrupt: ") + bcf;
+        THROW_OR_ABORT(string("bytecode file corrupt: ") + bcf);
     }
     uint origlen = *(uint *)(bc + fileheaderlen);
     bytecode.clear();
@@ -123,6 +132,87 @@ bool LoadByteCode(const char *bcf, vector<uchar> &bytecode) {
     return VerifyBytecode(bytecode);
 }
 
+// Compiled programs are cached in this folder (inside the folder of the main file), together with
+// a hash of everything that went into compiling them.
+const char *cachedir = "lobster_cache";
+const char *cacheheader = "\xA5\x74\xEF\x1A";
+
+static string CacheFileName(const char *fn) {
+    return string(cachedir) + "/" + StripDirPart(fn) + ".lbc";
+}
+
+// Anything that changes the bytecode a program compiles to: the compiler itself, the builtins it
+// knows about (which may be in other compilation units), and the source files, found the same way
+// the lexer finds them. Returns 0 if a file can't be loaded anymore.
+static uint64_t CacheKey(const bytecode::BytecodeFile *bcf) {
+    uint64_t h = FNV_OFFSET;
+    const char *version = __DATE__ " " __TIME__;
+    h = HashBytes(h, version, strlen(version));
+    h = HashBytes(h, &LOBSTER_BYTECODE_FORMAT_VERSION, sizeof(int));
+    for (auto nf : natreg.nfuns) {
+        h = HashBytes(h, nf->name.c_str(), nf->name.size() + 1);
+        for (auto &a : nf->args.v) h = HashBytes(h, &a.type->t, sizeof(ValueType));
+        for (auto &r : nf->retvals.v) h = HashBytes(h, &r.type->t, sizeof(ValueType));
+    }
+    for (auto fn : *bcf->filenames()) {
+        h = HashBytes(h, fn->c_str(), fn->size() + 1);
+        size_t len = 0;
+        auto buf = LoadFile((string("include/") + fn->c_str()).c_str(), &len);
+        if (!buf) buf = LoadFile(fn->c_str(), &len);
+        if (!buf) return 0;
+        h = HashBytes(h, buf, len);
+        free(buf);
+    }
+    return h;
+}
+
+void SaveCachedByteCode(const char *fn, const vector<uchar> &bytecode) {
+    auto key = CacheKey(bytecode::GetBytecodeFile(bytecode.data()));
+    if (!key || !MakeDir(cachedir)) return;
+    vector<uchar> out;
+    WEntropyCoder<true>(bytecode.data(), bytecode.size(), bytecode.size(), out);
+    auto len = (uint)bytecode.size();
+    auto check = HashBytes(HashBytes(FNV_OFFSET, &len, sizeof(uint)), out.data(), out.size());
+    FILE *f = OpenForWriting(CacheFileName(fn).c_str(), true);
+    if (f) {
+        fwrite(cacheheader, fileheaderlen, 1, f);
+        fwrite(&key, sizeof(uint64_t), 1, f);
+        fwrite(&check, sizeof(uint64_t), 1, f);
+        fwrite(&len, sizeof(uint), 1, f);
+        fwrite(out.data(), out.size(), 1, f);
+        fclose(f);
+    }
+}
+
+bool LoadCachedByteCode(const char *fn, vector<uchar> &bytecode) {
+    size_t bclen = 0;
+    uchar *bc = LoadFile(CacheFileName(fn).c_str(), &bclen);
+    if (!bc) return false;
+    auto checklen = fileheaderlen + sizeof(uint64_t) * 2;
+    auto hlen = checklen + sizeof(uint);
+    // A cache file that is corrupt or from another version is simply ignored. The check hash
+    // covers everything after it, since the entropy decoder can't deal with damaged input.
+    if (bclen < hlen || memcmp(cacheheader, bc, fileheaderlen) ||
+        *(uint64_t *)(bc + fileheaderlen + sizeof(uint64_t)) !=
+            HashBytes(FNV_OFFSET, bc + checklen, bclen - checklen)) {
+        free(bc);
+        return false;
+    }
+    auto key = *(uint64_t *)(bc + fileheaderlen);
+    auto origlen = *(uint *)(bc + checklen);
+    bytecode.clear();
+    WEntropyCoder<false>(bc + hlen, bclen - hlen, origlen, bytecode);
+    free(bc);
+    flatbuffers::Verifier verifier(bytecode.data(), bytecode.size());
+    if (bytecode.size() == origlen && bytecode::VerifyBytecodeFileBuffer(verifier) &&
+        bytecode::GetBytecodeFile(bytecode.data())->bytecode_version() ==
+            LOBSTER_BYTECODE_FORMAT_VERSION &&
+        CacheKey(bytecode::GetBytecodeFile(bytecode.data())) == key)
+        return true;
+    bytecode.clear();
+    return false;
+}
+
 void RegisterBuiltin(const char *name, void (* regfun)()) {
     Output(OUTPUT_DEBUG, "subsystem: %s", name);
     natreg.NativeSubSystemStart(name);
@@ -193,39 +283,94 @@ void DumpBuiltins(bool justnames) {
     }
 }
 
-Value CompileRun(Value &source, bool stringiscode) {
-    string fn = stringiscode ? "string" : source.sval()->str();  // fixme: datadir + sanitize?
-    SlabAlloc *parentpool = vmpool; vmpool = nullptr;
-    VM        *parentvm   = g_vm;   g_vm = nullptr;
-    try {
+// Compiles and runs a program in a VM of its own on the current thread, which must not have a VM
+// active. Returns an error string, or "" if the program ran successfully.
+static string RunSandboxed(const char *fn, char *stringsource, string &ret) {
+    #ifdef USE_EXCEPTION_HANDLING
+    try
+    #endif
+    {
         vector<uchar> bytecode;
-        Compile(fn.c_str(), stringiscode ? source.sval()->str() : nullptr, bytecode);
+        Compile(fn, stringsource, bytecode);
         //string s; DisAsm(s, bytecode.data()); Output(OUTPUT_INFO, "%s", s.c_str());
         #ifdef VM_COMPILED_CODE_MODE
             // FIXME: Sadly since we modify how the VM operates under compiled code, we can't run in
             // interpreted mode anymore.
-            throw string("cannot execute bytecode in compiled mode");
+            THROW_OR_ABORT(string("cannot execute bytecode in compiled mode"));
         #endif
-        RunBytecode(fn.c_str(), std::move(bytecode), nullptr, nullptr);
-        auto ret = g_vm->evalret;
+        auto err = RunBytecode(fn, std::move(bytecode), nullptr, nullptr);
+        ret = g_vm->evalret;
         delete g_vm;
         assert(!vmpool && !g_vm);
-        vmpool = parentpool;
-        g_vm = parentvm;
-        source.DECRT();
-        g_vm->Push(Value(g_vm->NewString(ret)));
-        return Value();
+        return err;
     }
+    #ifdef USE_EXCEPTION_HANDLING
     catch (string &s) {
         if (g_vm) delete g_vm;
-        vmpool = parentpool;
-        g_vm = parentvm;
-        source.DECRT();
+        if (vmpool) {  // VM constructor failed.
+            delete vmpool;
+            vmpool = nullptr;
+        }
+        return s;
+    }
+    #endif
+}
+
+// Same, but sets aside the VM of the calling program while the nested one runs.
+static string RunNested(const char *fn, char *stringsource, string &ret) {
+    SlabAlloc *parentpool = vmpool; vmpool = nullptr;
+    VM        *parentvm   = g_vm;   g_vm = nullptr;
+    auto err = RunSandboxed(fn, stringsource, ret);
+    vmpool = parentpool;
+    g_vm = parentvm;
+    return err;
+}
+
+Value CompileRun(Value &source, bool stringiscode) {
+    string fn = stringiscode ? "string" : source.sval()->str();  // fixme: datadir + sanitize?
+    string ret;
+    auto err = RunNested(fn.c_str(), stringiscode ? source.sval()->str() : nullptr, ret);
+    source.DECRT();
+    if (err.empty()) {
+        g_vm->Push(Value(g_vm->NewString(ret)));
+        return Value();
+    } else {
         g_vm->Push(Value(g_vm->NewString("nil")));
-        return Value(g_vm->NewString(s));
+        return Value(g_vm->NewString(err));
     }
 }
 
+Value CompileRunParallel(Value &sources) {
+    vector<string> codes;
+    for (int i = 0; i < sources.vval()->len; i++) codes.push_back(sources.vval()->At(i).sval()->str());
+    sources.DECRT();
+    vector<string> rets(codes.size()), errs(codes.size());
+    #ifdef __EMSCRIPTEN__
+        // No threads, but the results are the same.
+        for (size_t i = 0; i < codes.size(); i++)
+            errs[i] = RunNested("string", &codes[i][0], rets[i]);
+    #else
+        // g_vm, vmpool and parserpool are thread_local, so each thread gets a VM to itself.
+        vector<thread> workers;
+        for (size_t i = 0; i < codes.size(); i++) {
+            workers.emplace_back([&, i]() {
+                errs[i] = RunSandboxed("string", &codes[i][0], rets[i]);
+            });
+        }
+        for (auto &w : workers) w.join();
+    #endif
+    auto retv = (LVector *)g_vm->NewVector(0, (int)codes.size(),
+                                           g_vm->GetTypeInfo(TYPE_ELEM_VECTOR_OF_STRING));
+    auto errv = (LVector *)g_vm->NewVector(0, (int)codes.size(),
+                                           g_vm->GetTypeInfo(TYPE_ELEM_VECTOR_OF_STRING));
+    for (size_t i = 0; i < codes.size(); i++) {
+        retv->Push(Value(g_vm->NewString(errs[i].empty() ? rets[i] : "nil")));
+        errv->Push(errs[i].empty() ? Value() : Value(g_vm->NewString(errs[i])));
+    }
+    g_vm->Push(Value(retv));
+    return Value(errv);
+}
+
 void AddCompiler() {  // it knows how to call itself!
     STARTDECL(compile_run_code) (Value &filename) {
         return CompileRun(filename, true);
@@ -242,6 +387,14 @@ void AddCompiler() {  // it knows how to call itself!
     }
     ENDDECL1(compile_run_file, "filename", "S", "SS?",
         "same as compile_run_code(), only now you pass a filename.");
+
+    STARTDECL(compile_run_code_parallel) (Value &codes) {
+        return CompileRunParallel(codes);
+    }
+    ENDDECL1(compile_run_code_parallel, "codes", "S]", "S]S?]",
+        "like compile_run_code(), but runs each of the given programs at the same time, each on its"
+        " own thread and in its own VM. returns a vector of return values and a vector of errors"
+        " (nil where a program ran successfully), in the order of the programs.");
 }
 
 void RegisterCoreLanguageBuiltins() {
@@ -249,6 +402,10 @@ void RegisterCoreLanguageBuiltins() {
     extern void AddCompiler(); RegisterBuiltin("compiler",  AddCompiler);
     extern void AddFile();     RegisterBuiltin("file",      AddFile);
     extern void AddReader();   RegisterBuiltin("parsedata", AddReader);
+    extern void AddBulk();     RegisterBuiltin("bulk",      AddBulk);
+    extern void AddParallel(); RegisterBuiltin("parallel",  AddParallel);
+    extern void AddSpatial();  RegisterBuiltin("spatial",   AddSpatial);
+    extern void AddPathFinding(); RegisterBuiltin("pathfinding", AddPathFinding);
 }
 
 }
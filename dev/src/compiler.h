@@ -19,10 +19,12 @@ extern void Compile(const char *fn, char *stringsource, vector<uchar> &bytecode,
 extern bool VerifyBytecode(const vector<uchar> &bytecode);
 extern void SaveByteCode(const char *bcf, const vector<uchar> &bytecode);
 extern bool LoadByteCode(const char *bcf, vector<uchar> &bytecode);
+extern void SaveCachedByteCode(const char *fn, const vector<uchar> &bytecode);
+extern bool LoadCachedByteCode(const char *fn, vector<uchar> &bytecode);
 extern void RegisterBuiltin(const char *name, void (* regfun)());
 extern void RegisterCoreLanguageBuiltins();
 extern void DumpBuiltins(bool justnames);
 
-extern void ToCPP(string &s, const uchar *bytecode_buffer, size_t bytecode_len);
+extern void ToCPP(string &s, const uchar *bytecode_buffer);
 
 }
@@ -66,10 +66,11 @@ struct Voxels {
 
 IntResourceManagerCompact<Voxels> *voxels_set = nullptr;
 
-Voxels &GetVoxels(Value &i) {
+// Returns nullptr after reporting an error.
+Voxels *GetVoxels(Value &i) {
     auto v = voxels_set->Get(i.ival());
     if (!v) g_vm->BuiltinError("illegal voxel grid id: " + to_string(i.ival()));
-    return *v;
+    return v;
 }
 
 void CubeGenClear() {
@@ -86,6 +87,184 @@ Voxels &NewWorld(const int3 &size) {
     return *v;
 }
 
+static const int3 neighbors[] = {
+    int3(1, 0, 0), int3(-1,  0,  0),
+    int3(0, 1, 0), int3( 0, -1,  0),
+    int3(0, 0, 1), int3( 0,  0, -1),
+};
+// The corners of the face towards each neighbor, as xyz bits.
+static const char *faces[6] = { "4576", "0231", "2673", "0154", "1375", "0462" };
+static const int quadindices[6] = { 0, 1, 3, 1, 2, 3 };
+
+struct cvert { float3 pos; float3 normal; byte4 color; };
+// Greedy meshes have no random offsets, so all positions are integers.
+struct cvert_compact { vec<short, 4> pos; vec<signed char, 4> normal; byte4 color; };
+
+template<typename V> struct MeshPart {
+    vector<V> verts;
+    vector<int> triangles;
+
+    void AddQuad() {
+        auto base = (int)verts.size() - 4;
+        for (int i = 0; i < 6; i++) triangles.push_back(base + quadindices[i]);
+    }
+};
+
+static int3 FaceCorner(int n, int vn, const int3 &pos, const int3 &size) {
+    int3 vpos;
+    for (int d = 0; d < 3; d++) {
+        vpos.set(d, pos[d] + ((faces[n][vn] & (1 << (2 - d))) != 0) * size[d]);
+    }
+    return vpos;
+}
+
+static bool Exposed(const Voxels &v, const int3 &pos, int n) {
+    auto npos = pos + neighbors[n];
+    return !(npos >= 0 && npos < v.grid.dim) || v.grid.Get(npos) == transparant;
+}
+
+// One quad per exposed face, with each vertex randomly offset by its position.
+static void MeshCubes(const Voxels &v, int x0, int x1, MeshPart<cvert> &part) {
+    static const vector<float> rnd_offset = []() {
+        RandomNumberGenerator<PCG32> rnd;
+        vector<float> offsets(1024);
+        for (auto &f : offsets) { f = (rnd.rndfloat() - 0.5f) * 0.15f; }
+        return offsets;
+    }();
+    // Woah nested loops!
+    for (int x = x0; x < x1; x++) {
+        for (int y = 0; y < v.grid.dim.y(); y++) {
+            for (int z = 0; z < v.grid.dim.z(); z++) {
+                auto pos = int3(x, y, z);
+                auto c = v.grid.Get(pos);
+                if (c == transparant) continue;
+                for (int n = 0; n < 6; n++) {
+                    if (!Exposed(v, pos, n)) continue;
+                    for (int vn = 0; vn < 4; vn++) {
+                        auto vpos = FaceCorner(n, vn, pos, int3_1);
+                        cvert vert;
+                        auto oi = ((vpos.z() << 8) ^ (vpos.y() << 4) ^ vpos.x()) %
+                                  (rnd_offset.size() - 2);
+                        auto offset = float3(&rnd_offset[oi]);
+                        vert.pos = float3(vpos) + offset;
+                        vert.normal = float3(neighbors[n]);
+                        vert.color = v.palette[c];
+                        part.verts.push_back(vert);
+                    }
+                    part.AddQuad();
+                }
+            }
+        }
+    }
+}
+
+// For each face direction and each slice of the world perpendicular to it, marks the exposed
+// faces with their color, then repeatedly takes the largest rectangle of one color it can
+// grow from the first unmerged face, first along one axis, then the other.
+static void MeshGreedy(const Voxels &v, int x0, int x1, MeshPart<cvert_compact> &part) {
+    auto lo = int3(x0, 0, 0);
+    auto hi = int3(x1, v.grid.dim.y(), v.grid.dim.z());
+    vector<uchar> mask;
+    for (int n = 0; n < 6; n++) {
+        auto d = n / 2;
+        auto du = (d + 1) % 3;
+        auto dv = (d + 2) % 3;
+        auto nu = hi[du] - lo[du];
+        auto nv = hi[dv] - lo[dv];
+        mask.resize(nu * nv);
+        auto normal = vec<signed char, 4>(int4(neighbors[n] * 127, 0));
+        for (int i = lo[d]; i < hi[d]; i++) {
+            int3 pos;
+            pos.set(d, i);
+            for (int a = 0; a < nu; a++) {
+                pos.set(du, lo[du] + a);
+                for (int b = 0; b < nv; b++) {
+                    pos.set(dv, lo[dv] + b);
+                    auto c = v.grid.Get(pos);
+                    mask[a * nv + b] = c != transparant && Exposed(v, pos, n) ? c : transparant;
+                }
+            }
+            for (int a = 0; a < nu; a++) {
+                for (int b = 0; b < nv; b++) {
+                    auto c = mask[a * nv + b];
+                    if (c == transparant) continue;
+                    int h = 1;
+                    while (b + h < nv && mask[a * nv + b + h] == c) h++;
+                    int w = 1;
+                    for (; a + w < nu; w++) {
+                        auto row = &mask[(a + w) * nv + b];
+                        if (count(row, row + h, c) != h) break;
+                    }
+                    for (int j = 0; j < w; j++)
+                        fill_n(&mask[(a + j) * nv + b], h, transparant);
+                    int3 size;
+                    size.set(d, 1);
+                    size.set(du, w);
+                    size.set(dv, h);
+                    pos.set(du, lo[du] + a);
+                    pos.set(dv, lo[dv] + b);
+                    for (int vn = 0; vn < 4; vn++) {
+                        auto vpos = FaceCorner(n, vn, pos, size);
+                        part.verts.push_back(
+                            cvert_compact { vec<short, 4>(int4(vpos, 1)), normal, v.palette[c] });
+                    }
+                    part.AddQuad();
+                }
+            }
+        }
+    }
+}
+
+// Meshes slabs of the world on all cores, then concatenates the results in order, so the
+// output is the same as when meshed in one go (except greedy quads don't cross slabs).
+template<typename V> static void MeshChunks(
+        const Voxels &v, vector<V> &verts, vector<int> &triangles,
+        void (*meshchunk)(const Voxels &, int, int, MeshPart<V> &)) {
+    const int slab = 16;
+    auto nchunks = (v.grid.dim.x() + slab - 1) / slab;
+    vector<MeshPart<V>> parts(nchunks);
+    atomic<int> next(0);
+    auto worker = [&]() {
+        for (;;) {
+            auto i = next++;
+            if (i >= nchunks) break;
+            meshchunk(v, i * slab, min(i * slab + slab, v.grid.dim.x()), parts[i]);
+        }
+    };
+    auto nworkers = min(nchunks, max(1, (int)thread::hardware_concurrency()));
+    vector<thread> workers;
+    for (int i = 1; i < nworkers; i++) workers.emplace_back(worker);
+    worker();
+    for (auto &w : workers) w.join();
+    size_t nverts = 0, ntris = 0;
+    for (auto &part : parts) {
+        nverts += part.verts.size();
+        ntris += part.triangles.size();
+    }
+    verts.reserve(nverts);
+    triangles.reserve(ntris);
+    for (auto &part : parts) {
+        auto base = (int)verts.size();
+        verts.insert(verts.end(), part.verts.begin(), part.verts.end());
+        for (auto t : part.triangles) triangles.push_back(base + t);
+    }
+}
+
+// Greedy vertices store positions as shorts.
+static bool Greedy(const Voxels &v, const Value &greedy) {
+    return greedy.True() && v.grid.dim < 32768;
+}
+
+template<typename V> static Value NewCubeMesh(vector<V> &verts, vector<int> &triangles,
+                                              const char *fmt) {
+    Output(OUTPUT_INFO, "cubegen verts = %lu, tris = %lu\n", verts.size(),
+           triangles.size() / 3);
+    auto m = new Mesh(new Geometry(verts.data(), verts.size(), sizeof(V), fmt), PRIM_TRIS);
+    m->surfs.push_back(new Surface(triangles.data(), triangles.size(), PRIM_TRIS));
+    extern IntResourceManagerCompact<Mesh> *meshes;
+    return Value((int)meshes->Add(m));
+}
+
 void AddCubeGen() {
     STARTDECL(cg_init) (Value &size) {
         auto &v = NewWorld(ValueDecToI<3>(size));
@@ -96,7 +275,9 @@ void AddCubeGen() {
         " returns the world id");
 
     STARTDECL(cg_size) (Value &wid) {
-        return Value(ToValueI(GetVoxels(wid).grid.dim));
+        auto v = GetVoxels(wid);
+        if (!v) return Value();
+        return Value(ToValueI(v->grid.dim));
     }
     ENDDECL1(cg_size, "worldid", "I", "I]:3",
         "returns the current world size");
@@ -104,7 +285,9 @@ void AddCubeGen() {
     STARTDECL(cg_set) (Value &wid, Value &pos, Value &size, Value &color) {
         auto p = ValueDecToI<3>(pos);
         auto sz = ValueDecToI<3>(size);
-        GetVoxels(wid).Set(p, sz, (uchar)color.ival());
+        auto v = GetVoxels(wid);
+        if (!v) return Value();
+        v->Set(p, sz, (uchar)color.ival());
         return Value();
     }
     ENDDECL4(cg_set, "worldid,pos,size,paletteindex", "II]:3I]:3I", "",
@@ -127,110 +310,67 @@ void AddCubeGen() {
 
     STARTDECL(cg_palette_to_color) (Value &wid, Value &pal) {
         auto p = uchar(pal.ival());
-        return Value(ToValueF(color2vec(GetVoxels(wid).palette[p])));
+        auto v = GetVoxels(wid);
+        if (!v) return Value();
+        return Value(ToValueF(color2vec(v->palette[p])));
     }
     ENDDECL2(cg_palette_to_color, "worldid,paletteindex", "II", "F]:4",
         "converts a palette index to a color. empty space (index 0) will have 0 alpha");
 
     STARTDECL(cg_copy_palette) (Value &fromworld, Value &toworld) {
-        auto &w1 = GetVoxels(fromworld);
-        auto &w2 = GetVoxels(toworld);
-        w2.palette.clear();
-        w2.palette.insert(w2.palette.end(), w1.palette.begin(), w1.palette.end());
+        auto w1 = GetVoxels(fromworld);
+        auto w2 = GetVoxels(toworld);
+        if (!w1 || !w2) return Value();
+        w2->palette.clear();
+        w2->palette.insert(w2->palette.end(), w1->palette.begin(), w1->palette.end());
         return Value();
     }
     ENDDECL2(cg_copy_palette, "fromworld,toworld", "II", "",
         "");
 
-    STARTDECL(cg_create_mesh) (Value &wid) {
-        auto &v = GetVoxels(wid);
-        static int3 neighbors[] = {
-            int3(1, 0, 0), int3(-1,  0,  0),
-            int3(0, 1, 0), int3( 0, -1,  0),
-            int3(0, 0, 1), int3( 0,  0, -1),
-        };
-        // FIXME: normal can be byte4, pos can short4
-        struct cvert { float3 pos; float3 normal; byte4 color; };
+    STARTDECL(cg_create_mesh) (Value &wid, Value &greedy) {
+        auto vp = GetVoxels(wid);
+        if (!vp) return Value();
+        auto &v = *vp;
+        if (Greedy(v, greedy)) {
+            vector<cvert_compact> verts;
+            vector<int> triangles;
+            MeshChunks<cvert_compact>(v, verts, triangles, MeshGreedy);
+            return NewCubeMesh(verts, triangles, "SBC");
+        }
         vector<cvert> verts;
         vector<int> triangles;
-        static const char *faces[6] = { "4576", "0231", "2673", "0154", "1375", "0462" };
-        static int indices[6] = { 0, 1, 3, 1, 2, 3 };
-        // off by default because slow, maybe try: https://github.com/greg7mdp/sparsepp
-        bool optimize_verts = false;
-        struct VKey {
-            vec<short, 3> pos;
-            uchar pal, dir;
-            bool operator==(const VKey &o) const {
-                return pos == o.pos && pal == o.pal && dir == o.dir;
-            };
-        };
-        auto hasher = [](const VKey &k) {
-            return k.pos.x() ^ (k.pos.y() << 3) ^ (k.pos.z() << 6) ^ (k.pal << 3) ^ k.dir;
-        };
-        unordered_map<VKey, int, decltype(hasher)> vertlookup(optimize_verts ? 100000 : 10, hasher);
-        RandomNumberGenerator<PCG32> rnd;
-        vector<float> rnd_offset(1024);
-        for (auto &f : rnd_offset) { f = (rnd.rndfloat() - 0.5f) * 0.15f; }
-        // Woah nested loops!
-        for (int x = 0; x < v.grid.dim.x(); x++) {
-            for (int y = 0; y < v.grid.dim.y(); y++) {
-                for (int z = 0; z < v.grid.dim.z(); z++) {
-                    auto pos = int3(x, y, z);
-                    auto c = v.grid.Get(pos);
-                    if (c != transparant) {
-                        for (int n = 0; n < 6; n++) {
-                            auto npos = pos + neighbors[n];
-                            auto nc = npos >= 0 && npos < v.grid.dim ? v.grid.Get(npos)
-                                                                     : transparant;
-                            if (nc == transparant) {
-                                auto face = faces[n];
-                                int vindices[4];
-                                for (int vn = 0; vn < 4; vn++) {
-                                    int3 vpos;
-                                    for (int d = 0; d < 3; d++) {
-                                        vpos.set(d, (face[vn] & (1 << (2 - d))) != 0);
-                                    }
-                                    vpos += pos;
-                                    VKey vkey { vec<short, 3>(vpos), c, (uchar)n };
-                                    if (optimize_verts) {
-                                        auto it = vertlookup.find(vkey);
-                                        if (it != vertlookup.end()) {
-                                            vindices[vn] = it->second;
-                                            continue;
-                                        }
-                                    }
-                                    cvert vert;
-                                    auto oi = ((vpos.z() << 8) ^ (vpos.y() << 4) ^ vpos.x()) %
-                                              (rnd_offset.size() - 2);
-                                    auto offset = float3(&rnd_offset[oi]);
-                                    vert.pos = float3(vpos) + offset;
-                                    vert.normal = float3(neighbors[n]);
-                                    vert.color = v.palette[c];
-                                    vindices[vn] = (int)verts.size();
-                                    verts.push_back(vert);
-                                    if (optimize_verts) vertlookup[vkey] = vindices[vn];
-                                }
-                                for (int i = 0; i < 6; i++)
-                                    triangles.push_back(vindices[indices[i]]);
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        MeshChunks<cvert>(v, verts, triangles, MeshCubes);
         normalize_mesh(triangles.data(), triangles.size(), verts.data(), verts.size(),
                        sizeof(cvert), (uchar *)&verts.data()->normal - (uchar *)&verts.data()->pos,
                        false);
-        Output(OUTPUT_INFO, "cubegen verts = %lu, tris = %lu\n", verts.size(),
-               triangles.size() / 3);
-        auto m = new Mesh(new Geometry(verts.data(), verts.size(), sizeof(cvert), "PNC"),
-                          PRIM_TRIS);
-        m->surfs.push_back(new Surface(triangles.data(), triangles.size(), PRIM_TRIS));
-        extern IntResourceManagerCompact<Mesh> *meshes;
-        return (int)meshes->Add(m);
+        return NewCubeMesh(verts, triangles, "PNC");
+    }
+    ENDDECL2(cg_create_mesh, "worldid,greedy", "II?", "I",
+        "converts world to a mesh. if greedy is true, faces of the same color are merged into"
+        " larger rectangles, giving far fewer vertices (in a more compact format), but without"
+        " the random offsets on vertices the default mode has");
+
+    STARTDECL(cg_mesh_size) (Value &wid, Value &greedy) {
+        auto vp = GetVoxels(wid);
+        if (!vp) return Value();
+        size_t nverts;
+        vector<int> triangles;
+        if (Greedy(*vp, greedy)) {
+            vector<cvert_compact> verts;
+            MeshChunks<cvert_compact>(*vp, verts, triangles, MeshGreedy);
+            nverts = verts.size();
+        } else {
+            vector<cvert> verts;
+            MeshChunks<cvert>(*vp, verts, triangles, MeshCubes);
+            nverts = verts.size();
+        }
+        g_vm->Push(Value((int)nverts));
+        return Value((int)triangles.size() / 3);
     }
-    ENDDECL1(cg_create_mesh, "worldid", "I", "I",
-        "converts world to a mesh");
+    ENDDECL2(cg_mesh_size, "worldid,greedy", "II?", "II",
+        "returns the number of vertices and triangles cg_create_mesh would create for the world,"
+        " without creating the mesh (so also works without a window)");
 
     STARTDECL(cg_load_vox) (Value &name) {
         size_t len = 0;
@@ -275,7 +415,9 @@ void AddCubeGen() {
         " load");
 
     STARTDECL(cg_save_vox) (Value &wid, Value &name) {
-        auto &v = GetVoxels(wid);
+        auto vp = GetVoxels(wid);
+        if (!vp) return Value();
+        auto &v = *vp;
         if (!(v.grid.dim < 256)) {
             name.DECRT();
             return Value(false);
@@ -0,0 +1,198 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+#include "vmdata.h"
+
+namespace lobster {
+
+// Roots processed in one go. Phases of a batch can't be interleaved with running code, since that
+// changes counts, so this bounds how far a slice can go over its budget (for small graphs).
+const size_t CYCLE_BATCH = 64;
+
+CycleCollector::CycleCollector(VM &_vm)
+    : budget(1000), threshold(10000), trigger(10000), due(false), slices(0), freed(0),
+      totaltime(0), maxpause(0), vm(_vm) {}
+
+void CycleCollector::Init(const bytecode::BytecodeFile *bcf) {
+    cancycle.resize(bcf->typetable()->Length(), -1);
+}
+
+// Whether objects of this type can be part of a cycle, i.e. can refer to another object that
+// can, which may be of their own type.
+bool CycleCollector::CanCycle(const TypeInfo &ti) {
+    auto &c = cancycle[(const type_elem_t *)&ti - vm.typetable];
+    if (c >= 0) return c != 0;
+    bool r = false;
+    switch (ti.t) {
+        case V_VECTOR:
+            r = MayReferToCycle(ti.subt);
+            break;
+        case V_STRUCT:
+            for (int i = 0; i < ti.len; i++) r = MayReferToCycle(ti.elems[i]) || r;
+            break;
+        case V_COROUTINE:
+            r = true;  // Its stack can hold anything.
+            break;
+    }
+    c = r;
+    return r;
+}
+
+bool CycleCollector::MayReferToCycle(type_elem_t t) {
+    auto &ti = vm.GetTypeInfo(t);
+    switch (ti.t) {
+        case V_NIL:       return MayReferToCycle(ti.subt);
+        case V_VECTOR:    return CanCycle(ti);
+        case V_STRUCT:    // May be a subclass with more fields.
+        case V_COROUTINE:
+        case V_ANY:       return true;
+        default:          return false;
+    }
+}
+
+template<typename F> static void ForEachRef(CycleObj *o, F f) {
+    if (o->ti.t == V_COROUTINE) {
+        auto co = (CoRoutine *)o;
+        // A running coroutine holds the stacks of its resumer, and everything on its own is
+        // referred to from outside anyway.
+        if (!co->running) co->ForEachRef(f);
+    } else {
+        ((ElemObj *)o)->ForEachRef(f);
+    }
+}
+
+// Only visits children that can be part of a cycle, the rest can't lead back to the root.
+template<typename F> static void ForEachChild(CycleObj *o, F f) {
+    ForEachRef(o, [&](RefObj *r) {
+        if (IsCycleType(r->ti.t) && (((CycleObj *)r)->cyclebits & CYCLE_TYPE)) f((CycleObj *)r);
+    });
+}
+
+static uint Color(CycleObj *o) { return o->cyclebits & CYCLE_COLOR; }
+static void SetColor(CycleObj *o, uint c) { o->cyclebits = (o->cyclebits & ~CYCLE_COLOR) | c; }
+
+void CycleCollector::Step() {
+    due = false;
+    if (budget > 0 && candidates.size()) Collect(budget / 1000000.0);
+    trigger = candidates.size() + threshold;
+}
+
+int CycleCollector::Collect(double maxtime) {
+    auto start = vm.Time();
+    int nfreed = 0;
+    while (candidates.size()) {
+        for (size_t i = 0; i < CYCLE_BATCH && candidates.size(); i++) {
+            auto co = candidates.back();
+            Forget(co);
+            roots.push_back(co);
+        }
+        for (auto r : roots) MarkGray(r);
+        for (auto r : roots) Scan(r);
+        for (auto r : roots) CollectWhite(r);
+        roots.clear();
+        nfreed += FreeGarbage();
+        if (maxtime > 0 && vm.Time() - start >= maxtime) break;
+    }
+    auto pause = vm.Time() - start;
+    slices++;
+    freed += nfreed;
+    totaltime += pause;
+    maxpause = max(maxpause, pause);
+    return nfreed;
+}
+
+// Subtracts the references from within the subgraph reachable from root.
+void CycleCollector::MarkGray(CycleObj *root) {
+    if (Color(root) == CYCLE_GRAY) return;
+    SetColor(root, CYCLE_GRAY);
+    work.push_back(root);
+    while (work.size()) {
+        auto o = work.back();
+        work.pop_back();
+        ForEachChild(o, [&](CycleObj *c) {
+            c->refc--;
+            if (Color(c) != CYCLE_GRAY) {
+                SetColor(c, CYCLE_GRAY);
+                work.push_back(c);
+            }
+        });
+    }
+}
+
+// Whatever still has references is referred to from outside, and so is everything it reaches.
+void CycleCollector::Scan(CycleObj *root) {
+    work.push_back(root);
+    while (work.size()) {
+        auto o = work.back();
+        work.pop_back();
+        if (Color(o) != CYCLE_GRAY) continue;
+        if (o->refc > 0) {
+            ScanBlack(o);
+        } else {
+            SetColor(o, CYCLE_WHITE);
+            ForEachChild(o, [&](CycleObj *c) { work.push_back(c); });
+        }
+    }
+}
+
+// Restores the references subtracted by MarkGray.
+void CycleCollector::ScanBlack(CycleObj *root) {
+    SetColor(root, CYCLE_BLACK);
+    blackwork.push_back(root);
+    while (blackwork.size()) {
+        auto o = blackwork.back();
+        blackwork.pop_back();
+        ForEachChild(o, [&](CycleObj *c) {
+            c->refc++;
+            if (Color(c) != CYCLE_BLACK) {
+                SetColor(c, CYCLE_BLACK);
+                blackwork.push_back(c);
+            }
+        });
+    }
+}
+
+void CycleCollector::CollectWhite(CycleObj *root) {
+    work.push_back(root);
+    while (work.size()) {
+        auto o = work.back();
+        work.pop_back();
+        if (Color(o) != CYCLE_WHITE) continue;
+        // May be a candidate not in the current batch.
+        Forget(o);
+        SetColor(o, CYCLE_GARBAGE);
+        garbage.push_back(o);
+        ForEachChild(o, [&](CycleObj *c) { work.push_back(c); });
+    }
+}
+
+int CycleCollector::FreeGarbage() {
+    // Nothing outside the garbage refers to it, so only references to other objects need to be
+    // released (which can't lead back into the garbage), before deleting it all at once.
+    for (auto o : garbage) {
+        ForEachRef(o, [](RefObj *r) {
+            if (!IsCycleType(r->ti.t) || Color((CycleObj *)r) != CYCLE_GARBAGE) r->Dec();
+        });
+    }
+    for (auto o : garbage) {
+        assert(!o->refc);
+        o->DECDELETE(false);
+    }
+    auto n = (int)garbage.size();
+    garbage.clear();
+    return n;
+}
+
+}  // namespace lobster
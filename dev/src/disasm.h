@@ -81,6 +81,64 @@ static const int *DisAsmIns(string &s, const int *ip, const int *code, const typ
         case IL_VFOR:
         case IL_SFOR:
         case IL_YIELD:
+        case IL_JUMPFAILILT:
+        case IL_JUMPFAILIGT:
+        case IL_JUMPFAILILE:
+        case IL_JUMPFAILIGE:
+        case IL_JUMPFAILIEQ:
+        case IL_JUMPFAILINE:
+        case IL_IVVADDU:
+        case IL_IVVSUBU:
+        case IL_IVVMULU:
+        case IL_IVVDIVU:
+        case IL_FVVADDU:
+        case IL_FVVSUBU:
+        case IL_FVVMULU:
+        case IL_FVVDIVU:
+        case IL_IVSADDU:
+        case IL_IVSSUBU:
+        case IL_IVSMULU:
+        case IL_IVSDIVU:
+        case IL_FVSADDU:
+        case IL_FVSSUBU:
+        case IL_FVSMULU:
+        case IL_FVSDIVU:
+            s += to_string(*ip++);
+            break;
+
+        case IL_UNBOXVAR:
+            s += IdName(bcf, *ip++);
+            s += " ";
+            s += to_string(*ip++);  // type
+            s += " ";
+            s += to_string(*ip++);  // drop
+            s += " ";
+            s += to_string(*ip++);
+            break;
+
+        case IL_JUMPFAILVILT:
+        case IL_JUMPFAILVIGT:
+        case IL_JUMPFAILVILE:
+        case IL_JUMPFAILVIGE:
+        case IL_JUMPFAILVIEQ:
+        case IL_JUMPFAILVINE:
+            s += IdName(bcf, *ip++);
+            s += " ";
+            s += to_string(*ip++);
+            s += " ";
+            s += to_string(*ip++);
+            break;
+
+        case IL_PUSHVARFLD:
+            s += IdName(bcf, *ip++);
+            s += " ";
+            s += to_string(*ip++);
+            break;
+
+        case IL_LVALVARI:
+            LvalDisAsm(s, ip);
+            s += IdName(bcf, *ip++);
+            s += " ";
             s += to_string(*ip++);
             break;
 
@@ -105,12 +163,13 @@ static const int *DisAsmIns(string &s, const int *ip, const int *code, const typ
             break;
 
         case IL_CALL:
+        case IL_TAILCALL:
         case IL_CALLMULTI: {
             auto id = *ip++;
             auto bc = *ip++;
-            auto tm = *ip++;
+            auto tm = opc != IL_TAILCALL ? *ip++ : 0;
             auto nargs = code[bc + (opc == IL_CALLMULTI ? 2 : 1)];
-            if (opc == IL_CALLMULTI) ip += nargs;  // arg types.
+            if (opc == IL_CALLMULTI) ip += 1 + nargs;  // cache, arg types.
             s += to_string(nargs);
             s += " ";
             s += bcf->functions()->Get(id)->name()->c_str();
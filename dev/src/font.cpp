@@ -58,7 +58,8 @@ void FontCleanup() {
 
 void AddFont() {
     STARTDECL(gl_setfontname) (Value &fname)    {
-        extern void TestGL(); TestGL();
+        extern bool TestGL();
+        if (!TestGL()) return Value();
         string piname = SanitizePath(fname.sval()->str());
         fname.DECRT();
         auto faceit = loadedfaces.find(piname);
@@ -83,7 +84,8 @@ void AddFont() {
         " true if success.");
 
     STARTDECL(gl_setfontsize) (Value &fontsize)  {
-        if (!curface) g_vm->BuiltinError("gl_setfontsize: no current font set with gl_setfontname");
+        if (!curface)
+            return g_vm->BuiltinError("gl_setfontsize: no current font set with gl_setfontname");
         int size = max(1, fontsize.ival());
         int csize = min(size, maxfontsize);
         string fontname = curfacename;
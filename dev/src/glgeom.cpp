@@ -32,9 +32,9 @@ size_t AttribsSize(const char *fmt) {
     size_t size = 0;
     while (*fmt) {
         switch (*fmt++) {
-            case 'P': case 'N':           size += 12; break;
-            case 'p': case 'n': case 'T': size +=  8; break;
-            case 'C': case 'W': case 'I': size +=  4; break;
+            case 'P': case 'N':                     size += 12; break;
+            case 'p': case 'n': case 'T': case 'S': size +=  8; break;
+            case 'C': case 'W': case 'I': case 'B': size +=  4; break;
             default: assert(0);
         }
     }
@@ -59,6 +59,8 @@ void SetAttribs(uint vbo1, const char *fmt, int vertsize1, uint vbo2 = 0, int ve
             case 'N': SETATTRIB(1, 3, GL_FLOAT,         false, 12)
             case 'n': SETATTRIB(1, 2, GL_FLOAT,         false,  8)
             case 'T': SETATTRIB(2, 2, GL_FLOAT,         false,  8)
+            case 'S': SETATTRIB(0, 4, GL_SHORT,         false,  8)
+            case 'B': SETATTRIB(1, 4, GL_BYTE,          true,   4)
             case 'C': SETATTRIB(3, 4, GL_UNSIGNED_BYTE, true,   4)
             case 'W': SETATTRIB(4, 4, GL_UNSIGNED_BYTE, true,   4)
             case 'I': SETATTRIB(5, 4, GL_UNSIGNED_BYTE, false,  4)
@@ -74,12 +76,12 @@ void SetAttribs(uint vbo1, const char *fmt, int vertsize1, uint vbo2 = 0, int ve
 
 void UnSetAttribs(const char *fmt) {
     while (*fmt) switch (*fmt++) {
-        case 'P': case 'p': glDisableVertexAttribArray(0); break;
-        case 'N': case 'n': glDisableVertexAttribArray(1); break;
-        case 'T':           glDisableVertexAttribArray(2); break;
-        case 'C':           glDisableVertexAttribArray(3); break;
-        case 'W':           glDisableVertexAttribArray(4); break;
-        case 'I':           glDisableVertexAttribArray(5); break;
+        case 'P': case 'p': case 'S': glDisableVertexAttribArray(0); break;
+        case 'N': case 'n': case 'B': glDisableVertexAttribArray(1); break;
+        case 'T':                     glDisableVertexAttribArray(2); break;
+        case 'C':                     glDisableVertexAttribArray(3); break;
+        case 'W':                     glDisableVertexAttribArray(4); break;
+        case 'I':                     glDisableVertexAttribArray(5); break;
         default: assert(0);
     }
 }
@@ -178,6 +180,10 @@ bool Geometry::WritePLY(string &s, int nindices) {
             case 'N': s += "property float nx\nproperty float ny\nproperty float nz\n"; break;
             case 'n': s += "property float nx\nproperty float ny\n"; break;
             case 'T': s += "property float u\nproperty float v\n"; break;
+            case 'S': s += "property short x\nproperty short y\nproperty short z\n"
+                           "property short w\n"; break;
+            case 'B': s += "property char nx\nproperty char ny\nproperty char nz\n"
+                           "property char nw\n"; break;
             case 'C': s += "property uchar red\nproperty uchar green\n"
                            "property uchar blue\nproperty uchar alpha\n"; break;
             case 'W': s += "property uchar wa\nproperty uchar wb\n"
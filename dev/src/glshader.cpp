@@ -281,7 +281,7 @@ void Shader::Link(const char *name) {
     glGetProgramiv(program, GL_LINK_STATUS, &status);
     if (status != GL_TRUE) {
         GLSLError(program, true, nullptr);
-        throw string("linking failed for shader: ") + name;
+        THROW_OR_ABORT(string("linking failed for shader: ") + name);
     }
     mvp_i          = glGetUniformLocation(program, "mvp");
     col_i          = glGetUniformLocation(program, "col");
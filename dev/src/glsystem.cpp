@@ -125,11 +125,11 @@ void OpenGLInit() {
     auto exts = (char *)glGetString(GL_EXTENSIONS);
     if (exts) {  // GL 4.x doesn't have this.
         if (!strstr(exts, "GL_ARB_vertex_buffer_object"))
-            throw string("no VBOs!");
+            THROW_OR_ABORT(string("no VBOs!"));
         if (!strstr(exts, "GL_ARB_multitexture"))
-            throw string("no multitexture!");
+            THROW_OR_ABORT(string("no multitexture!"));
         if (!strstr(exts, "GL_ARB_vertex_program") || !strstr(exts, "GL_ARB_fragment_program"))
-            throw string("no shaders!");
+            THROW_OR_ABORT(string("no shaders!"));
         //if (!strstr(exts, "GL_ARB_shading_language_100") ||
         //    !strstr(exts, "GL_ARB_shader_objects") ||
         //    !strstr(exts, "GL_ARB_vertex_shader") ||
@@ -141,7 +141,7 @@ void OpenGLInit() {
             union { void *proc; type fun; } funcast; /* regular cast causes gcc warning */ \
             funcast.proc = SDL_GL_GetProcAddress(#name); \
             name = funcast.fun; \
-            if (!name && needed) throw string("no " #name); \
+            if (!name && needed) THROW_OR_ABORT(string("no " #name)); \
         }
     GLBASEEXTS GLEXTS
     #undef GLEXT
@@ -274,10 +274,13 @@ MotionController *GetMC(Value &mc) {
 
 #ifdef PLATFORM_VR
 
+// Returns k_EButton_Max after reporting an error.
 vr::EVRButtonId GetButtonId(Value &button) {
     auto it = button_ids.find(button.sval()->str());
-    if (it == button_ids.end())
+    if (it == button_ids.end()) {
         g_vm->BuiltinError(string("unknown button name: ") + button.sval()->str());
+        return vr::k_EButton_Max;
+    }
     button.DECRT();
     return it->second;
 }
@@ -361,7 +364,9 @@ void AddVR() {
     STARTDECL(vr_motioncontrollerbutton) (Value &mc, Value &button) {
         #ifdef PLATFORM_VR
             auto mcd = GetMC(mc);
-            auto mask = ButtonMaskFromId(GetButtonId(button));
+            auto id = GetButtonId(button);
+            if (id == vr::k_EButton_Max) return Value();
+            auto mask = ButtonMaskFromId(id);
             if (!mcd) return Value(TimeBool8().Step());
             auto masknow = mcd->state.ulButtonPressed & mask;
             auto maskbef = mcd->laststate.ulButtonPressed & mask;
@@ -379,6 +384,7 @@ void AddVR() {
         auto mcd = GetMC(mc);
         if (!mcd) return Value(ToValueF(float3_0));
         auto i = RangeCheck(idx, 4);
+        if (i < 0) return Value();
         return Value(ToValueF(mcd->mat[i].xyz()));
     }
     ENDDECL2(vr_motioncontrollervec, "n,i", "II", "F]:3",
@@ -387,6 +393,7 @@ void AddVR() {
 
     STARTDECL(vr_hmdvec) (Value &idx) {
         auto i = RangeCheck(idx, 4);
+        if (i < 0) return Value();
         return Value(ToValueF(hmdpose[i].xyz()));
     }
     ENDDECL1(vr_hmdvec, "i", "I", "F]:3",
@@ -68,9 +68,12 @@ bool GraphicsFrameStart() {
     return cb;
 }
 
-void TestGL() {
-    if (!graphics_initialized)
-        g_vm->BuiltinError("graphics system not initialized yet, call gl_window() first");
+// These helpers report errors by halting the VM, after which they return false / nullptr / -1, and
+// the builtin calling them must return.
+bool TestGL() {
+    if (graphics_initialized) return true;
+    g_vm->BuiltinError("graphics system not initialized yet, call gl_window() first");
+    return false;
 }
 
 float2 localpos(const int2 &pos) {
@@ -103,14 +106,19 @@ Mesh *GetMesh(Value &i) {
 }
 
 int GetSampler(Value &i) {
-    if (i.ival() < 0 || i.ival() >= Shader::MAX_SAMPLERS)
+    if (i.ival() < 0 || i.ival() >= Shader::MAX_SAMPLERS) {
         g_vm->BuiltinError("graphics: illegal texture unit");
+        return -1;
+    }
     return i.ival();
 }
 
 Mesh *CreatePolygon(Value &vl) {
-    TestGL();
-    if (vl.eval()->Len() < 3) g_vm->BuiltinError("polygon: must have at least 3 verts");
+    if (!TestGL()) return nullptr;
+    if (vl.eval()->Len() < 3) {
+        g_vm->BuiltinError("polygon: must have at least 3 verts");
+        return nullptr;
+    }
     auto vbuf = new BasicVert[vl.eval()->Len()];
     for (int i = 0; i < vl.eval()->Len(); i++) vbuf[i].pos = ValueToF<3>(vl.eval()->At(i));
     auto v1 = vbuf[1].pos - vbuf[0].pos;
@@ -129,7 +137,7 @@ Mesh *CreatePolygon(Value &vl) {
 void AddGraphics() {
     STARTDECL(gl_window) (Value &title, Value &xs, Value &ys, Value &fullscreen, Value &novsync) {
         if (graphics_initialized)
-            g_vm->BuiltinError("cannot call gl_window() twice");
+            return g_vm->BuiltinError("cannot call gl_window() twice");
         string err = SDLInit(title.sval()->str(), int2(xs.ival(), ys.ival()),
                              fullscreen.ival() != 0, novsync.ival() == 0);
         title.DECRT();
@@ -153,7 +161,7 @@ void AddGraphics() {
         " otherwise.");
 
     STARTDECL(gl_loadmaterials) (Value &fn, Value &isinline) {
-        TestGL();
+        if (!TestGL()) return Value();
         auto err = isinline.True() ? ParseMaterialFile(fn.sval()->str())
                                    : LoadMaterialFile(fn.sval()->str());
         fn.DECRT();
@@ -165,12 +173,13 @@ void AddGraphics() {
         " materials. returns error string if any problems, nil otherwise.");
 
     STARTDECL(gl_frame) () {
-        TestGL();
+        if (!TestGL()) return Value();
+        g_vm->cc.Step();
         #ifdef USE_MAIN_LOOP_CALLBACK
             // Here we have to something hacky: emscripten requires us to not take over the main loop.
             // So we use this exception to suspend the VM right inside the gl_frame() call.
             // FIXME: do this at the start of the frame instead?
-            throw string("SUSPEND-VM-MAINLOOP");
+            THROW_OR_ABORT(string("SUSPEND-VM-MAINLOOP"));
         #endif
         auto cb = GraphicsFrameStart();
         return Value(!cb);
@@ -188,7 +197,7 @@ void AddGraphics() {
         " before the end of the program");
 
     STARTDECL(gl_windowtitle) (Value &s) {
-        TestGL();
+        if (!TestGL()) return Value();
         SDLTitle(s.sval()->str());
         return s;
     }
@@ -203,7 +212,7 @@ void AddGraphics() {
         " foreground). If false, you should not render anything, nor run the frame's code.");
 
     STARTDECL(gl_cursor) (Value &on) {
-        TestGL();
+        if (!TestGL()) return Value();
         return Value(SDLCursor(on.ival() != 0));
     }
     ENDDECL1(gl_cursor, "on", "I", "I",
@@ -211,7 +220,7 @@ void AddGraphics() {
         " wether it's on.");
 
     STARTDECL(gl_grab) (Value &on) {
-        TestGL();
+        if (!TestGL()) return Value();
         return Value(SDLGrab(on.ival() != 0));
     }
     ENDDECL1(gl_grab, "on", "I", "I",
@@ -324,7 +333,7 @@ void AddGraphics() {
         "time key/mousebutton/finger last went down (true) or up (false)");
 
     STARTDECL(gl_clear) (Value &col) {
-        TestGL();
+        if (!TestGL()) return Value();
         ClearFrameBuffer(ValueDecToF<3>(col));
         return Value();
     }
@@ -344,6 +353,7 @@ void AddGraphics() {
 
     STARTDECL(gl_polygon) (Value &vl) {
         auto m = CreatePolygon(vl);
+        if (!m) return Value();
         currentshader->Set();
         m->Render(currentshader);
         delete m;
@@ -354,7 +364,7 @@ void AddGraphics() {
         " warning: gl_polygon creates a new mesh every time, gl_newpoly/gl_rendermesh is faster.");
 
     STARTDECL(gl_circle) (Value &radius, Value &segments) {
-        TestGL();
+        if (!TestGL()) return Value();
 
         RenderCircle(currentshader, polymode, max(segments.ival(), 3), radius.fval());
 
@@ -364,7 +374,7 @@ void AddGraphics() {
         "renders a circle");
 
     STARTDECL(gl_opencircle) (Value &radius, Value &segments, Value &thickness) {
-        TestGL();
+        if (!TestGL()) return Value();
 
         RenderOpenCircle(currentshader, max(segments.ival(), 3), radius.fval(), thickness.fval());
 
@@ -513,7 +523,7 @@ void AddGraphics() {
         " (allows you to safely test in most cases of overlapping rendering)");
 
     STARTDECL(gl_rect) (Value &vec, Value &centered) {
-        TestGL();
+        if (!TestGL()) return Value();
         RenderQuad(currentshader, polymode, centered.True(), float4x4(float4(ValueToF<2>(vec), 1)));
         return vec;
     }
@@ -522,7 +532,7 @@ void AddGraphics() {
         " size. returns the argument.");
 
     STARTDECL(gl_unit_square) (Value &centered) {
-        TestGL();
+        if (!TestGL()) return Value();
         RenderUnitSquare(currentshader, polymode, centered.True());
         return Value();
     }
@@ -530,7 +540,7 @@ void AddGraphics() {
         "renders a square (0,0)..(1,1) (or (-1,-1)..(1,1) when centered)");
 
     STARTDECL(gl_line) (Value &start, Value &end, Value &thickness) {
-        TestGL();
+        if (!TestGL()) return Value();
         auto v1 = ValueDecToF<3>(start);
         auto v2 = ValueDecToF<3>(end);
         if (Is2DMode()) RenderLine2D(currentshader, polymode, v1, v2, thickness.fval());
@@ -567,22 +577,22 @@ void AddGraphics() {
         "sets a custom ortho projection as 3D projection.");
 
     STARTDECL(gl_newmesh) (Value &format, Value &attributes, Value &indices) {
-        TestGL();
+        if (!TestGL()) return Value();
         auto nattr = format.sval()->len;
         if (nattr < 1 || nattr > 10 || nattr != attributes.vval()->len)
-            g_vm->BuiltinError("newmesh: illegal format/attributes size");
+            return g_vm->BuiltinError("newmesh: illegal format/attributes size");
         auto fmt = format.sval()->str();
         if (nattr != (int)strspn(fmt, "PCTN") || fmt[0] != 'P')
-            g_vm->BuiltinError("newmesh: illegal format characters (only PCTN allowed), P must be"
-                               " first");
+            return g_vm->BuiltinError("newmesh: illegal format characters (only PCTN allowed), P"
+                                      " must be first");
         auto attrs = attributes.vval();
         auto positions = attrs->At(0);
         vector<int> idxs;
         if (indices.True()) {
             for (int i = 0; i < indices.eval()->Len(); i++) {
-                auto &e = indices.eval()->At(i);
+                auto e = indices.eval()->At(i);
                 if (e.ival() < 0 || e.ival() >= positions.eval()->Len())
-                    g_vm->BuiltinError("newmesh: index out of range of vertex list");
+                    return g_vm->BuiltinError("newmesh: index out of range of vertex list");
                 idxs.push_back(e.ival());
             }
             indices.DECRT();
@@ -643,6 +653,7 @@ void AddGraphics() {
 
     STARTDECL(gl_newpoly) (Value &positions) {
         auto m = CreatePolygon(positions);
+        if (!m) return Value();
         positions.DECRT();
         return Value((int)meshes->Add(m));
     }
@@ -652,7 +663,7 @@ void AddGraphics() {
         " returns mesh id");
 
     STARTDECL(gl_newmesh_iqm) (Value &fn) {
-        TestGL();
+        if (!TestGL()) return Value();
         auto m = LoadIQM(fn.sval()->str());
         fn.DECRT();
         return Value(m ? (int)meshes->Add(m) : 0);
@@ -669,6 +680,7 @@ void AddGraphics() {
 
     STARTDECL(gl_meshparts) (Value &i) {
         auto m = GetMesh(i);
+        if (!m) return Value();
         auto v = (LVector *)g_vm->NewVector(0, (int)m->surfs.size(),
                                             g_vm->GetTypeInfo(TYPE_ELEM_VECTOR_OF_STRING));
         for (auto s : m->surfs) v->Push(Value(g_vm->NewString(s->name)));
@@ -679,29 +691,36 @@ void AddGraphics() {
 
     STARTDECL(gl_meshsize) (Value &i) {
         auto m = GetMesh(i);
+        if (!m) return Value();
         return Value((int)m->geom->nverts);
     }
     ENDDECL1(gl_meshsize, "i", "I", "I",
         "returns the number of verts in this mesh");
 
     STARTDECL(gl_animatemesh) (Value &i, Value &f) {
-        GetMesh(i)->curanim = f.fval();
+        auto m = GetMesh(i);
+        if (!m) return Value();
+        m->curanim = f.fval();
         return Value();
     }
     ENDDECL2(gl_animatemesh, "i,frame", "IF", "",
         "set the frame for animated mesh i");
 
     STARTDECL(gl_rendermesh) (Value &i) {
-        TestGL();
-        GetMesh(i)->Render(currentshader);
+        if (!TestGL()) return Value();
+        auto m = GetMesh(i);
+        if (!m) return Value();
+        m->Render(currentshader);
         return Value();
     }
     ENDDECL1(gl_rendermesh, "i", "I", "",
         "renders the specified mesh");
 
     STARTDECL(gl_savemesh) (Value &i, Value &name) {
-        TestGL();
-        bool ok = GetMesh(i)->SaveAsPLY(name.sval()->str());
+        if (!TestGL()) return Value();
+        auto m = GetMesh(i);
+        if (!m) return Value();
+        bool ok = m->SaveAsPLY(name.sval()->str());
         name.DECRT();
         return Value(ok);
     }
@@ -710,9 +729,9 @@ void AddGraphics() {
         " procedurally. returns false if the file could not be written");
 
     STARTDECL(gl_setshader) (Value &shader) {
-        TestGL();
+        if (!TestGL()) return Value();
         auto sh = LookupShader(shader.sval()->str());
-        if (!sh) g_vm->BuiltinError(string("no such shader: ") + shader.sval()->str());
+        if (!sh) return g_vm->BuiltinError(string("no such shader: ") + shader.sval()->str());
         shader.DECRT();
         currentshader = sh;
         return Value();
@@ -722,7 +741,7 @@ void AddGraphics() {
         " color / textured / phong");
 
     STARTDECL(gl_setuniform) (Value &name, Value &vec) {
-        TestGL();
+        if (!TestGL()) return Value();
         auto len = vec.eval()->Len();
         auto v = ValueDecToF<4>(vec);
         currentshader->Activate();
@@ -735,7 +754,7 @@ void AddGraphics() {
         " in the shader. returns false on error.");
 
     STARTDECL(gl_setuniformarray) (Value &name, Value &vec) {
-        TestGL();
+        if (!TestGL()) return Value();
         vector<float4> vals(vec.eval()->Len());
         for (int i = 0; i < vec.eval()->Len(); i++) vals[i] = ValueToF<4>(vec.eval()->At(i));
         vec.DECRT();
@@ -750,7 +769,7 @@ void AddGraphics() {
              " returns false on error.");
 
     STARTDECL(gl_uniformbufferobject) (Value &name, Value &vec, Value &ssbo) {
-        TestGL();
+        if (!TestGL()) return Value();
         vector<float4> vals(vec.eval()->Len());
         for (int i = 0; i < vec.eval()->Len(); i++) vals[i] = ValueToF<4>(vec.eval()->At(i));
         vec.DECRT();
@@ -766,7 +785,7 @@ void AddGraphics() {
         " returns buffer id or 0 on error.");
 
     STARTDECL(gl_deletebufferobject) (Value &id) {
-        TestGL();
+        if (!TestGL()) return Value();
         // FIXME: should route this thru a IntResourceManagerCompact to be safe?
         // I guess GL doesn't care about illegal id's?
         DeleteBO(id.ival());
@@ -776,9 +795,14 @@ void AddGraphics() {
         "deletes a buffer objects, e.g. one allocated by gl_uniformbufferobject().");
 
     STARTDECL(gl_bindmeshtocompute) (Value &mesh, Value &bpi) {
-        TestGL();
-        if (mesh.ival()) GetMesh(mesh)->geom->BindAsSSBO(bpi.ival());
-        else BindVBOAsSSBO(bpi.ival(), 0);
+        if (!TestGL()) return Value();
+        if (mesh.ival()) {
+            auto m = GetMesh(mesh);
+            if (!m) return Value();
+            m->geom->BindAsSSBO(bpi.ival());
+        } else {
+            BindVBOAsSSBO(bpi.ival(), 0);
+        }
         return Value();
     }
     ENDDECL2(gl_bindmeshtocompute, "mesh,binding", "II", "",
@@ -786,7 +810,7 @@ void AddGraphics() {
         " unbind.");
 
     STARTDECL(gl_dispatchcompute) (Value &groups) {
-        TestGL();
+        if (!TestGL()) return Value();
         DispatchCompute(ValueDecToI<3>(groups));
         return Value();
     }
@@ -795,7 +819,7 @@ void AddGraphics() {
         " values.");
 
     STARTDECL(gl_blend) (Value &mode, Value &body) {
-        TestGL();
+        if (!TestGL()) return Value();
         int old = SetBlendMode((BlendMode)mode.ival());
         if (body.True()) g_vm->Push(Value(old));
         return body;
@@ -810,7 +834,7 @@ void AddGraphics() {
         " given, restores the previous mode afterwards");
 
     STARTDECL(gl_loadtexture) (Value &name, Value &tf) {
-        TestGL();
+        if (!TestGL()) return Value();
         uint id = 0;
         int2 dim(0);
         auto it = texturecache.find(name.sval()->str());
@@ -835,8 +859,10 @@ void AddGraphics() {
         " PIC.");
 
     STARTDECL(gl_setprimitivetexture) (Value &i, Value &id, Value &tf) {
-        TestGL();
-        SetTexture(GetSampler(i), id.ival(), tf.ival());
+        if (!TestGL()) return Value();
+        auto unit = GetSampler(i);
+        if (unit < 0) return Value();
+        SetTexture(unit, id.ival(), tf.ival());
         return Value();
     }
     ENDDECL3(gl_setprimitivetexture, "i,id,textureformat", "III?", "",
@@ -844,17 +870,22 @@ void AddGraphics() {
 
     STARTDECL(gl_setmeshtexture) (Value &mid, Value &part, Value &i, Value &id) {
         auto m = GetMesh(mid);
+        if (!m) return Value();
         if (part.ival() < 0 || part.ival() >= (int)m->surfs.size())
-            g_vm->BuiltinError("setmeshtexture: illegal part index");
-        m->surfs[part.ival()]->textures[GetSampler(i)] = id.ival();
+            return g_vm->BuiltinError("setmeshtexture: illegal part index");
+        auto unit = GetSampler(i);
+        if (unit < 0) return Value();
+        m->surfs[part.ival()]->textures[unit] = id.ival();
         return Value();
     }
     ENDDECL4(gl_setmeshtexture, "meshid,part,i,textureid", "IIII", "",
         "sets texture unit i to texture id for a mesh and part (0 if not a multi-part mesh)");
 
     STARTDECL(gl_setimagetexture) (Value &i, Value &id, Value &tf) {
-        TestGL();
-        SetImageTexture(GetSampler(i), id.ival(), tf.ival());
+        if (!TestGL()) return Value();
+        auto unit = GetSampler(i);
+        if (unit < 0) return Value();
+        SetImageTexture(unit, id.ival(), tf.ival());
         return Value();
     }
     ENDDECL3(gl_setimagetexture, "i,id,textureformat", "III", "",
@@ -863,7 +894,7 @@ void AddGraphics() {
         " with optionally writeonly/readwrite flags.");
 
     STARTDECL(gl_createtexture) (Value &matv, Value &tf) {
-        TestGL();
+        if (!TestGL()) return Value();
         ElemObj *mat = matv.eval();
         int ys = mat->Len();
         int xs = mat->At(0).eval()->Len();
@@ -889,7 +920,7 @@ void AddGraphics() {
         " see color.lobster for texture format");
 
     STARTDECL(gl_createblanktexture) (Value &size_, Value &col, Value &tf) {
-        TestGL();
+        if (!TestGL()) return Value();
         return Value((int)CreateBlankTexture(ValueDecToI<2>(size_), ValueDecToF<4>(col),
                                              tf.ival()));
     }
@@ -898,7 +929,7 @@ void AddGraphics() {
         " id. see color.lobster for texture format");
 
     STARTDECL(gl_deletetexture) (Value &i) {
-        TestGL();
+        if (!TestGL()) return Value();
         uint tex = i.ival();
         auto it = texturecache.begin();
         // this is potentially expensive, we're counting on gl_deletetexture not being needed often
@@ -915,7 +946,7 @@ void AddGraphics() {
         "free up memory for the given texture id");
 
     STARTDECL(gl_texturesize) (Value &i) {
-        TestGL();
+        if (!TestGL()) return Value();
         uint tex = i.ival();
         auto size = TextureSize(tex);
         return ToValueI(size);
@@ -924,7 +955,7 @@ void AddGraphics() {
         "returns the size of a texture");
 
     STARTDECL(gl_readtexture) (Value &i) {
-        TestGL();
+        if (!TestGL()) return Value();
         uint tex = i.ival();
         auto size = TextureSize(tex);
         auto numpixels = size.x() * size.y();
@@ -939,7 +970,7 @@ void AddGraphics() {
 
     STARTDECL(gl_switchtoframebuffer) (Value &tex, Value &fbsize, Value &depth, Value &tf,
                                        Value &retex) {
-        TestGL();
+        if (!TestGL()) return Value();
         auto sz = fbsize.True() ? ValueDecToI<2>(fbsize) : int2_0;
         return Value(SwitchToFrameBuffer(tex.ival(), tex.ival() ? sz : GetScreenSize(),
                                          depth.True(), tf.ival(), retex.ival()));
@@ -966,7 +997,7 @@ void AddGraphics() {
         " the specular scale in y (try 1 for full intensity)");
 
     STARTDECL(gl_debug_grid) (Value &num, Value &dist, Value &thickness) {
-        TestGL();
+        if (!TestGL()) return Value();
         float3 cp = otransforms.view2object[3].xyz();
         auto m = float3(ValueDecToI<3>(num));
         auto step = ValueDecToF<3>(dist);
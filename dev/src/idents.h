@@ -103,6 +103,7 @@ struct Struct : Named {
     bool readonly;
     bool generic;
     bool predeclaration;
+    bool unboxable;        // Small numeric value, intermediate results can live on the stack.
     Type thistype;         // convenient place to store the type corresponding to this.
     TypeRef vectortype;    // What kind of vector this can be demoted to.
     type_elem_t typeinfo;  // Runtime type.
@@ -110,7 +111,7 @@ struct Struct : Named {
     Struct(const string &_name, int _idx)
         : Named(_name, _idx), fields(0), next(nullptr), first(this), superclass(nullptr),
           firstsubclass(nullptr), nextsubclass(nullptr),
-          readonly(false), generic(false), predeclaration(false),
+          readonly(false), generic(false), predeclaration(false), unboxable(false),
           thistype(V_STRUCT, this),
           vectortype(type_vector_any),
           typeinfo((type_elem_t)-1) {}
@@ -628,7 +629,7 @@ struct SymbolTable {
             fbb.CreateVector((vector<int> &)vint_typeoffsets),
             fbb.CreateVector((vector<int> &)vfloat_typeoffsets),
             fbb.CreateVector(speclogvars));
-        fbb.Finish(bcf);
+        bytecode::FinishBytecodeFileBuffer(fbb, bcf);
         bytecode.assign(fbb.GetBufferPointer(), fbb.GetBufferPointer() + fbb.GetSize());
     }
 };
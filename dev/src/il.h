@@ -16,7 +16,7 @@
 // This needs to be bumped each time we make changes to the format.
 
 namespace lobster {
-    const int LOBSTER_BYTECODE_FORMAT_VERSION = 11;
+    const int LOBSTER_BYTECODE_FORMAT_VERSION = 16;
 
 #define ILBASENAMES \
     F(PUSHINT, 1) \
@@ -24,6 +24,7 @@ namespace lobster {
     F(PUSHSTR, 1) \
     F(PUSHNIL, 0) \
     F(PUSHVAR, 1) F(PUSHVARREF, 1) F(LVALVAR, 2) \
+    F(PUSHVARFLD, 2) F(LVALVARI, 3) \
     F(PUSHIDXI, 0) F(PUSHIDXV, 0) F(LVALIDXI, 1) F(LVALIDXV, 1) \
     F(PUSHFLD, 1) F(PUSHFLDM, 1) F(LVALFLD, 2) \
     F(PUSHLOC, 1) F(LVALLOC, 2) \
@@ -48,6 +49,10 @@ namespace lobster {
     F(IVSLT, 0) F(IVSGT, 0) F(IVSLE, 0) F(IVSGE, 0) \
     F(FVSADD, 0) F(FVSSUB, 0) F(FVSMUL, 0) F(FVSDIV, 0) F(FVSMOD, 0) \
     F(FVSLT, 0) F(FVSGT, 0) F(FVSLE, 0) F(FVSGE, 0) \
+    F(IVVADDU, 1) F(IVVSUBU, 1) F(IVVMULU, 1) F(IVVDIVU, 1) \
+    F(FVVADDU, 1) F(FVVSUBU, 1) F(FVVMULU, 1) F(FVVDIVU, 1) \
+    F(IVSADDU, 1) F(IVSSUBU, 1) F(IVSMULU, 1) F(IVSDIVU, 1) \
+    F(FVSADDU, 1) F(FVSSUBU, 1) F(FVSMULU, 1) F(FVSDIVU, 1) \
     F(AEQ, 0) F(ANE, 0) \
     F(IUMINUS, 0) F(FUMINUS, 0) F(IVUMINUS, 0) F(FVUMINUS, 0) \
     F(LOGNOT, 0) F(LOGNOTREF, 0) \
@@ -59,7 +64,7 @@ namespace lobster {
     F(FORLOOPI, 0) F(IFORELEM, 0) F(SFORELEM, 0) F(VFORELEM, 0)
 
 #define ILCALLNAMES \
-    F(CALL, 3) F(CALLMULTI, -1) F(CALLV, 1) F(CALLVCOND, 1) \
+    F(CALL, 3) F(TAILCALL, 2) F(CALLMULTI, -1) F(CALLV, 1) F(CALLVCOND, 1) \
     F(PUSHFUN, 1) F(CORO, -1) F(YIELD, 1)
 
 #define ILJUMPNAMES \
@@ -67,7 +72,22 @@ namespace lobster {
     F(JUMPFAIL, 1) F(JUMPFAILREF, 1) F(JUMPFAILR, 1) F(JUMPFAILRREF, 1) \
     F(JUMPFAILN, 1) F(JUMPFAILNREF, 1) \
     F(JUMPNOFAIL, 1) F(JUMPNOFAILREF, 1) F(JUMPNOFAILR, 1) F(JUMPNOFAILRREF, 1) \
-    F(IFOR, 1) F(SFOR, 1) F(VFOR, 1)
+    F(IFOR, 1) F(SFOR, 1) F(VFOR, 1) \
+    F(JUMPFAILILT, 1) F(JUMPFAILIGT, 1) F(JUMPFAILILE, 1) \
+    F(JUMPFAILIGE, 1) F(JUMPFAILIEQ, 1) F(JUMPFAILINE, 1) \
+    F(JUMPFAILVILT, 3) F(JUMPFAILVIGT, 3) F(JUMPFAILVILE, 3) \
+    F(JUMPFAILVIGE, 3) F(JUMPFAILVIEQ, 3) F(JUMPFAILVINE, 3) \
+    F(UNBOXVAR, 4)
+
+// All jumps other than JUMP are conditional, and have their jump target as last operand.
+// The JUMPFAILI ops are superinstructions for an int comparison followed by a JUMPFAIL, the
+// JUMPFAILVI ops additionally have a variable and an int constant as their operands.
+// PUSHVARFLD and LVALVARI similarly fuse PUSHVARREF + PUSHFLD and PUSHINT + LVALVAR.
+// The ops ending in U work on value structs that have been unboxed onto the stack by UNBOXVAR,
+// which jumps if the variable holds a different type than the one expected.
+
+// TAILCALL is a CALL in tail position, which replaces the frame of the calling function instead
+// of returning to it, see VM::F_TAILCALL.
 
 #define ILNAMES ILBASENAMES ILCALLNAMES ILJUMPNAMES
 
@@ -120,4 +140,47 @@ inline const int *ILArity() {
     return ilarity;
 }
 
+inline int ParseOpAndGetArity(int opc, const int *&ip, const int *code) {
+    auto arity = ILArity()[opc];
+    switch(opc) {
+        default: {
+            assert(arity >= 0);
+            ip += arity;
+            break;
+        }
+        case IL_CORO: {
+            ip += 2;
+            int n = *ip++;
+            ip += n;
+            arity = n + 3;
+            break;
+        }
+        case IL_CALLMULTI: {
+            ip++;
+            auto nargs = code[*ip++ + 2];
+            ip += 2;
+            ip += nargs;
+            arity = nargs + 5;
+            break;
+        }
+        case IL_FUNSTART: {
+            int n = *ip++;
+            ip += n;
+            int m = *ip++;
+            ip += m;
+            arity = n + m + 3;
+            break;
+        }
+        case IL_FUNMULTI: {
+            auto n = *ip++;
+            auto nargs = *ip++;
+            auto tablesize = (nargs + 1) * n;
+            ip += tablesize;
+            arity = tablesize + 2;
+            break;
+        }
+    }
+    return arity;
+}
+
 }
\ No newline at end of file
@@ -47,7 +47,7 @@ struct LoadedFile : Line {
         source = stringsource;
         if (!source) source = (char *)LoadFile((string("include/") + fn).c_str());
         if (!source) source = (char *)LoadFile(fn);
-        if (!source) throw string("can't open file: ") + fn;
+        if (!source) THROW_OR_ABORT(string("can't open file: ") + fn);
 
         linestart = p = source;
 
@@ -424,7 +424,7 @@ struct Lex : LoadedFile {
     void Error(string err, const Line *ln = nullptr) {
         err = Location(ln ? *ln : Line(errorline, fileidx)) + ": error: " + err;
         //Output(OUTPUT_DEBUG, "%s", err.c_str());
-        throw err;
+        THROW_OR_ABORT(err);
     }
 };
 
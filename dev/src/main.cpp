@@ -23,6 +23,19 @@
 
 using namespace lobster;
 
+static void ErrorExit(const string &s, bool from_bundle, bool wait) {
+    Output(OUTPUT_ERROR, s.c_str());
+    if (from_bundle) MsgBox(s.c_str());
+    if (wait) {
+        Output(OUTPUT_PROGRAM, "press <ENTER> to continue:\n");
+        getchar();
+    }
+    #ifdef _WIN32
+        _CrtSetDbgFlag(0);  // Don't bother with memory leaks when there was an error.
+    #endif
+    EngineExit(1);
+}
+
 int main(int argc, char* argv[]) {
     #ifdef _WIN32
         _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
@@ -36,11 +49,15 @@ int main(int argc, char* argv[]) {
     #else
         false;
     #endif
-    try {
+    #ifdef USE_EXCEPTION_HANDLING
+    try
+    #endif
+    {
         RegisterCoreEngineBuiltins();
         bool parsedump = false;
         bool disasm = false;
         bool to_cpp = false;
+        bool use_cache = true;
         const char *default_bcf = "default.lbc";
         const char *bcf = nullptr;
         const char *fn = nullptr;
@@ -57,7 +74,9 @@ int main(int argc, char* argv[]) {
             "--silent               Only output errors.\n"
             "--gen-builtins-html    Write builtin commands help file.\n"
             "--gen-builtins-names   Write builtin commands - just names.\n"
-            "--non-interactive-test Quit after running 1 frame.\n";
+            "--non-interactive-test Quit after running 1 frame.\n"
+            "--profile              Profile the program, write call stacks to profile.folded.\n"
+            "--no-cache             Always compile, don't use or update lobster_cache.\n";
         for (int arg = 1; arg < argc; arg++) {
             if (argv[arg][0] == '-') {
                 string a = argv[arg];
@@ -72,11 +91,14 @@ int main(int argc, char* argv[]) {
                 else if (a == "--gen-builtins-html") { DumpBuiltins(false); return 0; }
                 else if (a == "--gen-builtins-names") { DumpBuiltins(true); return 0; }
                 else if (a == "--non-interactive-test") { SDLTestMode(); }
+                else if (a == "--profile") { ProfileNextRun("profile.folded"); }
+                else if (a == "--no-cache") { use_cache = false; }
                 // process identifier supplied by OS X
                 else if (a.substr(0, 5) == "-psn_") { from_bundle = true; }
-                else throw "unknown command line argument: " + (argv[arg] + helptext);
+                else
+                    THROW_OR_ABORT("unknown command line argument: " + (argv[arg] + helptext));
             } else {
-                if (fn) throw "more than one file specified" + helptext;
+                if (fn) THROW_OR_ABORT("more than one file specified" + helptext);
                 fn = argv[arg];
             }
         }
@@ -84,22 +106,30 @@ int main(int argc, char* argv[]) {
             //fn = "totslike.lobster";  // FIXME: temp solution
         #endif
         if (!SetupDefaultDirs(argv[0], fn, from_bundle))
-            throw string("cannot find location to read/write data on this platform!");
+            THROW_OR_ABORT(
+                string("cannot find location to read/write data on this platform!"));
         vector<uchar> bytecode;
         if (!fn) {
             if (!LoadByteCode(default_bcf, bytecode))
-                throw "Lobster programming language compiler/runtime (version " __DATE__
-                      ")\nno arguments given - cannot load " + (default_bcf + helptext);
+                THROW_OR_ABORT("Lobster programming language compiler/runtime (version " __DATE__
+                               ")\nno arguments given - cannot load " + (default_bcf + helptext));
         } else {
-            Output(OUTPUT_INFO, "compiling...");
-            string dump;
-            Compile(StripDirPart(fn).c_str(), nullptr, bytecode, parsedump ? &dump : nullptr);
-            if (parsedump) {
-                FILE *f = OpenForWriting("parsedump.txt", false);
-                if (f) {
-                    fprintf(f, "%s\n", dump.c_str());
-                    fclose(f);
+            auto mainfn = StripDirPart(fn);
+            // The parse tree is only available when compiling.
+            if (parsedump || !use_cache || !LoadCachedByteCode(mainfn.c_str(), bytecode)) {
+                Output(OUTPUT_INFO, "compiling...");
+                string dump;
+                Compile(mainfn.c_str(), nullptr, bytecode, parsedump ? &dump : nullptr);
+                if (parsedump) {
+                    FILE *f = OpenForWriting("parsedump.txt", false);
+                    if (f) {
+                        fprintf(f, "%s\n", dump.c_str());
+                        fclose(f);
+                    }
                 }
+                if (use_cache) SaveCachedByteCode(mainfn.c_str(), bytecode);
+            } else {
+                Output(OUTPUT_INFO, "using cached bytecode");
             }
             if (bcf) {
                 SaveByteCode(bcf, bytecode);
@@ -121,27 +151,22 @@ int main(int argc, char* argv[]) {
                             "../dev/compiled_lobster/src/compiled_lobster.cpp").c_str(), "w");
             if (f) {
                 string s;
-                ToCPP(s, bytecode.data(), bytecode.size());
+                ToCPP(s, bytecode.data());
                 fputs(s.c_str(), f);
                 fclose(f);
             }
         } else {
-            if (EngineRunByteCode(fn, std::move(bytecode), nullptr, nullptr))
+            string error;
+            if (EngineRunByteCode(fn, std::move(bytecode), nullptr, nullptr, error))
                 return 0;  // Emscripten inverted control.
+            if (!error.empty()) ErrorExit(error, from_bundle, wait);
         }
     }
+    #ifdef USE_EXCEPTION_HANDLING
     catch (string &s) {
-        Output(OUTPUT_ERROR, s.c_str());
-        if (from_bundle) MsgBox(s.c_str());
-        if (wait) {
-            Output(OUTPUT_PROGRAM, "press <ENTER> to continue:\n");
-            getchar();
-        }
-        #ifdef _WIN32
-            _CrtSetDbgFlag(0);  // Don't bother with memory leaks when there was an error.
-        #endif
-        EngineExit(1);
+        ErrorExit(s, from_bundle, wait);
     }
+    #endif
     EngineExit(0);
     return 0;
 }
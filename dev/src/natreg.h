@@ -152,7 +152,8 @@ enum ArgFlags {
     NF_SUBARG2 = 8,
     NF_SUBARG3 = 16,
     NF_ANYVAR = 32,
-    NF_CORESUME = 64
+    NF_CORESUME = 64,
+    NF_ITERFUN = 128
 };
 
 struct Ident;
@@ -201,6 +202,7 @@ struct Narg : Typed {
                 case '*': flags = ArgFlags(flags | NF_ANYVAR); break;
                 case '@': flags = ArgFlags(flags | NF_EXPFUNVAL); break;
                 case '%': flags = ArgFlags(flags | NF_CORESUME); break; // FIXME: make a vm op.
+                case '#': flags = ArgFlags(flags | NF_ITERFUN); break;
                 case ']':
                     typestorage.push_back(Type());
                     type = type->Wrap(&typestorage.back());
@@ -316,7 +318,7 @@ struct NativeRegistry {
                 nf->ncm != existing->ncm) {
                 // Must have similar signatures.
                 assert(0);
-                throw "native library name clash: " + nf->name;
+                THROW_OR_ABORT("native library name clash: " + nf->name);
             }
             nf->overloads = existing->overloads;
             existing->overloads = nf;
@@ -171,13 +171,52 @@ struct Node : SlabAllocatedSmall {
         }
     }
 
-    // Used in the optimizer to see if this node can be discarded without consequences.
+    // Used in the optimizer to see if this node changes any state, such as assignments or calls.
     bool HasSideEffects() {
         return TSideEffect(type) ||
                (a() && a()->HasSideEffects()) ||
                (b() && b()->HasSideEffects()) ||
                (c() && c()->HasSideEffects());
     }
+
+    // Whether this operation itself (not counting its children) can cause a runtime error, such
+    // as an index out of range or a division by zero. Such nodes must be evaluated, even if they
+    // have no side effects and their value is unused.
+    bool OpMayFail() const {
+        switch (type) {
+            case T_INDEX:
+                return true;
+            case T_DIV:
+            case T_MOD: {
+                // Only a constant divisor is known not to fail (INT_MIN / -1 traps).
+                auto r = b();
+                if (!(r->type == T_INT && r->integer() && r->integer() != -1) &&
+                    !(r->type == T_FLOAT && r->flt())) return true;
+            }
+            // FALL-THRU
+            case T_PLUS:
+            case T_MINUS:
+            case T_MULT:
+            case T_LT:
+            case T_GT:
+            case T_LTEQ:
+            case T_GTEQ:
+                // Vector arithmetic fails if the lengths differ.
+                return a()->exptype->t == V_VECTOR || b()->exptype->t == V_VECTOR;
+            default:
+                return false;
+        }
+    }
+
+    bool MayFail() const {
+        return OpMayFail() ||
+               (a() && a()->MayFail()) ||
+               (b() && b()->MayFail()) ||
+               (c() && c()->MayFail());
+    }
+
+    // Used in the optimizer to see if this node can be removed when its value is unused.
+    bool Discardable() { return !HasSideEffects() && !MayFail(); }
 };
 
 inline int CountNodes(const Node *n) {
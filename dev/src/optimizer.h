@@ -9,30 +9,148 @@ struct Optimizer {
     size_t total_changes;
     Node *dummy_node;
     SubFunction *cursf;
+    set<Ident *> freevars;                 // Of all functions, their stores are never dead.
+    unordered_map<SpecIdent *, int> uses;  // Of the locals of cursf, other than its defs.
+    unordered_map<int, int> nonlocalreturns;  // Function idx -> returns that can't be inlined.
 
     Optimizer(Parser &_p, SymbolTable &_st, TypeChecker &_tc, int maxpasses)
         : parser(_p), st(_st), tc(_tc), changes_this_pass(true), total_changes(0),
           dummy_node(nullptr), cursf(nullptr) {
         //dummy_node = NewNode(T_EMPTY, type_any);
         int i = 0;
+        auto nodesbefore = CountAllNodes();
         // MUST run at least 1 pass, to guarantee certain unwanted code is gone.
         maxpasses = max(1, maxpasses);
         for (; changes_this_pass && i < maxpasses; i++) {
             changes_this_pass = false;
+            freevars.clear();
+            nonlocalreturns.clear();
+            for (auto f : parser.st.functiontable) {
+                for (auto sf = f->subf; sf; sf = sf->next) {
+                    for (auto &arg : sf->freevars.v) freevars.insert(arg.id);
+                    for (auto &arg : sf->dynscoperedefs.v) freevars.insert(arg.id);
+                    CountNonLocalReturns(sf->body, !f->anonymous, f);
+                }
+            }
             // We don't optimize parser.root, it only contains a single call.
             for (auto f : parser.st.functiontable) {
                 if (f->subf && f->subf->typechecked) {
                     for (auto sf = f->subf; sf; sf = sf->next) if (sf->body) {
                         cursf = sf;
                         Optimize(sf->body, T_LIST);
+                        // Done after the above, since inlining creates new defs and uses.
+                        RemoveDeadStores();
                     }
                 }
             }
         }
-        Output(OUTPUT_INFO, "optimizer: %d passes, %d optimizations", i, total_changes);
+        auto merged = MergeIdenticalSpecializations();
+        Output(OUTPUT_INFO, "optimizer: %d passes, %d optimizations, %d -> %d nodes, "
+                            "%d identical specializations merged", i,
+               total_changes, nodesbefore, CountAllNodes(), merged);
         assert(i);  // Must run at least one pass.
     }
 
+    // Specializations that only differ in types that don't matter to the code generated (often
+    // after optimization, or because their return type was bound the same way by each caller),
+    // are merged, and their callers made to call the first one.
+    int MergeIdenticalSpecializations() {
+        unordered_map<SubFunction *, SubFunction *> merges;
+        for (auto f : parser.st.functiontable) {
+            if (f->anonymous || f->multimethod || f->istype || !f->subf || !f->subf->next)
+                continue;
+            for (auto a = f->subf; a; a = a->next) {
+                if (merges.count(a)) continue;
+                for (auto b = a->next; b; b = b->next) {
+                    if (!merges.count(b) && SameCode(*a, *b)) merges[b] = a;
+                }
+            }
+        }
+        if (merges.empty()) return 0;
+        for (auto f : parser.st.functiontable) {
+            for (auto sf = f->subf; sf; sf = sf->next) RedirectCalls(sf->body, merges);
+        }
+        RedirectCalls(parser.root, merges);
+        for (auto &m : merges) {
+            m.second->numcallers += m.first->numcallers;
+            m.first->parent->RemoveSubFunction(m.first);
+        }
+        return (int)merges.size();
+    }
+
+    void RedirectCalls(Node *n, unordered_map<SubFunction *, SubFunction *> &merges) {
+        if (!n) return;
+        if (n->type == T_FUN) {
+            auto it = merges.find(n->sf());
+            if (it != merges.end()) n->sf() = it->second;
+            return;
+        }
+        RedirectCalls(n->a(), merges);
+        RedirectCalls(n->b(), merges);
+        RedirectCalls(n->c(), merges);
+    }
+
+    // The variables of both are matched up by position, everything else must be equal.
+    bool SameCode(SubFunction &a, SubFunction &b) {
+        if (!a.typechecked || !b.typechecked || !a.body || !b.body ||
+            a.iscoroutine || b.iscoroutine || a.logvarcallgraph || b.logvarcallgraph ||
+            a.returntypes != b.returntypes || a.freevars.v.size() || b.freevars.v.size() ||
+            a.dynscoperedefs.v.size() || b.dynscoperedefs.v.size() ||
+            a.args.v.size() != b.args.v.size() || a.locals.v.size() != b.locals.v.size())
+            return false;
+        unordered_map<SpecIdent *, SpecIdent *> atob, btoa;
+        auto pair_up = [&](const vector<Arg> &av, const vector<Arg> &bv) {
+            for (size_t i = 0; i < av.size(); i++) {
+                auto sa = av[i].sid;
+                auto sb = bv[i].sid;
+                if (av[i].type != bv[i].type || sa->type != sb->type || av[i].flags != bv[i].flags)
+                    return false;
+                auto ita = atob.insert(make_pair(sa, sb));
+                auto itb = btoa.insert(make_pair(sb, sa));
+                if (ita.first->second != sb || itb.first->second != sa) return false;
+            }
+            return true;
+        };
+        if (!pair_up(a.args.v, b.args.v) || !pair_up(a.locals.v, b.locals.v)) return false;
+        return SameCode(a.body, b.body, a, b, atob);
+    }
+
+    bool SameCode(Node *x, Node *y, SubFunction &a, SubFunction &b,
+                  unordered_map<SpecIdent *, SpecIdent *> &atob) {
+        if (!x || !y) return x == y;
+        if (x->type != y->type || x->exptype != y->exptype) return false;
+        switch (x->type) {
+            case T_IDENT: {
+                if (x->ident() != y->ident()) return false;
+                auto it = atob.find(x->sid());
+                return (it == atob.end() ? x->sid() : it->second) == y->sid();
+            }
+            case T_INT:    return x->integer() == y->integer();
+            case T_FLOAT:  return x->flt() == y->flt();
+            case T_STR:    return !strcmp(x->str(), y->str());
+            case T_STRUCT: return x->st() == y->st();
+            case T_FIELD:  return x->fld() == y->fld();
+            case T_NATIVE: return x->nf() == y->nf();
+            case T_FUN:    return x->sf() == y->sf() || (x->sf() == &a && y->sf() == &b);
+            case T_TYPE:
+            case T_NIL:    return x->typenode() == y->typenode();
+            default:
+                return SameCode(x->a(), y->a(), a, b, atob) &&
+                       SameCode(x->b(), y->b(), a, b, atob) &&
+                       SameCode(x->c(), y->c(), a, b, atob);
+        }
+    }
+
+    int CountAllNodes() {
+        int count = 0;
+        for (auto f : parser.st.functiontable) {
+            if (f->subf && f->subf->typechecked) {
+                for (auto sf = f->subf; sf; sf = sf->next) count += CountNodes(sf->body);
+            }
+        }
+        return count;
+    }
+
     void Changed() { changes_this_pass = true; total_changes++; }
 
     Node *Typed(TypeRef type, Node *n) {
@@ -44,10 +162,31 @@ struct Optimizer {
     void Optimize(Node *&n_ptr, TType parent_type) {
         Node &n = *n_ptr;
         switch (n.type) {
-            case T_LIST:
+            case T_LIST: {
+                // Lists of statements, as opposed to arguments.
+                auto block = parent_type == T_LIST || parent_type == T_INLINED;
                 // Flatten the Optimize recursion a bit
-                for (Node *stats = &n; stats; stats = stats->b()) Optimize(stats->aref(), T_LIST);
+                for (Node **stats = &n_ptr; *stats; ) {
+                    auto &s = **stats;
+                    Optimize(s.aref(), T_LIST);
+                    if (block && s.tail()) {
+                        // Not the last statement, so its value is unused.
+                        if (s.head()->Discardable()) {
+                            Changed();
+                            *stats = s.tail();
+                            continue;
+                        }
+                        // Only the last statement is kept after a return, since codegen relies on
+                        // the block producing a value, even if it is unreachable.
+                        if (s.head()->type == T_RETURN && s.tail()->tail()) {
+                            Changed();
+                            s.tail() = Parser::LastInList(s.tail());
+                        }
+                    }
+                    stats = &s.bref();
+                }
                 return;
+            }
             case T_IF: {  // This optimzation MUST run, since it deletes untypechecked code.
                 Optimize(n.if_condition(), T_IF);
                 Value cval;
@@ -60,10 +199,14 @@ struct Optimizer {
                     if (other->type != T_DEFAULTVAL) {
                         if (other->type == T_E2N) other = other->child();
                         auto &sf = other->call_function()->sf();
-                        if (!sf->typechecked) {
+                        if (sf && !sf->typechecked) {
                             // Typechecker did not typecheck this function for use in this if-then,
-                            // but neither did any other instances, so it can be removed.
-                            sf->parent->RemoveSubFunction(sf);
+                            // but neither did any other instances, so it can be removed. Copies of
+                            // this if made by inlining share it, so it may be gone already.
+                            for (auto osf = sf->parent->subf; osf; osf = osf->next) if (osf == sf) {
+                                sf->parent->RemoveSubFunction(sf);
+                                break;
+                            }
                             sf = nullptr;
                         }
                     }
@@ -82,7 +225,7 @@ struct Optimizer {
                 Value cval;
                 if (tc.ConstVal(n, cval)) {
                     n_ptr = Typed(type_int, new Node(n.line, cval.ival()));
-                    if (n.left()->HasSideEffects()) {
+                    if (!n.left()->Discardable()) {
                         n_ptr = Typed(type_int, new Node(n.line, T_SEQ, n.left(), n_ptr));
                     }
                 }
@@ -103,13 +246,71 @@ struct Optimizer {
                     auto spec_sf = n.dcall_function()->sf();
                     (void)spec_sf;
                     assert(sf && sf == spec_sf);  // Sanity check.
-                    if (!sf->parent->istype && !n.dcall_fval()->HasSideEffects()) {
+                    if (!sf->parent->istype && n.dcall_fval()->Discardable()) {
                         n_ptr = Typed(n.exptype,
                                       new Node(n.line, T_CALL, n.dcall_function(), n.dcall_args()));
                     }
                 }
                 break;
             }
+            case T_PLUS:
+            case T_MINUS:
+            case T_MULT:
+            case T_DIV:
+            case T_MOD:
+            case T_LT:
+            case T_GT:
+            case T_LTEQ:
+            case T_GTEQ:
+            case T_EQ:
+            case T_NEQ:
+            case T_BINAND:
+            case T_BINOR:
+            case T_XOR:
+            case T_ASL:
+            case T_ASR:
+                if (!FoldBinary(n_ptr)) Simplify(n_ptr);
+                break;
+            case T_UMINUS:
+            case T_NEG:
+            case T_NOT:
+            case T_I2F:
+            case T_A2S:
+                FoldUnary(n_ptr);
+                break;
+            case T_AND:
+            case T_OR: {
+                // The typechecker has made both sides the same type if the result is used.
+                Value cval;
+                if (tc.ConstVal(*n.left(), cval) && n.left()->Discardable() &&
+                    n.left()->exptype == n.exptype && n.right()->exptype == n.exptype) {
+                    n_ptr = Typed(n.exptype,
+                                  cval.True() == (n.type == T_AND) ? n.right() : n.left());
+                }
+                break;
+            }
+            case T_INDEX:
+            case T_DOT: {
+                // Accessing an element of a constructor directly.
+                auto con = n.left();
+                if (con->type != T_CONSTRUCTOR) break;
+                int idx = -1;
+                if (n.type == T_INDEX) {
+                    if (n.right()->type != T_INT) break;
+                    idx = n.right()->integer();
+                } else {
+                    if (con->exptype->t != V_STRUCT) break;
+                    idx = con->exptype->struc->Has(n.right()->fld());
+                }
+                Node *elem = nullptr;
+                int i = 0;
+                for (auto arg = con->constructor_args(); arg; arg = arg->tail(), i++) {
+                    if (i == idx) elem = arg->head();
+                    else if (!arg->head()->Discardable()) elem = nullptr, idx = -1;
+                }
+                if (elem && elem->exptype == n.exptype) n_ptr = Typed(n.exptype, elem);
+                break;
+            }
             case T_CALL: {
                 auto sf = n.call_function()->sf();
                 // FIXME: Reduce these requirements where possible.
@@ -122,10 +323,289 @@ struct Optimizer {
                     if (sf->numcallers <= 1 || CountNodes(sf->body) < 8) {  // FIXME: configurable.
                         n_ptr = Inline(n, *sf);
                     }
+                } else if (CanInlineNamed(n, *sf)) {
+                    // Small functions everywhere, larger ones only if there are few callers, since
+                    // each caller gets its own copy.
+                    auto size = CountNodes(sf->body);
+                    if (size < 16 || (sf->numcallers <= 2 && size < 64)) {
+                        n_ptr = Inline(n, *sf);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    // Evaluates operators on int, float and string literals the same way the VM would.
+    bool FoldBinary(Node *&n_ptr) {
+        auto &n = *n_ptr;
+        auto l = n.left();
+        auto r = n.right();
+        if (l->type == T_INT && r->type == T_INT && n.exptype->t == V_INT) {
+            auto a = l->integer();
+            auto b = r->integer();
+            auto ua = (uint)a;  // Overflow wraps around.
+            auto ub = (uint)b;
+            int res;
+            switch (n.type) {
+                case T_PLUS:   res = (int)(ua + ub); break;
+                case T_MINUS:  res = (int)(ua - ub); break;
+                case T_MULT:   res = (int)(ua * ub); break;
+                case T_DIV:
+                case T_MOD:
+                    // Leave any errors to run-time.
+                    if (!b || (a == INT_MIN && b == -1)) return false;
+                    res = n.type == T_DIV ? a / b : a % b;
+                    break;
+                case T_LT:     res = a <  b; break;
+                case T_GT:     res = a >  b; break;
+                case T_LTEQ:   res = a <= b; break;
+                case T_GTEQ:   res = a >= b; break;
+                case T_EQ:     res = a == b; break;
+                case T_NEQ:    res = a != b; break;
+                case T_BINAND: res = a &  b; break;
+                case T_BINOR:  res = a |  b; break;
+                case T_XOR:    res = a ^  b; break;
+                case T_ASL:
+                case T_ASR:
+                    if (b < 0 || b > 31) return false;
+                    res = n.type == T_ASL ? (int)(ua << b) : a >> b;
+                    break;
+                default: return false;
+            }
+            n_ptr = Typed(n.exptype, new Node(n.line, res));
+            return true;
+        }
+        if (l->type == T_FLOAT && r->type == T_FLOAT) {
+            // The VM computes in single precision.
+            auto a = (float)l->flt();
+            auto b = (float)r->flt();
+            if (n.exptype->t == V_FLOAT) {
+                float res;
+                switch (n.type) {
+                    case T_PLUS:  res = a + b; break;
+                    case T_MINUS: res = a - b; break;
+                    case T_MULT:  res = a * b; break;
+                    case T_DIV:   if (!b) return false; res = a / b; break;
+                    default: return false;
                 }
+                n_ptr = Typed(n.exptype, new Node(n.line, (double)res));
+                return true;
+            }
+            if (n.exptype->t == V_INT) {
+                int res;
+                switch (n.type) {
+                    case T_LT:   res = a <  b; break;
+                    case T_GT:   res = a >  b; break;
+                    case T_LTEQ: res = a <= b; break;
+                    case T_GTEQ: res = a >= b; break;
+                    case T_EQ:   res = a == b; break;
+                    case T_NEQ:  res = a != b; break;
+                    default: return false;
+                }
+                n_ptr = Typed(n.exptype, new Node(n.line, res));
+                return true;
+            }
+            return false;
+        }
+        if (l->type == T_STR && r->type == T_STR && n.type == T_PLUS &&
+            n.exptype->t == V_STRING) {
+            n_ptr = Typed(n.exptype, new Node(n.line, string(l->str()) + r->str()));
+            return true;
+        }
+        return false;
+    }
+
+    // Removes arithmetic with no effect on scalars, such as x + 0 or x * 1. There is no strength
+    // reduction like x * 2 -> x + x, since the VM pays per instruction, not per kind of operation.
+    void Simplify(Node *&n_ptr) {
+        auto &n = *n_ptr;
+        auto t = n.exptype->t;
+        auto l = n.left();
+        auto r = n.right();
+        if ((t != V_INT && t != V_FLOAT) || l->exptype->t != t || r->exptype->t != t) return;
+        auto is = [&](const Node *c, int v) {
+            return t == V_INT ? c->type == T_INT && c->integer() == v
+                              : c->type == T_FLOAT && c->flt() == v;
+        };
+        Node *res = nullptr;
+        switch (n.type) {
+            case T_PLUS:
+                // Not for floats, since -0.0 + 0.0 is 0.0.
+                if (t == V_INT) res = is(r, 0) ? l : is(l, 0) ? r : nullptr;
+                break;
+            case T_MINUS:
+                if (is(r, 0)) res = l;
+                break;
+            case T_MULT:
+                if (is(r, 1)) res = l;
+                else if (is(l, 1)) res = r;
+                else if (is(r, -1)) res = new Node(n.line, T_UMINUS, l);
+                else if (is(l, -1)) res = new Node(n.line, T_UMINUS, r);
                 break;
+            case T_DIV:
+                if (is(r, 1)) res = l;
+                break;
+            default:
+                break;
+        }
+        if (res) n_ptr = Typed(n.exptype, res);
+    }
+
+    void FoldUnary(Node *&n_ptr) {
+        auto &n = *n_ptr;
+        auto c = n.child();
+        switch (n.type) {
+            case T_UMINUS:
+                if (c->type == T_INT)
+                    n_ptr = Typed(n.exptype, new Node(n.line, (int)(0u - (uint)c->integer())));
+                else if (c->type == T_FLOAT)
+                    n_ptr = Typed(n.exptype, new Node(n.line, -c->flt()));
+                break;
+            case T_NEG:
+                if (c->type == T_INT) n_ptr = Typed(n.exptype, new Node(n.line, ~c->integer()));
+                break;
+            case T_NOT: {
+                Value cval;
+                if (tc.ConstVal(n, cval) && n.exptype->t == V_INT && c->Discardable())
+                    n_ptr = Typed(n.exptype, new Node(n.line, (int)cval.True()));
+                break;
+            }
+            case T_I2F:
+                if (c->type == T_INT)
+                    n_ptr = Typed(n.exptype, new Node(n.line, (double)(float)c->integer()));
+                break;
+            case T_A2S:
+                if (c->type == T_INT)
+                    n_ptr = Typed(n.exptype, new Node(n.line, to_string(c->integer())));
+                break;
+            default:
+                break;
+        }
+    }
+
+    void CountUses(Node *n) {
+        if (!n) return;
+        if (n->type == T_IDENT) uses[n->sid()]++;
+        if (n->type == T_DEF) {
+            // The variables being defined are not a use.
+            auto d = n;
+            for (; d->type == T_DEF; d = d->right()) CountUses(d->c());
+            CountUses(d);
+            return;
+        }
+        CountUses(n->a());
+        CountUses(n->b());
+        CountUses(n->c());
+    }
+
+    // A local that is never read can be removed along with its definition, keeping only the side
+    // effects of its initializer. Globals, and locals of coroutines (which can be read from the
+    // outside) or used by other functions are left alone.
+    void RemoveDeadStores() {
+        if (cursf->iscoroutine) return;
+        uses.clear();
+        CountUses(cursf->body);
+        RemoveDeadStores(cursf->body, T_LIST);
+    }
+
+    void RemoveDeadStores(Node *n, TType parent_type) {
+        if (!n) return;
+        if (n->type == T_LIST && (parent_type == T_LIST || parent_type == T_INLINED)) {
+            for (auto stats = n; stats; stats = stats->tail()) {
+                auto &def = stats->head();
+                if (stats->tail() && def->type == T_DEF && def->right()->type != T_DEF) {
+                    auto sid = def->left()->sid();
+                    if (sid->id->sf_def != st.toplevel && !sid->id->logvar &&
+                        !uses[sid] && !freevars.count(sid->id)) {
+                        Changed();
+                        // If pure, the next pass removes it.
+                        def = def->right();
+                    }
+                }
+                RemoveDeadStores(def, T_LIST);
             }
+            return;
+        }
+        RemoveDeadStores(n->a(), n->type);
+        RemoveDeadStores(n->b(), n->type);
+        RemoveDeadStores(n->c(), n->type);
+    }
+
+    // Named functions, unlike anonymous ones, can be recursive, can be reached through a function
+    // value, and can be returned from by other functions, so these are left as calls.
+    bool CanInlineNamed(Node &call, SubFunction &sf) {
+        auto &f = *sf.parent;
+        if (f.anonymous || f.multimethod || f.istype || sf.iscoroutine || cursf->iscoroutine ||
+            &sf == cursf || cursf == st.toplevel || sf.dynscoperedefs.size() ||
+            sf.logvarcallgraph || sf.returntypes.size() > 1 || nonlocalreturns[f.idx] ||
+            Calls(sf.body, &f))
+            return false;
+        // Inlined variables live until cursf returns, which must not keep objects alive that
+        // would otherwise have been freed (which collect_garbage() etc. can observe).
+        for (auto &loc : sf.locals.v) if (!IsScalar(loc.sid->type->t)) return false;
+        int i = 0;
+        for (auto list = call.call_args(); list; list = list->tail(), i++) {
+            auto arg = list->head();
+            if (!IsScalar(sf.args.v[i].sid->type->t) && arg->type != T_IDENT) return false;
+            // The inlined arguments are stored in the variables of sf, so an argument may not
+            // read them (if cursf is nested inside sf), or write them (if it has sf inlined).
+            if (UsesVarsOf(arg, sf)) return false;
+        }
+        return true;
+    }
+
+    // Checks for recursion, and for calls of function values and anonymous functions that have
+    // not been inlined yet, since those are much cheaper to inline before sf is copied.
+    bool Calls(Node *n, Function *f) {
+        if (!n) return false;
+        if (n->type == T_DYNCALL) return true;
+        if (n->type == T_CALL) {
+            auto cf = n->call_function()->sf()->parent;
+            if (cf == f || cf->anonymous) return true;
+        }
+        return Calls(n->a(), f) || Calls(n->b(), f) || Calls(n->c(), f);
+    }
+
+    bool UsesVarsOf(Node *n, SubFunction &sf) {
+        if (!n) return false;
+        if (n->type == T_IDENT) {
+            for (auto &arg : sf.args.v) if (arg.sid == n->sid()) return true;
+            for (auto &loc : sf.locals.v) if (loc.sid == n->sid()) return true;
+        }
+        return UsesVarsOf(n->a(), sf) || UsesVarsOf(n->b(), sf) || UsesVarsOf(n->c(), sf);
+    }
+
+    // The calls in a copy of a body are new callers, which stops the functions called from being
+    // inlined by moving their body, which can happen only once.
+    void CountCallers(Node *n) {
+        if (!n) return;
+        if (n->type == T_CALL) n->call_function()->sf()->numcallers++;
+        if (n->type == T_DYNCALL && n->dcall_function()->sf())
+            n->dcall_function()->sf()->numcallers++;
+        CountCallers(n->a());
+        CountCallers(n->b());
+        CountCallers(n->c());
+    }
+
+    // Counts the returns to each function, other than the ones ending a function body, which
+    // simply become the value of the body when inlined.
+    void CountNonLocalReturns(Node *n, bool last, Function *f) {
+        if (!n) return;
+        if (n->type == T_LIST) {
+            for (auto s = n; s; s = s->tail())
+                CountNonLocalReturns(s->head(), last && !s->tail(), f);
+            return;
+        }
+        if (n->type == T_RETURN) {
+            auto fid = n->return_function_idx()->integer();
+            if (fid >= 0 && !(last && fid == f->idx && n->return_value() &&
+                              n->return_value()->type != T_MULTIRET))
+                nonlocalreturns[fid]++;
         }
+        CountNonLocalReturns(n->a(), false, f);
+        CountNonLocalReturns(n->b(), false, f);
+        CountNonLocalReturns(n->c(), false, f);
     }
 
     Node *Inline(Node &call, SubFunction &sf) {
@@ -152,14 +632,20 @@ struct Optimizer {
             tail = &(*tail)->bref();
             ai++;
         }
-        if (sf.numcallers <= 1) {
+        if (sf.numcallers <= 1 && sf.parent->anonymous) {
             *tail = sf.body;
             sf.body = nullptr;
             sf.parent->RemoveSubFunction(&sf);
         } else {
+            // Named functions keep their code, since they may still be called through a function
+            // value.
             *tail = sf.body->Clone();
             sf.numcallers--;
+            CountCallers(*tail);
         }
+        auto &last = Parser::LastInList(*tail)->head();
+        if (last->type == T_RETURN && last->return_function_idx()->integer() == sf.parent->idx)
+            last = last->return_value();
         newn = Typed(sf.returntypes[0], new Node(call.line, T_INLINED, newn));
         return newn;
     }
@@ -0,0 +1,184 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Data-parallel loops, run on a set of threads that each have a VM (and heap) of their own, running
+// the same bytecode as the calling VM (see VMWorkers). See parallel_map() / parallel_for() in
+// std.lobster.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+namespace lobster {
+
+VMWorkers::~VMWorkers() {
+    {
+        lock_guard<mutex> guard(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads) t.join();
+}
+
+// Runs job on all workers, and returns when all of them are done with it.
+void VMWorkers::Run(function<void()> &&_job) {
+    if (threads.empty()) {
+        auto n = max(1, (int)thread::hardware_concurrency());
+        for (int i = 0; i < n; i++) threads.emplace_back([this]() { Work(); });
+    }
+    unique_lock<mutex> guard(lock);
+    job = std::move(_job);
+    running = (int)threads.size();
+    generation++;
+    wake.notify_all();
+    done.wait(guard, [this]() { return !running; });
+    job = nullptr;
+}
+
+void VMWorkers::Work() {
+    int seen = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [&]() { return quit || generation != seen; });
+            if (quit) break;
+            seen = generation;
+        }
+        job();
+        lock_guard<mutex> guard(lock);
+        if (!--running) done.notify_one();
+    }
+    if (g_vm) delete g_vm;
+}
+
+// Makes another VM current on this thread for as long as it is in scope.
+struct CurrentVM {
+    VM *vm;
+    SlabAlloc *pool;
+
+    CurrentVM(VM *_vm, SlabAlloc *_pool) : vm(g_vm), pool(vmpool) {
+        g_vm = _vm;
+        vmpool = _pool;
+    }
+    ~CurrentVM() {
+        g_vm = vm;
+        vmpool = pool;
+    }
+};
+
+// Whether values of type t can be copied to another VM by CopyFromHeap: coroutines can't, and
+// neither can "any", since it may hold one. seen guards against recursive struct types.
+static bool Copyable(const TypeInfo &ti, set<const TypeInfo *> &seen) {
+    if (!seen.insert(&ti).second) return true;
+    switch (ti.t) {
+        case V_COROUTINE:
+        case V_ANY:
+            return false;
+        case V_NIL:
+        case V_VECTOR:
+            return Copyable(g_vm->GetTypeInfo(ti.subt), seen);
+        case V_STRUCT:
+            for (int i = 0; i < ti.len; i++)
+                if (!Copyable(g_vm->GetTypeInfo(ti.elems[i]), seen)) return false;
+            return true;
+        default:
+            return true;
+    }
+}
+
+// Calls fun(x, i) for every element x of xs (or every i below xs if it is an int), and returns
+// the results in a vector of type ti (empty if !collect). The calling VM is blocked meanwhile, so
+// the workers can read its heap without locking: elements get copied into a worker's heap, and
+// results back into the caller's, one worker at a time. Workers take the next unclaimed index
+// whenever they finish one, so uneven work is balanced automatically.
+static Value ParallelLoop(Value &xs, bool isvec, Value &fun, const TypeInfo &ti, bool collect) {
+    auto parentvm = g_vm;
+    auto parentpool = vmpool;
+    auto n = isvec ? xs.eval()->Len() : xs.ival();
+    auto arity = g_vm->FunctionArity(fun);
+    if (g_vm->halted) return Value();
+    auto &rti = g_vm->GetTypeInfo(ti.subt);
+    auto rt = rti.t == V_NIL ? g_vm->GetTypeInfo(rti.subt).t : rti.t;
+    // Checked here, since an error while copying would happen on a worker thread.
+    set<const TypeInfo *> seen;
+    if ((isvec && !Copyable(xs.eval()->ti, seen)) || (collect && !Copyable(rti, seen))) {
+        if (isvec) xs.DECRT();
+        return g_vm->BuiltinError("parallel loop: arguments and results cannot be (or contain)"
+                           " coroutines, or values of type any");
+    }
+    vector<Value> results(collect ? max(n, 0) : 0);
+    atomic<int> next(0);
+    mutex lock;
+    string error;
+    g_vm->workers.Run([&]() {
+        for (;;) {
+            auto i = next++;
+            if (i >= n) break;
+            if (!g_vm) new VM(parentvm->GetProgramName(), vector<uchar>(), nullptr,
+                              parentvm->bytecode_start);
+            if (arity > 0) {
+                unordered_map<const RefObj *, RefObj *> done;
+                g_vm->Push(isvec ? CopyFromHeap(xs.eval()->At(i), xs.eval()->ElemType(i), done)
+                                 : Value(i));
+            }
+            if (arity > 1) g_vm->Push(Value(i));
+            auto r = g_vm->CallFunction(fun);
+            if (!g_vm->errmsg.empty()) {
+                lock_guard<mutex> guard(lock);
+                if (error.empty()) error = g_vm->errmsg;
+                next = n;  // Stop the other workers.
+                // Its stack may be in any state now, the next loop will create a fresh one.
+                delete g_vm;
+                break;
+            }
+            if (collect) {
+                lock_guard<mutex> guard(lock);
+                CurrentVM parent(parentvm, parentpool);
+                unordered_map<const RefObj *, RefObj *> done;
+                results[i] = CopyFromHeap(r, rt, done);
+            }
+            r.DECTYPE(rt);
+        }
+    });
+    if (isvec) xs.DECRT();
+    if (!error.empty()) {
+        for (auto &r : results) r.DECTYPE(rt);
+        return g_vm->BuiltinError("error in parallel loop:\n" + error);
+    }
+    auto rv = (LVector *)g_vm->NewVector(0, (int)results.size(), ti);
+    for (auto &r : results) rv->Push(r);
+    return Value(rv);
+}
+
+void AddParallel() {
+    STARTDECL(parallel_loop) (Value &type, Value &n, Value &fun, Value &collect) {
+        return ParallelLoop(n, false, fun, g_vm->GetTypeInfo((type_elem_t)type.ival()),
+                            collect.True());
+    }
+    ENDDECL4(parallel_loop, "typeid,n,fun,collect", "TIC#I", "A]3",
+        "calls fun for all ints below n on multiple threads, each with its own VM, so fun can't"
+        " use variables from outside of it, and any globals used by functions it calls are"
+        " uninitialized. its results are returned in a vector if collect is true. pass"
+        " \"typeof return\" as typeid. use parallel_map() / parallel_for() instead.");
+
+    STARTDECL(parallel_loop) (Value &type, Value &xs, Value &fun, Value &collect) {
+        return ParallelLoop(xs, true, fun, g_vm->GetTypeInfo((type_elem_t)type.ival()),
+                            collect.True());
+    }
+    ENDDECL4(parallel_loop, "typeid,xs,fun,collect", "TV*C#I", "A]3",
+        "same, but for all elements of xs, which are copied to the VM fun runs in.");
+}
+
+}
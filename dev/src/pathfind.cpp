@@ -0,0 +1,486 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Priority queues of ints, and A* over grids of movement costs. Grids are persistent objects so
+// their costs can be updated incrementally, and they keep their search state around between
+// searches, which only touch the cells they visit.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+namespace lobster {
+
+// Binary heap with handles, so entries can have their priority changed or be removed. Entries
+// with equal priorities are ordered by a second priority, then by which was pushed first.
+struct PriorityQueue {
+    struct Item {
+        float pri, pri2;
+        uint64_t seq;
+        int value;
+        int handle;
+    };
+
+    vector<Item> heap;
+    vector<int> slots;  // Position in heap of each handle, or -1 if free.
+    vector<int> freelist;
+    uint64_t seq;
+
+    PriorityQueue() { Clear(); }
+
+    void Clear() {
+        heap.clear();
+        // Handle 0 is never used, so it can denote "none".
+        slots.assign(1, -1);
+        freelist.clear();
+        seq = 0;
+    }
+
+    bool Valid(int h) const { return h > 0 && h < (int)slots.size() && slots[h] >= 0; }
+
+    static bool Less(const Item &a, const Item &b) {
+        return a.pri != b.pri ? a.pri < b.pri : a.pri2 != b.pri2 ? a.pri2 < b.pri2 : a.seq < b.seq;
+    }
+
+    void Place(int i, const Item &it) {
+        heap[i] = it;
+        slots[it.handle] = i;
+    }
+
+    void Up(int i) {
+        auto it = heap[i];
+        while (i) {
+            auto p = (i - 1) / 2;
+            if (!Less(it, heap[p])) break;
+            Place(i, heap[p]);
+            i = p;
+        }
+        Place(i, it);
+    }
+
+    void Down(int i) {
+        auto it = heap[i];
+        auto n = (int)heap.size();
+        for (;;) {
+            auto c = i * 2 + 1;
+            if (c >= n) break;
+            if (c + 1 < n && Less(heap[c + 1], heap[c])) c++;
+            if (!Less(heap[c], it)) break;
+            Place(i, heap[c]);
+            i = c;
+        }
+        Place(i, it);
+    }
+
+    int Push(int value, float pri, float pri2) {
+        int h;
+        if (freelist.empty()) {
+            h = (int)slots.size();
+            slots.push_back(-1);
+        } else {
+            h = freelist.back();
+            freelist.pop_back();
+        }
+        heap.push_back(Item { pri, pri2, seq++, value, h });
+        Up((int)heap.size() - 1);
+        return h;
+    }
+
+    void Update(int h, float pri, float pri2) {
+        auto &it = heap[slots[h]];
+        it.pri = pri;
+        it.pri2 = pri2;
+        Up(slots[h]);
+        Down(slots[h]);
+    }
+
+    void Remove(int h) {
+        auto i = slots[h];
+        slots[h] = -1;
+        freelist.push_back(h);
+        auto last = heap.back();
+        heap.pop_back();
+        if (i == (int)heap.size()) return;
+        Place(i, last);
+        Up(i);
+        Down(slots[last.handle]);
+    }
+
+    int Pop() {
+        auto value = heap[0].value;
+        Remove(heap[0].handle);
+        return value;
+    }
+};
+
+enum { HEURISTIC_NONE, HEURISTIC_MANHATTAN, HEURISTIC_OCTILE, HEURISTIC_EUCLIDEAN };
+
+struct PathGrid {
+    // What a search needs per cell. Cells not touched by the current search (according to stamp)
+    // are unvisited, so starting a new search doesn't need to clear anything.
+    struct Search {
+        PriorityQueue open;
+        vector<uint32_t> stamp;
+        vector<float> g;
+        vector<int> from;
+        vector<int> state;  // Handle in open, or -1 if closed.
+        uint32_t gen;
+
+        Search() : gen(0) {}
+    };
+
+    int2 size;
+    bool diagonal;
+    vector<int> costs;
+    vector<Search> searches;  // One per thread that has searched this grid.
+
+    PathGrid(const int2 &_size, bool _diagonal)
+        : size(_size), diagonal(_diagonal), costs(_size.x() * _size.y(), 1), searches(1) {}
+
+    bool InRange(const int2 &p) const { return p >= int2_0 && p < size; }
+
+    int Cell(const int2 &p) const { return p.y() * size.x() + p.x(); }
+
+    static float Heuristic(int kind, const int2 &d) {
+        auto x = (float)abs(d.x());
+        auto y = (float)abs(d.y());
+        switch (kind) {
+            case HEURISTIC_MANHATTAN: return x + y;
+            case HEURISTIC_OCTILE:    return max(x, y) + (sqrtf(2) - 1) * min(x, y);
+            case HEURISTIC_EUCLIDEAN: return sqrtf(x * x + y * y);
+            default:                  return 0;
+        }
+    }
+
+    // Appends the cells of the path from start to goal as x, y pairs to out, and returns its
+    // cost, or -1 if there is none.
+    float FindPath(Search &s, const int2 &start, const int2 &goal, int heuristic, float weight,
+                   vector<int> &out) {
+        auto n = size.x() * size.y();
+        if ((int)s.stamp.size() != n) {
+            s.stamp.assign(n, 0);
+            s.g.resize(n);
+            s.from.resize(n);
+            s.state.resize(n);
+            s.gen = 0;
+        }
+        if (!++s.gen) {
+            fill(s.stamp.begin(), s.stamp.end(), 0);
+            s.gen = 1;
+        }
+        s.open.Clear();
+        auto goalc = Cell(goal);
+        if (costs[goalc] <= 0) return -1;
+        auto visit = [&](const int2 &p, int c, float g, int from) {
+            if (s.stamp[c] != s.gen) {
+                s.stamp[c] = s.gen;
+                s.state[c] = 0;
+            } else if (s.state[c] < 0 || g >= s.g[c]) {
+                return;
+            }
+            s.g[c] = g;
+            s.from[c] = from;
+            auto h = Heuristic(heuristic, p - goal) * weight;
+            if (s.state[c]) s.open.Update(s.state[c], g + h, h);
+            else s.state[c] = s.open.Push(c, g + h, h);
+        };
+        visit(start, Cell(start), 0, -1);
+        static const int2 dirs[] = {
+            int2(1, 0), int2(-1, 0), int2(0, 1), int2(0, -1),
+            int2(1, 1), int2(-1, 1), int2(1, -1), int2(-1, -1)
+        };
+        auto ndirs = diagonal ? 8 : 4;
+        while (!s.open.heap.empty()) {
+            auto c = s.open.Pop();
+            s.state[c] = -1;
+            if (c == goalc) {
+                auto first = out.size();
+                for (auto i = c; i >= 0; i = s.from[i]) {
+                    out.push_back(i / size.x());
+                    out.push_back(i % size.x());
+                }
+                reverse(out.begin() + first, out.end());
+                return s.g[c];
+            }
+            int2 p(c % size.x(), c / size.x());
+            for (int i = 0; i < ndirs; i++) {
+                auto d = dirs[i];
+                auto np = p + d;
+                if (!InRange(np)) continue;
+                auto nc = Cell(np);
+                auto cost = (float)costs[nc];
+                if (cost <= 0) continue;
+                if (i >= 4) {
+                    // No cutting corners past blocked cells.
+                    if (costs[Cell(int2(np.x(), p.y()))] <= 0 ||
+                        costs[Cell(int2(p.x(), np.y()))] <= 0) continue;
+                    cost *= sqrtf(2);
+                }
+                visit(np, nc, s.g[c] + cost, c);
+            }
+        }
+        return -1;
+    }
+
+    // Finds paths for many start/goal pairs using all cores, appending for each the number of
+    // cells followed by the cells (0 if no path) to out.
+    void FindPaths(const vector<int2> &starts, const vector<int2> &goals, int heuristic,
+                   float weight, vector<int> &out) {
+        auto nq = (int)starts.size();
+        vector<vector<int>> paths(nq);
+        auto nthreads = min(max(1, (int)thread::hardware_concurrency()), max(1, nq));
+        if ((int)searches.size() < nthreads) searches.resize(nthreads);
+        atomic<int> next(0);
+        auto worker = [&](int t) {
+            for (;;) {
+                auto i = next++;
+                if (i >= nq) break;
+                FindPath(searches[t], starts[i], goals[i], heuristic, weight, paths[i]);
+            }
+        };
+        if (nthreads == 1) {
+            worker(0);
+        } else {
+            vector<thread> workers;
+            for (int t = 0; t < nthreads; t++) workers.emplace_back(worker, t);
+            for (auto &w : workers) w.join();
+        }
+        for (auto &path : paths) {
+            out.push_back((int)path.size() / 2);
+            out.insert(out.end(), path.begin(), path.end());
+        }
+    }
+};
+
+// Per thread, like the VM, since each VM running in parallel_map() etc. has its own globals.
+static thread_local IntResourceManagerCompact<PriorityQueue> queues([](PriorityQueue *pq) {
+    delete pq;
+});
+static thread_local IntResourceManagerCompact<PathGrid> grids([](PathGrid *pg) {
+    delete pg;
+});
+static thread_local vector<int> results;
+
+// These report errors by halting the VM, after which they return nullptr / -1, and the builtin
+// must return (GetPos() callers check g_vm->halted).
+static PriorityQueue *GetQueue(Value &id, const char *name) {
+    auto pq = queues.Get(id.ival());
+    if (!pq) g_vm->BuiltinError(string(name) + ": invalid priority queue");
+    return pq;
+}
+
+static int GetHandle(PriorityQueue &pq, Value &h, const char *name) {
+    if (pq.Valid(h.ival())) return h.ival();
+    g_vm->BuiltinError(string(name) + ": invalid handle");
+    return -1;
+}
+
+static PathGrid *GetGrid(Value &id, const char *name) {
+    auto pg = grids.Get(id.ival());
+    if (!pg) g_vm->BuiltinError(string(name) + ": invalid grid");
+    return pg;
+}
+
+static int2 GetPos(PathGrid &pg, Value &pos, const char *name) {
+    auto p = ValueDecToI<2>(pos);
+    if (!pg.InRange(p)) g_vm->BuiltinError(string(name) + ": position outside of grid");
+    return p;
+}
+
+static int GetHeuristic(Value &heuristic, const char *name) {
+    if (heuristic.ival() >= HEURISTIC_NONE && heuristic.ival() <= HEURISTIC_EUCLIDEAN)
+        return heuristic.ival();
+    g_vm->BuiltinError(string(name) + ": unknown heuristic");
+    return -1;
+}
+
+// Overwrites the contents of buf with the results, and returns it.
+static Value ToBuffer(Value &buf) {
+    auto v = buf.vval();
+    v->len = 0;  // Only ints, so nothing to DEC.
+    if (v->maxl < (int)results.size()) v->Resize((int)results.size());
+    for (auto i : results) v->Push(Value(i));
+    results.clear();
+    return buf;
+}
+
+void AddPathFinding() {
+    STARTDECL(pq_new) () {
+        return Value((int)queues.Add(new PriorityQueue()));
+    }
+    ENDDECL0(pq_new, "", "", "I",
+        "creates a priority queue of ints, returning its id.");
+
+    STARTDECL(pq_delete) (Value &id) {
+        if (!GetQueue(id, "pq_delete")) return Value();
+        queues.Delete(id.ival());
+        return Value();
+    }
+    ENDDECL1(pq_delete, "id", "I", "",
+        "deletes a priority queue.");
+
+    STARTDECL(pq_push) (Value &id, Value &value, Value &priority, Value &tiebreak) {
+        auto pq = GetQueue(id, "pq_push");
+        if (!pq) return Value();
+        return Value(pq->Push(value.ival(), priority.fval(), tiebreak.fval()));
+    }
+    ENDDECL4(pq_push, "id,value,priority,tiebreak", "IIFF?", "I",
+        "adds value to the queue, returning a handle to change its priority or remove it with."
+        " values with equal priorities come out in order of tiebreak (lowest first), then in the"
+        " order they were pushed.");
+
+    STARTDECL(pq_pop) (Value &id) {
+        auto pq = GetQueue(id, "pq_pop");
+        if (!pq) return Value();
+        if (pq->heap.empty()) return g_vm->BuiltinError("pq_pop: queue is empty");
+        return Value(pq->Pop());
+    }
+    ENDDECL1(pq_pop, "id", "I", "I",
+        "removes the value with the lowest priority from the queue, and returns it.");
+
+    STARTDECL(pq_top) (Value &id) {
+        auto pq = GetQueue(id, "pq_top");
+        if (!pq) return Value();
+        if (pq->heap.empty()) return g_vm->BuiltinError("pq_top: queue is empty");
+        g_vm->Push(Value(pq->heap[0].value));
+        return Value(pq->heap[0].pri);
+    }
+    ENDDECL1(pq_top, "id", "I", "IF",
+        "returns the value with the lowest priority and its priority, without removing it.");
+
+    STARTDECL(pq_update) (Value &id, Value &handle, Value &priority, Value &tiebreak) {
+        auto pq = GetQueue(id, "pq_update");
+        if (!pq) return Value();
+        auto h = GetHandle(*pq, handle, "pq_update");
+        if (h < 0) return Value();
+        pq->Update(h, priority.fval(), tiebreak.fval());
+        return Value();
+    }
+    ENDDECL4(pq_update, "id,handle,priority,tiebreak", "IIFF?", "",
+        "changes the priority (up or down) of a value still in the queue.");
+
+    STARTDECL(pq_remove) (Value &id, Value &handle) {
+        auto pq = GetQueue(id, "pq_remove");
+        if (!pq) return Value();
+        auto h = GetHandle(*pq, handle, "pq_remove");
+        if (h < 0) return Value();
+        pq->Remove(h);
+        return Value();
+    }
+    ENDDECL2(pq_remove, "id,handle", "II", "",
+        "removes a value from the queue. its handle may be reused by later pushes.");
+
+    STARTDECL(pq_size) (Value &id) {
+        auto pq = GetQueue(id, "pq_size");
+        if (!pq) return Value();
+        return Value((int)pq->heap.size());
+    }
+    ENDDECL1(pq_size, "id", "I", "I",
+        "the number of values in the queue.");
+
+    STARTDECL(pathgrid_new) (Value &size, Value &diagonal) {
+        auto sz = ValueDecToI<2>(size);
+        if (sz.x() <= 0 || sz.y() <= 0 || (int64_t)sz.x() * sz.y() > INT_MAX / 2)
+            return g_vm->BuiltinError("pathgrid_new: invalid size");
+        return Value((int)grids.Add(new PathGrid(sz, diagonal.True())));
+    }
+    ENDDECL2(pathgrid_new, "size,diagonal", "I]:2I", "I",
+        "creates a grid of movement costs for path finding (all 1 initially), returning its id."
+        " if diagonal, paths may move diagonally (at sqrt(2) times the cost), otherwise only"
+        " horizontally and vertically.");
+
+    STARTDECL(pathgrid_delete) (Value &id) {
+        if (!GetGrid(id, "pathgrid_delete")) return Value();
+        grids.Delete(id.ival());
+        return Value();
+    }
+    ENDDECL1(pathgrid_delete, "id", "I", "",
+        "deletes a grid.");
+
+    STARTDECL(pathgrid_set) (Value &id, Value &pos, Value &cost) {
+        auto pg = GetGrid(id, "pathgrid_set");
+        if (!pg) return Value();
+        auto p = GetPos(*pg, pos, "pathgrid_set");
+        if (g_vm->halted) return Value();
+        pg->costs[pg->Cell(p)] = cost.ival();
+        return Value();
+    }
+    ENDDECL3(pathgrid_set, "id,pos,cost", "II]:2I", "",
+        "sets the cost of moving onto the cell at pos. a cost of 0 or less blocks it.");
+
+    STARTDECL(pathgrid_set_all) (Value &id, Value &costs) {
+        auto pg = GetGrid(id, "pathgrid_set_all");
+        if (!pg) return Value();
+        auto v = costs.vval();
+        if (v->len != (int)pg->costs.size())
+            return g_vm->BuiltinError("pathgrid_set_all: costs must have one entry per cell");
+        memcpy(pg->costs.data(), v->PackedElems<int>(), pg->costs.size() * sizeof(int));
+        costs.DECRT();
+        return Value();
+    }
+    ENDDECL2(pathgrid_set_all, "id,costs", "II]", "",
+        "sets the cost of all cells at once, row by row.");
+
+    STARTDECL(pathgrid_find) (Value &id, Value &start, Value &goal, Value &heuristic,
+                              Value &weight, Value &path) {
+        auto pg = GetGrid(id, "pathgrid_find");
+        if (!pg) return Value();
+        auto s = GetPos(*pg, start, "pathgrid_find");
+        auto g = GetPos(*pg, goal, "pathgrid_find");
+        auto h = GetHeuristic(heuristic, "pathgrid_find");
+        if (g_vm->halted) return Value();
+        auto cost = pg->FindPath(pg->searches[0], s, g, h, weight.fval(), results);
+        ToBuffer(path);
+        path.DECRT();
+        return Value(cost);
+    }
+    ENDDECL6(pathgrid_find, "id,start,goal,heuristic,weight,path", "II]:2I]:2IFI]", "F",
+        "finds the cheapest path from start to goal using A*, and returns its cost, or -1 if there"
+        " is none. the contents of path are replaced by the x, y of each cell along it, start and"
+        " goal included. heuristic is 0 (none, for a plain Dijkstra search), 1 (manhattan), 2"
+        " (octile) or 3 (euclidean) distance, times weight. the path is only guaranteed to be the"
+        " cheapest if weight is no larger than the lowest cost in the grid, but larger weights"
+        " visit fewer cells.");
+
+    STARTDECL(pathgrid_find_all) (Value &id, Value &starts, Value &goals, Value &heuristic,
+                                  Value &weight, Value &paths) {
+        auto pg = GetGrid(id, "pathgrid_find_all");
+        if (!pg) return Value();
+        auto h = GetHeuristic(heuristic, "pathgrid_find_all");
+        if (h < 0) return Value();
+        auto sv = starts.vval();
+        auto gv = goals.vval();
+        if (sv->len != gv->len || sv->len % 2)
+            return g_vm->BuiltinError("pathgrid_find_all: starts and goals must be equal length"
+                                      " lists of x, y pairs");
+        vector<int2> ss, gs;
+        for (int i = 0; i < sv->len; i += 2) {
+            ss.push_back(int2(sv->At(i).ival(), sv->At(i + 1).ival()));
+            gs.push_back(int2(gv->At(i).ival(), gv->At(i + 1).ival()));
+            if (!pg->InRange(ss.back()) || !pg->InRange(gs.back()))
+                return g_vm->BuiltinError("pathgrid_find_all: position outside of grid");
+        }
+        starts.DECRT();
+        goals.DECRT();
+        pg->FindPaths(ss, gs, h, weight.fval(), results);
+        return ToBuffer(paths);
+    }
+    ENDDECL6(pathgrid_find_all, "id,starts,goals,heuristic,weight,paths", "II]I]IFI]", "I]",
+        "like pathgrid_find, but for many paths at once, using all cores. starts and goals are"
+        " lists of x, y pairs. the contents of paths are replaced by, for each path, the number"
+        " of cells in it (0 if there is none) followed by their x, y. returns paths.");
+}
+
+}
@@ -216,7 +216,9 @@ void AddPhysics() {
 
 	STARTDECL(ph_settexture) (Value &fixture_id, Value &tex_id, Value &tex_unit) {
 		auto r = GetRenderable(fixture_id.ival());
-		if (r) r->textures[GetSampler(tex_unit)] = tex_id.ival();
+		auto unit = GetSampler(tex_unit);
+		if (unit < 0) return Value();
+		if (r) r->textures[unit] = tex_id.ival();
 		return Value();
 	}
 	ENDDECL3(ph_settexture, "id,texid,texunit", "III?", "",
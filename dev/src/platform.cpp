@@ -26,6 +26,8 @@
     #include <intrin.h>
 #else
     #include <sys/time.h>
+    #include <sys/stat.h>
+    #include <pthread.h>
     #define FILESEP '/'
 #endif
 
@@ -134,6 +136,15 @@ FILE *OpenForWriting(const char *relfilename, bool binary) {
     return fopen((writedir + SanitizePath(relfilename)).c_str(), binary ? "wb" : "w");
 }
 
+bool MakeDir(const char *relfilename) {
+    auto dir = writedir + SanitizePath(relfilename);
+    #ifdef _WIN32
+        return CreateDirectory(dir.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+    #else
+        return !mkdir(dir.c_str(), 0755) || errno == EEXIST;
+    #endif
+}
+
 OutputType min_output_level = OUTPUT_WARN;
 
 void Output(OutputType ot, const char *msg, ...) {
@@ -220,3 +231,26 @@ void ConditionalBreakpoint(bool shouldbreak) {
     }
 }
 
+size_t StackSpaceLeft() {
+    char here = 0;
+    #ifdef _WIN32
+        // The stack is a single allocation that grows down towards its base.
+        MEMORY_BASIC_INFORMATION mbi;
+        if (!VirtualQuery(&here, &mbi, sizeof(mbi))) return 0;
+        return &here - (char *)mbi.AllocationBase;
+    #elif defined(__APPLE__)
+        auto top = (char *)pthread_get_stackaddr_np(pthread_self());
+        return &here - (top - pthread_get_stacksize_np(pthread_self()));
+    #elif defined(__linux__)
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr)) return 0;
+        void *bottom = nullptr;
+        size_t size = 0;
+        pthread_attr_getstack(&attr, &bottom, &size);
+        pthread_attr_destroy(&attr);
+        return &here - (char *)bottom;
+    #else
+        return 0;
+    #endif
+}
+
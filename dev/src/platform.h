@@ -22,6 +22,7 @@ extern bool SetupDefaultDirs(const char *exefilepath, const char *auxfilepath, b
 
 extern uchar *LoadFile(const char *relfilename, size_t *len = nullptr);
 extern FILE *OpenForWriting(const char *relfilename, bool binary);
+extern bool MakeDir(const char *relfilename);  // Also succeeds if it already exists.
 extern string SanitizePath(const char *path);
 
 // Logging:
@@ -52,6 +53,7 @@ extern double SecondsSinceStart();
 
 // Misc:
 extern void ConditionalBreakpoint(bool shouldbreak);
+extern size_t StackSpaceLeft();  // Of the calling thread, 0 if unknown.
 
 #if defined(__IOS__) || defined(__ANDROID__) || defined(__EMSCRIPTEN__)
     #define PLATFORM_ES2
@@ -0,0 +1,157 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+#include "vmdata.h"
+
+#include <chrono>
+
+namespace lobster {
+
+// Deeper stacks only have their innermost frames recorded, to keep sampling cheap.
+const size_t PROFILE_MAX_DEPTH = 256;
+const int PROFILE_TRUNCATED = -2;
+
+VMProfiler::VMProfiler(VM &_vm) : due(false), running(false), interval(0), samples(0), vm(_vm) {}
+
+VMProfiler::~VMProfiler() {
+    Stop();
+}
+
+void VMProfiler::Start(int _interval) {
+    Stop();
+    interval = max(_interval, 1);
+    stacks.clear();
+    samples = 0;
+    #ifndef VM_COMPILED_CODE_MODE
+        if (funstarts.empty()) {
+            auto code = vm.codestart;
+            for (uint i = 0; i < vm.bcf->functions()->size(); i++) {
+                auto start = vm.bcf->functions()->Get(i)->bytecodestart();
+                if (start <= 0) continue;  // Never called, so no code generated.
+                funstarts.push_back(make_pair(start, (int)i));
+                if (code[start] == IL_FUNMULTI) {
+                    // The code of the specializations comes before their dispatch table.
+                    auto numentries = code[start + 1];
+                    auto nargs = code[start + 2];
+                    for (int j = 0; j < numentries; j++) {
+                        auto substart = code[start + 3 + j * (nargs + 1) + nargs];
+                        funstarts.push_back(make_pair(substart, (int)i));
+                    }
+                }
+            }
+            sort(funstarts.begin(), funstarts.end());
+        }
+    #endif
+    running = true;
+    timer = thread([this]() {
+        while (running) {
+            this_thread::sleep_for(chrono::microseconds(interval));
+            due = true;
+            // Wait for the sample to be taken before timing the next one, so that when the VM
+            // reaches a check late, or sampling itself is slow, samples don't back up.
+            while (running && due) this_thread::sleep_for(chrono::microseconds(interval / 8 + 1));
+        }
+    });
+}
+
+void VMProfiler::Stop() {
+    if (!running) return;
+    running = false;
+    timer.join();
+    due = false;
+}
+
+void VMProfiler::Sample() {
+    due = false;
+    chain.clear();
+    // Innermost first: the frames of whoever resumed the current coroutine are in it.
+    auto add = [&](const vector<StackFrame> &frames) {
+        for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+            if (chain.size() == PROFILE_MAX_DEPTH) return false;
+            #ifdef VM_COMPILED_CODE_MODE
+                // There's no bytecode to find funstart in, blocks show up as "?" instead.
+                chain.push_back(it->definedfunction);
+            #else
+                chain.push_back(FunctionAt(it->funstart));
+            #endif
+        }
+        return true;
+    };
+    auto complete = add(vm.stackframes);
+    for (auto co = vm.curcoroutine; co && complete; co = co->parent) complete = add(co->stackframes);
+    if (!complete) chain.push_back(PROFILE_TRUNCATED);
+    reverse(chain.begin(), chain.end());
+    stacks[chain]++;
+    samples++;
+}
+
+int VMProfiler::FunctionAt(const int *funstart) {
+    // FUNSTART is right before where funstart points, and belongs to the last function that
+    // starts at or before it.
+    auto pos = (int)(funstart - vm.codestart) - 1;
+    auto it = upper_bound(funstarts.begin(), funstarts.end(), make_pair(pos, INT_MAX));
+    return it == funstarts.begin() ? -1 : (it - 1)->second;
+}
+
+string VMProfiler::FunctionName(int fidx) {
+    if (fidx == PROFILE_TRUNCATED) return "...";
+    return fidx < 0 ? "?" : vm.bcf->functions()->Get(fidx)->name()->c_str();
+}
+
+// One line per unique call stack, in the format flamegraph.pl and compatible tools take.
+string VMProfiler::Folded() {
+    string s;
+    for (auto &st : stacks) {
+        for (auto fidx : st.first) {
+            s += FunctionName(fidx);
+            s += ";";
+        }
+        if (st.first.empty()) s += "(root);";
+        s.back() = ' ';
+        s += to_string(st.second);
+        s += "\n";
+    }
+    return s;
+}
+
+// The functions sorted by the time spent in them (self) or in them and what they call (total).
+string VMProfiler::Report() {
+    map<int, pair<int64_t, int64_t>> funs;
+    for (auto &st : stacks) {
+        if (st.first.empty()) continue;
+        funs[st.first.back()].first += st.second;
+        set<int> seen;  // Count recursive calls only once.
+        for (auto fidx : st.first)
+            if (fidx != PROFILE_TRUNCATED && seen.insert(fidx).second)
+                funs[fidx].second += st.second;
+    }
+    vector<pair<int, pair<int64_t, int64_t>>> sorted(funs.begin(), funs.end());
+    sort(sorted.begin(), sorted.end(), [](const pair<int, pair<int64_t, int64_t>> &a,
+                                          const pair<int, pair<int64_t, int64_t>> &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    string s = "profile: " + to_string(samples) + " samples, every " + to_string(interval) +
+               " microseconds\n   self  total  function\n";
+    auto total = max(samples, (int64_t)1) / 100.0;
+    for (auto &f : sorted) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%6.1f %6.1f  ", f.second.first / total,
+                 f.second.second / total);
+        s += buf + FunctionName(f.first) + "\n";
+    }
+    return s;
+}
+
+}  // namespace lobster
@@ -53,7 +53,7 @@ extern bool GraphicsFrameStart();
 extern void GraphicsShutDown();
 extern void EngineExit(int code);
 extern bool EngineRunByteCode(const char *fn, vector<uchar> &&bytecode, const void *entry_point, 
-                              const void *static_bytecode);
+                              const void *static_bytecode, string &error);
 extern int EngineRunCompiledCodeMain(int argc, char *argv[], const void *entry_point, const void *bytecodefb);
 
 #ifdef __EMSCRIPTEN__
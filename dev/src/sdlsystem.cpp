@@ -657,13 +657,21 @@ void EngineExit(int code) {
 }
 
 void one_frame_callback() {
-    try {
+    #ifdef USE_EXCEPTION_HANDLING
+    try
+    #endif
+    {
         GraphicsFrameStart();
         assert(lobster::g_vm);
         lobster::g_vm->OneMoreFrame();
-        // If this returns, we didn't hit a gl_frame() again and exited normally.
+        // If this returns, we didn't hit a gl_frame() again and exited normally, or had an error.
+        if (!lobster::g_vm->errmsg.empty()) {
+            Output(OUTPUT_ERROR, lobster::g_vm->errmsg.c_str());
+            EngineExit(1);
+        }
         EngineExit(0);
     }
+    #ifdef USE_EXCEPTION_HANDLING
     catch (string &s) {
         if (s != "SUSPEND-VM-MAINLOOP") {
             // An actual error.
@@ -671,12 +679,20 @@ void one_frame_callback() {
             EngineExit(1);
         }
     }
+    #endif
 }
 
-bool EngineRunByteCode(const char *fn, vector<uchar> &&bytecode, const void *entry_point, const void *static_bytecode) {
-    try {
-        lobster::RunBytecode(fn ? StripDirPart(fn).c_str() : "", std::move(bytecode), entry_point, static_bytecode);
+// Runtime errors are returned in error, compile errors (and SUSPEND-VM-MAINLOOP) are thrown.
+bool EngineRunByteCode(const char *fn, vector<uchar> &&bytecode, const void *entry_point, const void *static_bytecode,
+                       string &error) {
+    #ifdef USE_EXCEPTION_HANDLING
+    try
+    #endif
+    {
+        error = lobster::RunBytecode(fn ? StripDirPart(fn).c_str() : "", std::move(bytecode), entry_point,
+                                     static_bytecode);
     }
+    #ifdef USE_EXCEPTION_HANDLING
     catch (string &s) {
         #ifdef USE_MAIN_LOOP_CALLBACK
         if (s == "SUSPEND-VM-MAINLOOP") {
@@ -700,6 +716,7 @@ bool EngineRunByteCode(const char *fn, vector<uchar> &&bytecode, const void *ent
             throw s;
         }
     }
+    #endif
 
     delete lobster::g_vm;
     return false;
@@ -711,18 +728,28 @@ int EngineRunCompiledCodeMain(int argc, char *argv[], const void *entry_point, c
     min_output_level = OUTPUT_INFO;
     InitTime();
 
-    try {
+    #ifdef USE_EXCEPTION_HANDLING
+    try
+    #endif
+    {
         SetupDefaultDirs("", "../../lobster/", false);  // FIXME
         RegisterCoreEngineBuiltins();
 
         vector<uchar> empty;
-        if (EngineRunByteCode(argv[0], std::move(empty), entry_point, bytecodefb))
+        string error;
+        if (EngineRunByteCode(argv[0], std::move(empty), entry_point, bytecodefb, error))
             return 0;  // Emscripten.
+        if (!error.empty()) {
+            Output(OUTPUT_ERROR, error.c_str());
+            EngineExit(1);
+        }
     }
+    #ifdef USE_EXCEPTION_HANDLING
     catch (string &s) {
         Output(OUTPUT_ERROR, s.c_str());
         EngineExit(1);
     }
+    #endif
 
     EngineExit(0);
     return 0;
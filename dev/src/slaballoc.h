@@ -233,6 +233,21 @@ class SlabAlloc {
     }
 
     void *resize(void *p, size_t oldsize, size_t size) {
+        #ifndef PASSTHRUALLOC
+        // Small blocks that stay within the same bucket can be resized in place.
+        if (oldsize <= MAXREUSESIZE && size <= MAXREUSESIZE &&
+            bucket((int)oldsize) == bucket((int)size)) return p;
+        if (oldsize > MAXREUSESIZE && size > MAXREUSESIZE)
+        #endif
+        {
+            DLNodeRaw *buf = (DLNodeRaw *)p;
+            --buf;
+            buf->Remove();
+            buf = (DLNodeRaw *)realloc(buf, size + sizeof(DLNodeRaw));
+            assert(buf);
+            largeallocs.InsertAfterThis(buf);
+            return ++buf;
+        }
         void *np = alloc(size);
         memcpy(np, p, size>oldsize ? oldsize : size);
         dealloc(p, oldsize);
@@ -0,0 +1,398 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Persistent spatial indices: a hashed uniform grid of circles (2D) or spheres (3D), which are
+// kept up to date incrementally, so moving objects that stay in their cell costs almost nothing.
+// Queries write handles into a vector passed in by the caller, so they can reuse it every frame.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+namespace lobster {
+
+struct SpatialIndex {
+    struct Entry {
+        float3 pos;
+        float rad;
+        int64_t cell;
+        int slot;  // Position in its cell, or -1 if this handle is free.
+    };
+
+    int dims;
+    float cellsize;
+    float maxrad;  // Of all live objects, to know how far around a query to look.
+    map<float, int> radii;  // Number of live objects per radius, so maxrad can shrink.
+    int live;
+    vector<Entry> entries;
+    vector<int> freelist;
+    typedef unordered_map<int64_t, vector<int>> CellMap;
+    CellMap cells;
+    vector<const CellMap::value_type *> celllist;
+    vector<vector<int>> threadresults;
+
+    SpatialIndex(int _dims, float _cellsize)
+        : dims(_dims), cellsize(_cellsize), maxrad(0), live(0) {
+        // Handle 0 is never used, so it can denote "none".
+        entries.push_back(Entry { float3_0, 0, 0, -1 });
+    }
+
+    bool Valid(int h) const { return h > 0 && h < (int)entries.size() && entries[h].slot >= 0; }
+
+    float3 Pos(const float3 &p) const { return dims == 2 ? float3(p.x(), p.y(), 0) : p; }
+
+    int CellOf(float x) const {
+        return (int)max(-1e9f, min(1e9f, floorf(x / cellsize)));  // Queries may be unbounded.
+    }
+    int3 CellOf(const float3 &p) const { return int3(CellOf(p.x()), CellOf(p.y()), CellOf(p.z())); }
+
+    // Coordinates wrap around every 2^21 cells, which only makes far away objects share a cell.
+    static int64_t Key(const int3 &c) {
+        return ((int64_t)(c.x() & 0x1FFFFF) << 42) | ((int64_t)(c.y() & 0x1FFFFF) << 21) |
+               (int64_t)(c.z() & 0x1FFFFF);
+    }
+
+    void Link(int h) {
+        auto &e = entries[h];
+        auto &c = cells[e.cell];
+        e.slot = (int)c.size();
+        c.push_back(h);
+    }
+
+    void Unlink(int h) {
+        auto &e = entries[h];
+        auto it = cells.find(e.cell);
+        auto &c = it->second;
+        entries[c.back()].slot = e.slot;
+        c[e.slot] = c.back();
+        c.pop_back();
+        if (c.empty()) cells.erase(it);
+    }
+
+    int Insert(const float3 &pos, float rad) {
+        int h;
+        if (freelist.empty()) {
+            h = (int)entries.size();
+            entries.push_back(Entry());
+        } else {
+            h = freelist.back();
+            freelist.pop_back();
+        }
+        auto &e = entries[h];
+        e.pos = Pos(pos);
+        e.rad = rad;
+        e.cell = Key(CellOf(e.pos));
+        radii[rad]++;
+        maxrad = radii.rbegin()->first;
+        Link(h);
+        live++;
+        return h;
+    }
+
+    void Move(int h, const float3 &pos) {
+        auto &e = entries[h];
+        e.pos = Pos(pos);
+        auto cell = Key(CellOf(e.pos));
+        if (cell == e.cell) return;
+        Unlink(h);
+        e.cell = cell;
+        Link(h);
+    }
+
+    void Remove(int h) {
+        Unlink(h);
+        auto it = radii.find(entries[h].rad);
+        if (!--it->second) radii.erase(it);
+        maxrad = radii.empty() ? 0 : radii.rbegin()->first;
+        entries[h].slot = -1;
+        freelist.push_back(h);
+        live--;
+    }
+
+    // Calls f on all objects in cells overlapping [lo..hi]. When that range spans more cells than
+    // are occupied, it is cheaper to just visit all of them.
+    template<typename F> void ForRange(const float3 &lo, const float3 &hi, F f) const {
+        auto clo = CellOf(Pos(lo));
+        auto chi = CellOf(Pos(hi));
+        auto ext = chi - clo + 1;
+        if ((double)ext.x() * ext.y() * ext.z() > (double)cells.size()) {
+            for (auto &c : cells) for (auto h : c.second) f(h);
+            return;
+        }
+        for (int z = clo.z(); z <= chi.z(); z++)
+            for (int y = clo.y(); y <= chi.y(); y++)
+                for (int x = clo.x(); x <= chi.x(); x++)
+                    ForCell(int3(x, y, z), f);
+    }
+
+    template<typename F> void ForCell(const int3 &c, F f) const {
+        auto it = cells.find(Key(c));
+        if (it != cells.end()) for (auto h : it->second) f(h);
+    }
+
+    // Objects that are within dist of pos, taking into account their radius.
+    void Within(const float3 &pos, float dist, vector<int> &out) const {
+        auto p = Pos(pos);
+        auto scan = float3(dist + maxrad);
+        ForRange(p - scan, p + scan, [&](int h) {
+            auto &e = entries[h];
+            if (length(e.pos - p) - e.rad < dist) out.push_back(h);
+        });
+    }
+
+    // Objects whose circle/sphere overlaps the box [lo..hi].
+    void InBox(const float3 &lo, const float3 &hi, vector<int> &out) const {
+        auto blo = Pos(lo);
+        auto bhi = Pos(hi);
+        auto scan = float3(maxrad);
+        ForRange(blo - scan, bhi + scan, [&](int h) {
+            auto &e = entries[h];
+            auto closest = min(max(e.pos, blo), bhi);
+            if (squaredlength(e.pos - closest) <= e.rad * e.rad) out.push_back(h);
+        });
+    }
+
+    // The k objects whose centers are closest to pos, nearest first. Searches rings of cells of
+    // increasing size around pos, until the next ring can't contain anything closer.
+    void Nearest(const float3 &pos, int k, vector<int> &out) const {
+        if (k <= 0 || !live) return;
+        auto p = Pos(pos);
+        vector<pair<float, int>> best;  // Max-heap of the k closest so far.
+        int seen = 0;
+        auto consider = [&](int h) {
+            seen++;
+            auto d = squaredlength(entries[h].pos - p);
+            if ((int)best.size() < k) {
+                best.push_back(make_pair(d, h));
+                push_heap(best.begin(), best.end());
+            } else if (d < best.front().first) {
+                pop_heap(best.begin(), best.end());
+                best.back() = make_pair(d, h);
+                push_heap(best.begin(), best.end());
+            }
+        };
+        auto c = CellOf(p);
+        for (int r = 0; ; r++) {
+            auto side = 2.0 * r + 1;
+            if ((dims == 2 ? side * side : side * side * side) > (double)cells.size()) {
+                // Rings got bigger than the set of occupied cells, so look at everything instead.
+                best.clear();
+                for (auto &cell : cells) for (auto h : cell.second) consider(h);
+                break;
+            }
+            auto zr = dims == 2 ? 0 : r;
+            for (int z = -zr; z <= zr; z++) {
+                for (int y = -r; y <= r; y++) {
+                    // Only the cells on the surface of this ring, the inside was done already.
+                    auto full = abs(z) == r || abs(y) == r;
+                    for (int x = -r; x <= r; x += full || x == r ? 1 : 2 * r)
+                        ForCell(c + int3(x, y, z), consider);
+                }
+            }
+            if (seen == live) break;
+            if ((int)best.size() == k && sqrtf(best.front().first) <= r * cellsize) break;
+        }
+        sort_heap(best.begin(), best.end());
+        for (auto &b : best) out.push_back(b.second);
+    }
+
+    // All pairs of objects within dist of eachother, taking into account their radiuses, as a
+    // flat list of handles with the lowest of each pair first. Works a cell at a time, pairing
+    // it with the neighbouring cells that have a higher key (and itself), so each pair is only
+    // looked at once. Split over all cores, since this is typically done for all objects in a
+    // simulation every frame.
+    void Pairs(float dist, vector<int> &out) {
+        celllist.clear();
+        for (auto &c : cells) celllist.push_back(&c);
+        auto n = (int)celllist.size();
+        auto reach = ceil((2 * maxrad + dist) / cellsize);
+        auto side = 2.0 * reach + 1;
+        auto allcells = (dims == 2 ? side * side : side * side * side) > (double)n;
+        auto r = allcells ? 0 : (int)reach;
+        auto zr = dims == 2 ? 0 : r;
+        auto nthreads = min(max(1, (int)thread::hardware_concurrency()), max(1, live / 1024));
+        threadresults.resize(nthreads);
+        auto worker = [&](int t) {
+            auto &res = threadresults[t];
+            res.clear();
+            auto test = [&](const CellMap::value_type &ca, const CellMap::value_type &cb) {
+                auto same = &ca == &cb;
+                for (auto a : ca.second) {
+                    auto &ea = entries[a];
+                    for (auto b : cb.second) {
+                        if (same && b <= a) continue;
+                        auto &eb = entries[b];
+                        if (length(eb.pos - ea.pos) - ea.rad - eb.rad < dist) {
+                            res.push_back(min(a, b));
+                            res.push_back(max(a, b));
+                        }
+                    }
+                }
+            };
+            for (int i = n * t / nthreads; i < n * (t + 1) / nthreads; i++) {
+                auto &ca = *celllist[i];
+                if (allcells) {
+                    for (auto cb : celllist) if (cb->first >= ca.first) test(ca, *cb);
+                    continue;
+                }
+                auto c = CellOf(entries[ca.second[0]].pos);
+                for (int z = -zr; z <= zr; z++) {
+                    for (int y = -r; y <= r; y++) {
+                        for (int x = -r; x <= r; x++) {
+                            auto key = Key(c + int3(x, y, z));
+                            if (key < ca.first) continue;
+                            auto it = cells.find(key);
+                            if (it != cells.end()) test(ca, *it);
+                        }
+                    }
+                }
+            }
+        };
+        if (nthreads == 1) {
+            worker(0);
+        } else {
+            // On the VM's persistent worker threads, which take the next part when done with one.
+            atomic<int> next(0);
+            g_vm->workers.Run([&]() {
+                for (int t; (t = next++) < nthreads; ) worker(t);
+            });
+        }
+        for (auto &res : threadresults) out.insert(out.end(), res.begin(), res.end());
+    }
+};
+
+// Per thread, like the VM, since each VM running in parallel_map() etc. has its own globals.
+static thread_local IntResourceManagerCompact<SpatialIndex> indices([](SpatialIndex *si) {
+    delete si;
+});
+static thread_local vector<int> results;
+
+// These return nullptr / -1 after reporting an error, after which the builtin must return.
+static SpatialIndex *GetIndex(Value &id, const char *name) {
+    auto si = indices.Get(id.ival());
+    if (!si) g_vm->BuiltinError(string(name) + ": invalid spatial index");
+    return si;
+}
+
+static int GetHandle(SpatialIndex &si, Value &h, const char *name) {
+    if (si.Valid(h.ival())) return h.ival();
+    g_vm->BuiltinError(string(name) + ": invalid handle");
+    return -1;
+}
+
+// Overwrites the contents of buf with the results, and returns it.
+static Value ToBuffer(Value &buf) {
+    auto v = buf.vval();
+    v->len = 0;  // Only ints, so nothing to DEC.
+    if (v->maxl < (int)results.size()) v->Resize((int)results.size());
+    for (auto h : results) v->Push(Value(h));
+    results.clear();
+    return buf;
+}
+
+void AddSpatial() {
+    STARTDECL(spatial_new) (Value &dims, Value &cellsize) {
+        if (dims.ival() != 2 && dims.ival() != 3)
+            return g_vm->BuiltinError("spatial_new: dims must be 2 or 3");
+        if (cellsize.fval() <= 0)
+            return g_vm->BuiltinError("spatial_new: cellsize must be positive");
+        return Value((int)indices.Add(new SpatialIndex(dims.ival(), cellsize.fval())));
+    }
+    ENDDECL2(spatial_new, "dims,cellsize", "IF", "I",
+        "creates a spatial index for circles (dims 2) or spheres (dims 3), returning its id."
+        " queries are fastest when cellsize is about the distance typically queried.");
+
+    STARTDECL(spatial_delete) (Value &id) {
+        if (!GetIndex(id, "spatial_delete")) return Value();
+        indices.Delete(id.ival());
+        return Value();
+    }
+    ENDDECL1(spatial_delete, "id", "I", "",
+        "frees a spatial index and all objects in it.");
+
+    STARTDECL(spatial_insert) (Value &id, Value &pos, Value &radius) {
+        auto si = GetIndex(id, "spatial_insert");
+        if (!si) return Value();
+        return Value(si->Insert(ValueDecToF<3>(pos), radius.fval()));
+    }
+    ENDDECL3(spatial_insert, "id,position,radius", "IF]F?", "I",
+        "adds an object at position (2 or 3 components) with an optional radius, returning a"
+        " handle to it (never 0). handles of removed objects get reused.");
+
+    STARTDECL(spatial_move) (Value &id, Value &handle, Value &pos) {
+        auto si = GetIndex(id, "spatial_move");
+        if (!si) return Value();
+        auto h = GetHandle(*si, handle, "spatial_move");
+        if (h < 0) return Value();
+        si->Move(h, ValueDecToF<3>(pos));
+        return Value();
+    }
+    ENDDECL3(spatial_move, "id,handle,position", "IIF]", "",
+        "moves an object to a new position.");
+
+    STARTDECL(spatial_remove) (Value &id, Value &handle) {
+        auto si = GetIndex(id, "spatial_remove");
+        if (!si) return Value();
+        auto h = GetHandle(*si, handle, "spatial_remove");
+        if (h < 0) return Value();
+        si->Remove(h);
+        return Value();
+    }
+    ENDDECL2(spatial_remove, "id,handle", "II", "",
+        "removes an object from the index.");
+
+    STARTDECL(spatial_within) (Value &id, Value &pos, Value &dist, Value &buf) {
+        auto si = GetIndex(id, "spatial_within");
+        if (!si) return Value();
+        si->Within(ValueDecToF<3>(pos), dist.fval(), results);
+        return ToBuffer(buf);
+    }
+    ENDDECL4(spatial_within, "id,position,dist,buf", "IF]FI]", "I]",
+        "finds the objects within dist of position (measured from the edge of their radius),"
+        " in no particular order. they replace the contents of buf, which is returned.");
+
+    STARTDECL(spatial_nearest) (Value &id, Value &pos, Value &k, Value &buf) {
+        auto si = GetIndex(id, "spatial_nearest");
+        if (!si) return Value();
+        si->Nearest(ValueDecToF<3>(pos), k.ival(), results);
+        return ToBuffer(buf);
+    }
+    ENDDECL4(spatial_nearest, "id,position,k,buf", "IF]II]", "I]",
+        "finds the k objects whose centers are nearest to position, nearest first. they replace"
+        " the contents of buf, which is returned.");
+
+    STARTDECL(spatial_box) (Value &id, Value &lo, Value &hi, Value &buf) {
+        auto si = GetIndex(id, "spatial_box");
+        if (!si) return Value();
+        si->InBox(ValueDecToF<3>(lo), ValueDecToF<3>(hi), results);
+        return ToBuffer(buf);
+    }
+    ENDDECL4(spatial_box, "id,lo,hi,buf", "IF]F]I]", "I]",
+        "finds the objects that overlap the box from lo to hi, in no particular order. they"
+        " replace the contents of buf, which is returned.");
+
+    STARTDECL(spatial_pairs) (Value &id, Value &dist, Value &buf) {
+        auto si = GetIndex(id, "spatial_pairs");
+        if (!si) return Value();
+        si->Pairs(dist.fval(), results);
+        return ToBuffer(buf);
+    }
+    ENDDECL3(spatial_pairs, "id,dist,buf", "IFI]", "I]",
+        "finds all pairs of objects within dist of eachother (measured between the edges of their"
+        " radiuses), using all cores. they replace the contents of buf as a flat list of handles"
+        " a, b (with a < b) for each pair, which is returned.");
+}
+
+}
@@ -44,6 +44,10 @@
 #include <algorithm>
 #include <iterator>
 #include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <sstream>
 #include <iostream>
@@ -72,6 +76,16 @@ static_assert(sizeof(intp) == sizeof(floatp) && sizeof(intp) == sizeof(void *),
 #endif
 #define nullptr nullptr
 
+// Errors (in the compiler, or at runtime) are strings thrown to whoever started the compile or
+// run, which catches them if USE_EXCEPTION_HANDLING. Without exception support (-fno-exceptions)
+// they are output instead, and terminate the process.
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+    #define USE_EXCEPTION_HANDLING
+    #define THROW_OR_ABORT(X) throw (X)
+#else
+    #define THROW_OR_ABORT(X) (fprintf(stderr, "%s\n", string(X).c_str()), abort())
+#endif
+
 // Our universally used headers.
 #include "platform.h"
 #include "tools.h"
@@ -14,50 +14,515 @@
 
 namespace lobster {
 
-int ParseOpAndGetArity(int opc, const int *&ip, const int *code) {
-    auto arity = ILArity()[opc];
-    switch(opc) {
-        default: {
-            assert(arity >= 0);
-            ip += arity;
-            break;
+// An int, float or scalar variable value that hasn't been pushed onto the VM stack yet, as a C++
+// expression. Sequences of scalar ops are emitted as a single expression on these, such that
+// their intermediate results never go through the VM stack.
+struct CPPScalar {
+    string c;
+    char t;  // 'I' for an int expression, 'F' for float, 'V' for a Value (a variable).
+
+    string Int() const { return t == 'V' ? c + ".ival()" : c; }
+    string Float() const { return t == 'V' ? c + ".fval()" : c; }
+    string Bool() const { return t == 'V' ? c + ".True()" : c; }
+    string Val() const { return t == 'V' ? c : "lobster::Value(" + c + ")"; }
+    string As(char ct) const { return ct == 'I' ? Int() : Float(); }
+    // Cheap enough to evaluate more than once.
+    bool Leaf() const { return c.find(' ') == string::npos; }
+};
+
+static string CType(char t) { return t == 'I' ? "int" : "float"; }
+
+// The type of a var as in CPPScalar, if it is one that can live in a C++ local.
+static char ScalarVarType(const bytecode::BytecodeFile *bcf, int var) {
+    auto t = (ValueType)bcf->typetable()->Get(bcf->specidents()->Get(var)->typeidx());
+    return t == V_INT ? 'I' : t == V_FLOAT ? 'F' : 0;
+}
+
+// A function that is also emitted as a plain C++ function, see DirectFunToCPP().
+struct CPPDirectFun {
+    int fidx;
+    vector<char> argtypes;
+    char ret;
+
+    string Name(int start) const { return "fun" + to_string(start); }
+};
+
+// Where ScalarOpToCPP() is emitting code.
+struct CPPScope {
+    int *ntemps;                            // If set, C++ locals can be declared for values.
+    string *decls;                          // If set, those are declared here instead of in place.
+    bool vmstack;                           // Values not in sstack are on the VM stack.
+    const map<int, char> *locals;           // If set, the vars that are C++ locals ("v" + idx).
+    const map<int, CPPDirectFun> *direct;   // Functions that CALL can call directly.
+    const char *errret;                     // What to return after a runtime error.
+};
+
+// Emits C++ for the scalar ops in a block (everything that can't have side effects other than
+// runtime errors), building up expressions in sstack. Returns false for any other op, which
+// then needs the VM stack to be up to date, see FlushScalars().
+// Only variable reads are deferred, never writes, so no var can change while its read is pending.
+// Calls to the functions in sc.direct can't change any var the caller can see (see
+// DirectFunToCPP()), but are not deferred either, so their errors happen in the right place.
+static bool ScalarOpToCPP(string &s, vector<CPPScalar> &sstack, const CPPScope &sc, int opc,
+                          const int *args, const function<void(int)> &jumpins,
+                          const function<void()> &flush) {
+    auto Push = [&](const string &c, char t) { sstack.push_back({ c, t }); };
+    auto Temp = [&](char t, const string &c) {
+        auto name = "t" + to_string((*sc.ntemps)++);
+        if (sc.decls) *sc.decls += "    " + CType(t) + " " + name + ";\n";
+        s += sc.decls ? "    " + name + " = " + c + ";" : "    auto " + name + " = " + c + ";";
+        return name;
+    };
+    auto Need = [&](size_t n) {
+        if (sstack.size() >= n) return true;
+        if (!sc.ntemps || !sc.vmstack) return false;
+        // The VM stack is below anything pending, which doesn't depend on it.
+        while (sstack.size() < n) {
+            auto t = Temp('V', "g_vm->stack[g_vm->sp--]");
+            s += "\n";
+            sstack.insert(sstack.begin(), { t, 'V' });
         }
-        case IL_CORO: {
-            ip += 2;
-            int n = *ip++;
-            ip += n;
-            arity = n + 3;
-            break;
+        return true;
+    };
+    auto Pop = [&]() { auto e = sstack.back(); sstack.pop_back(); return e; };
+    auto Var = [&](int v) { return "g_vm->vars[" + to_string(v) + "]"; };
+    auto Local = [&](int v) {
+        auto it = sc.locals->find(v);
+        return it == sc.locals->end() ? 0 : it->second;
+    };
+    // Emits var = var OP rhs, or var = rhs if op is empty, where var has type t.
+    auto Update = [&](int v, char t, const char *op, const string &rhs) {
+        if (sc.locals) {
+            if (Local(v) != t) return false;
+            s += "    v" + to_string(v) + " " + op + "= " + rhs + ";\n";
+        } else if (!*op) {
+            s += "    " + Var(v) + " = lobster::Value(" + rhs + ");\n";
+        } else {
+            string ts = t == 'I' ? "i" : "f";
+            s += "    " + Var(v) + ".set" + ts + "val(" + Var(v) + "." + ts + "val() " + op + " " +
+                 rhs + ");\n";
         }
-        case IL_CALLMULTI: {
-            ip++;
-            auto nargs = code[*ip++ + 2];
-            ip++;
-            ip += nargs;
-            arity = nargs + 4;
-            break;
+        return true;
+    };
+    #define BINOP(C, T, OP) { \
+        if (!Need(2)) return false; \
+        auto b = Pop(); auto a = Pop(); \
+        Push("(" + a.C() + " " OP " " + b.C() + ")", T); \
+        return true; }
+    // As the VM, these check for division by zero before applying op, which halts the VM, so the
+    // generated code returns right away (see VM::Error). b is a leaf, so evaluating it early is ok.
+    #define DIVOP(C, T, OP) { \
+        if (!Need(2) || !sstack.back().Leaf()) return false; \
+        auto b = Pop(); auto a = Pop(); \
+        s += "    if (" + b.C() + " == 0) { g_vm->Div0(); return " + sc.errret + "; }\n"; \
+        Push("(" + a.C() + " " OP " " + b.C() + ")", T); \
+        return true; }
+    #define UNOP(C, T, OP) { \
+        if (!Need(1)) return false; \
+        auto a = Pop(); \
+        Push(OP "(" + a.C() + ")", T); \
+        return true; }
+    switch (opc) {
+        case IL_PUSHINT:
+            // INT_MIN can't be written as a literal of type int.
+            Push(args[0] == INT_MIN ? "(-2147483647 - 1)" : to_string(args[0]), 'I');
+            return true;
+        case IL_PUSHFLT: Push("flt(" + to_string(args[0]) + ")", 'F'); return true;
+        case IL_PUSHVAR:
+            if (!sc.locals) {
+                Push(Var(args[0]), 'V');
+            } else {
+                if (!Local(args[0])) return false;
+                Push("v" + to_string(args[0]), Local(args[0]));
+            }
+            return true;
+        case IL_POP:
+            if (sstack.empty()) return false;
+            sstack.pop_back();
+            return true;
+        case IL_DUP:
+            if (sstack.empty() || !sstack.back().Leaf()) return false;
+            sstack.push_back(sstack.back());
+            return true;
+        case IL_IADD: BINOP(Int, 'I', "+")
+        case IL_ISUB: BINOP(Int, 'I', "-")
+        case IL_IMUL: BINOP(Int, 'I', "*")
+        case IL_IDIV: DIVOP(Int, 'I', "/")
+        case IL_IMOD: DIVOP(Int, 'I', "%")
+        case IL_ILT:  BINOP(Int, 'I', "<")
+        case IL_IGT:  BINOP(Int, 'I', ">")
+        case IL_ILE:  BINOP(Int, 'I', "<=")
+        case IL_IGE:  BINOP(Int, 'I', ">=")
+        case IL_IEQ:  BINOP(Int, 'I', "==")
+        case IL_INE:  BINOP(Int, 'I', "!=")
+        case IL_FADD: BINOP(Float, 'F', "+")
+        case IL_FSUB: BINOP(Float, 'F', "-")
+        case IL_FMUL: BINOP(Float, 'F', "*")
+        case IL_FDIV: DIVOP(Float, 'F', "/")
+        case IL_FLT:  BINOP(Float, 'I', "<")
+        case IL_FGT:  BINOP(Float, 'I', ">")
+        case IL_FLE:  BINOP(Float, 'I', "<=")
+        case IL_FGE:  BINOP(Float, 'I', ">=")
+        case IL_FEQ:  BINOP(Float, 'I', "==")
+        case IL_FNE:  BINOP(Float, 'I', "!=")
+        case IL_BINAND: BINOP(Int, 'I', "&")
+        case IL_BINOR:  BINOP(Int, 'I', "|")
+        case IL_XOR:    BINOP(Int, 'I', "^")
+        case IL_ASL:    BINOP(Int, 'I', "<<")
+        case IL_ASR:    BINOP(Int, 'I', ">>")
+        case IL_IUMINUS: UNOP(Int, 'I', "-")
+        case IL_FUMINUS: UNOP(Float, 'F', "-")
+        case IL_NEG:     UNOP(Int, 'I', "~")
+        case IL_LOGNOT:  UNOP(Bool, 'I', "!")
+        case IL_E2B:     UNOP(Bool, 'I', "(bool)")
+        case IL_I2F:     UNOP(Int, 'F', "(float)")
+        case IL_CALL: {
+            if (!sc.direct || !sc.ntemps) return false;
+            auto it = sc.direct->find(args[1]);
+            if (it == sc.direct->end()) return false;
+            auto &df = it->second;
+            auto nargs = df.argtypes.size();
+            if (!Need(nargs)) return false;
+            auto call = df.Name(args[1]) + "(";
+            for (size_t i = 0; i < nargs; i++) {
+                if (i) call += ", ";
+                call += sstack[sstack.size() - nargs + i].As(df.argtypes[i]);
+            }
+            sstack.resize(sstack.size() - nargs);
+            auto t = Temp(df.ret, call + ")");
+            s += string(" if (g_vm->halted) return ") + sc.errret + ";\n";
+            Push(t, df.ret);
+            return true;
         }
-        case IL_FUNSTART: {
-            int n = *ip++;
-            ip += n;
-            int m = *ip++;
-            ip += m;
-            arity = n + m + 3;
-            break;
+        case IL_JUMPFAIL:
+        case IL_JUMPNOFAIL: {
+            if (!Need(1)) return false;
+            auto a = Pop();
+            flush();
+            s += "    if (";
+            if (opc == IL_JUMPFAIL) s += "!";
+            s += "(" + a.Bool() + ")) ";
+            jumpins(args[0]);
+            s += "\n";
+            return true;
         }
-        case IL_FUNMULTI: {
-            auto n = *ip++;
-            auto nargs = *ip++;
-            auto tablesize = (nargs + 1) * n;
-            ip += tablesize;
-            arity = tablesize + 2;
-            break;
+        case IL_JUMPFAILR:
+        case IL_JUMPNOFAILR: {
+            // As above, but the value stays on the stack if it jumps.
+            if (!Need(1)) return false;
+            auto a = Pop();
+            flush();
+            s += "    if (";
+            if (opc == IL_JUMPFAILR) s += "!";
+            s += "(" + a.Bool() + ")) {\n";
+            auto rest = sstack;
+            sstack.push_back(a);
+            flush();
+            s += "    ";
+            jumpins(args[0]);
+            s += "\n    }\n";
+            sstack = rest;
+            return true;
+        }
+        #define CJUMP(N, OP) case IL_JUMPFAILI##N: case IL_JUMPFAILVI##N: { \
+            string a, b; \
+            if (opc == IL_JUMPFAILVI##N) { \
+                if (sc.locals && Local(args[0]) != 'I') return false; \
+                flush(); \
+                a = sc.locals ? "v" + to_string(args[0]) : Var(args[0]) + ".ival()"; \
+                b = to_string(args[1]); \
+            } else { \
+                if (!Need(2)) return false; \
+                b = Pop().Int(); \
+                a = Pop().Int(); \
+                flush(); \
+            } \
+            s += "    if (" + a + " " OP " " + b + ") "; \
+            jumpins(args[opc == IL_JUMPFAILVI##N ? 2 : 0]); \
+            s += "\n"; \
+            return true; }
+        CJUMP(LT, ">=")
+        CJUMP(GT, "<=")
+        CJUMP(LE, ">")
+        CJUMP(GE, "<")
+        CJUMP(EQ, "!=")
+        CJUMP(NE, "==")
+        case IL_LVALVARI: {
+            auto c = to_string(args[2]);
+            switch (args[0]) {
+                case LVO_WRITE: flush(); return Update(args[1], 'I', "", c);
+                case LVO_IADD:  flush(); return Update(args[1], 'I', "+", c);
+                case LVO_ISUB:  flush(); return Update(args[1], 'I', "-", c);
+            }
+            return false;
+        }
+        case IL_LVALVAR: {
+            auto v = args[1];
+            switch (args[0]) {
+                #define LVALOP(N, T, C, OP) case LVO_##N: { \
+                    if (!Need(1)) return false; \
+                    auto a = Pop(); \
+                    flush(); \
+                    return Update(v, T, OP, a.C()); }
+                LVALOP(IADD, 'I', Int,   "+")
+                LVALOP(ISUB, 'I', Int,   "-")
+                LVALOP(IMUL, 'I', Int,   "*")
+                LVALOP(FADD, 'F', Float, "+")
+                LVALOP(FSUB, 'F', Float, "-")
+                LVALOP(FMUL, 'F', Float, "*")
+                #undef LVALOP
+                case LVO_WRITE: {
+                    if (!Need(1)) return false;
+                    auto a = Pop();
+                    flush();
+                    if (sc.locals) return Local(v) && Update(v, Local(v), "", a.As(Local(v)));
+                    s += "    " + Var(v) + " = " + a.Val() + ";\n";
+                    return true;
+                }
+                #define PPOP(N, T, OP) case LVO_##N: \
+                    flush(); \
+                    return Update(v, T, OP, "1");
+                PPOP(IPP,  'I', "+")
+                PPOP(IPPP, 'I', "+")
+                PPOP(IMM,  'I', "-")
+                PPOP(IMMP, 'I', "-")
+                PPOP(FPP,  'F', "+")
+                PPOP(FPPP, 'F', "+")
+                PPOP(FMM,  'F', "-")
+                PPOP(FMMP, 'F', "-")
+                #undef PPOP
+            }
+            return false;
+        }
+        #undef CJUMP
+    }
+    #undef BINOP
+    #undef DIVOP
+    #undef UNOP
+    return false;
+}
+
+// Ops that may halt the VM with a runtime error (see VM::Error), after which the generated code
+// must return rather than run the next op.
+static bool MayError(int opc) {
+    switch (opc) {
+        case IL_LVALVAR: case IL_LVALVARI:
+        case IL_PUSHIDXI: case IL_PUSHIDXV: case IL_LVALIDXI: case IL_LVALIDXV: case IL_LVALFLD:
+        case IL_PUSHLOC: case IL_LVALLOC:
+        case IL_FUNSTART: case IL_FUNMULTI: case IL_CALLMULTI: case IL_RETURN: case IL_CORO:
+        case IL_IDIV: case IL_IMOD: case IL_FDIV: case IL_FMOD:
+        case IL_IVVDIVU: case IL_FVVDIVU: case IL_IVSDIVU: case IL_FVSDIVU:
+            return true;
+        default:
+            return (opc >= IL_BCALL0 && opc <= IL_BCALL6) || (opc >= IL_IVVADD && opc <= IL_FVSGE);
+    }
+}
+
+// Emits the function at start as a C++ function that keeps its args and locals in typed C++
+// locals, which CALL ops can call directly, rather than through the VM's stack frames. This is
+// only done for functions that just do int/float math on their own vars, and only call functions
+// like them (or themselves in tail position, which becomes a loop). Nothing else can see their
+// vars then, so those don't need to be in the VM's vars array, or saved and restored on calls.
+// Values on the stack at jumps are kept in per-depth slot locals. Returns false for any other
+// function, and otherwise the type it returns in ret.
+static bool DirectFunToCPP(string &s, const bytecode::BytecodeFile *bcf, const int *code,
+                           const int *codeend, int start, const map<int, CPPDirectFun> &direct,
+                           char &ret) {
+    auto &df = direct.at(start);
+    auto ip = code + start + 1;
+    map<int, char> locals;
+    vector<int> argvars;
+    string decls;
+    auto nargs = *ip++;
+    for (int i = 0; i < nargs; i++) {
+        argvars.push_back(*ip);
+        locals[*ip++] = df.argtypes[i];
+    }
+    auto ndef = *ip++;
+    for (int i = 0; i < ndef; i++) {
+        auto v = *ip++;
+        auto t = ScalarVarType(bcf, v);
+        if (!t || locals.count(v)) return false;
+        locals[v] = t;
+        decls += "    " + CType(t) + " v" + to_string(v) + " = 0;\n";
+    }
+    auto body = ip;
+    set<int> labels;
+    const int *end = nullptr;
+    for (auto p = body; !end; ) {
+        if (p >= codeend) return false;
+        auto opc = *p++;
+        if (opc < 0 || opc >= IL_MAX_OPS || opc == IL_FUNSTART || opc == IL_FUNMULTI) return false;
+        auto args = p;
+        auto arity = ParseOpAndGetArity(opc, p, code);
+        if (opc >= IL_JUMP) labels.insert(args[arity - 1]);
+        if (opc == IL_FUNEND) end = p;
+    }
+    for (auto l : labels) if (l < body - code || l >= end - code) return false;
+    string b;
+    vector<CPPScalar> sstack;
+    map<int, vector<char>> labelstack;  // The types on the stack at each label.
+    set<string> slots;
+    int ntemps = 0;
+    bool ok = true, reachable = true, tailcall = false;
+    ret = 0;
+    auto Slot = [&](size_t i, char t) {
+        auto slot = "s" + to_string(i) + (t == 'I' ? "i" : "f");
+        slots.insert(slot);
+        return slot;
+    };
+    auto Flush = [&]() {
+        vector<pair<string, string>> assigns;
+        for (size_t i = 0; i < sstack.size(); i++) {
+            auto slot = Slot(i, sstack[i].t);
+            if (sstack[i].c != slot) assigns.push_back({ slot, sstack[i].c });
+            sstack[i].c = slot;
+        }
+        if (assigns.size() == 1) {
+            b += "    " + assigns[0].first + " = " + assigns[0].second + ";\n";
+        } else if (assigns.size() > 1) {
+            // A value may depend on a slot a value below it is assigned to.
+            b += "    {";
+            for (size_t i = 0; i < assigns.size(); i++)
+                b += " auto a" + to_string(i) + " = " + assigns[i].second + ";";
+            for (size_t i = 0; i < assigns.size(); i++)
+                b += " " + assigns[i].first + " = a" + to_string(i) + ";";
+            b += " }\n";
+        }
+    };
+    // Records the stack at a label the first time it is reached, after that it must match.
+    auto Reach = [&](int target) {
+        vector<char> types;
+        for (auto &e : sstack) types.push_back(e.t);
+        auto it = labelstack.find(target);
+        if (it == labelstack.end()) labelstack[target] = types;
+        else if (it->second != types) ok = false;
+    };
+    auto JumpIns = [&](int target) {
+        Reach(target);
+        b += "goto L" + to_string(target) + ";";
+    };
+    CPPScope sc = { &ntemps, &decls, false, &locals, &direct, "0" };
+    for (auto p = body; p < end; ) {
+        auto pos = (int)(p - code);
+        if (labels.count(pos)) {
+            if (reachable) {
+                Flush();
+                Reach(pos);
+            }
+            // If only reached by jumps back to it, the stack must be empty.
+            auto &types = labelstack[pos];
+            sstack.clear();
+            for (size_t i = 0; i < types.size(); i++) sstack.push_back({ Slot(i, types[i]), types[i] });
+            b += "  L" + to_string(pos) + ":\n";
+            reachable = true;
+        }
+        auto opc = *p++;
+        auto args = p;
+        ParseOpAndGetArity(opc, p, code);
+        if (!reachable) continue;
+        switch (opc) {
+            case IL_JUMP:
+                Flush();
+                b += "    ";
+                JumpIns(args[0]);
+                b += "\n";
+                reachable = false;
+                break;
+            case IL_RETURN:
+                if (args[0] != df.fidx || args[1] != 1) return false;
+                // Fall thru.
+            case IL_FUNEND: {
+                if (sstack.empty() || (ret && ret != sstack.back().t)) return false;
+                ret = sstack.back().t;
+                b += "    return " + sstack.back().c + ";\n";
+                reachable = false;
+                break;
+            }
+            case IL_TAILCALL: {
+                if (args[1] != start || (int)sstack.size() < nargs) return false;
+                // All args are evaluated before any of them is assigned.
+                b += "    {";
+                for (int i = 0; i < nargs; i++)
+                    b += " auto a" + to_string(i) + " = " +
+                         sstack[sstack.size() - nargs + i].As(df.argtypes[i]) + ";";
+                for (int i = 0; i < nargs; i++)
+                    b += " v" + to_string(argvars[i]) + " = a" + to_string(i) + ";";
+                b += " goto start; }\n";
+                tailcall = true;
+                reachable = false;
+                break;
+            }
+            default:
+                if (!ScalarOpToCPP(b, sstack, sc, opc, args, JumpIns, Flush)) return false;
+                break;
         }
+        if (!ok) return false;
     }
-    return arity;
+    s += "static " + CType(ret) + " " + df.Name(start) + "(";
+    for (int i = 0; i < nargs; i++) {
+        if (i) s += ", ";
+        s += CType(df.argtypes[i]) + " v" + to_string(argvars[i]);
+    }
+    // Counts as the saved vars a VM call would have, and its return value.
+    s += ") {\n    lobster::CPPFrame frame(" + to_string(df.fidx) + ", " +
+         to_string(nargs + ndef + 1) + ");\n    if (frame.Overflow()) return 0;\n";
+    for (auto &slot : slots) s += "    " + CType(slot.back() == 'i' ? 'I' : 'F') + " " + slot + " = 0;\n";
+    s += decls;
+    if (tailcall) s += "  start:\n";
+    s += b;
+    s += "}\n";
+    return true;
+}
+
+// The compiled code only needs the metadata from the bytecode file (types, strings, names..), so
+// this makes a copy of it without the bytecode itself.
+static void StripByteCode(const bytecode::BytecodeFile *bcf, vector<uchar> &buf) {
+    flatbuffers::FlatBufferBuilder fbb;
+    auto strings = [&](const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *v) {
+        vector<flatbuffers::Offset<flatbuffers::String>> offsets;
+        for (uint i = 0; i < v->size(); i++) offsets.push_back(fbb.CreateString(v->Get(i)));
+        return fbb.CreateVector(offsets);
+    };
+    auto ints = [&](const flatbuffers::Vector<int> *v) {
+        return fbb.CreateVector(v->data(), v->size());
+    };
+    vector<flatbuffers::Offset<bytecode::Function>> functions;
+    for (auto f : *bcf->functions())
+        functions.push_back(bytecode::CreateFunction(fbb, fbb.CreateString(f->name()),
+                                                     f->bytecodestart()));
+    vector<flatbuffers::Offset<bytecode::Struct>> structs;
+    for (auto st : *bcf->structs())
+        structs.push_back(bytecode::CreateStruct(fbb, fbb.CreateString(st->name()), st->idx(),
+                                                 st->nfields()));
+    vector<flatbuffers::Offset<bytecode::Ident>> idents;
+    for (auto id : *bcf->idents())
+        idents.push_back(bytecode::CreateIdent(fbb, fbb.CreateString(id->name()), id->readonly(),
+                                               id->global()));
+    vector<bytecode::LineInfo> lineinfo;
+    for (auto li : *bcf->lineinfo()) lineinfo.push_back(*li);
+    vector<bytecode::SpecIdent> specidents;
+    for (auto sid : *bcf->specidents()) specidents.push_back(*sid);
+    auto nbcf = bytecode::CreateBytecodeFile(fbb,
+        bcf->bytecode_version(),
+        fbb.CreateVector(vector<int>()),
+        fbb.CreateVector(vector<uchar>()),
+        ints(bcf->typetable()),
+        strings(bcf->stringtable()),
+        fbb.CreateVectorOfStructs(lineinfo),
+        strings(bcf->filenames()),
+        fbb.CreateVector(functions),
+        fbb.CreateVector(structs),
+        fbb.CreateVector(idents),
+        fbb.CreateVectorOfStructs(specidents),
+        ints(bcf->default_int_vector_types()),
+        ints(bcf->default_float_vector_types()),
+        ints(bcf->logvars()));
+    bytecode::FinishBytecodeFileBuffer(fbb, nbcf);
+    buf.assign(fbb.GetBufferPointer(), fbb.GetBufferPointer() + fbb.GetSize());
 }
 
-void ToCPP(string &s, const uchar *bytecode_buffer, size_t bytecode_len) {
+void ToCPP(string &s, const uchar *bytecode_buffer) {
     int dispatch = VM_DISPATCH_METHOD;
     auto bcf = bytecode::GetBytecodeFile(bytecode_buffer);
     assert(FLATBUFFERS_LITTLEENDIAN);
@@ -79,9 +544,66 @@ void ToCPP(string &s, const uchar *bytecode_buffer, size_t bytecode_len) {
             "using lobster::g_vm;\n"
             "\n"
             "#pragma warning (disable: 4102)  // Unused label.\n"
+            "\n"
+            "static inline float flt(int bits) { float f; memcpy(&f, &bits, sizeof(f)); return f; }\n"
             "\n";
     auto len = bcf->bytecode()->Length();
     auto ilnames = ILNames();
+    // Find the called functions that DirectFunToCPP() can emit. Whether a function qualifies
+    // depends on the functions it calls, and its return type may be that of a (recursive) call,
+    // so this repeats until nothing changes, starting from all functions with scalar args.
+    map<int, CPPDirectFun> direct;
+    for (auto ip = code; ip < code + len; ) {
+        int opc = *ip++;
+        auto args = ip;
+        if (opc < 0 || opc >= IL_MAX_OPS) break;
+        ParseOpAndGetArity(opc, ip, code);
+        if ((opc != IL_CALL && opc != IL_TAILCALL) || code[args[1]] != IL_FUNSTART) continue;
+        CPPDirectFun df = { args[0], {}, 'I' };
+        for (int i = 0; i < code[args[1] + 1]; i++)
+            df.argtypes.push_back(ScalarVarType(bcf, code[args[1] + 2 + i]));
+        if (find(df.argtypes.begin(), df.argtypes.end(), 0) == df.argtypes.end())
+            direct.insert({ args[1], df });
+    }
+    map<int, string> directcode;
+    for (int pass = 0; ; pass++) {
+        bool changed = false;
+        directcode.clear();
+        for (auto it = direct.begin(); it != direct.end(); ) {
+            char ret;
+            if (!DirectFunToCPP(directcode[it->first], bcf, code, code + len, it->first, direct,
+                                ret)) {
+                directcode.erase(it->first);
+                it = direct.erase(it);
+                changed = true;
+                continue;
+            }
+            if (ret != it->second.ret) changed = true;
+            it->second.ret = ret;
+            it++;
+        }
+        if (!changed) break;
+        if (pass == 10) {  // Return types that don't settle, should not happen.
+            direct.clear();
+            directcode.clear();
+            break;
+        }
+    }
+    if (!direct.empty()) {
+        for (auto &it : direct) {
+            s += "static " + CType(it.second.ret) + " " + it.second.Name(it.first) + "(";
+            for (size_t i = 0; i < it.second.argtypes.size(); i++) {
+                if (i) s += ", ";
+                s += CType(it.second.argtypes[i]);
+            }
+            s += ");\n";
+        }
+        s += "\n";
+        for (auto &it : directcode) {
+            s += "// " + bcf->functions()->Get(direct[it.first].fidx)->name()->str() + "\n";
+            s += it.second + "\n";
+        }
+    }
     vector<int> block_ids(bcf->bytecode_attr()->size());
     auto BlockRef = [&](int ip) {
         if (dispatch == VM_DISPATCH_TRAMPOLINE) s += "block";
@@ -97,7 +619,8 @@ void ToCPP(string &s, const uchar *bytecode_buffer, size_t bytecode_len) {
         if (ip) BlockRef(ip); else s += "g_vm->next_call_target";
         s += ";";
         if (dispatch == VM_DISPATCH_SWITCH_GOTO) {
-            if (!ip) s += " continue; }";
+            // Dynamic jumps are where the program may have ended, see VM::EvalProgram.
+            if (!ip) s += " if (g_vm->halted) return nullptr; continue; }";
         }
     };
     const int *ip = code;
@@ -131,6 +654,14 @@ void ToCPP(string &s, const uchar *bytecode_buffer, size_t bytecode_len) {
         BlockRef(starting_point);
         s += ";\n  for(;;) switch(ip) {\n    default: assert(false); continue;\n";
     }
+    vector<CPPScalar> sstack;
+    int ntemps = 0;  // Locals can't be used with switch dispatch, which jumps past them.
+    auto FlushScalars = [&]() {
+        for (auto &e : sstack) s += "    g_vm->stack[++g_vm->sp] = " + e.Val() + ";\n";
+        sstack.clear();
+    };
+    CPPScope sc = { dispatch == VM_DISPATCH_TRAMPOLINE ? &ntemps : nullptr, nullptr, true, nullptr,
+                    &direct, "nullptr" };
     ip = code + 2;
     bool already_returned = false;
     while (ip < code + len) {
@@ -157,96 +688,116 @@ void ToCPP(string &s, const uchar *bytecode_buffer, size_t bytecode_len) {
             already_returned = false;
         }
         auto arity = ParseOpAndGetArity(opc, ip, code);
-        s += "    ";
-        if (opc == IL_JUMP) {
-            already_returned = true;
-            JumpIns(args[0]);
-            s += "\n";
-        } else if ((opc >= IL_JUMPFAIL && opc <= IL_JUMPNOFAILRREF) ||
-                   (opc >= IL_IFOR && opc <= IL_VFOR)) {
-            s += "if (g_vm->F_";
-            s += ilname;
-            s += "()) ";
-            JumpIns(args[0]);
-            s += "\n";
-        } else {
-            s += "{ ";
-            if (arity) {
-                s += "static int args[] = {";
+        if (!ScalarOpToCPP(s, sstack, sc, opc, args, [&](int target) { JumpIns(target); },
+                           FlushScalars)) {
+            FlushScalars();
+            s += "    ";
+            if (opc == IL_JUMP) {
+                already_returned = true;
+                JumpIns(args[0]);
+                s += "\n";
+            } else if (opc == IL_PUSHNIL) {
+                // As in VM::EvalThreaded, these simple pushes are done inline.
+                s += "g_vm->stack[++g_vm->sp] = lobster::Value();\n";
+            } else if (opc == IL_PUSHVARREF) {
+                s += "g_vm->stack[++g_vm->sp] = g_vm->vars[" + to_string(args[0]) +
+                     "].INCRTNIL(); /* " + IdName(bcf, args[0]) + " */\n";
+            } else if (opc > IL_JUMP) {
+                // Conditional jump, with the target as last operand.
+                s += "{ static int args[] = {";
                 for (int i = 0; i < arity; i++) {
                     if (i) s += ", ";
                     s += to_string(args[i]);
                 }
-                s += "}; ";
-            }
-            if (opc == IL_FUNMULTI) {
-                s += "static lobster::block_t mmtable[] = {";
-                auto nargs = args[1];
-                for (int i = 0; i < args[0]; i++) {
-                    BlockRef(args[2 + (nargs + 1) * i + nargs]);
+                s += "}; if (g_vm->F_";
+                s += ilname;
+                s += "(args)) ";
+                JumpIns(args[arity - 1]);
+                s += " }\n";
+            } else {
+                s += "{ ";
+                if (arity) {
+                    s += "static int args[] = {";
+                    for (int i = 0; i < arity; i++) {
+                        if (i) s += ", ";
+                        s += to_string(args[i]);
+                    }
+                    // There's no bytecode to find the number of args in, see F_TAILCALL.
+                    if (opc == IL_TAILCALL) s += ", " + to_string(code[args[1] + 1]);
+                    s += "}; ";
+                }
+                if (opc == IL_FUNMULTI) {
+                    s += "static lobster::block_t mmtable[] = {";
+                    auto nargs = args[1];
+                    for (int i = 0; i < args[0]; i++) {
+                        BlockRef(args[2 + (nargs + 1) * i + nargs]);
+                        s += ", ";
+                    }
+                    s += "}; g_vm->next_mm_table = mmtable; ";
+                // FIXME: make resume a vm op.
+                } else if (opc == IL_BCALL2 && natreg.nfuns[args[0]]->name == "resume") {
+                    s += "g_vm->next_call_target = ";
+                    BlockRef(ip - code);
+                    s += "; ";
+                }
+                s += "g_vm->F_";
+                s += ilname;
+                s += "(";
+                s += arity ? "args" : "nullptr";
+                if (opc == IL_CALL || opc == IL_TAILCALL || opc == IL_CALLMULTI || opc == IL_CALLV ||
+                    opc == IL_CALLVCOND || opc == IL_YIELD) {
+                    s += ", ";
+                    BlockRef(ip - code);
+                } else if (opc == IL_PUSHFUN || opc == IL_CORO) {
                     s += ", ";
+                    BlockRef(args[0]);
                 }
-                s += "}; g_vm->next_mm_table = mmtable; ";
-            // FIXME: make resume a vm op.
-            } else if (opc == IL_BCALL2 && natreg.nfuns[args[0]]->name == "resume") {
-                s += "g_vm->next_call_target = ";
-                BlockRef(ip - code);
-                s += "; ";
-            }
-            s += "g_vm->F_";
-            s += ilname;
-            s += "(";
-            s += arity ? "args" : "nullptr";
-            if (opc == IL_CALL || opc == IL_CALLMULTI || opc == IL_CALLV || opc == IL_CALLVCOND ||
-                opc == IL_YIELD) {
-                s += ", ";
-                BlockRef(ip - code);
-            } else if (opc == IL_PUSHFUN || opc == IL_CORO) {
-                s += ", ";
-                BlockRef(args[0]);
-            }
-            s += ");";
-            if (opc >= IL_BCALL0 && opc <= IL_BCALL6) {
-                s += " /* ";
-                s += natreg.nfuns[args[0]]->name;
-                s += " */";
-            } else if (opc == IL_PUSHVAR || opc == IL_PUSHVARREF) {
-                s += " /* ";
-                s += IdName(bcf, args[0]);
-                s += " */";
-            } else if (opc == IL_LVALVAR) {
-                s += " /* ";
-                s += LvalOpNames()[args[0]];
-                s += " ";
-                s += IdName(bcf, args[1]);
-                s += " */";
-            } else if (opc == IL_PUSHSTR) {
-                s += " /* ";
-                EscapeAndQuote(bcf->stringtable()->Get(args[0])->c_str(), s);
-                s += " */";
-            } else if (opc == IL_CALL || opc == IL_CALLMULTI) {
-                s += " /* ";
-                s += bcf->functions()->Get(args[0])->name()->c_str();
-                s += " */";
-            }
-            if (opc == IL_CALL || opc == IL_CALLMULTI) {
-                s += " ";
-                JumpIns(args[1]);
-                already_returned = true;
-            } else if (opc == IL_CALLV || opc == IL_FUNEND || opc == IL_FUNMULTI ||
-                       opc == IL_YIELD || opc == IL_COEND || opc == IL_RETURN ||
-                       // FIXME: make resume a vm op.
-                       (opc == IL_BCALL2 && natreg.nfuns[args[0]]->name == "resume")) {
-                s += " ";
-                JumpIns();
-                already_returned = true;
-            } else if (opc == IL_CALLVCOND) {
-                s += " if (g_vm->next_call_target) ";
-                JumpIns();
+                s += ");";
+                if (opc >= IL_BCALL0 && opc <= IL_BCALL6) {
+                    s += " /* ";
+                    s += natreg.nfuns[args[0]]->name;
+                    s += " */";
+                } else if (opc == IL_PUSHVAR || opc == IL_PUSHVARREF || opc == IL_PUSHVARFLD) {
+                    s += " /* ";
+                    s += IdName(bcf, args[0]);
+                    s += " */";
+                } else if (opc == IL_LVALVAR || opc == IL_LVALVARI) {
+                    s += " /* ";
+                    s += LvalOpNames()[args[0]];
+                    s += " ";
+                    s += IdName(bcf, args[1]);
+                    s += " */";
+                } else if (opc == IL_PUSHSTR) {
+                    s += " /* ";
+                    EscapeAndQuote(bcf->stringtable()->Get(args[0])->c_str(), s);
+                    s += " */";
+                } else if (opc == IL_CALL || opc == IL_TAILCALL || opc == IL_CALLMULTI) {
+                    s += " /* ";
+                    s += bcf->functions()->Get(args[0])->name()->c_str();
+                    s += " */";
+                }
+                if (MayError(opc)) s += " if (g_vm->halted) return nullptr;";
+                if (opc == IL_CALL || opc == IL_TAILCALL || opc == IL_CALLMULTI) {
+                    s += " ";
+                    JumpIns(args[1]);
+                    already_returned = true;
+                } else if (opc == IL_CALLV || opc == IL_FUNEND || opc == IL_FUNMULTI ||
+                           opc == IL_YIELD || opc == IL_COEND || opc == IL_RETURN ||
+                           opc == IL_EXIT ||
+                           // FIXME: make resume a vm op.
+                           (opc == IL_BCALL2 && natreg.nfuns[args[0]]->name == "resume")) {
+                    s += " ";
+                    JumpIns();
+                    already_returned = true;
+                } else if (opc == IL_CALLVCOND) {
+                    s += " if (g_vm->next_call_target) ";
+                    JumpIns();
+                }
+                s += " }\n";
             }
-            s += " }\n";
         }
         if (bcf->bytecode_attr()->Get(ip - code) & bytecode::Attr_SPLIT) {
+            FlushScalars();
             if (dispatch == VM_DISPATCH_TRAMPOLINE) {
                 if (!already_returned) {
                     s += "  ";
@@ -260,11 +811,12 @@ void ToCPP(string &s, const uchar *bytecode_buffer, size_t bytecode_len) {
     if (dispatch == VM_DISPATCH_SWITCH_GOTO) {
         s += "}\n}\n";  // End of gigantic function.
     }
-    // FIXME: this obviously does NOT need to include the actual bytecode, just the metadata.
-    // in fact, it be nice if those were in readable format in the generated code.
+    // The VM still needs the metadata (types, strings, names..), but none of the bytecode.
+    vector<uchar> metadata;
+    StripByteCode(bcf, metadata);
     s += "\nstatic const int bytecodefb[] =\n{";
-    auto bytecode_ints = (const int *)bytecode_buffer;
-    for (size_t i = 0; i < bytecode_len / sizeof(int); i++) {
+    auto bytecode_ints = (const int *)metadata.data();
+    for (size_t i = 0; i < metadata.size() / sizeof(int); i++) {
         if ((i & 0xF) == 0) s += "\n  ";
         s += to_string(bytecode_ints[i]);
         s += ", ";
@@ -212,6 +212,20 @@ template<typename T> struct RandomNumberGenerator {
     float rndfloatsigned() { return (float)(rnddouble() * 2 - 1); }
 };
 
+// FNV-1a, which can be chained over multiple pieces of data starting from FNV_OFFSET.
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+inline uint64_t HashBytes(uint64_t h, const void *data, size_t len) {
+    for (size_t i = 0; i < len; i++) h = (h ^ ((const uchar *)data)[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// The splitmix64 finalizer: every input bit affects every output bit.
+inline uint64_t HashMix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
 // Special case for to_string to get exact float formatting we need.
 template<typename T> string to_string_float(T x, int decimals = -1) {
     // stringstream gives more consistent cross-platform results than to_string() for floats, and
@@ -13,6 +13,11 @@ struct TypeChecker {
         FlowItem(const Node *_item, TypeRef type) : item(_item), old(_item->exptype), now(type) {}
     };
     vector<FlowItem> flowstack;
+    // Specializations of all functions, by the types of the args they were specialized on.
+    unordered_multimap<size_t, SubFunction *> specializations;
+    // Those whose arg types contained type variables when hashed. Their hash changes once these
+    // get bound, so they are re-keyed when that is found to have happened.
+    unordered_map<const Function *, vector<SubFunction *>> unbound_specializations;
 
     TypeChecker(Parser &_p, SymbolTable &_st) : parser(_p), st(_st) {
         st.RegisterDefaultVectorTypes();
@@ -42,6 +47,11 @@ struct TypeChecker {
                 if (!ExactType(struc->fields.v[i].type, vectortype)) vectortype = type_any;
             }
             struc->vectortype = vectortype->Wrap(NewType());
+            // Values like xy_f can be computed on without allocating each intermediate result,
+            // see CodeGen::GenUnboxed.
+            struc->unboxable = struc->readonly &&
+                               struc->fields.size() >= 2 && struc->fields.size() <= 4 &&
+                               (vectortype->t == V_INT || vectortype->t == V_FLOAT);
         }
     }
 
@@ -162,6 +172,15 @@ struct TypeChecker {
         return type;
     }
 
+    TypeRef ForLoopElemType(TypeRef itertype, const Node &n) {
+        if (itertype->t == V_INT || itertype->t == V_STRING) return type_int;
+        if (itertype->t == V_VECTOR) return itertype->Element();
+        if (itertype->t == V_STRUCT) return itertype->struc->vectortype->Element();
+        TypeError("for can only iterate over int/string/vector/struct, not: " +
+                  TypeName(itertype), n);
+        return itertype;
+    }
+
     TypeRef NewTypeVar() {
         auto var = NewType();
         *var = Type(V_VAR);
@@ -514,6 +533,7 @@ struct TypeChecker {
         scopes.push_back(scope);
         if (!sf.parent->anonymous) named_scopes.push_back(scope);
         sf.typechecked = true;
+        AddSpecialization(sf);
         for (auto &fv : sf.freevars.v) fv.sid = fv.id->cursid;
         for (auto &dyn : sf.dynscoperedefs.v) dyn.sid = dyn.id->cursid;
         auto backup_vars = [&](ArgVector &in, ArgVector &backup) {
@@ -626,6 +646,63 @@ struct TypeChecker {
         return true;
     }
 
+    // Consistent with ExactType: type variables are only equal to themselves, and may still be
+    // bound later, so don't contribute to the hash.
+    size_t TypeHash(TypeRef type) {
+        auto h = (size_t)type->t;
+        if (type->Wrapped()) return h * 31 + TypeHash(type->sub);
+        if (type->t == V_STRUCT || type->t == V_FUNCTION || type->t == V_COROUTINE)
+            return h * 31 + hash<const void *>()(type->named);
+        return h;
+    }
+
+    size_t SpecializationHash(Function &f, Node *call_args) {
+        auto h = (size_t)f.idx;
+        int i = 0;
+        for (Node *list = call_args; list && i < f.nargs(); list = list->tail()) {
+            if (f.subf->args.v[i++].flags == AF_ANYTYPE)
+                h = h * 31 + TypeHash(list->head()->exptype);
+        }
+        return h;
+    }
+
+    // Same as the above for a call with the arg types of sf.
+    size_t SpecializationHash(const SubFunction &sf) {
+        auto h = (size_t)sf.parent->idx;
+        for (auto &arg : sf.args.v) if (arg.flags == AF_ANYTYPE) h = h * 31 + TypeHash(arg.type);
+        return h;
+    }
+
+    bool HasTypeVar(TypeRef type) {
+        for (;; type = type->sub) {
+            if (type->t == V_VAR) return true;
+            if (!type->Wrapped()) return false;
+        }
+    }
+
+    bool HasTypeVars(const SubFunction &sf) {
+        for (auto &arg : sf.args.v) {
+            if (arg.flags == AF_ANYTYPE && HasTypeVar(arg.type)) return true;
+        }
+        return false;
+    }
+
+    void AddSpecialization(SubFunction &sf) {
+        specializations.insert(make_pair(SpecializationHash(sf), &sf));
+        if (HasTypeVars(sf)) unbound_specializations[sf.parent].push_back(&sf);
+    }
+
+    bool SpecializationMatches(SubFunction *sf, Node *call_args) {
+        if (!sf->typechecked || sf->mustspecialize) return false;
+        int i = 0;
+        for (Node *list = call_args; list && i < sf->parent->nargs(); list = list->tail()) {
+            auto &arg = sf->args.v[i++];
+            if (arg.flags == AF_ANYTYPE && !ExactType(list->head()->exptype, arg.type))
+                return false;
+        }
+        return FreeVarsSameAsCurrent(sf, false);
+    }
+
     SubFunction *CloneFunction(SubFunction *csf) {
         Output(OUTPUT_DEBUG, "cloning: %s", csf->parent->name.c_str());
         auto sf = st.CreateSubFunction();
@@ -672,18 +749,25 @@ struct TypeChecker {
                 assert(!f.istype);  // Should not contain any AF_ANYTYPE
                 if (sf->typechecked) {
                     // Check if any existing specializations match.
-                    for (sf = f.subf; sf; sf = sf->next) {
-                        if (sf->typechecked && !sf->mustspecialize) {
-                            int i = 0;
-                            for (Node *list = call_args; list && i < f.nargs();
-                                list = list->tail()) {
-                                auto &arg = sf->args.v[i++];
-                                if (arg.flags == AF_ANYTYPE &&
-                                    !ExactType(list->head()->exptype, arg.type)) goto fail;
-                            }
-                            if (FreeVarsSameAsCurrent(sf, false)) goto match;
-                            fail:;
+                    auto hash = SpecializationHash(f, call_args);
+                    auto range = specializations.equal_range(hash);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        sf = it->second;
+                        if (sf->parent == &f && SpecializationMatches(sf, call_args)) goto match;
+                    }
+                    // Those hashed with type variables in their arg types may have had them bound
+                    // since, so check those too, and re-key the ones that are now fully bound.
+                    auto &unbound = unbound_specializations[&f];
+                    for (size_t j = 0; j < unbound.size(); ) {
+                        sf = unbound[j];
+                        auto matches = SpecializationMatches(sf, call_args);
+                        if (HasTypeVars(*sf)) {
+                            j++;
+                        } else {
+                            specializations.insert(make_pair(SpecializationHash(*sf), sf));
+                            unbound.erase(unbound.begin() + j);
                         }
+                        if (matches) goto match;
                     }
                     // No fit. Specialize existing function, or its clone.
                     sf = CloneFunction(csf);
@@ -1094,12 +1178,7 @@ struct TypeChecker {
 
             case T_FOR: {
                 TypeCheck(n.for_iter(), T_FOR);
-                auto itertype = n.for_iter()->exptype;
-                if (itertype->t == V_INT || itertype->t == V_STRING) itertype = type_int;
-                else if (itertype->t == V_VECTOR) itertype = itertype->Element();
-                else if (itertype->t == V_STRUCT) itertype = itertype->struc->vectortype->Element();
-                else TypeError("for can only iterate over int/string/vector/struct, not: " +
-                               TypeName(itertype), n);
+                auto itertype = ForLoopElemType(n.for_iter()->exptype, n);
                 auto args = n.for_body()->call_args();
                 if (args) {
                     args->head()->exptype = itertype;  // T_FORLOOPELEM
@@ -1425,7 +1504,18 @@ struct TypeChecker {
                         // We must assume this is going to get called and type-check it
                         auto sf = actualtype->sf;
                         Node *args = nullptr;
-                        if (sf->args.v.size()) {
+                        if (arg.flags & NF_ITERFUN) {
+                            // Called like the body of a for loop over the previous argument, but
+                            // not necessarily from this VM, so it can't see any variables it
+                            // doesn't own.
+                            assert(i);
+                            auto elem = new Node(n.line, T_FORLOOPELEM);
+                            auto idx = new Node(n.line, T_FORLOOPI);
+                            elem->exptype = ForLoopElemType(argtypes[i - 1], n);
+                            idx->exptype = type_int;
+                            args = new Node(n.line, T_LIST, elem,
+                                            new Node(n.line, T_LIST, idx, nullptr));
+                        } else if (sf->args.v.size()) {
                             // we have no idea what args.
                             assert(0);
                             TypeError("function passed to " + nf->name +
@@ -1435,6 +1525,11 @@ struct TypeChecker {
                         TypeCheckCall(sf, args, *fake_function_def);
                         assert(sf == fake_function_def->sf());
                         delete fake_function_def;
+                        delete args;
+                        if (arg.flags & NF_ITERFUN && sf->freevars.v.size())
+                            TypeError("function passed to " + nf->name +
+                                      " cannot use variables from outside of it, such as: " +
+                                      sf->freevars.v[0].id->name, n);
                     }
                     argtypes.push_back(actualtype);
                     i++;
@@ -1476,6 +1571,8 @@ struct TypeChecker {
                                 assert(sf);
                                 // In theory it is possible this hasn't been generated yet..
                                 type = sf->returntypes[0];
+                                // A vector of whatever the function returns.
+                                if (ret.type->t == V_VECTOR) type = type->Wrap(NewType());
                             }
                             break;
                         }
@@ -1726,7 +1823,8 @@ struct TypeChecker {
         Output(OUTPUT_INFO, "Node count: orig: %d, cloned: %d", orignodes, clonenodes);
         sort(funstats.begin(), funstats.end(),
              [](const Pair &a, const Pair &b) { return a.first > b.first; });
-        for (auto &p : funstats) if (p.first > orignodes / 50) {
+        funstats.resize(min(funstats.size(), (size_t)10));
+        for (auto &p : funstats) if (p.first) {
             auto &pos = p.second->subf->body->line;
             Output(OUTPUT_INFO, "Most clones: %s (%s:%d) -> %d nodes accross %d clones (+1 orig)",
                    p.second->name.c_str(),
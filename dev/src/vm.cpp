@@ -21,12 +21,14 @@
 
 namespace lobster {
 
-VM *g_vm = nullptr;                  // set during the lifetime of a VM object
-SlabAlloc *vmpool = nullptr;         // set during the lifetime of a VM object
+// Each OS thread can run its own VM, so these are per thread.
+thread_local VM *g_vm = nullptr;             // set during the lifetime of a VM object
+thread_local SlabAlloc *vmpool = nullptr;    // set during the lifetime of a VM object
 
-#ifdef _DEBUG
+// Outputs line and op sequence profiles at program exit. Can also be turned on in release builds
+// with -DVM_PROFILER, to profile representative workloads.
+#if defined(_DEBUG) && !defined(VM_PROFILER)
     #define VM_PROFILER              // tiny VM slowdown and memory usage when enabled
-    #define VM_PROFILER
 #endif
 
 #ifdef VM_COMPILED_CODE_MODE
@@ -43,7 +45,9 @@ enum {
     // *8 bytes each, modest on smallest handheld we support (iPhone 3GS has 256MB).
     DEFMAXSTACKSIZE = 128 * 1024,
     // *8 bytes each, max by which the stack could possibly grow in a single call.
-    STACKMARGIN     =   1 * 1024
+    STACKMARGIN     =   1 * 1024,
+    // *8 bytes each, initial size of the stack of each coroutine, grows like the main one.
+    COSTACKSIZE     =   2 * STACKMARGIN
 };
 
 #define PUSH(v) (stack[++sp] = (v))
@@ -53,6 +57,13 @@ enum {
 #define POPN(n) (sp -= (n))
 #define TOPPTR() (stack + sp + 1)
 
+// Where the sampling profiler takes its samples, see VMProfiler.
+#define SAMPLEPOINT() { if (prof.due.load(memory_order_relaxed)) prof.Sample(); }
+
+static string profile_next_run;
+
+void ProfileNextRun(const char *foldedfilename) { profile_next_run = foldedfilename; }
+
 VM::VM(const char *_pn, vector<uchar> &&_bytecode_buffer, const void *entry_point,
        const void *static_bytecode)
       : stack(nullptr), stacksize(0), maxstacksize(DEFMAXSTACKSIZE), sp(-1),
@@ -61,20 +72,32 @@ VM::VM(const char *_pn, vector<uchar> &&_bytecode_buffer, const void *entry_poin
         #else
             ip(nullptr),
         #endif
+        #ifdef VM_COMPILED_CODE_MODE
+            cppframes(nullptr), cppstackuse(0), cppstacklimit(nullptr),
+        #endif
         curcoroutine(nullptr), vars(nullptr), codelen(0), codestart(nullptr),
         byteprofilecounts(nullptr), bytecode_buffer(std::move(_bytecode_buffer)),
-        bcf(nullptr),
+        bytecode_start(nullptr), bcf(nullptr),
         programprintprefs(10, 10000, false, -1, false), typetable(nullptr),
         currentline(-1), maxsp(-1),
-        debugpp(2, 50, true, -1, true), programname(_pn), vml(*this),
+        debugpp(2, 50, true, -1, true), programname(_pn), vml(*this), cc(*this), prof(*this),
         trace(false), trace_tail(false),
-        vm_count_ins(0), vm_count_fcalls(0), vm_count_bcalls(0),
-        compiled_code_ip(entry_point) {
+        vm_count_ins(0), vm_count_fcalls(0), vm_count_bcalls(0), nativecall(false),
+        halted(false), compiled_code_ip(entry_point) {
     assert(vmpool == nullptr);
     vmpool = new SlabAlloc();
-    bcf = bytecode::GetBytecodeFile(static_bytecode ? static_bytecode : bytecode_buffer.data());
+    #ifdef VM_COMPILED_CODE_MODE
+        // The lowest address CPPFrames may use, leaving room to report an error from there. The
+        // VM is created on the thread that runs it. If the stack size is unknown, assume 1MB.
+        const size_t margin = 128 * 1024;
+        auto left = StackSpaceLeft();
+        if (!left) left = 1024 * 1024;
+        cppstacklimit = (char *)&left - (left > 2 * margin ? left - margin : left / 2);
+    #endif
+    bytecode_start = static_bytecode ? static_bytecode : bytecode_buffer.data();
+    bcf = bytecode::GetBytecodeFile(bytecode_start);
     if (bcf->bytecode_version() != LOBSTER_BYTECODE_FORMAT_VERSION)
-        throw string("bytecode is from a different version of Lobster");
+        THROW_OR_ABORT(string("bytecode is from a different version of Lobster"));
     codelen = bcf->bytecode()->Length();
     if (FLATBUFFERS_LITTLEENDIAN) {
         // We can use the buffer directly.
@@ -93,12 +116,15 @@ VM::VM(const char *_pn, vector<uchar> &&_bytecode_buffer, const void *entry_poin
         ip = codestart;
     #endif
     vars = new Value[bcf->specidents()->size()];
+    for (uint i = 0; i < bcf->specidents()->size(); i++)
+        varisref.push_back(IsRefNil(GetVarTypeInfo(i).t));
     stack = new Value[stacksize = INITSTACKSIZE];
     #ifdef VM_PROFILER
         byteprofilecounts = new uint64_t[codelen];
         memset(byteprofilecounts, 0, sizeof(uint64_t) * codelen);
     #endif
     vml.LogInit(bcf);
+    cc.Init(bcf);
     #ifdef VM_COMPILED_CODE_MODE
         #define F(N, A) f_ins_pointers[IL_##N] = nullptr;
     #else
@@ -108,12 +134,18 @@ VM::VM(const char *_pn, vector<uchar> &&_bytecode_buffer, const void *entry_poin
     #undef F
     assert(g_vm == nullptr);
     g_vm = this;
+    if (!profile_next_run.empty()) {
+        prof.foldedfile = profile_next_run;
+        profile_next_run.clear();
+        prof.Start(1000);
+    }
 }
 
 VM::~VM() {
     assert(g_vm == this);
     g_vm = nullptr;
     if (stack) delete[] stack;
+    for (auto s : costackpool) delete[] s;
     if (vars)  delete[] vars;
     if (byteprofilecounts) delete[] byteprofilecounts;
     if (vmpool) {
@@ -201,9 +233,19 @@ LString *VM::NewString(size_t l) {
 }
 CoRoutine *VM::NewCoRoutine(InsPtr rip, const int *vip, CoRoutine *p, const TypeInfo &cti) {
     assert(cti.t == V_COROUTINE);
-    return new (vmpool->alloc(sizeof(CoRoutine)))
-               CoRoutine(sp + 2 /* top of sp + pushed coro */, (int)stackframes.size(), rip, vip, p,
-                         cti);
+    Value *costack;
+    if (costackpool.size()) {
+        costack = costackpool.back();
+        costackpool.pop_back();
+    } else {
+        costack = new Value[COSTACKSIZE];
+    }
+    return new (vmpool->alloc(sizeof(CoRoutine))) CoRoutine(costack, COSTACKSIZE, rip, vip, p, cti);
+}
+void VM::FreeCoStack(Value *costack, int size) {
+    // Ones that grew are rare enough to not be worth keeping.
+    if (size == COSTACKSIZE) costackpool.push_back(costack);
+    else delete[] costack;
 }
 BoxedInt *VM::NewInt(int i) {
     return new (vmpool->alloc(sizeof(BoxedInt))) BoxedInt(i);
@@ -236,10 +278,21 @@ LString *VM::NewString(const char *c1, size_t l1, const char *c2, size_t l2) {
     return s;
 }
 
+// Only for strings we hold the only reference to, may move the string.
+LString *VM::ResizeString(LString *s, size_t l) {
+    assert(s->refc == 1);
+    auto ns = (LString *)vmpool->resize(s, sizeof(LString) + s->len + 1, sizeof(LString) + l + 1);
+    ns->len = (int)l;
+    ns->str()[l] = 0;
+    return ns;
+}
+
 // This function is now way less important than it was when the language was still dynamically
 // typed. But ok to leave it as-is for "index out of range" and other errors that are still dynamic.
+// Rather than throwing, this unwinds the VM and halts it with the message in errmsg, so the caller
+// must return (up to the dispatch loop) right after, without touching the stack any further.
 Value VM::Error(string err, const RefObj *a, const RefObj *b) {
-    if (trace_tail && trace_output.length()) throw trace_output + err;
+    if (!errmsg.empty()) return Value();  // Only report the first error.
     string s;
     #ifndef VM_COMPILED_CODE_MODE
         // error is usually in the byte before the current ip.
@@ -258,8 +311,21 @@ Value VM::Error(string err, const RefObj *a, const RefObj *b) {
         POP();  // We don't DEC here, as we can't know what type it is.
                 // This is ok, as we ignore leaks in case of an error anyway.
     }
+    #ifdef VM_COMPILED_CODE_MODE
+        for (auto f = cppframes; f; f = f->parent) {
+            s += string("\nin function: ") +
+                 bcf->functions()->Get(f->definedfunction)->name()->c_str();
+        }
+    #endif
     for (;;) {
-        if (!stackframes.size()) break;
+        if (!stackframes.size()) {
+            if (!curcoroutine) break;
+            // Continue in the code that created or resumed this coroutine.
+            curcoroutine->RestoreParentVars(vars);
+            CoDone(InsPtr(0));
+            while (sp >= 0 && (!stackframes.size() || sp != stackframes.back().spstart)) POP();
+            continue;
+        }
         string locals;
         int deffun = stackframes.back().definedfunction;
         VarCleanup(s.length() < 10000 ? &locals : nullptr, -2 /* clean up temps always */);
@@ -279,7 +345,9 @@ Value VM::Error(string err, const RefObj *a, const RefObj *b) {
     for (size_t i = 0; i < bcf->specidents()->size(); i++) {
         s += DumpVar(vars[i], i, true);
     }
-    throw s;
+    errmsg = trace_tail && trace_output.length() ? trace_output + err : s;
+    halted = true;
+    return Value();
 }
 
 void VM::VMAssert(bool ok, const char *what)  {
@@ -320,10 +388,55 @@ string VM::DumpVar(const Value &x, size_t idx, bool dumpglobals) {
     return "\n   " + name + " = " + x.ToString(static_type, debugpp);
 }
 
-void VM::EvalMulti(const int *mip, int definedfunction, const int *call_arg_types,
+void VM::EvalMulti(const int *mip, int definedfunction, const int *call_arg_types, int cacheidx,
                    block_t comp_retip, int tempmask) {
     auto nsubf = *mip++;
     auto nargs = *mip++;
+    auto args = &stack[sp - nargs + 1];
+    int variant = -1;
+    if (cacheidx >= (int)multicaches.size()) multicaches.resize(cacheidx + 1);
+    auto &mc = multicaches[cacheidx];
+    for (int e = 0; e < mc.used; e++) {
+        auto types = &mc.argtypes[e * nargs];
+        for (int j = 0; j < nargs; j++)
+            if (types[j] && &args[j].ref()->ti != types[j]) goto miss;
+        variant = mc.variants[e];
+        break;
+        miss:;
+    }
+    if (variant < 0) {
+        variant = FindMulti(mip, nsubf, nargs, call_arg_types, definedfunction);
+        if (variant < 0) return;
+        // Replace entries round-robin once full, since types never change meaning this never needs
+        // to be invalidated.
+        auto e = mc.next;
+        mc.next = (mc.next + 1) % MULTI_CACHE_SIZE;
+        if (mc.used <= e) {
+            mc.used = e + 1;
+            mc.argtypes.resize(mc.used * nargs);
+        }
+        mc.variants[e] = variant;
+        for (int j = 0; j < nargs; j++) {
+            auto &given = GetTypeInfo((type_elem_t)call_arg_types[j]);
+            mc.argtypes[e * nargs + j] = IsRef(given.t) ? &args[j].ref()->ti : nullptr;
+        }
+    }
+    call_arg_types += nargs;
+    #ifdef VM_COMPILED_CODE_MODE
+        InsPtr retip(comp_retip);
+        InsPtr fun(next_mm_table[variant]);
+    #else
+        InsPtr retip(call_arg_types);
+        InsPtr fun(codestart + mip[variant * (nargs + 1) + nargs]);
+        (void)comp_retip;
+    #endif
+    StartStackFrame(definedfunction, retip, tempmask);
+    return FunIntroPre(fun);
+}
+
+// Finds the first variant in the dispatch table at mip that accepts the args.
+int VM::FindMulti(const int *mip, int nsubf, int nargs, const int *call_arg_types,
+                  int definedfunction) {
     for (int i = 0; i < nsubf; i++) {
         // TODO: rather than going thru all args, only go thru those that have types
         for (int j = 0; j < nargs; j++) {
@@ -331,27 +444,14 @@ void VM::EvalMulti(const int *mip, int definedfunction, const int *call_arg_type
             if (desired.t != V_ANY) {
                 auto &given = GetTypeInfo((type_elem_t)call_arg_types[j]);
                 // Have to check the actual value, since given may be a supertype.
-                // FIXME: this is slow.
                 if ((given.t != desired.t && given.t != V_ANY) ||
                     (IsRef(given.t) && &stack[sp - nargs + j + 1].ref()->ti != &desired)) {
                     mip += nargs - j;  // Includes the code starting point.
                     goto fail;
                 }
-            } else {
             }
-        } {
-            call_arg_types += nargs;
-            #ifdef VM_COMPILED_CODE_MODE
-                InsPtr retip(comp_retip);
-                InsPtr fun(next_mm_table[i]);
-            #else
-                InsPtr retip(call_arg_types);
-                InsPtr fun(codestart + *mip);
-                (void)comp_retip;
-            #endif
-            StartStackFrame(definedfunction, retip, tempmask);
-            return FunIntroPre(fun);
         }
+        return i;
         fail:;
     }
     string argtypes;
@@ -363,6 +463,7 @@ void VM::EvalMulti(const int *mip, int definedfunction, const int *call_arg_type
     }
     Error(string("the call ") + bcf->functions()->Get(definedfunction)->name()->c_str() + "(" +
           argtypes + ") did not match any function variants");
+    return -1;
 }
 
 void VM::FinalStackVarsCleanup() {
@@ -398,17 +499,23 @@ int VM::VarCleanup(string *error, int towhere) {
     fip += nargs;
     auto ndef = *fip++;
     auto defvars = fip + ndef;
-    while (ndef--) {
-        auto i = *--defvars;
-        if (error) (*error) += DumpVar(vars[i], i, false);
-        else vars[i].DECTYPE(GetVarTypeInfo(i).t);
-        vars[i] = POP();
-    }
-    while (nargs--) {
-        auto i = *--freevars;
-        if (error) (*error) += DumpVar(vars[i], i, false);
-        else vars[i].DECTYPE(GetVarTypeInfo(i).t);
-        vars[i] = POP();
+    if (!stf.hasrefs && !error) {
+        // Nothing to decrement, just restore the previous values.
+        while (ndef--) vars[*--defvars] = POP();
+        while (nargs--) vars[*--freevars] = POP();
+    } else {
+        while (ndef--) {
+            auto i = *--defvars;
+            if (error) (*error) += DumpVar(vars[i], i, false);
+            else if (varisref[i]) vars[i].DECRTNIL();
+            vars[i] = POP();
+        }
+        while (nargs--) {
+            auto i = *--freevars;
+            if (error) (*error) += DumpVar(vars[i], i, false);
+            else if (varisref[i]) vars[i].DECRTNIL();
+            vars[i] = POP();
+        }
     }
     JumpTo(stf.retip);
     bool lastunwind = towhere == -1 || towhere == stf.definedfunction;
@@ -457,7 +564,12 @@ void VM::FunIntro(VM_OP_ARGS) {
         // per function call increment should be small
         // FIXME: not safe for untrusted scripts, could simply add lots of locals
         // could record max number of locals? not allow more than N locals?
-        if (stacksize >= maxstacksize) Error("stack overflow! (use set_max_stack_size() if needed)");
+        if (stacksize >= maxstacksize) {
+            // This frame isn't set up yet, so report the error in the caller.
+            stackframes.pop_back();
+            Error("stack overflow! (use set_max_stack_size() if needed)");
+            return;
+        }
         auto nstack = new Value[stacksize *= 2];
         memcpy(nstack, stack, sizeof(Value) * (sp + 1));
         delete[] stack;
@@ -466,7 +578,11 @@ void VM::FunIntro(VM_OP_ARGS) {
         Output(OUTPUT_DEBUG, "stack grew to: %d", stacksize);
     }
     auto nargs_fun = *ip++;
-    for (int i = 0; i < nargs_fun; i++) swap(vars[ip[i]], stack[sp - nargs_fun + i + 1]);
+    bool hasrefs = false;
+    for (int i = 0; i < nargs_fun; i++) {
+        hasrefs |= varisref[ip[i]] != 0;
+        swap(vars[ip[i]], stack[sp - nargs_fun + i + 1]);
+    }
     ip += nargs_fun;
     auto ndef = *ip++;
     for (int i = 0; i < ndef; i++) {
@@ -477,14 +593,22 @@ void VM::FunIntro(VM_OP_ARGS) {
         // so maybe we can at some point distinguish between vars that are used with DS and those
         // that are not.
         auto varidx = *ip++;
-        PUSH(vars[varidx].INCTYPE(GetVarTypeInfo(varidx).t));
+        if (varisref[varidx]) {
+            hasrefs = true;
+            vars[varidx].INCRTNIL();
+        }
+        PUSH(vars[varidx]);
     }
     auto &stf = stackframes.back();
     stf.funstart = funstart;
     stf.spstart = sp;
+    stf.hasrefs = hasrefs;
     #ifdef _DEBUG
         if (sp > maxsp) maxsp = sp;
     #endif
+    // A safe point for the cycle collector: everything is either in a var or on the stack.
+    if (cc.due) cc.Step();
+    SAMPLEPOINT();
 }
 
 bool VM::FunOut(int towhere, int nrv) {
@@ -493,9 +617,15 @@ bool VM::FunOut(int towhere, int nrv) {
     auto rvs = TOPPTR();
     for(;;) {
         if (!stackframes.size()) {
-            if (towhere >= 0)
+            if (curcoroutine) {
+                Error("cannot return out of a coroutine");
+                return false;
+            }
+            if (towhere >= 0) {
                 Error(string("\"return from ") + bcf->functions()->Get(towhere)->name()->c_str() +
                       "\" outside of function");
+                return false;
+            }
             bottom = true;
             break;
         }
@@ -503,16 +633,26 @@ bool VM::FunOut(int towhere, int nrv) {
     }
     memcpy(TOPPTR(), rvs, nrv * sizeof(Value));
     sp += nrv;
+    // The function called from CallFunction() returned, so we're done.
+    if (nativecall && !stackframes.size() && !curcoroutine) halted = true;
     return bottom;
 }
 
 void VM::CoVarCleanup(CoRoutine *co) {
-    // Convenient way to copy everything back onto the stack.
-    InsPtr tip(0);
-    auto copylen = co->Resume(sp + 1, stack, stackframes, tip, nullptr);
-    auto startsp = sp;
-    sp += copylen;
-    for (int i = co->stackframecopylen - 1; i >= 0 ; i--) {
+    // Unwind the coroutine's stack as if it was resumed, but without running any of its code, and
+    // without jumping to the return addresses of its frames.
+    #ifdef VM_COMPILED_CODE_MODE
+        InsPtr curip(next_call_target);
+    #else
+        InsPtr curip(ip);
+    #endif
+    co->SwapStacks();
+    for (int i = *co->varip; i > 0; i--) {
+        auto &var = vars[co->varip[i]];
+        co->parentvars[i - 1] = var;
+        var = POP();
+    }
+    while (stackframes.size()) {
         auto &stf = stackframes.back();
         // FIXME: guarantee this statically.
         if (stf.spstart != sp) {
@@ -522,21 +662,24 @@ void VM::CoVarCleanup(CoRoutine *co) {
                     stack[stf.spstart + 1 + i].DECRTNIL();
             sp = stf.spstart;
         }
-        VarCleanup(nullptr, !i ? stf.definedfunction : -2);
+        VarCleanup(nullptr, stackframes.size() == 1 ? stf.definedfunction : -2);
     }
-    assert(sp == startsp);
-    (void)startsp;
+    co->RestoreParentVars(vars);
+    co->SwapStacks();
+    JumpTo(curip);
 }
 
-void VM::CoNonRec(const int *varip) {
+bool VM::CoNonRec(const int *varip) {
     // probably could be skipped in a "release" mode
     for (auto co = curcoroutine; co; co = co->parent) if (co->varip == varip) {
         // if allowed, inner coro would save vars of outer, and then possibly restore them outside
         // of scope of parent
         Error("cannot create coroutine recursively");
+        return false;
     }
     // TODO: this check guarantees all saved stack vars are undef, except for DS vars,
     // which could still cause problems
+    return true;
 }
 
 void VM::CoNew(VM_OP_ARGS_CALL) {
@@ -547,28 +690,28 @@ void VM::CoNew(VM_OP_ARGS_CALL) {
         InsPtr returnip(codestart + *ip++);
     #endif
     auto ctidx = (type_elem_t)*ip++;
-    CoNonRec(ip);
-    curcoroutine = NewCoRoutine(returnip, ip, curcoroutine, GetTypeInfo(ctidx));
-    curcoroutine->BackupParentVars(vars);
+    if (!CoNonRec(ip)) return;
+    auto co = NewCoRoutine(InsPtr(), ip, nullptr, GetTypeInfo(ctidx));
+    co->BackupParentVars(vars);
     int nvars = *ip++;
     ip += nvars;
-    PUSH(Value(curcoroutine));
+    // This is where we continue when it first yields, with the coroutine as value.
+    PUSH(Value(co));
+    co->Resume(returnip, curcoroutine);
+    curcoroutine = co;
 }
 
 void VM::CoDone(InsPtr retip) {
-    int newtop = curcoroutine->Suspend(sp + 1, stack, stackframes, retip, curcoroutine);
+    curcoroutine->Suspend(retip, curcoroutine);
     JumpTo(retip);
-    sp = newtop - 1; // top of stack is now coro value from create or resume
+    // top of stack is now coro value from create or resume
 }
 
 void VM::CoClean() {
-    for (int i = 1; i <= *curcoroutine->varip; i++) {
-        auto &var = vars[curcoroutine->varip[i]];
-        var = curcoroutine->stackcopy[i - 1];
-    }
+    curcoroutine->RestoreParentVars(vars);
     auto co = curcoroutine;
     CoDone(InsPtr(0));
-    VMASSERT(co->stackcopylen == 1);
+    VMASSERT(co->sp == 0);
     co->active = false;
 }
 
@@ -586,37 +729,37 @@ void VM::CoYield(VM_OP_ARGS_CALL) {
         auto &var = vars[curcoroutine->varip[i]];
         PUSH(var);
         //var.type = V_NIL;
-        var = curcoroutine->stackcopy[i - 1];
+        var = curcoroutine->parentvars[i - 1];
     }
     PUSH(ret);  // current value always top of the stack
     CoDone(retip);
 }
 
 void VM::CoResume(CoRoutine *co) {
-    if (co->stackstart >= 0)
+    if (co->running) {
         Error("cannot resume running coroutine");
-    if (!co->active)
+        return;
+    }
+    if (!co->active) {
         Error("cannot resume finished coroutine");
+        return;
+    }
+    if (!CoNonRec(co->varip)) return;
     // This will be the return value for the corresponding yield, and holds the ref for gc.
     PUSH(Value(co));
-    CoNonRec(co->varip);
     #ifdef VM_COMPILED_CODE_MODE
         auto rip = InsPtr(next_call_target);
     #else
         auto rip = InsPtr(ip);
     #endif
-    sp += co->Resume(sp + 1, stack, stackframes, rip, curcoroutine);
+    co->Resume(rip, curcoroutine);
     JumpTo(rip);
     curcoroutine = co;
-    // must be, since those vars got backed up in it before
-    VMASSERT(curcoroutine->stackcopymax >=  *curcoroutine->varip);
-    curcoroutine->stackcopylen = *curcoroutine->varip;
-    //curcoroutine->BackupParentVars(vars);
     POP().DECTYPE(GetTypeInfo(curcoroutine->ti.yieldtype).t);    // previous current value
     for (int i = *curcoroutine->varip; i > 0; i--) {
         auto &var = vars[curcoroutine->varip[i]];
         // No INC, since parent is still on the stack and hold ref for us.
-        curcoroutine->stackcopy[i - 1] = var;
+        curcoroutine->parentvars[i - 1] = var;
         var = POP();
     }
     // the builtin call takes care of the return value
@@ -628,16 +771,30 @@ void VM::EndEval(Value &ret, ValueType vt) {
     assert(sp == -1);
     FinalStackVarsCleanup();
     vml.LogCleanup();
+    // With the cycle collector off, cycles show up as leaks, which helps find them.
+    if (cc.budget) cc.Collect(0);
     DumpLeaks();
     VMASSERT(!curcoroutine);
+    if (!prof.foldedfile.empty()) {
+        prof.Stop();
+        Output(OUTPUT_PROGRAM, "%s", prof.Report().c_str());
+        FILE *f = OpenForWriting(prof.foldedfile.c_str(), false);
+        if (f) {
+            fputs(prof.Folded().c_str(), f);
+            fclose(f);
+        }
+    }
     #ifdef VM_PROFILER
         Output(OUTPUT_INFO, "Profiler statistics:");
         uint64_t total = 0;
         auto fraction = 200;  // Line needs at least 0.5% to be counted.
-        vector<uint64_t> lineprofilecounts(bcf->lineinfo()->size());
+        auto lineinfo = bcf->lineinfo();
+        vector<uint64_t> lineprofilecounts(lineinfo->size());
+        size_t j = 0;
         for (size_t i = 0; i < codelen; i++) {
-            auto li = LookupLine(codestart + i, codestart, bcf); // FIXME: can do faster
-            size_t j = li - bcf->lineinfo()->Get(0);
+            // Both are sorted by code position, so no need to look up each line.
+            while (j + 1 < lineinfo->size() && lineinfo->Get((uint)j + 1)->bytecodestart() <= (int)i)
+                j++;
             lineprofilecounts[j] += byteprofilecounts[i];
             total += byteprofilecounts[i];
         }
@@ -674,10 +831,82 @@ void VM::EndEval(Value &ret, ValueType vt) {
         if (vm_count_fcalls)  // remove trivial VM executions from output
             Output(OUTPUT_INFO, "ins %lld, fcall %lld, bcall %lld", vm_count_ins, vm_count_fcalls,
                    vm_count_bcalls);
+        OpSequenceProfile(total);
+    #endif
+    halted = true;
+}
+
+int VM::FunctionArity(const Value &f) {
+    #ifdef VM_COMPILED_CODE_MODE
+        (void)f;
+        Error("cannot call function values from native code in compiled mode");
+        return 0;
+    #else
+        auto fip = f.ip().f;
+        VMASSERT(*fip == IL_FUNSTART);
+        return fip[1];
     #endif
-    throw string("end-eval");
 }
 
+// Calls f with its FunctionArity() arguments already pushed, for VMs that are not running any
+// other code, like worker VMs. Returns the function's return value.
+Value VM::CallFunction(const Value &f) {
+    VMASSERT(!stackframes.size() && !nativecall);
+    nativecall = true;
+    // Return to the function itself, so errors during the call get reported there.
+    StartStackFrame(-1, f.ip(), 0);
+    FunIntroPre(f.ip());
+    EvalProgram();
+    nativecall = false;
+    if (!errmsg.empty()) return Value();  // Stays halted, the caller must check errmsg.
+    halted = false;
+    return POP();
+}
+
+#ifdef VM_PROFILER
+// Finds the op pairs and triples that took the most executions, as candidates for
+// superinstructions. Only sequences that are not interrupted by a jump target are counted, such
+// that the least executed op in the sequence gives its execution count.
+void VM::OpSequenceProfile(uint64_t total) {
+    if (!total) return;
+    const size_t maxlen = 3;
+    const size_t numshown = 20;
+    map<vector<int>, uint64_t> seqcounts;
+    vector<const int *> window;
+    for (auto sip = codestart; sip < codestart + codelen; ) {
+        if (bcf->bytecode_attr()->Get(sip - codestart) & bytecode::Attr_SPLIT) window.clear();
+        window.push_back(sip);
+        if (window.size() > maxlen) window.erase(window.begin());
+        for (size_t n = 2; n <= window.size(); n++) {
+            vector<int> seq;
+            auto count = UINT64_MAX;
+            for (auto it = window.end() - n; it != window.end(); ++it) {
+                seq.push_back(**it);
+                count = min(count, byteprofilecounts[*it - codestart]);
+            }
+            if (count) seqcounts[seq] += count;
+        }
+        auto opc = *sip++;
+        ParseOpAndGetArity(opc, sip, codestart);
+    }
+    vector<pair<uint64_t, vector<int>>> sorted;
+    for (auto &sc : seqcounts) sorted.push_back(make_pair(sc.second, sc.first));
+    std::sort(sorted.begin(), sorted.end(), [] (const pair<uint64_t, vector<int>> &a,
+                                                const pair<uint64_t, vector<int>> &b) {
+        return a.first > b.first;
+    });
+    Output(OUTPUT_INFO, "Hottest op sequences:");
+    for (size_t i = 0; i < sorted.size() && i < numshown; i++) {
+        string s;
+        for (auto opc : sorted[i].second) {
+            if (!s.empty()) s += " ";
+            s += ILNames()[opc];
+        }
+        Output(OUTPUT_INFO, "%s: %.1f %%", s.c_str(), sorted[i].first * 100.0f / total);
+    }
+}
+#endif
+
 void VM::F_PUSHINT(VM_OP_ARGS) { PUSH(Value(*ip++)); }
 void VM::F_PUSHFLT(VM_OP_ARGS) { PUSH(Value(*(float *)ip)); ip++; }
 void VM::F_PUSHNIL(VM_OP_ARGS) { PUSH(Value()); }
@@ -715,6 +944,34 @@ void VM::F_CALL(VM_OP_ARGS_CALL) {
     FunIntroPre(InsPtr(fun));
 }
 
+// Like CALL, but the caller's frame is removed before the callee's is created, with the callee
+// returning straight to where the caller would have returned to. This is what allows recursion
+// in tail position to run in constant stack space. The code generator only emits this when
+// nothing on the stack or in the caller's vars can be needed after the call, see
+// CodeGen::CanTailCall.
+void VM::F_TAILCALL(VM_OP_ARGS_CALL) {
+    auto fvar = *ip++;
+    auto start = *ip++;
+    #ifdef VM_COMPILED_CODE_MODE
+        (void)fcont;
+        (void)start;
+        block_t fun = 0;  // Like CALL, the compiled code jumps to the function itself.
+        auto nargs = *ip++;  // Added by ToCPP, which doesn't include the bytecode.
+    #else
+        auto fun = codestart + start;
+        auto nargs = codestart[start + 1];
+    #endif
+    sp -= nargs;
+    tailcallargs.assign(TOPPTR(), TOPPTR() + nargs);
+    auto &stf = stackframes.back();
+    auto retip = stf.retip;
+    auto tm = stf.tempmask;
+    VarCleanup(nullptr, -1);
+    for (auto &a : tailcallargs) PUSH(a);
+    StartStackFrame(fvar, retip, tm);
+    FunIntroPre(InsPtr(fun));
+}
+
 void VM::F_CALLMULTI(VM_OP_ARGS_CALL) {
     #ifdef VM_COMPILED_CODE_MODE
         next_mm_call = ip;
@@ -723,10 +980,11 @@ void VM::F_CALLMULTI(VM_OP_ARGS_CALL) {
         auto fvar = *ip++;
         auto fun = *ip++;
         auto tm = *ip++;
+        auto cacheidx = *ip++;
         auto mip = codestart + fun;
         VMASSERT(*mip == IL_FUNMULTI);
         mip++;
-        EvalMulti(mip, fvar, ip, 0, tm);
+        EvalMulti(mip, fvar, ip, cacheidx, 0, tm);
     #endif
 }
 
@@ -736,7 +994,8 @@ void VM::F_FUNMULTI(VM_OP_ARGS) {
         auto fvar = *cip++;
         cip++;
         auto tm = *cip++;
-        EvalMulti(ip, fvar, cip, next_call_target, tm);
+        auto cacheidx = *cip++;
+        EvalMulti(ip, fvar, cip, cacheidx, next_call_target, tm);
     #else
         VMASSERT(false);
     #endif
@@ -821,6 +1080,7 @@ void VM::F_CONT1REF(VM_OP_ARGS) {
     i.setival(i.ival() + 1); \
     int len = 0; \
     if (i.ival() < (len = (L))) { \
+        SAMPLEPOINT(); \
         FOR_CONTINUE; \
     } else { \
         if (iterref) TOP().DECRT(); \
@@ -835,9 +1095,9 @@ void VM::F_CONT1REF(VM_OP_ARGS) {
     TYPE_ASSERT(i.type == V_INT); \
     PUSH(V);
 
-VM_JUMP_RET VM::F_IFOR() { FORLOOP(iter.ival(), false); }
-VM_JUMP_RET VM::F_VFOR() { FORLOOP(iter.eval()->Len(), true); }
-VM_JUMP_RET VM::F_SFOR() { FORLOOP(iter.sval()->len, true); }
+VM_JUMP_RET VM::F_IFOR(VM_OP_ARGS) { FORLOOP(iter.ival(), false); }
+VM_JUMP_RET VM::F_VFOR(VM_OP_ARGS) { FORLOOP(iter.eval()->Len(), true); }
+VM_JUMP_RET VM::F_SFOR(VM_OP_ARGS) { FORLOOP(iter.sval()->len, true); }
 
 void VM::F_IFORELEM(VM_OP_ARGS) { FORELEM(i); }
 void VM::F_VFORELEM(VM_OP_ARGS) { FORELEM(iter.eval()->AtInc(i.ival())); }
@@ -855,6 +1115,7 @@ void VM::F_BCALL0(VM_OP_ARGS) {
     #endif
     auto nf = natreg.nfuns[*ip++];
     Value v = nf->fun.f0();
+    if (halted) return;  // Runtime error.
     PUSH(v);
     BCallRetCheck(nf);
 }
@@ -865,6 +1126,7 @@ void VM::F_BCALL1(VM_OP_ARGS) {
     #endif
     auto nf = natreg.nfuns[*ip++];
     Value v = nf->fun.f1(POP());
+    if (halted) return;  // Runtime error.
     PUSH(v);
     BCallRetCheck(nf);
 }
@@ -877,6 +1139,7 @@ void VM::F_BCALL2(VM_OP_ARGS) {
     Value a1 = POP();
     Value a0 = POP();
     Value v = nf->fun.f2(a0, a1);
+    if (halted) return;  // Runtime error.
     PUSH(v);
     BCallRetCheck(nf);
 }
@@ -890,6 +1153,7 @@ void VM::F_BCALL3(VM_OP_ARGS) {
     Value a1 = POP();
     Value a0 = POP();
     Value v = nf->fun.f3(a0, a1, a2);
+    if (halted) return;  // Runtime error.
     PUSH(v);
     BCallRetCheck(nf);
 }
@@ -904,6 +1168,7 @@ void VM::F_BCALL4(VM_OP_ARGS) {
     Value a1 = POP();
     Value a0 = POP();
     Value v = nf->fun.f4(a0, a1, a2, a3);
+    if (halted) return;  // Runtime error.
     PUSH(v);
     BCallRetCheck(nf);
 }
@@ -919,6 +1184,7 @@ void VM::F_BCALL5(VM_OP_ARGS) {
     Value a1 = POP();
     Value a0 = POP();
     Value v = nf->fun.f5(a0, a1, a2, a3, a4);
+    if (halted) return;  // Runtime error.
     PUSH(v);
     BCallRetCheck(nf);
 }
@@ -935,6 +1201,7 @@ void VM::F_BCALL6(VM_OP_ARGS) {
     Value a1 = POP();
     Value a0 = POP();
     Value v = nf->fun.f6(a0, a1, a2, a3, a4, a5);
+    if (halted) return;  // Runtime error.
     PUSH(v);
     BCallRetCheck(nf);
 }
@@ -957,7 +1224,8 @@ void VM::F_DUPREF(VM_OP_ARGS) { auto x = TOP().INCRTNIL(); PUSH(x); }
 #define REFOP(exp) { res = exp; a.DECRTNIL(); b.DECRTNIL(); }
 #define GETARGS() Value b = POP(); Value a = POP()
 #define TYPEOP(op, extras, field, errstat) Value res; errstat; \
-    if (extras & 1 && b.field == 0) Div0(); res = a.field op b.field;
+    if (extras & 1 && b.field == 0) { Div0(); return; } \
+    res = a.field op b.field;
 
 #define _IOP(op, extras) \
     TYPEOP(op, extras, ival(), VMASSERT(a.type == V_INT && b.type == V_INT))
@@ -965,16 +1233,36 @@ void VM::F_DUPREF(VM_OP_ARGS) { auto x = TOP().INCRTNIL(); PUSH(x); }
     TYPEOP(op, extras, fval(), VMASSERT(a.type == V_FLOAT && b.type == V_FLOAT))
 
 #define _VELEM(a, i, isfloat, T) (isfloat ? (T)a.eval()->At(i).fval() : (T)a.eval()->At(i).ival())
+#define _VPACKED(v, isfloat) \
+    (v.ref()->ti.t == V_VECTOR && v.vval()->packed == (isfloat ? V_FLOAT : V_INT))
 #define _VOP(op, extras, T, isfloat, withscalar, comp) Value res; { \
     int len = VectorLoop(a, b, res, withscalar, comp ? GetTypeInfo(TYPE_ELEM_VECTOR_OF_INT) \
                                                      : a.eval()->ti); \
-    for (int j = 0; j < len; j++) { \
-        if (withscalar) VMTYPEEQ(b, isfloat ? V_FLOAT : V_INT) \
-        else VMTYPEEQ(b.eval()->At(j), isfloat ? V_FLOAT : V_INT); \
-        auto bv = withscalar ? (isfloat ? (T)b.fval() : (T)b.ival()) : _VELEM(b, j, isfloat, T); \
-        if (extras&1 && bv == 0) Div0(); \
-        VMTYPEEQ(a.eval()->At(j), isfloat ? V_FLOAT : V_INT); \
-        res.eval()->At(j) = Value(_VELEM(a, j, isfloat, T) op bv); \
+    if (len < 0) return; \
+    if (_VPACKED(a, isfloat) && (withscalar || _VPACKED(b, isfloat))) { \
+        /* Plain loops over the packed elements, which the compiler can vectorize. */ \
+        auto ap = a.vval()->PackedElems<T>(); \
+        auto bp = withscalar ? nullptr : b.vval()->PackedElems<T>(); \
+        auto bs = withscalar ? (isfloat ? (T)b.fval() : (T)b.ival()) : (T)0; \
+        if (comp) { \
+            auto rp = res.vval()->PackedElems<int>(); \
+            for (int j = 0; j < len; j++) rp[j] = ap[j] op (withscalar ? bs : bp[j]); \
+        } else { \
+            auto rp = res.vval()->PackedElems<T>(); \
+            if (extras&1) \
+                for (int j = 0; j < len; j++) \
+                    if ((withscalar ? bs : bp[j]) == 0) { Div0(); return; } \
+            for (int j = 0; j < len; j++) rp[j] = (T)(ap[j] op (withscalar ? bs : bp[j])); \
+        } \
+    } else { \
+        for (int j = 0; j < len; j++) { \
+            if (withscalar) VMTYPEEQ(b, isfloat ? V_FLOAT : V_INT) \
+            else VMTYPEEQ(b.eval()->At(j), isfloat ? V_FLOAT : V_INT); \
+            auto bv = withscalar ? (isfloat ? (T)b.fval() : (T)b.ival()) : _VELEM(b, j, isfloat, T); \
+            if (extras&1 && bv == 0) { Div0(); return; } \
+            VMTYPEEQ(a.eval()->At(j), isfloat ? V_FLOAT : V_INT); \
+            res.eval()->Set(j, Value(_VELEM(a, j, isfloat, T) op bv)); \
+        } \
     } \
     a.DECRT(); \
     if (!withscalar) b.DECRT(); \
@@ -983,8 +1271,17 @@ void VM::F_DUPREF(VM_OP_ARGS) { auto x = TOP().INCRTNIL(); PUSH(x); }
 #define _FVOP(op, extras, withscalar, fcomp) _VOP(op, extras, float, true, withscalar, fcomp)
 
 #define _SOP(op) Value res; REFOP((*a.sval()) op (*b.sval()))
+// If a is a temporary or a variable we hold the only reference to (s += t), append in place.
 #define _SCAT() Value res; \
-                REFOP(NewString(a.sval()->str(), a.sval()->len, b.sval()->str(), b.sval()->len))
+    if (a.sval()->refc == 1) { \
+        auto alen = a.sval()->len; \
+        auto ns = ResizeString(a.sval(), alen + b.sval()->len); \
+        memcpy(ns->str() + alen, b.sval()->str(), b.sval()->len); \
+        res = Value(ns); \
+        b.DECRT(); \
+    } else { \
+        REFOP(NewString(a.sval()->str(), a.sval()->len, b.sval()->str(), b.sval()->len)); \
+    }
 
 #define ACOMPEN(op) { GETARGS(); Value res; REFOP(a.any() op b.any()); PUSH(res); }
 
@@ -1055,6 +1352,43 @@ void VM::F_FVSGT(VM_OP_ARGS)  { FVSOPC(>,  0); }
 void VM::F_FVSLE(VM_OP_ARGS)  { FVSOPC(<=, 0); }
 void VM::F_FVSGE(VM_OP_ARGS)  { FVSOPC(>=, 0); }
 
+// Same, but on value structs unboxed onto the stack as n scalars, see CodeGen::GenUnboxed.
+#define _UOP(op, extras, T, isfloat, withscalar) { \
+    auto n = *ip++; \
+    auto b = TOPPTR() - (withscalar ? 1 : n); \
+    auto a = b - n; \
+    for (int j = 0; j < n; j++) { \
+        auto &bj = b[withscalar ? 0 : j]; \
+        VMTYPEEQ(bj, isfloat ? V_FLOAT : V_INT); \
+        auto bv = isfloat ? (T)bj.fval() : (T)bj.ival(); \
+        if (extras & 1 && bv == 0) { Div0(); return; } \
+        VMTYPEEQ(a[j], isfloat ? V_FLOAT : V_INT); \
+        a[j] = Value((isfloat ? (T)a[j].fval() : (T)a[j].ival()) op bv); \
+    } \
+    POPN(withscalar ? 1 : n); \
+}
+#define IVVUOP(op, extras) _UOP(op, extras, int, false, false)
+#define FVVUOP(op, extras) _UOP(op, extras, float, true, false)
+#define IVSUOP(op, extras) _UOP(op, extras, int, false, true)
+#define FVSUOP(op, extras) _UOP(op, extras, float, true, true)
+
+void VM::F_IVVADDU(VM_OP_ARGS) { IVVUOP(+, 0); }
+void VM::F_IVVSUBU(VM_OP_ARGS) { IVVUOP(-, 0); }
+void VM::F_IVVMULU(VM_OP_ARGS) { IVVUOP(*, 0); }
+void VM::F_IVVDIVU(VM_OP_ARGS) { IVVUOP(/, 1); }
+void VM::F_FVVADDU(VM_OP_ARGS) { FVVUOP(+, 0); }
+void VM::F_FVVSUBU(VM_OP_ARGS) { FVVUOP(-, 0); }
+void VM::F_FVVMULU(VM_OP_ARGS) { FVVUOP(*, 0); }
+void VM::F_FVVDIVU(VM_OP_ARGS) { FVVUOP(/, 1); }
+void VM::F_IVSADDU(VM_OP_ARGS) { IVSUOP(+, 0); }
+void VM::F_IVSSUBU(VM_OP_ARGS) { IVSUOP(-, 0); }
+void VM::F_IVSMULU(VM_OP_ARGS) { IVSUOP(*, 0); }
+void VM::F_IVSDIVU(VM_OP_ARGS) { IVSUOP(/, 1); }
+void VM::F_FVSADDU(VM_OP_ARGS) { FVSUOP(+, 0); }
+void VM::F_FVSSUBU(VM_OP_ARGS) { FVSUOP(-, 0); }
+void VM::F_FVSMULU(VM_OP_ARGS) { FVSUOP(*, 0); }
+void VM::F_FVSDIVU(VM_OP_ARGS) { FVSUOP(/, 1); }
+
 void VM::F_AEQ(VM_OP_ARGS) { ACOMPEN(==); }
 void VM::F_ANE(VM_OP_ARGS) { ACOMPEN(!=); }
 
@@ -1104,7 +1438,7 @@ void VM::F_FUMINUS(VM_OP_ARGS) { Value a = POP(); PUSH(Value(-a.fval())); }
     if (len >= 0) { \
         for (int i = 0; i < len; i++) { \
             VMTYPEEQ(a.eval()->At(i), isfloat ? V_FLOAT : V_INT); \
-            res.eval()->At(i) = Value(-_VELEM(a, i, isfloat, type)); \
+            res.eval()->Set(i, Value(-_VELEM(a, i, isfloat, type))); \
         } \
         a.DECRT(); \
         PUSH(res); \
@@ -1176,13 +1510,18 @@ void VM::F_PUSHVARREF(VM_OP_ARGS) { PUSH(vars[*ip++].INCRTNIL()); }
 void VM::F_PUSHFLD(VM_OP_ARGS)  { PushDerefField(*ip++); }
 void VM::F_PUSHFLDM(VM_OP_ARGS) { PushDerefField(*ip++); }
 void VM::F_PUSHIDXI(VM_OP_ARGS) { PushDerefIdx(POP().ival()); }
-void VM::F_PUSHIDXV(VM_OP_ARGS) { PushDerefIdx(GrabIndex(POP())); }
+void VM::F_PUSHIDXV(VM_OP_ARGS) {
+    auto i = GrabIndex(POP());
+    if (!halted) PushDerefIdx(i);
+}
 
 void VM::F_PUSHLOC(VM_OP_ARGS) {
     int i = *ip++;
     Value coro = POP();
     VMTYPEEQ(coro, V_COROUTINE);
-    PUSH(coro.cval()->GetVar(i));
+    auto var = coro.cval()->GetVar(i);
+    if (!var) return;
+    PUSH(*var);
     TOP().INCTYPE(GetVarTypeInfo(i).t);
     coro.DECRT();
 }
@@ -1192,8 +1531,9 @@ void VM::F_LVALLOC(VM_OP_ARGS) {
     int i = *ip++;
     Value coro = POP();
     VMTYPEEQ(coro, V_COROUTINE);
-    Value &a = coro.cval()->GetVar(i);
-    LvalueOp(lvalop, a);
+    auto a = coro.cval()->GetVar(i);
+    if (!a) return;
+    LvalueOp(lvalop, *a);
     coro.DECRT();
 }
 
@@ -1202,19 +1542,38 @@ void VM::F_LVALVAR(VM_OP_ARGS)    {
     LvalueOp(lvalop, vars[*ip++]);
 }
 
+void VM::F_PUSHVARFLD(VM_OP_ARGS) {
+    auto &r = vars[*ip++];
+    auto i = *ip++;
+    // Same as PushDerefField, but without having to inc/dec r.
+    if (r.ref()) PUSH(r.eval()->AtInc(i));
+    else PUSH(r);
+}
+
+void VM::F_LVALVARI(VM_OP_ARGS) {
+    int lvalop = *ip++;
+    auto &a = vars[*ip++];
+    PUSH(Value(*ip++));
+    LvalueOp(lvalop, a);
+}
+
 void VM::F_LVALIDXI(VM_OP_ARGS) { int lvalop = *ip++; LvalueObj(lvalop, POP().ival()); }
-void VM::F_LVALIDXV(VM_OP_ARGS) { int lvalop = *ip++; LvalueObj(lvalop, GrabIndex(POP())); }
+void VM::F_LVALIDXV(VM_OP_ARGS) {
+    int lvalop = *ip++;
+    auto i = GrabIndex(POP());
+    if (!halted) LvalueObj(lvalop, i);
+}
 void VM::F_LVALFLD(VM_OP_ARGS)  { int lvalop = *ip++; LvalueObj(lvalop, *ip++); }
 
 #ifdef VM_COMPILED_CODE_MODE
-    #define GJUMP(N, V, D1, C, P, D2) VM_JUMP_RET VM::N() \
+    #define GJUMP(N, V, D1, C, P, D2) VM_JUMP_RET VM::N(VM_OP_ARGS) \
         { V; D1; if (C) { P; return true; } else { D2; return false; } }
 #else
-    #define GJUMP(N, V, D1, C, P, D2) VM_JUMP_RET VM::N() \
+    #define GJUMP(N, V, D1, C, P, D2) VM_JUMP_RET VM::N(VM_OP_ARGS) \
         { V; auto nip = *ip++; D1; if (C) { ip = codestart + nip; P; } else { D2; } }
 #endif
 
-GJUMP(F_JUMP          ,               ,             , true     ,              ,             )
+GJUMP(F_JUMP          ,               ,             , true     , SAMPLEPOINT(),             )
 GJUMP(F_JUMPFAIL      , auto x = POP(),             , !x.True(),              ,             )
 GJUMP(F_JUMPFAILR     , auto x = POP(),             , !x.True(), PUSH(x)      ,             )
 GJUMP(F_JUMPFAILN     , auto x = POP(),             , !x.True(), PUSH(Value()),             )
@@ -1226,6 +1585,25 @@ GJUMP(F_JUMPFAILNREF  , auto x = POP(), x.DECRTNIL(), !x.True(), PUSH(Value()),
 GJUMP(F_JUMPNOFAILREF , auto x = POP(), x.DECRTNIL(),  x.True(),              ,             )
 GJUMP(F_JUMPNOFAILRREF, auto x = POP(),             ,  x.True(), PUSH(x)      , x.DECRTNIL())
 
+#define GETVARIMM() auto a = vars[*ip++]; auto b = Value(*ip++)
+#define UNBOXVARARGS() auto &v = vars[*ip++]; auto &ti = GetTypeInfo((type_elem_t)*ip++); \
+                       auto drop = *ip++
+#define UNBOXPUSH() { auto st = v.stval(); for (int i = 0; i < ti.len; i++) PUSH(st->At(i)); }
+GJUMP(F_JUMPFAILILT   , GETARGS()     ,             , a.ival() >= b.ival(),  ,             )
+GJUMP(F_JUMPFAILIGT   , GETARGS()     ,             , a.ival() <= b.ival(),  ,             )
+GJUMP(F_JUMPFAILILE   , GETARGS()     ,             , a.ival() >  b.ival(),  ,             )
+GJUMP(F_JUMPFAILIGE   , GETARGS()     ,             , a.ival() <  b.ival(),  ,             )
+GJUMP(F_JUMPFAILIEQ   , GETARGS()     ,             , a.ival() != b.ival(),  ,             )
+GJUMP(F_JUMPFAILINE   , GETARGS()     ,             , a.ival() == b.ival(),  ,             )
+GJUMP(F_JUMPFAILVILT  , GETVARIMM()   ,             , a.ival() >= b.ival(),  ,             )
+GJUMP(F_JUMPFAILVIGT  , GETVARIMM()   ,             , a.ival() <= b.ival(),  ,             )
+GJUMP(F_JUMPFAILVILE  , GETVARIMM()   ,             , a.ival() >  b.ival(),  ,             )
+GJUMP(F_JUMPFAILVIGE  , GETVARIMM()   ,             , a.ival() <  b.ival(),  ,             )
+GJUMP(F_JUMPFAILVIEQ  , GETVARIMM()   ,             , a.ival() != b.ival(),  ,             )
+GJUMP(F_JUMPFAILVINE  , GETVARIMM()   ,             , a.ival() == b.ival(),  ,             )
+// Jumps to the boxed version of the current expression if the var holds a subclass.
+GJUMP(F_UNBOXVAR      , UNBOXVARARGS(),             , &v.ref()->ti != &ti, POPN(drop), UNBOXPUSH())
+
 void VM::F_ISTYPE(VM_OP_ARGS) {
     auto to = (type_elem_t)*ip++;
     auto v = POP();
@@ -1256,64 +1634,285 @@ void VM::F_LOGWRITE(VM_OP_ARGS) {
     vml.LogWrite(vars[vidx], lidx);
 }
 
+#if VM_INTERP_DISPATCH_METHOD == VM_DISPATCH_DIRECT_THREADED && !defined(VM_COMPILED_CODE_MODE)
+
+// Interpreter loop that jumps directly from one op to the next through a table of label
+// addresses that runs parallel to the bytecode, rather than calling each op through a member
+// function pointer. This gives the branch predictor a separate indirect branch per op, and lets
+// the compiler keep ip/sp/stack in registers.
+// The most frequent ops that can't error or decrement refcounts are implemented inline below,
+// on locals that shadow the VM members of the same name, such that the PUSH/POP macros work
+// unchanged. All other ops call their regular F_ function, which requires syncing the locals
+// back to the VM before, and reloading them after (since e.g. the stack may get reallocated).
+void VM::EvalThreaded() {
+    #define F(N, A) &&L_##N,
+        static const void *labels[] = { ILNAMES };
+    #undef F
+    if (threadedcode.empty()) {
+        threadedcode.resize(codelen, nullptr);
+        for (auto tip = codestart; tip < codestart + codelen; ) {
+            auto opc = *tip;
+            if (opc < 0 || opc >= IL_MAX_OPS) {
+                Error("bytecode format problem: " + to_string(opc));
+                return;
+            }
+            threadedcode[tip - codestart] = labels[opc];
+            tip++;
+            ParseOpAndGetArity(opc, tip, codestart);
+        }
+    }
+    auto threaded = threadedcode.data();
+    auto tcodestart = codestart;
+    auto ip = this->ip;
+    auto sp = this->sp;
+    auto stack = this->stack;
+    #ifdef VM_PROFILER
+        #define THREADED_PROFILE() { byteprofilecounts[ip - codestart]++; vm_count_ins++; }
+    #else
+        #define THREADED_PROFILE()
+    #endif
+    #define DISPATCH() { THREADED_PROFILE(); goto *threaded[ip++ - tcodestart]; }
+    // Only ops implemented out of line can end the program (or the call of CallFunction()), but
+    // any op may halt it with a runtime error, see Error(). Inline ones only through VMASSERT, for
+    // which Error() needs to see the current ip/sp.
+    #define OUTOFLINE(N) L_##N: \
+        this->ip = ip; this->sp = sp; \
+        F_##N(); \
+        if (halted) return; \
+        ip = this->ip; sp = this->sp; stack = this->stack; \
+        DISPATCH();
+    #if defined(_DEBUG) && RTT_ENABLED
+        #define INLINESYNC() { this->ip = ip; this->sp = sp; }
+    #else
+        #define INLINESYNC()
+    #endif
+    #define INLINEOP(N, B) L_##N: INLINESYNC(); B; if (halted) return; DISPATCH();
+    #define TJUMP(N, V, C, P) L_##N: INLINESYNC(); \
+        { V; auto nip = *ip++; if (C) { ip = codestart + nip; P; } } \
+        if (halted) return; \
+        DISPATCH();
+
+    DISPATCH();
+
+    INLINEOP(PUSHINT,    PUSH(Value(*ip++)))
+    INLINEOP(PUSHFLT,    PUSH(Value(*(float *)ip)); ip++)
+    INLINEOP(PUSHNIL,    PUSH(Value()))
+    INLINEOP(PUSHVAR,    PUSH(vars[*ip++]))
+    INLINEOP(PUSHVARREF, PUSH(vars[*ip++].INCRTNIL()))
+
+    INLINEOP(POP,    (void)POP())
+    INLINEOP(DUP,    { auto x = TOP();            PUSH(x); })
+    INLINEOP(DUPREF, { auto x = TOP().INCRTNIL(); PUSH(x); })
+
+    INLINEOP(IADD, IOP(+,  0))
+    INLINEOP(ISUB, IOP(-,  0))
+    INLINEOP(IMUL, IOP(*,  0))
+    INLINEOP(ILT,  IOP(<,  0))
+    INLINEOP(IGT,  IOP(>,  0))
+    INLINEOP(ILE,  IOP(<=, 0))
+    INLINEOP(IGE,  IOP(>=, 0))
+    INLINEOP(IEQ,  IOP(==, 0))
+    INLINEOP(INE,  IOP(!=, 0))
+    INLINEOP(FADD, FOP(+,  0))
+    INLINEOP(FSUB, FOP(-,  0))
+    INLINEOP(FMUL, FOP(*,  0))
+    INLINEOP(FLT,  FOP(<,  0))
+    INLINEOP(FGT,  FOP(>,  0))
+    INLINEOP(FLE,  FOP(<=, 0))
+    INLINEOP(FGE,  FOP(>=, 0))
+    INLINEOP(FEQ,  FOP(==, 0))
+    INLINEOP(FNE,  FOP(!=, 0))
+
+    INLINEOP(IUMINUS, { Value a = POP(); PUSH(Value(-a.ival())); })
+    INLINEOP(FUMINUS, { Value a = POP(); PUSH(Value(-a.fval())); })
+    INLINEOP(LOGNOT,  { Value a = POP(); PUSH(!a.True()); })
+    INLINEOP(BINAND,  BITOP(&))
+    INLINEOP(BINOR,   BITOP(|))
+    INLINEOP(XOR,     BITOP(^))
+    INLINEOP(ASL,     BITOP(<<))
+    INLINEOP(ASR,     BITOP(>>))
+    INLINEOP(NEG,     { auto a = POP(); PUSH(~a.ival()); })
+    INLINEOP(I2F,     { Value a = POP(); VMTYPEEQ(a, V_INT); PUSH((float)a.ival()); })
+    INLINEOP(E2B,     { Value a = POP(); PUSH(a.True()); })
+
+    INLINEOP(FORLOOPI, { auto &i = TOPM(1); TYPE_ASSERT(i.type == V_INT); PUSH(i); })
+    INLINEOP(IFORELEM, { FORELEM(i); })
+    INLINEOP(VFORELEM, { FORELEM(iter.eval()->AtInc(i.ival())); })
+    INLINEOP(SFORELEM, { FORELEM(Value((int)((uchar *)iter.sval()->str())[i.ival()])); })
+    INLINEOP(IFOR,     FORLOOP(iter.ival(), false))
+
+    TJUMP(JUMP       ,               , true     , SAMPLEPOINT())
+    TJUMP(JUMPFAIL   , auto x = POP(), !x.True(),              )
+    TJUMP(JUMPFAILR  , auto x = POP(), !x.True(), PUSH(x)      )
+    TJUMP(JUMPFAILN  , auto x = POP(), !x.True(), PUSH(Value()))
+    TJUMP(JUMPNOFAIL , auto x = POP(),  x.True(),              )
+    TJUMP(JUMPNOFAILR, auto x = POP(),  x.True(), PUSH(x)      )
+    TJUMP(JUMPFAILILT , GETARGS()  , a.ival() >= b.ival(),  )
+    TJUMP(JUMPFAILIGT , GETARGS()  , a.ival() <= b.ival(),  )
+    TJUMP(JUMPFAILILE , GETARGS()  , a.ival() >  b.ival(),  )
+    TJUMP(JUMPFAILIGE , GETARGS()  , a.ival() <  b.ival(),  )
+    TJUMP(JUMPFAILIEQ , GETARGS()  , a.ival() != b.ival(),  )
+    TJUMP(JUMPFAILINE , GETARGS()  , a.ival() == b.ival(),  )
+    TJUMP(JUMPFAILVILT, GETVARIMM(), a.ival() >= b.ival(),  )
+    TJUMP(JUMPFAILVIGT, GETVARIMM(), a.ival() <= b.ival(),  )
+    TJUMP(JUMPFAILVILE, GETVARIMM(), a.ival() >  b.ival(),  )
+    TJUMP(JUMPFAILVIGE, GETVARIMM(), a.ival() <  b.ival(),  )
+    TJUMP(JUMPFAILVIEQ, GETVARIMM(), a.ival() != b.ival(),  )
+    TJUMP(JUMPFAILVINE, GETVARIMM(), a.ival() == b.ival(),  )
+
+    L_UNBOXVAR: {
+        UNBOXVARARGS();
+        auto nip = *ip++;
+        if (&v.ref()->ti != &ti) { POPN(drop); ip = codestart + nip; }
+        else UNBOXPUSH();
+        DISPATCH();
+    }
+    INLINEOP(IVVADDU, IVVUOP(+, 0))
+    INLINEOP(IVVSUBU, IVVUOP(-, 0))
+    INLINEOP(IVVMULU, IVVUOP(*, 0))
+    INLINEOP(FVVADDU, FVVUOP(+, 0))
+    INLINEOP(FVVSUBU, FVVUOP(-, 0))
+    INLINEOP(FVVMULU, FVVUOP(*, 0))
+    INLINEOP(IVSADDU, IVSUOP(+, 0))
+    INLINEOP(IVSSUBU, IVSUOP(-, 0))
+    INLINEOP(IVSMULU, IVSUOP(*, 0))
+    INLINEOP(FVSADDU, FVSUOP(+, 0))
+    INLINEOP(FVSSUBU, FVSUOP(-, 0))
+    INLINEOP(FVSMULU, FVSUOP(*, 0))
+
+    INLINEOP(PUSHVARFLD, {
+        auto &r = vars[*ip++];
+        auto i = *ip++;
+        if (r.ref()) PUSH(r.eval()->AtInc(i));
+        else PUSH(r);
+    })
+    L_LVALVARI: {
+        auto lvalop = *ip++;
+        auto &a = vars[*ip++];
+        auto c = *ip++;
+        switch (lvalop) {
+            case LVO_WRITE: a = Value(c); break;
+            case LVO_IADD:  a.setival(a.ival() + c); break;
+            case LVO_ISUB:  a.setival(a.ival() - c); break;
+            default:
+                PUSH(Value(c));
+                this->ip = ip; this->sp = sp;
+                LvalueOp(lvalop, a);
+                if (halted) return;
+                sp = this->sp; stack = this->stack;
+                break;
+        }
+        DISPATCH();
+    }
+
+    OUTOFLINE(PUSHSTR) OUTOFLINE(LVALVAR)
+    OUTOFLINE(PUSHIDXI) OUTOFLINE(PUSHIDXV) OUTOFLINE(LVALIDXI) OUTOFLINE(LVALIDXV)
+    OUTOFLINE(PUSHFLD) OUTOFLINE(PUSHFLDM) OUTOFLINE(LVALFLD)
+    OUTOFLINE(PUSHLOC) OUTOFLINE(LVALLOC)
+    OUTOFLINE(BCALL0) OUTOFLINE(BCALL1) OUTOFLINE(BCALL2) OUTOFLINE(BCALL3) OUTOFLINE(BCALL4)
+    OUTOFLINE(BCALL5) OUTOFLINE(BCALL6)
+    OUTOFLINE(CONT1) OUTOFLINE(CONT1REF)
+    OUTOFLINE(FUNSTART) OUTOFLINE(FUNEND) OUTOFLINE(FUNMULTI)
+    OUTOFLINE(NEWVEC)
+    OUTOFLINE(POPREF)
+    OUTOFLINE(EXIT)
+    OUTOFLINE(IDIV) OUTOFLINE(IMOD) OUTOFLINE(FDIV) OUTOFLINE(FMOD)
+    OUTOFLINE(SADD) OUTOFLINE(SSUB) OUTOFLINE(SMUL) OUTOFLINE(SDIV) OUTOFLINE(SMOD)
+    OUTOFLINE(SLT) OUTOFLINE(SGT) OUTOFLINE(SLE) OUTOFLINE(SGE) OUTOFLINE(SEQ) OUTOFLINE(SNE)
+    OUTOFLINE(IVVADD) OUTOFLINE(IVVSUB) OUTOFLINE(IVVMUL) OUTOFLINE(IVVDIV) OUTOFLINE(IVVMOD)
+    OUTOFLINE(IVVLT) OUTOFLINE(IVVGT) OUTOFLINE(IVVLE) OUTOFLINE(IVVGE)
+    OUTOFLINE(FVVADD) OUTOFLINE(FVVSUB) OUTOFLINE(FVVMUL) OUTOFLINE(FVVDIV) OUTOFLINE(FVVMOD)
+    OUTOFLINE(FVVLT) OUTOFLINE(FVVGT) OUTOFLINE(FVVLE) OUTOFLINE(FVVGE)
+    OUTOFLINE(IVSADD) OUTOFLINE(IVSSUB) OUTOFLINE(IVSMUL) OUTOFLINE(IVSDIV) OUTOFLINE(IVSMOD)
+    OUTOFLINE(IVSLT) OUTOFLINE(IVSGT) OUTOFLINE(IVSLE) OUTOFLINE(IVSGE)
+    OUTOFLINE(FVSADD) OUTOFLINE(FVSSUB) OUTOFLINE(FVSMUL) OUTOFLINE(FVSDIV) OUTOFLINE(FVSMOD)
+    OUTOFLINE(FVSLT) OUTOFLINE(FVSGT) OUTOFLINE(FVSLE) OUTOFLINE(FVSGE)
+    OUTOFLINE(IVVDIVU) OUTOFLINE(FVVDIVU)
+    OUTOFLINE(IVSDIVU) OUTOFLINE(FVSDIVU)
+    OUTOFLINE(AEQ) OUTOFLINE(ANE)
+    OUTOFLINE(IVUMINUS) OUTOFLINE(FVUMINUS)
+    OUTOFLINE(LOGNOTREF)
+    OUTOFLINE(A2S) OUTOFLINE(I2A) OUTOFLINE(F2A) OUTOFLINE(E2BREF)
+    OUTOFLINE(RETURN)
+    OUTOFLINE(ISTYPE) OUTOFLINE(COCL) OUTOFLINE(COEND)
+    OUTOFLINE(LOGREAD) OUTOFLINE(LOGWRITE)
+    OUTOFLINE(CALL) OUTOFLINE(TAILCALL) OUTOFLINE(CALLMULTI) OUTOFLINE(CALLV) OUTOFLINE(CALLVCOND)
+    OUTOFLINE(PUSHFUN) OUTOFLINE(CORO) OUTOFLINE(YIELD)
+    OUTOFLINE(JUMPFAILREF) OUTOFLINE(JUMPFAILRREF) OUTOFLINE(JUMPFAILNREF)
+    OUTOFLINE(JUMPNOFAILREF) OUTOFLINE(JUMPNOFAILRREF)
+    OUTOFLINE(SFOR) OUTOFLINE(VFOR)
+
+    #undef TJUMP
+    #undef INLINEOP
+    #undef OUTOFLINE
+    #undef INLINESYNC
+    #undef DISPATCH
+    #undef THREADED_PROFILE
+}
+
+#endif
+
+// Runs until the program ends (see EndEval) or the function called by CallFunction() returns,
+// both of which set halted. Runtime errors don't return here, see Error().
 void VM::EvalProgram() {
-    try {
-        for (;;) {
-            #ifdef VM_COMPILED_CODE_MODE
-                #if VM_DISPATCH_METHOD == VM_DISPATCH_TRAMPOLINE
-                    compiled_code_ip = ((block_t)compiled_code_ip)();
-                #elif VM_DISPATCH_METHOD == VM_DISPATCH_SWITCH_GOTO
-                    ((block_base_t)compiled_code_ip)();
-                    assert(false);  // Should not return here.
-                #endif
-            #else
-                #ifdef _DEBUG
-                    if (trace) {
-                        if (!trace_tail) trace_output.clear();
-                        DisAsmIns(trace_output, ip, codestart, typetable, bcf);
-                        trace_output += " [";
-                        trace_output += to_string(sp + 1);
-                        trace_output += "] - ";
-                        #if RTT_ENABLED
-                        if (sp >= 0) {
-                            auto x = TOP();
-                            trace_output += x.ToString(x.type, debugpp);
-                        }
-                        if (sp >= 1) {
-                            auto x = TOPM(1);
-                            trace_output += " ";
-                            trace_output += x.ToString(x.type, debugpp);
-                        }
-                        #endif
-                        if (trace_tail) {
-                            trace_output += "\n";
-                            const int trace_max = 10000;
-                            if (trace_output.length() > trace_max)
-                                trace_output.erase(0, trace_max / 2);
-                        } else {
-                            Output(OUTPUT_INFO, "%s", trace_output.c_str());
-                        }
+    #if VM_INTERP_DISPATCH_METHOD == VM_DISPATCH_DIRECT_THREADED && \
+        !defined(VM_COMPILED_CODE_MODE)
+        EvalThreaded();
+    #else
+    while (!halted) {
+        #ifdef VM_COMPILED_CODE_MODE
+            #if VM_DISPATCH_METHOD == VM_DISPATCH_TRAMPOLINE
+                compiled_code_ip = ((block_t)compiled_code_ip)();
+            #elif VM_DISPATCH_METHOD == VM_DISPATCH_SWITCH_GOTO
+                ((block_base_t)compiled_code_ip)();  // Only returns once halted.
+            #endif
+        #else
+            #ifdef _DEBUG
+                if (trace) {
+                    if (!trace_tail) trace_output.clear();
+                    DisAsmIns(trace_output, ip, codestart, typetable, bcf);
+                    trace_output += " [";
+                    trace_output += to_string(sp + 1);
+                    trace_output += "] - ";
+                    #if RTT_ENABLED
+                    if (sp >= 0) {
+                        auto x = TOP();
+                        trace_output += x.ToString(x.type, debugpp);
+                    }
+                    if (sp >= 1) {
+                        auto x = TOPM(1);
+                        trace_output += " ";
+                        trace_output += x.ToString(x.type, debugpp);
+                    }
+                    #endif
+                    if (trace_tail) {
+                        trace_output += "\n";
+                        const int trace_max = 10000;
+                        if (trace_output.length() > trace_max)
+                            trace_output.erase(0, trace_max / 2);
+                    } else {
+                        Output(OUTPUT_INFO, "%s", trace_output.c_str());
                     }
-                    //currentline = LookupLine(ip).line;
-                #endif
-                #ifdef VM_PROFILER
-                    auto code_idx = size_t(ip - codestart);
-                    assert(code_idx < codelen);
-                    byteprofilecounts[code_idx]++;
-                    vm_count_ins++;
-                #endif
-                auto op = *ip++;
-                #ifdef _DEBUG
-                    if (op < 0 || op >= IL_MAX_OPS)
-                        Error("bytecode format problem: " + to_string(op));
-                #endif
-                ((*this).*(f_ins_pointers[op]))();
+                }
+                //currentline = LookupLine(ip).line;
             #endif
-        }
-    }
-    catch (string &s) {
-        if (s != "end-eval") throw s;
+            #ifdef VM_PROFILER
+                auto code_idx = size_t(ip - codestart);
+                assert(code_idx < codelen);
+                byteprofilecounts[code_idx]++;
+                vm_count_ins++;
+            #endif
+            auto op = *ip++;
+            #ifdef _DEBUG
+                if (op < 0 || op >= IL_MAX_OPS) {
+                    Error("bytecode format problem: " + to_string(op));
+                    return;
+                }
+            #endif
+            ((*this).*(f_ins_pointers[op]))();
+        #endif
     }
+    #endif
 }
 
 void VM::PushDerefField(int i)  {
@@ -1329,11 +1928,11 @@ void VM::PushDerefIdx(int i)  {
     switch (r.ref()->ti.t)  {
         case V_STRUCT:  // Struct::vectortype
         case V_VECTOR:
-            IDXErr(i, r.eval()->Len(), r.eval());
+            if (!IDXErr(i, r.eval()->Len(), r.eval())) return;
             PUSH(r.eval()->AtInc(i));
             break;
         case V_STRING:
-            IDXErr(i, r.sval()->len, r.sval());
+            if (!IDXErr(i, r.sval()->len, r.sval())) return;
             PUSH(Value((int)((uchar *)r.sval()->str())[i]));
             break;
         default:
@@ -1345,9 +1944,15 @@ void VM::PushDerefIdx(int i)  {
 void VM::LvalueObj(int lvalop, int i) {
     Value vec = POP();
     TYPE_ASSERT(IsVector(vec.type));
-    IDXErr(i, (int)vec.eval()->Len(), vec.eval());
-    Value &a = vec.eval()->At(i);
-    LvalueOp(lvalop, a);
+    if (!IDXErr(i, (int)vec.eval()->Len(), vec.eval())) return;
+    if (vec.ref()->ti.t == V_VECTOR && vec.vval()->packed != V_NIL) {
+        // No Value to refer to, so operate on a copy and write it back.
+        auto a = vec.vval()->At(i);
+        LvalueOp(lvalop, a);
+        vec.vval()->Set(i, a);
+    } else {
+        LvalueOp(lvalop, vec.ref()->ti.t == V_VECTOR ? vec.vval()->AtRef(i) : vec.stval()->At(i));
+    }
     vec.DECRT();
 }
 
@@ -1454,8 +2059,11 @@ string VM::ProperTypeName(const TypeInfo &ti) {
     return BaseTypeName(ti.t);
 }
 
-void VM::IDXErr(int i, int n, const RefObj *v) {
-    if (i < 0 || i >= n) Error("index " + to_string(i) + " out of range " + to_string(n), v);
+// Returns false after reporting an error if i is out of range.
+bool VM::IDXErr(int i, int n, const RefObj *v) {
+    if (i >= 0 && i < n) return true;
+    Error("index " + to_string(i) + " out of range " + to_string(n), v);
+    return false;
 }
 
 void VM::BCallRetCheck(const void *_nf) {
@@ -1487,8 +2095,9 @@ int VM::GrabIndex(const Value &idx) {
             return sidx.ival();
         }
         TYPE_ASSERT(IsVector(v.type));
-        IDXErr(sidx.ival(), v.eval()->Len(), v.eval());
-        auto nv = v.eval()->At(sidx.ival()).INCRT();
+        if (!IDXErr(sidx.ival(), v.eval()->Len(), v.eval())) return -1;
+        auto nv = v.eval()->At(sidx.ival());
+        nv.INCRT();
         v.DECRT();
         v = nv;
     }
@@ -1500,10 +2109,19 @@ int VM::VectorLoop(const Value &a, const Value &b, Value &res, bool withscalar,
     int len = a.eval()->Len();
     if (!withscalar) {
         TYPE_ASSERT(IsVector(b.type));
-        if (b.eval()->Len() != len)
+        if (b.eval()->Len() != len) {
             Error("vectors operation: vector must be same length", a.eval(), b.eval());
+            return -1;
+        }
+    }
+    // If we hold the only reference to a, the result can overwrite it element by element, since
+    // a is always consumed by the caller.
+    if (a.eval()->refc == 1 && &a.eval()->ti == &desttype) {
+        res = a;
+        res.INCRT();
+    } else {
+        res = Value(NewVector(len, len, desttype));
     }
-    res = Value(NewVector(len, len, desttype));
     return len;
 }
 
@@ -1520,12 +2138,18 @@ const char *VM::ReverseLookupType(uint v) {
 }
 
 int VM::GC() {  // shouldn't really be used, but just in case
+    if (curcoroutine) {
+        Error("collect_garbage() cannot be called from a coroutine");
+        return 0;
+    }
     for (int i = 0; i <= sp; i++) {
         //stack[i].Mark(?);
         // TODO: we could actually walk the stack here and recover correct types, but it is so easy
         // to avoid this error that that may not be worth it.
-        if (stack[i].True())  // Typically all nil
+        if (stack[i].True()) {  // Typically all nil
             Error("collect_garbage() must be called from a top level function");
+            return 0;
+        }
     }
     for (uint i = 0; i < bcf->specidents()->size(); i++) vars[i].Mark(GetVarTypeInfo(i).t);
     vml.LogMark();
@@ -1547,10 +2171,11 @@ int VM::GC() {  // shouldn't really be used, but just in case
     return (int)leaks.size();
 }
 
-void RunBytecode(const char *programname, vector<uchar> &&bytecode, const void *entry_point,
-                 const void *static_bytecode) {
+string RunBytecode(const char *programname, vector<uchar> &&bytecode, const void *entry_point,
+                   const void *static_bytecode) {
     new VM(programname, std::move(bytecode), entry_point, static_bytecode);  // Sets up g_vm
     g_vm->EvalProgram();
+    return g_vm->errmsg;
 }
 
 }  // namespace lobster
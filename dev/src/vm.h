@@ -14,9 +14,13 @@
 
 namespace lobster {
 
-    // This will spin up a new VM, run the code, and tear it down again.
-    extern void RunBytecode(const char *programname, vector<uchar> &&bytecode,
-                            const void *entry_point, const void *static_bytecode);
+    // This will spin up a new VM (in g_vm, for the caller to delete) and run the code. Returns the
+    // runtime error, if any.
+    extern string RunBytecode(const char *programname, vector<uchar> &&bytecode,
+                              const void *entry_point, const void *static_bytecode);
+
+    // Makes the next VM that runs profile itself, and write out the results when it ends.
+    extern void ProfileNextRun(const char *foldedfilename);
 
     extern void DisAsm(string &s, const uchar *bytecode_buffer);
 
@@ -21,6 +21,8 @@ namespace lobster {
 BoxedInt::BoxedInt(int _v) : RefObj(g_vm->GetTypeInfo(TYPE_ELEM_BOXEDINT)), val(_v) {}
 BoxedFloat::BoxedFloat(float _v) : RefObj(g_vm->GetTypeInfo(TYPE_ELEM_BOXEDFLOAT)), val(_v) {}
 LString::LString(int _l) : RefObj(g_vm->GetTypeInfo(TYPE_ELEM_STRING)), len(_l) {}
+CycleObj::CycleObj(const TypeInfo &_ti)
+    : RefObj(_ti), cyclebits(g_vm->cc.CanCycle(_ti) ? CYCLE_TYPE : 0) {}
 
 char HexChar(char i) { return i + (i < 10 ? '0' : 'A' - 10); }
 
@@ -64,12 +66,6 @@ int ElemObj::Len() const {
     return ti.len;
 }
 
-Value &ElemObj::At(int i) const {
-    if (ti.t == V_VECTOR) return ((LVector *)this)->At(i);
-    assert(ti.t == V_STRUCT);
-    return ((LStruct *)this)->At(i);
-};
-
 ValueType ElemObj::ElemType(int i) const {
     auto &sti = g_vm->GetTypeInfo(ti.t == V_VECTOR ? ti.subt : ti.elems[i]);
     auto vt = sti.t;
@@ -103,24 +99,37 @@ string ElemObj::ToString(PrintPrefs &pp) {
 
 LVector::LVector(int _initial, int _max, const TypeInfo &_ti)
     : ElemObj(_ti), len(_initial), maxl(_max) {
-    v = maxl ? AllocSubBuf<Value>(maxl, g_vm->GetTypeInfo(TYPE_ELEM_VALUEBUF)) : nullptr;
+    auto et = ElemTypeInfo().t;
+    packed = IsScalar(et) ? et : V_NIL;
+    v = maxl ? (Value *)AllocSubBuf<char>(maxl * ElemSize(), g_vm->GetTypeInfo(TYPE_ELEM_VALUEBUF))
+             : nullptr;
 }
 
 const TypeInfo &LVector::ElemTypeInfo() const { return g_vm->GetTypeInfo(ti.subt); }
 
 void LVector::Resize(int newmax) {
     // FIXME: check overflow
-    auto mem = AllocSubBuf<Value>(newmax, g_vm->GetTypeInfo(TYPE_ELEM_VALUEBUF));
-    if (len) memcpy(mem, v, sizeof(Value) * len);
+    auto es = ElemSize();
+    auto mem = AllocSubBuf<char>(newmax * es, g_vm->GetTypeInfo(TYPE_ELEM_VALUEBUF));
+    if (len) memcpy(mem, v, es * len);
     DeallocBuf();
     maxl = newmax;
-    v = mem;
+    v = (Value *)mem;
 }
 
 void LVector::Append(LVector *from, int start, int amount) {
-    if (len + amount > maxl) Resize(len + amount);  // FIXME: check overflow
-    memcpy(v + len, from->v + start, sizeof(Value) * amount);
-    if (IsRefNil(from->ElemTypeInfo().t)) {
+    if (len + amount > maxl) Resize(max(len + amount, maxl * 2));  // FIXME: check overflow
+    if (packed != from->packed) {
+        // Only scalars can be converted between representations, no refcounts involved.
+        for (int i = 0; i < amount; i++) {
+            len++;
+            Set(len - 1, from->At(start + i));
+        }
+        return;
+    }
+    auto es = ElemSize();
+    memcpy((char *)v + len * es, (char *)from->v + start * es, es * amount);
+    if (packed == V_NIL && IsRefNil(from->ElemTypeInfo().t)) {
         for (int i = 0; i < amount; i++) v[len + i].INCRTNIL();
     }
     len += amount;
@@ -128,6 +137,7 @@ void LVector::Append(LVector *from, int start, int amount) {
 
 void RefObj::DECDELETE(bool deref) {
     assert(refc == 0);
+    if (IsCycleType(ti.t)) g_vm->cc.Forget((CycleObj *)this);
     switch (ti.t) {
         case V_BOXEDINT:   vmpool->dealloc(this, sizeof(BoxedInt)); break;
         case V_BOXEDFLOAT: vmpool->dealloc(this, sizeof(BoxedFloat)); break;
@@ -154,6 +164,53 @@ bool RefEqual(const RefObj *a, const RefObj *b, bool structural) {
     }
 }
 
+// Consistent with RefEqual(structural = true): objects that are equal have the same hash.
+uint64_t RefHash(const RefObj *ro) {
+    if (!ro) return 0;
+    switch (ro->ti.t) {
+        case V_BOXEDINT:    return Value(((BoxedInt *)ro)->val).Hash(V_INT);
+        case V_BOXEDFLOAT:  return Value(((BoxedFloat *)ro)->val).Hash(V_FLOAT);
+        case V_STRING:      return HashMix(HashBytes(FNV_OFFSET, ((LString *)ro)->str(),
+                                                     ((LString *)ro)->len));
+        case V_COROUTINE:   return HashMix((size_t)ro);  // Only equal to itself.
+        case V_VECTOR:
+        case V_STRUCT:      return ((ElemObj *)ro)->Hash();
+        default:            assert(0); return 0;
+    }
+}
+
+// Copies v from the heap of another VM running the same bytecode (and thus typetable) into the
+// current one. The other heap must not change while this runs. done maps objects already copied,
+// so shared references and cycles are preserved. vt must not be able to hold coroutines, which
+// the caller checks, since an error here would be raised in the wrong VM.
+Value CopyFromHeap(const Value &v, ValueType vt, unordered_map<const RefObj *, RefObj *> &done) {
+    if (!IsRefNil(vt) || !v.ref()) return v;
+    auto ro = v.ref();
+    auto it = done.find(ro);
+    if (it != done.end()) {
+        it->second->Inc();
+        return Value(it->second);
+    }
+    RefObj *n = nullptr;
+    switch (ro->ti.t) {
+        case V_BOXEDINT:   n = g_vm->NewInt(((BoxedInt *)ro)->val); break;
+        case V_BOXEDFLOAT: n = g_vm->NewFloat(((BoxedFloat *)ro)->val); break;
+        case V_STRING:     n = g_vm->NewString(((LString *)ro)->str(), ((LString *)ro)->len); break;
+        case V_VECTOR:
+        case V_STRUCT: {
+            auto e = (ElemObj *)ro;
+            auto len = e->Len();
+            auto ne = g_vm->NewVector(len, len, ro->ti);
+            done[ro] = ne;
+            for (int i = 0; i < len; i++) ne->Set(i, CopyFromHeap(e->At(i), e->ElemType(i), done));
+            return Value(ne);
+        }
+        default:           assert(0);
+    }
+    done[ro] = n;
+    return Value(n);
+}
+
 bool Value::Equal(ValueType vtype, const Value &o, ValueType otype, bool structural) const {
     if (vtype != otype) return false;
     switch (vtype) {
@@ -164,6 +221,19 @@ bool Value::Equal(ValueType vtype, const Value &o, ValueType otype, bool structu
     }
 }
 
+uint64_t Value::Hash(ValueType vtype) const {
+    switch (vtype) {
+        case V_INT: return HashMix((uint64_t)ival_);
+        case V_FLOAT: {
+            uint64_t bits = 0;
+            if (fval_ != 0) memcpy(&bits, &fval_, sizeof(floatp));  // Since 0.0 == -0.0.
+            return HashMix(bits);
+        }
+        case V_FUNCTION: return HashMix((size_t)ip_.f);
+        default: return RefHash(refnil());
+    }
+}
+
 string RefToString(const RefObj *ro, PrintPrefs &pp) {
     if (!ro) return "nil";
     switch (ro->ti.t) {
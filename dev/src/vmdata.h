@@ -122,9 +122,20 @@ struct PrintPrefs {
 
 #define VM_DISPATCH_TRAMPOLINE 1
 #define VM_DISPATCH_SWITCH_GOTO 2
+#define VM_DISPATCH_DIRECT_THREADED 3  // Bytecode interpreter only, needs GCC's "labels as values".
 
+// How code generated by --to-cpp dispatches (either of the first two above).
 #define VM_DISPATCH_METHOD VM_DISPATCH_TRAMPOLINE
 
+// How the bytecode interpreter dispatches, can be overridden with -D on the command line.
+#ifndef VM_INTERP_DISPATCH_METHOD
+    #if defined(__GNUC__) && !defined(_DEBUG)
+        #define VM_INTERP_DISPATCH_METHOD VM_DISPATCH_DIRECT_THREADED
+    #else
+        #define VM_INTERP_DISPATCH_METHOD VM_DISPATCH_TRAMPOLINE
+    #endif
+#endif
+
 typedef void *(*block_base_t)();
 #if VM_DISPATCH_METHOD == VM_DISPATCH_TRAMPOLINE
     typedef block_base_t block_t;
@@ -135,8 +146,8 @@ typedef void *(*block_base_t)();
 struct VM;
 
 // the 2 globals that make up the current VM instance
-extern VM *g_vm;
-extern SlabAlloc *vmpool;
+extern thread_local VM *g_vm;
+extern thread_local SlabAlloc *vmpool;
 
 // ANY memory allocated by the VM must inherit from this, so we can identify leaked memory
 struct DynAlloc {
@@ -154,10 +165,7 @@ struct RefObj : DynAlloc {
         refc++;
     }
 
-    void Dec() {
-        refc--;
-        if (refc <= 0) DECDELETE(true);
-    }
+    inline void Dec();
 
     void CycleDone(int &cycles) {
         refc = -(++cycles);
@@ -169,7 +177,38 @@ struct RefObj : DynAlloc {
     void Mark();
 };
 
+inline bool IsCycleType(ValueType t) { return t == V_VECTOR || t == V_STRUCT || t == V_COROUTINE; }
+
+// Base of the objects that can be part of a cycle, i.e. vectors, structs and coroutines. Those
+// whose type allows them to (indirectly) refer to themselves have CYCLE_TYPE set, and get buffered
+// as possible roots of garbage cycles whenever their refc drops to non-zero (see CycleCollector).
+struct CycleObj : RefObj {
+    uint cyclebits;  // CYCLE_TYPE | color | (index in CycleCollector::candidates + 1) << 3.
+
+    CycleObj(const TypeInfo &_ti);
+
+    inline void MaybeGarbage();
+};
+
+enum {
+    CYCLE_TYPE = 1,
+    CYCLE_BLACK = 0,    // In use (or not visited).
+    CYCLE_GRAY = 2,     // Possible member of a garbage cycle.
+    CYCLE_WHITE = 4,    // Member of a garbage cycle.
+    CYCLE_GARBAGE = 6,  // Member of a garbage cycle, about to be deleted.
+    CYCLE_COLOR = 6,
+    CYCLE_INDEX_SHIFT = 3
+};
+
+void RefObj::Dec() {
+    refc--;
+    if (refc <= 0) DECDELETE(true);
+    else if (IsCycleType(ti.t)) ((CycleObj *)this)->MaybeGarbage();
+}
+
 extern bool RefEqual(const RefObj *a, const RefObj *b, bool structural);
+extern uint64_t RefHash(const RefObj *ro);
+extern Value CopyFromHeap(const Value &v, ValueType vt, unordered_map<const RefObj *, RefObj *> &done);
 extern string RefToString(const RefObj *ro, PrintPrefs &pp);
 
 struct BoxedInt : RefObj {
@@ -213,7 +252,7 @@ struct InsPtr {
     #endif
     InsPtr() : f(0) {}
     bool operator==(const InsPtr o) const { return f == o.f; }
-    int CallerId() { return (int)f; }
+    int CallerId() { return (int)(size_t)f; }
 };
 
 #if RTT_ENABLED
@@ -301,6 +340,7 @@ struct Value {
 
     string ToString(ValueType vtype, PrintPrefs &pp) const;
     bool Equal(ValueType vtype, const Value &o, ValueType otype, bool structural) const;
+    uint64_t Hash(ValueType vtype) const;
     void Mark(ValueType vtype);
     void MarkRef();
 };
@@ -318,28 +358,26 @@ template<typename T> inline void DeallocSubBuf(T *v, size_t size) {
     vmpool->dealloc(mem, size * sizeof(T) + sizeof(TypeInfo *));
 }
 
-struct ElemObj : RefObj {
-    ElemObj(const TypeInfo &_ti) : RefObj(_ti) {}
+struct ElemObj : CycleObj {
+    ElemObj(const TypeInfo &_ti) : CycleObj(_ti) {}
 
     int Len() const;
 
-    Value &At(int i) const;
+    // Returns a copy, since packed vectors don't store Values. Use Set() to write.
+    const Value At(int i) const;
 
-    void Init(Value *from, int len, bool inc) {
-        assert(len == Len());
-        if (len) {
-            memcpy(&At(0), from, len * sizeof(Value));
-            if (inc) IncAll();
-        }
-    }
+    void Set(int i, const Value &val);
+
+    void Init(Value *from, int len, bool inc);
 
     ValueType ElemType(int i) const;
 
     // TODO: If any of the methods below ever become performance critical, we can duplicate them
     // over LVector/LStruct, such that the check for which type it is only is made once.
 
-    Value &AtInc(int i) const {
-        return At(i).INCTYPE(ElemType(i));
+    Value AtInc(int i) const {
+        auto x = At(i);
+        return x.INCTYPE(ElemType(i));
     }
 
     void Dec(int i) const {
@@ -364,9 +402,25 @@ struct ElemObj : RefObj {
         return true;
     }
 
+    uint64_t Hash() {
+        uint64_t h = Len();
+        for (int i = 0; i < Len(); i++) h = (h ^ At(i).Hash(ElemType(i))) * 0x100000001b3ULL;
+        return HashMix(h);
+    }
+
     void Mark() {
-        for (int i = 0; i < Len(); i++)
-            At(i).Mark(ElemType(i));
+        for (int i = 0; i < Len(); i++) {
+            auto x = At(i);
+            x.Mark(ElemType(i));
+        }
+    }
+
+    template<typename F> void ForEachRef(F f) const {
+        for (int i = 0; i < Len(); i++) {
+            if (!IsRefNil(ElemType(i))) continue;
+            auto x = At(i);
+            if (x.any()) f((RefObj *)x.any());
+        }
     }
 
     string ToString(PrintPrefs &pp);
@@ -393,21 +447,26 @@ struct LVector : ElemObj {
     int len;    // has to match the Value integer type, since we allow the length to be obtained
 
     private:
-    Value *v;   // use At()
+    Value *v;   // use At() / Set(), or PackedElems() if packed.
 
     public:
     int maxl;
+    // Vectors of int or float are stored as contiguous 32-bit scalars, in which case this is
+    // V_INT or V_FLOAT, V_NIL otherwise.
+    ValueType packed;
 
     LVector(int _initial, int _max, const TypeInfo &_ti);
 
     ~LVector() { assert(0); }   // destructed by DECREF
 
+    int ElemSize() const { return packed != V_NIL ? (int)sizeof(int) : (int)sizeof(Value); }
+
     void DeallocBuf() {
-        if (v) DeallocSubBuf(v, maxl);
+        if (v) DeallocSubBuf((char *)v, maxl * ElemSize());
     }
 
     void DeleteSelf(bool deref) {
-        if (deref) DecAll();
+        if (deref && packed == V_NIL) DecAll();
         DeallocBuf();
         vmpool->dealloc_small(this);
     }
@@ -418,42 +477,96 @@ struct LVector : ElemObj {
 
     void Push(const Value &val) {
         if (len == maxl) Resize(maxl ? maxl * 2 : 4);
-        v[len++] = val;
+        len++;
+        Set(len - 1, val);
     }
 
     Value Pop() {
-        return v[--len];
+        auto x = At(len - 1);
+        len--;
+        return x;
     }
 
-    Value &Top() const {
-        return v[len - 1].INCTYPE(ElemTypeInfo().t);
+    Value Top() const {
+        auto x = At(len - 1);
+        return x.INCTYPE(ElemTypeInfo().t);
     }
 
     void Insert(Value &val, int i) {
         assert(i >= 0 && i <= len); // note: insertion right at the end is legal, hence <=
         if (len + 1 > maxl) Resize(max(len + 1, maxl ? maxl * 2 : 4));
-        memmove(v + i + 1, v + i, sizeof(Value) * (len - i));
+        auto es = ElemSize();
+        memmove((char *)v + (i + 1) * es, (char *)v + i * es, es * (len - i));
         len++;
-        v[i] = val;
+        Set(i, val);
     }
 
     Value Remove(int i, int n, int decfrom) {
         assert(n >= 0 && n <= len && i >= 0 && i <= len - n);
-        auto x = v[i];
-        for (int j = decfrom; j < n; j++) Dec(i + j);
-        memmove(v + i, v + i + n, sizeof(Value) * (len - i - n));
+        auto x = At(i);
+        if (packed == V_NIL) for (int j = decfrom; j < n; j++) Dec(i + j);
+        auto es = ElemSize();
+        memmove((char *)v + i * es, (char *)v + (i + n) * es, es * (len - i - n));
         len -= n;
         return x;
     }
 
-    Value &At(int i) const {
+    const Value At(int i) const {
         assert(i < len);
+        switch (packed) {
+            case V_INT:   return Value(((int *)v)[i]);
+            case V_FLOAT: return Value(((float *)v)[i]);
+            default:      return v[i];
+        }
+    }
+
+    void Set(int i, const Value &val) {
+        assert(i < len);
+        switch (packed) {
+            case V_INT:   ((int *)v)[i] = val.ival(); break;
+            case V_FLOAT: ((float *)v)[i] = val.fval(); break;
+            default:      v[i] = val; break;
+        }
+    }
+
+    Value &AtRef(int i) const {
+        assert(i < len && packed == V_NIL);
         return v[i];
     }
 
+    template<typename T> T *PackedElems() const {
+        assert(packed != V_NIL && sizeof(T) == sizeof(int));
+        return (T *)v;
+    }
+
+    void Init(Value *from, int amount) {
+        if (packed == V_NIL) memcpy(v, from, amount * sizeof(Value));
+        else for (int i = 0; i < amount; i++) Set(i, from[i]);
+    }
+
     void Append(LVector *from, int start, int amount);
 };
 
+inline const Value ElemObj::At(int i) const {
+    if (ti.t == V_VECTOR) return ((LVector *)this)->At(i);
+    assert(ti.t == V_STRUCT);
+    return ((LStruct *)this)->At(i);
+}
+
+inline void ElemObj::Set(int i, const Value &val) {
+    if (ti.t == V_VECTOR) { ((LVector *)this)->Set(i, val); return; }
+    assert(ti.t == V_STRUCT);
+    ((LStruct *)this)->At(i) = val;
+}
+
+inline void ElemObj::Init(Value *from, int len, bool inc) {
+    assert(len == Len());
+    if (!len) return;
+    if (ti.t == V_VECTOR) ((LVector *)this)->Init(from, len);
+    else memcpy(((LStruct *)this)->Elems(), from, len * sizeof(Value));
+    if (inc) IncAll();
+}
+
 struct VMLog {
     struct LogVar {
         vector<Value> values;
@@ -474,12 +587,126 @@ struct VMLog {
     void LogMark();
 };
 
+// Collects the cycles reference counting can't, incrementally, using trial deletion (Bacon &
+// Rajan): starting from the buffered candidates, it subtracts the references internal to the
+// subgraph they reach, and whatever ends up at 0 is only kept alive by itself. Since only
+// references from outside that subgraph matter, the stack and globals need not be scanned.
+// Runs a slice of at most budget microseconds on every gl_frame(), and whenever threshold more
+// candidates have been buffered since the last one (at the next function call).
+struct CycleCollector {
+    vector<CycleObj *> candidates;
+    vector<char> cancycle;  // Per typetable offset: -1 not computed yet, or whether it can cycle.
+    vector<CycleObj *> roots, work, blackwork, garbage;
+    int budget;
+    size_t threshold;
+    size_t trigger;
+    bool due;
+
+    int64_t slices;
+    int64_t freed;
+    double totaltime;
+    double maxpause;
+
+    VM &vm;
+    CycleCollector(VM &_vm);
+
+    void Init(const bytecode::BytecodeFile *bcf);
+    bool CanCycle(const TypeInfo &ti);
+    bool MayReferToCycle(type_elem_t t);
+
+    void AddCandidate(CycleObj *co) {
+        candidates.push_back(co);
+        co->cyclebits |= (uint)candidates.size() << CYCLE_INDEX_SHIFT;
+        if (candidates.size() >= trigger) due = true;
+    }
+
+    void Forget(CycleObj *co) {
+        auto i = co->cyclebits >> CYCLE_INDEX_SHIFT;
+        if (!i) return;
+        auto last = candidates.back();
+        candidates[i - 1] = last;
+        last->cyclebits = (last->cyclebits & CYCLE_COLOR) | CYCLE_TYPE | (i << CYCLE_INDEX_SHIFT);
+        candidates.pop_back();
+        co->cyclebits &= CYCLE_TYPE | CYCLE_COLOR;
+    }
+
+    void Step();
+    int Collect(double maxtime);
+
+    void MarkGray(CycleObj *root);
+    void Scan(CycleObj *root);
+    void ScanBlack(CycleObj *root);
+    void CollectWhite(CycleObj *root);
+    int FreeGarbage();
+};
+
+// Samples the call stack at a fixed interval, for functions that take the most time. A timer
+// thread sets due, which the VM checks at function entry and loop back-edges: checking at every
+// instruction would slow down the VM also when not profiling.
+struct VMProfiler {
+    atomic<bool> due;
+    atomic<bool> running;
+    thread timer;
+    int interval;  // Microseconds.
+    string foldedfile;  // If set, write the results here when the program ends.
+
+    vector<pair<int, int>> funstarts;  // Code positions where functions start, to their index.
+    map<vector<int>, int64_t> stacks;  // Call stacks (as function indices) to samples taken.
+    vector<int> chain;
+    int64_t samples;
+
+    VM &vm;
+    VMProfiler(VM &_vm);
+    ~VMProfiler();
+
+    void Start(int _interval);
+    void Stop();
+    void Sample();
+    int FunctionAt(const int *funstart);
+    string FunctionName(int fidx);
+    string Folded();
+    string Report();
+};
+
+// Threads that each have a VM (and heap) of their own, running the same bytecode as the VM that
+// owns them, for parallel_loop(). Started by its first call, and kept until the owning VM is
+// deleted. Worker VMs are created when first needed, and deleted after an error.
+struct VMWorkers {
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake, done;
+    function<void()> job;  // Run by every worker, for the current generation.
+    int generation;
+    int running;           // Workers that haven't finished the current job.
+    bool quit;
+
+    VMWorkers() : generation(0), running(0), quit(false) {}
+    ~VMWorkers();
+
+    void Run(function<void()> &&_job);
+    void Work();
+};
+
+// Remembers which function variants a CALLMULTI call site dispatched to, see VM::EvalMulti.
+// Which variant gets picked only depends on the static types of the args (fixed per call site)
+// and the dynamic types of the ones that are objects, so that is all that needs to be compared.
+const int MULTI_CACHE_SIZE = 4;
+
+struct MultiCache {
+    int used, next;
+    int variants[MULTI_CACHE_SIZE];
+    vector<const TypeInfo *> argtypes;  // nargs per entry, nullptr for args with a static type.
+
+    MultiCache() : used(0), next(0) {}
+};
+
 struct StackFrame {
     InsPtr retip;
     const int *funstart;
     int definedfunction;
     int spstart;
     int tempmask;
+    bool hasrefs;  // Any of the args or locals of the function can hold a reference.
 };
 
 struct VM {
@@ -497,18 +724,31 @@ struct VM {
     #endif
 
     vector<StackFrame> stackframes;
+    #ifdef VM_COMPILED_CODE_MODE
+        struct CPPFrame *cppframes;  // Innermost first, on top of stackframes.
+        int cppstackuse;             // What those would have used of the stack.
+        const char *cppstacklimit;   // How far down the C++ stack they may go.
+    #endif
+
+    vector<MultiCache> multicaches;  // Indexed by the cache operand of CALLMULTI.
+    vector<Value> tailcallargs;      // Args of a TAILCALL while its caller's frame is removed.
 
     CoRoutine *curcoroutine;
+    vector<Value *> costackpool;  // Stacks of deleted coroutines, for reuse.
 
     Value *vars;
+    // Per var, whether it can hold a reference, so calls don't need GetVarTypeInfo.
+    vector<uchar> varisref;
 
     size_t codelen;
     const int *codestart;
     vector<int> codebigendian;
     vector<type_elem_t> typetablebigendian;
     uint64_t *byteprofilecounts;
+    vector<const void *> threadedcode;  // Label addresses parallel to the bytecode.
 
     vector<uchar> bytecode_buffer;
+    const void *bytecode_start;  // Either the above or static, can be shared by worker VMs.
     const bytecode::BytecodeFile *bcf;
 
     PrintPrefs programprintprefs;
@@ -523,6 +763,9 @@ struct VM {
     string programname;
 
     VMLog vml;
+    CycleCollector cc;
+    VMProfiler prof;
+    VMWorkers workers;
 
     bool trace;
     bool trace_tail;
@@ -532,6 +775,12 @@ struct VM {
     int64_t vm_count_fcalls;
     int64_t vm_count_bcalls;
 
+    bool nativecall;  // Inside CallFunction().
+    // Set when the program ended, the function CallFunction() called returned, or there was a
+    // runtime error, after which the dispatch loop returns rather than running the next op.
+    bool halted;
+    string errmsg;  // Set by Error(), the first runtime error.
+
     typedef void (VM::* f_ins_pointer)();
     f_ins_pointer f_ins_pointers[IL_MAX_OPS];
 
@@ -556,12 +805,14 @@ struct VM {
 
     ElemObj *NewVector(int initial, int max, const TypeInfo &ti);
     CoRoutine *NewCoRoutine(InsPtr rip, const int *vip, CoRoutine *p, const TypeInfo &cti);
+    void FreeCoStack(Value *costack, int size);
     BoxedInt *NewInt(int i);
     BoxedFloat *NewFloat(float f);
     LString *NewString(size_t l);
     LString *NewString(const char *c, size_t l);
     LString *NewString(const string &s);
     LString *NewString(const char *c1, size_t l1, const char *c2, size_t l2);
+    LString *ResizeString(LString *s, size_t l);
 
     Value Error(string err, const RefObj *a = nullptr, const RefObj *b = nullptr);
     Value BuiltinError(string err) { return Error(err); }
@@ -571,8 +822,10 @@ struct VM {
     string ValueDBG(const RefObj *a);
     string DumpVar(const Value &x, size_t idx, bool dumpglobals);
 
-    void EvalMulti(const int *mip, int definedfunction, const int *call_arg_types,
+    void EvalMulti(const int *mip, int definedfunction, const int *call_arg_types, int cacheidx,
                    block_t comp_retip, int tempmask);
+    int FindMulti(const int *mip, int nsubf, int nargs, const int *call_arg_types,
+                  int definedfunction);
 
     void FinalStackVarsCleanup();
 
@@ -596,7 +849,7 @@ struct VM {
     bool FunOut(int towhere, int nrv);
 
     void CoVarCleanup(CoRoutine *co);
-    void CoNonRec(const int *varip);
+    bool CoNonRec(const int *varip);
     void CoNew(VM_OP_ARGS_CALL);
     void CoDone(InsPtr retip);
     void CoClean();
@@ -604,6 +857,9 @@ struct VM {
     void CoResume(CoRoutine *co);
 
     void EndEval(Value &ret, ValueType vt);
+    int FunctionArity(const Value &f);
+    Value CallFunction(const Value &f);
+    void OpSequenceProfile(uint64_t total);
 
     #define F(N, A) void F_##N(VM_OP_ARGS);
         ILBASENAMES
@@ -611,11 +867,15 @@ struct VM {
     #define F(N, A) void F_##N(VM_OP_ARGS_CALL);
         ILCALLNAMES
     #undef F
-    #define F(N, A) VM_JUMP_RET F_##N();
+    #define F(N, A) VM_JUMP_RET F_##N(VM_OP_ARGS);
         ILJUMPNAMES
     #undef F
 
     void EvalProgram();
+    #if VM_INTERP_DISPATCH_METHOD == VM_DISPATCH_DIRECT_THREADED && \
+        !defined(VM_COMPILED_CODE_MODE)
+        void EvalThreaded();
+    #endif
 
     void PushDerefField(int i);
     void PushDerefIdx(int i);
@@ -625,7 +885,7 @@ struct VM {
     string ProperTypeName(const TypeInfo &ti);
 
     void Div0() { Error("division by zero"); }
-    void IDXErr(int i, int n, const RefObj *v);
+    bool IDXErr(int i, int n, const RefObj *v);
     void BCallRetCheck(const void *nf);
     int GrabIndex(const Value &idx);
     int VectorLoop(const Value &a, const Value &b, Value &res, bool withscalar,
@@ -669,42 +929,82 @@ template<int N> inline vec<int, N> ValueDecToI(const Value &v, int def = 0) {
 template <int N> inline Value ToValueI(const vec<int, N> &vec, int maxelems = 4) {
     auto numelems = min(maxelems, N);
     auto v = g_vm->NewVector(numelems, numelems, *g_vm->GetIntVectorType(numelems));
-    for (int i = 0; i < numelems; i++) v->At(i) = Value(vec[i]);
+    for (int i = 0; i < numelems; i++) v->Set(i, Value(vec[i]));
     return Value(v);
 }
 
 template <int N> inline Value ToValueF(const vec<float, N> &vec, int maxelems = 4) {
     auto numelems = min(maxelems, N);
     auto v = g_vm->NewVector(numelems, numelems, *g_vm->GetFloatVectorType(numelems));
-    for (int i = 0; i < numelems; i++) v->At(i) = Value(vec[i]);
+    for (int i = 0; i < numelems; i++) v->Set(i, Value(vec[i]));
     return Value(v);
 }
 
+// Returns -1 after reporting an error if idx is out of range, so check for that (or g_vm->halted)
+// before using it.
 inline int RangeCheck(const Value &idx, int range, int bias = 0) {
     int i = idx.ival();
-    if (i < bias || i >= bias + range)
+    if (i < bias || i >= bias + range) {
         g_vm->BuiltinError("index out of range [" + to_string(bias) + ".." +
                            to_string(bias + range) + "): " + to_string(i));
+        return -1;
+    }
     return i;
 }
 
+#ifdef VM_COMPILED_CODE_MODE
+// Functions that ToCPP turns into plain C++ functions have no StackFrame and keep their variables
+// in C++ locals. Each call still counts the stack the VM would have used for it (its args and
+// locals) against maxstacksize, and is listed so errors can name it. Since they recurse on the C++
+// stack, that may run out first, which is reported the same way.
+struct CPPFrame {
+    CPPFrame *parent;
+    int definedfunction;
+    int stackuse;
+
+    CPPFrame(int _definedfunction, int _stackuse)
+        : parent(g_vm->cppframes), definedfunction(_definedfunction), stackuse(_stackuse) {
+        g_vm->cppframes = this;
+        g_vm->cppstackuse += stackuse;
+    }
+
+    ~CPPFrame() {
+        g_vm->cppframes = parent;
+        g_vm->cppstackuse -= stackuse;
+    }
+
+    bool Overflow() {
+        if (g_vm->sp + g_vm->cppstackuse < g_vm->maxstacksize &&
+            (const char *)this > g_vm->cppstacklimit) return false;
+        g_vm->Error("stack overflow! (use set_max_stack_size() if needed)");
+        return true;
+    }
+};
+#endif
+
+void CycleObj::MaybeGarbage() {
+    if (cyclebits == CYCLE_TYPE) g_vm->cc.AddCandidate(this);
+}
+
 inline const char *IdName(const bytecode::BytecodeFile *bcf, int i) {
     return bcf->idents()->Get(bcf->specidents()->Get(i)->ididx())->name()->c_str();
 }
 
 void EscapeAndQuote(const string &s, string &r);
 
-struct CoRoutine : RefObj {
+// A coroutine runs on a value stack and frame stack of its own. Resuming or suspending it swaps
+// these with the ones the VM is running on, so neither copies anything, regardless of depth.
+struct CoRoutine : CycleObj {
     bool active;       // Goes to false when it has hit the end of the coroutine instead of a yield.
+    bool running;
 
-    int stackstart;    // When currently running, otherwise -1
-    Value *stackcopy;
-    int stackcopylen, stackcopymax;
+    // While suspended, this coroutine's own stacks. While running, those of whoever resumed it.
+    Value *stack;
+    int stacksize;
+    int sp;
+    vector<StackFrame> stackframes;
 
-    int stackframestart;  // When currently running, otherwise -1
-    StackFrame *stackframescopy;
-    int stackframecopylen, stackframecopymax;
-    int top_at_suspend;
+    Value *parentvars;  // While running, the values the parent had in the vars of varip.
 
     InsPtr returnip;
     const int *varip;
@@ -712,131 +1012,91 @@ struct CoRoutine : RefObj {
 
     int tm;  // When yielding from within a for, there will be temps on top of the stack.
 
-    CoRoutine(int _ss, int _sfs, InsPtr _rip, const int *_vip, CoRoutine *_p, const TypeInfo &cti)
-        : RefObj(cti), active(true),
-          stackstart(_ss), stackcopy(nullptr), stackcopylen(0), stackcopymax(0),
-          stackframestart(_sfs), stackframescopy(nullptr), stackframecopylen(0),
-          stackframecopymax(0), top_at_suspend(-1), returnip(_rip), varip(_vip), parent(_p), tm(0)
-          {}
+    CoRoutine(Value *_stack, int _stacksize, InsPtr _rip, const int *_vip, CoRoutine *_p,
+              const TypeInfo &cti)
+        : CycleObj(cti), active(true), running(false), stack(_stack), stacksize(_stacksize), sp(-1),
+          parentvars(nullptr), returnip(_rip), varip(_vip), parent(_p), tm(0) {}
 
-    Value &Current() {
-        if (stackstart >= 0) g_vm->BuiltinError("cannot get value of active coroutine");
-        return stackcopy[stackcopylen - 1].INCTYPE(g_vm->GetTypeInfo(ti.yieldtype).t);
-    }
-
-    void Resize(int newlen) {
-        if (newlen > stackcopymax) {
-            if (stackcopy) DeallocSubBuf(stackcopy, stackcopymax);
-            stackcopy = AllocSubBuf<Value>(stackcopymax = newlen,
-                                           g_vm->GetTypeInfo(TYPE_ELEM_VALUEBUF));
+    // Like GetVar(), returns nullptr after reporting an error.
+    Value *Current() {
+        if (running) {
+            g_vm->BuiltinError("cannot get value of active coroutine");
+            return nullptr;
         }
-        stackcopylen = newlen;
+        return &stack[sp].INCTYPE(g_vm->GetTypeInfo(ti.yieldtype).t);
     }
 
-    void ResizeFrames(int newlen) {
-        if (newlen > stackframecopymax) {
-            if (stackframescopy) DeallocSubBuf(stackframescopy, stackframecopymax);
-            stackframescopy = AllocSubBuf<StackFrame>(stackframecopymax = newlen,
-                                                      g_vm->GetTypeInfo(TYPE_ELEM_STACKFRAMEBUF));
-        }
-        stackframecopylen = newlen;
+    void SwapStacks() {
+        swap(stack, g_vm->stack);
+        swap(stacksize, g_vm->stacksize);
+        swap(sp, g_vm->sp);
+        stackframes.swap(g_vm->stackframes);
     }
 
-    int Suspend(int top, Value *stack, vector<StackFrame> &stackframes, InsPtr &rip,
-                CoRoutine *&curco) {
-        assert(stackstart >= 0);
+    void Suspend(InsPtr &rip, CoRoutine *&curco) {
+        assert(running && curco == this);
         swap(rip, returnip);
-        assert(curco == this);
         curco = parent;
         parent = nullptr;
-        ResizeFrames((int)stackframes.size() - stackframestart);
-        memcpy(stackframescopy, stackframes.data() + stackframestart,
-               stackframecopylen * sizeof(StackFrame));
-        stackframes.erase(stackframes.begin() + stackframestart, stackframes.end());
-        stackframestart = -1;
-        top_at_suspend = top;
-        Resize(top - stackstart);
-        memcpy(stackcopy, stack + stackstart, stackcopylen * sizeof(Value));
-        int ss = stackstart;
-        stackstart = -1;
-        return ss;
-    }
-
-    void AdjustStackFrames(int top) {
-        int topdelta = (top + stackcopylen) - top_at_suspend;
-        if (topdelta) {
-            for (int i = 0; i < stackframecopylen; i++) {
-                stackframescopy[i].spstart += topdelta;
-            }
-        }
+        running = false;
+        SwapStacks();
     }
 
-    int Resume(int top, Value *stack, vector<StackFrame> &stackframes, InsPtr &rip, CoRoutine *p) {
-        assert(stackstart < 0);
+    void Resume(InsPtr &rip, CoRoutine *p) {
+        assert(!running && !parent);
         swap(rip, returnip);
-        assert(!parent);
         parent = p;
-        stackframestart = (int)stackframes.size();
-        AdjustStackFrames(top);
-        stackframes.insert(stackframes.end(), stackframescopy, stackframescopy + stackframecopylen);
-        stackstart = top;
-        // FIXME: assume that it fits, which is not guaranteed with recursive coros
-        memcpy(stack + top, stackcopy, stackcopylen * sizeof(Value));
-        return stackcopylen;
+        running = true;
+        SwapStacks();
     }
 
     void BackupParentVars(Value *vars) {
-        // stored here while coro is active
-        Resize(*varip);
+        if (!*varip) return;
+        parentvars = AllocSubBuf<Value>(*varip, g_vm->GetTypeInfo(TYPE_ELEM_VALUEBUF));
         for (int i = 1; i <= *varip; i++) {
-            auto &var = vars[varip[i]];
             // we don't INC, since parent var is still on the stack and will hold ref
-            stackcopy[i - 1] = var;
+            parentvars[i - 1] = vars[varip[i]];
         }
     }
 
+    void RestoreParentVars(Value *vars) {
+        for (int i = 1; i <= *varip; i++) vars[varip[i]] = parentvars[i - 1];
+    }
+
     Value &AccessVar(int savedvaridx) {
-        assert(stackstart < 0);
-        // Variables are always saved on top of the stack before the stackcopy gets made, so they
-        // are last, followed by the retval (thus -1).
-        return stackcopy[stackcopylen - *varip + savedvaridx - 1];
+        assert(!running);
+        // Variables are always saved on top of the stack when suspending, followed by the retval.
+        return stack[sp - *varip + savedvaridx];
     }
 
-    Value &GetVar(int ididx) {
-        if (stackstart >= 0)
+    Value *GetVar(int ididx) {
+        if (running) {
             g_vm->BuiltinError("cannot access locals of running coroutine");
+            return nullptr;
+        }
         // FIXME: we can probably make it work without this search, but for now no big deal
         for (int i = 1; i <= *varip; i++) {
             if (varip[i] == ididx) {
-                return AccessVar(i - 1);
+                return &AccessVar(i - 1);
             }
         }
         // This one should be really rare, since parser already only allows lexically contained vars
         // for that function, could happen when accessing var that's not in the callchain of yields.
         g_vm->BuiltinError("local variable being accessed is not part of coroutine state");
-        return *stackcopy;
+        return nullptr;
     }
 
     void DeleteSelf(bool deref) {
-        assert(stackstart < 0);
-        if (stackcopy) {
-            stackcopy[--stackcopylen].DECTYPE(g_vm->GetTypeInfo(ti.yieldtype).t);
-            if (active) {
-                if (deref) {
-                    for (int i = *varip; i > 0; i--) {
-                        auto &vti = g_vm->GetVarTypeInfo(varip[i]);
-                        stackcopy[--stackcopylen].DECTYPE(vti.t);
-                    }
-                    top_at_suspend -= *varip + 1;
-                    // This calls Resume() to get the rest back onto the stack, then unwinds it.
-                    g_vm->CoVarCleanup(this);
-                }
-            } else {
-               assert(!stackcopylen);
-            }
-            DeallocSubBuf(stackcopy, stackcopymax);
+        assert(!running);
+        if (deref) {
+            stack[sp--].DECTYPE(g_vm->GetTypeInfo(ti.yieldtype).t);
+            // This unwinds the rest of the stack, if any.
+            if (active) g_vm->CoVarCleanup(this);
+            assert(sp < 0);
         }
-        if (stackframescopy) DeallocSubBuf(stackframescopy, stackframecopymax);
+        g_vm->FreeCoStack(stack, stacksize);
+        if (parentvars) DeallocSubBuf(parentvars, *varip);
+        this->~CoRoutine();
         vmpool->dealloc(this, sizeof(CoRoutine));
     }
 
@@ -857,15 +1117,42 @@ struct CoRoutine : RefObj {
         return vt;
     }
 
+    // Calls f on all (non-nil) refs this coroutine holds. Only valid while it is suspended, since a
+    // running one holds the stacks of its resumer. The stack holds, from the top: the current
+    // value, the saved vars, and per frame the temps of the call it made (or of the for loops
+    // around the yield), and the values its vars had before it was called.
+    template<typename F> void ForEachRef(F f) {
+        auto visit = [&](const Value &v, ValueType vt) {
+            if (IsRefNil(vt) && v.any()) f((RefObj *)v.any());
+        };
+        auto top = sp;
+        visit(stack[top--], g_vm->GetTypeInfo(ti.yieldtype).t);
+        if (!active) return;
+        for (int i = *varip; i > 0; i--) visit(stack[top--], g_vm->GetVarTypeInfo(varip[i]).t);
+        auto tempmask = tm;
+        for (auto stf = stackframes.rbegin(); stf != stackframes.rend(); ++stf) {
+            for (int i = 0; i < top - stf->spstart; i++)
+                if (((uint)tempmask) & (1u << i) && stack[stf->spstart + 1 + i].any())
+                    f((RefObj *)stack[stf->spstart + 1 + i].any());
+            top = stf->spstart;
+            auto fip = stf->funstart;
+            auto nargs = *fip++;
+            auto args = fip;
+            fip += nargs;
+            auto ndef = *fip++;
+            for (int i = ndef - 1; i >= 0; i--)
+                visit(stack[top--], g_vm->GetVarTypeInfo(fip[i]).t);
+            for (int i = nargs - 1; i >= 0; i--)
+                visit(stack[top--], g_vm->GetVarTypeInfo(args[i]).t);
+            // The first frame's temps live on the stack of the code that created this coroutine.
+            tempmask = stf->tempmask;
+        }
+        assert(top < 0);
+    }
+
     void Mark() {
-        // FIXME!
-        // ElemType(i) refers to the ith variable, not the ith stackcopy element.
-        /*
-        if (stackstart < 0)
-            for (int i = 0; i < stackcopylen; i++)
-                stackcopy[i].Mark(?);
-        */
-        g_vm->BuiltinError("internal: can\'t GC coroutines");
+        // GC() is never called while a coroutine runs.
+        ForEachRef([](RefObj *r) { r->Mark(); });
     }
 };
 